@@ -0,0 +1,502 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libmq.h"
+
+#ifdef WITH_LIBZSTD
+# include <zstd.h>
+#endif
+#ifdef WITH_LIBLZ4
+# include <lz4frame.h>
+#endif
+
+/* Bodies are compressed as they are added to an outgoing message: if the
+ * connection has MQO_COMPRESSION set, the engine can convey a
+ * content-encoding, and the first buffer added to the body is at least
+ * MQO_COMPRESS_THRESHOLD bytes long, it is compressed as a frame of its own
+ * and the message is tagged with the algorithm's content-encoding; any
+ * buffers added after it are compressed as further frames, which the
+ * receiver decompresses as a single stream.
+ *
+ * Incoming bodies are only decompressed when the application first obtains
+ * the body (or its length), and the engine replaces the message's body with
+ * the result, so that a peer which doesn't compress needn't know that this
+ * is supported. A body is never decompressed beyond MQO_DECOMPRESS_LIMIT
+ * bytes, however large the sender claims it to be, so that a small message
+ * can't cause the receiver to exhaust its memory.
+ */
+
+#define MQ_COMPRESS_THRESHOLD          1024
+#define MQ_DECOMPRESS_LIMIT            (64 * 1024 * 1024)
+#define MQ_ENCODING_LZ4                "lz4"
+#define MQ_ENCODING_ZSTD               "zstd"
+
+static int mq_compress_algorithm_(const char *encoding);
+#if defined(WITH_LIBZSTD) || defined(WITH_LIBLZ4)
+static size_t mq_decompress_max_(MQMESSAGE *message);
+static int mq_decompress_grow_(unsigned char **buf, size_t *size, size_t len, size_t max);
+#endif
+#ifdef WITH_LIBZSTD
+static int mq_compress_zstd_(const unsigned char *bytes, size_t len, int level, unsigned char **out, size_t *outlen);
+static int mq_decompress_zstd_(const unsigned char *bytes, size_t len, size_t max, unsigned char **out, size_t *outlen);
+#endif
+#ifdef WITH_LIBLZ4
+static int mq_compress_lz4_(const unsigned char *bytes, size_t len, int level, unsigned char **out, size_t *outlen);
+static int mq_decompress_lz4_(const unsigned char *bytes, size_t len, size_t max, unsigned char **out, size_t *outlen);
+#endif
+
+/* (Internal) set one of the compression options of a connection */
+int
+mq_compress_set_option_(MQCOMMON *common, MQOPTION option, long value)
+{
+	switch(option)
+	{
+	case MQO_COMPRESSION:
+		switch(value)
+		{
+		case MQZ_NONE:
+			break;
+		case MQZ_LZ4:
+#ifndef WITH_LIBLZ4
+			errno = ENOTSUP;
+			return -1;
+#endif
+			break;
+		case MQZ_ZSTD:
+#ifndef WITH_LIBZSTD
+			errno = ENOTSUP;
+			return -1;
+#endif
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+		}
+		common->compression = (int) value;
+		return 0;
+	case MQO_COMPRESS_THRESHOLD:
+		if(value < 0)
+		{
+			break;
+		}
+		/* An empty body is never compressed */
+		common->compressmin = value ? value : 1;
+		return 0;
+	case MQO_COMPRESS_LEVEL:
+		common->compresslevel = (int) value;
+		return 0;
+	case MQO_DECOMPRESS_LIMIT:
+		if(!value)
+		{
+			break;
+		}
+		common->decompressmax = value < 0 ? -1 : value;
+		return 0;
+	default:
+		break;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/* (Internal) obtain the state of the connection that an outgoing message
+ * belongs to, if bodies added to the message may be compressed
+ */
+MQCOMMON *
+mq_compress_enabled_(MQMESSAGE *message)
+{
+	MQ *connection;
+	MQCOMMON *common;
+
+	if(!message->impl->set_encoding || !message->impl->encoding)
+	{
+		return NULL;
+	}
+	connection = MQ_MESSAGE_CONNECTION(message);
+	common = connection ? MQ_COMMON(connection) : NULL;
+	if(!common || common->compression == MQZ_NONE)
+	{
+		return NULL;
+	}
+	return common;
+}
+
+/* (Internal) compress a buffer which is being added to the body of an
+ * outgoing message, tagging the message with a content-encoding if it's the
+ * first; returns 1 if *out has been set to a buffer which should be added in
+ * its place, and 0 if the buffer should be added as it is
+ */
+int
+mq_compress_(MQMESSAGE *message, const unsigned char *bytes, size_t len, unsigned char **out, size_t *outlen)
+{
+	MQCOMMON *common;
+	const char *encoding;
+	int algorithm, r;
+
+	common = mq_compress_enabled_(message);
+	if(!common)
+	{
+		return 0;
+	}
+	encoding = message->impl->encoding(message);
+	if(encoding)
+	{
+		/* Once a body is compressed, everything added to it must be */
+		algorithm = mq_compress_algorithm_(encoding);
+		if(algorithm == MQZ_NONE)
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		if(len < (size_t) (common->compressmin ? common->compressmin : MQ_COMPRESS_THRESHOLD) ||
+		   mq_message_len_(message))
+		{
+			return 0;
+		}
+		algorithm = common->compression;
+	}
+	switch(algorithm)
+	{
+#ifdef WITH_LIBLZ4
+	case MQZ_LZ4:
+		r = mq_compress_lz4_(bytes, len, common->compresslevel, out, outlen);
+		encoding = MQ_ENCODING_LZ4;
+		break;
+#endif
+#ifdef WITH_LIBZSTD
+	case MQZ_ZSTD:
+		r = mq_compress_zstd_(bytes, len, common->compresslevel, out, outlen);
+		encoding = MQ_ENCODING_ZSTD;
+		break;
+#endif
+	default:
+		return 0;
+	}
+	if(r)
+	{
+		return -1;
+	}
+	if(message->impl->set_encoding(message, encoding))
+	{
+		free(*out);
+		*out = NULL;
+		return -1;
+	}
+	return 1;
+}
+
+/* (Internal) decompress the body of an incoming message, if it has a
+ * content-encoding naming a supported algorithm and hasn't been already
+ */
+int
+mq_decompress_(MQMESSAGE *message)
+{
+	const unsigned char *body;
+	unsigned char *out;
+	size_t len, outlen;
+	const char *encoding;
+	int r;
+
+	if(!message->impl->encoding || !message->impl->replace_body ||
+	   !(encoding = message->impl->encoding(message)) ||
+	   message->impl->kind(message) != MQK_INCOMING)
+	{
+		return 0;
+	}
+	body = message->impl->body(message);
+	len = message->impl->len(message);
+	if(!body || len == (size_t) -1)
+	{
+		return -1;
+	}
+	switch(mq_compress_algorithm_(encoding))
+	{
+#ifdef WITH_LIBLZ4
+	case MQZ_LZ4:
+		r = mq_decompress_lz4_(body, len, mq_decompress_max_(message), &out, &outlen);
+		break;
+#endif
+#ifdef WITH_LIBZSTD
+	case MQZ_ZSTD:
+		r = mq_decompress_zstd_(body, len, mq_decompress_max_(message), &out, &outlen);
+		break;
+#endif
+	default:
+		/* The body is left for the application to decode */
+		return 0;
+	}
+	if(r)
+	{
+		return -1;
+	}
+	if(message->impl->replace_body(message, out, outlen, free))
+	{
+		free(out);
+		return -1;
+	}
+	return 0;
+}
+
+/* (Internal) determine the algorithm named by a content-encoding */
+static int
+mq_compress_algorithm_(const char *encoding)
+{
+	if(!strcasecmp(encoding, MQ_ENCODING_LZ4))
+	{
+		return MQZ_LZ4;
+	}
+	if(!strcasecmp(encoding, MQ_ENCODING_ZSTD))
+	{
+		return MQZ_ZSTD;
+	}
+	return MQZ_NONE;
+}
+
+#if defined(WITH_LIBZSTD) || defined(WITH_LIBLZ4)
+/* (Internal) determine the size beyond which an incoming message's body
+ * may not be decompressed
+ */
+static size_t
+mq_decompress_max_(MQMESSAGE *message)
+{
+	MQ *connection;
+	MQCOMMON *common;
+
+	connection = MQ_MESSAGE_CONNECTION(message);
+	common = connection ? MQ_COMMON(connection) : NULL;
+	if(!common || !common->decompressmax)
+	{
+		return MQ_DECOMPRESS_LIMIT;
+	}
+	return common->decompressmax < 0 ? (size_t) -1 : (size_t) common->decompressmax;
+}
+
+/* (Internal) enlarge a decompression buffer so that it has room for len
+ * more bytes beyond its first size bytes, doubling it as necessary, but
+ * never beyond max bytes; fails with EMSGSIZE if it is already that size
+ */
+static int
+mq_decompress_grow_(unsigned char **buf, size_t *size, size_t len, size_t max)
+{
+	unsigned char *p;
+	size_t n;
+
+	if(*size >= max)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+	for(n = *size ? *size * 2 : 4096; n < *size + len && n < max; n *= 2);
+	if(n > max)
+	{
+		n = max;
+	}
+	p = (unsigned char *) realloc(*buf, n);
+	if(!p)
+	{
+		return -1;
+	}
+	*buf = p;
+	*size = n;
+	return 0;
+}
+#endif
+
+#ifdef WITH_LIBZSTD
+/* (Internal) compress a buffer as a Zstandard frame */
+static int
+mq_compress_zstd_(const unsigned char *bytes, size_t len, int level, unsigned char **out, size_t *outlen)
+{
+	size_t bound, r;
+
+	bound = ZSTD_compressBound(len);
+	*out = (unsigned char *) malloc(bound);
+	if(!*out)
+	{
+		return -1;
+	}
+	r = ZSTD_compress(*out, bound, bytes, len, level);
+	if(ZSTD_isError(r))
+	{
+		free(*out);
+		*out = NULL;
+		errno = EINVAL;
+		return -1;
+	}
+	*outlen = r;
+	return 0;
+}
+
+/* (Internal) decompress a sequence of Zstandard frames */
+static int
+mq_decompress_zstd_(const unsigned char *bytes, size_t len, size_t max, unsigned char **out, size_t *outlen)
+{
+	ZSTD_DStream *stream;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer dest;
+	unsigned long long content;
+	size_t size, r;
+
+	stream = ZSTD_createDStream();
+	if(!stream)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	ZSTD_initDStream(stream);
+	/* The first frame's size is normally recorded in its header, which
+	 * is a good guess as to the size of the whole, unless it exceeds the
+	 * limit on the whole
+	 */
+	content = ZSTD_getFrameContentSize(bytes, len);
+	if(content != ZSTD_CONTENTSIZE_UNKNOWN && content != ZSTD_CONTENTSIZE_ERROR &&
+	   content > (unsigned long long) max)
+	{
+		ZSTD_freeDStream(stream);
+		errno = EMSGSIZE;
+		return -1;
+	}
+	size = (content == ZSTD_CONTENTSIZE_UNKNOWN || content == ZSTD_CONTENTSIZE_ERROR) ? len * 4 : (size_t) content;
+	if(size > max)
+	{
+		size = max;
+	}
+	*out = (unsigned char *) malloc(size ? size : 1);
+	if(!*out)
+	{
+		ZSTD_freeDStream(stream);
+		return -1;
+	}
+	in.src = bytes;
+	in.size = len;
+	in.pos = 0;
+	dest.dst = *out;
+	dest.size = size;
+	dest.pos = 0;
+	r = 0;
+	while(in.pos < in.size || r)
+	{
+		if(dest.pos == dest.size)
+		{
+			if(mq_decompress_grow_(out, &size, 1, max))
+			{
+				break;
+			}
+			dest.dst = *out;
+			dest.size = size;
+		}
+		r = ZSTD_decompressStream(stream, &dest, &in);
+		if(ZSTD_isError(r) || (r && in.pos == in.size && dest.pos < dest.size))
+		{
+			/* The body is corrupt or truncated */
+			errno = EBADMSG;
+			break;
+		}
+	}
+	ZSTD_freeDStream(stream);
+	if(in.pos < in.size || r)
+	{
+		free(*out);
+		*out = NULL;
+		return -1;
+	}
+	*outlen = dest.pos;
+	return 0;
+}
+#endif /*WITH_LIBZSTD*/
+
+#ifdef WITH_LIBLZ4
+/* (Internal) compress a buffer as an LZ4 frame */
+static int
+mq_compress_lz4_(const unsigned char *bytes, size_t len, int level, unsigned char **out, size_t *outlen)
+{
+	LZ4F_preferences_t prefs;
+	size_t bound, r;
+
+	memset(&prefs, 0, sizeof(prefs));
+	prefs.frameInfo.contentSize = len;
+	prefs.compressionLevel = level;
+	bound = LZ4F_compressFrameBound(len, &prefs);
+	*out = (unsigned char *) malloc(bound);
+	if(!*out)
+	{
+		return -1;
+	}
+	r = LZ4F_compressFrame(*out, bound, bytes, len, &prefs);
+	if(LZ4F_isError(r))
+	{
+		free(*out);
+		*out = NULL;
+		errno = EINVAL;
+		return -1;
+	}
+	*outlen = r;
+	return 0;
+}
+
+/* (Internal) decompress a sequence of LZ4 frames */
+static int
+mq_decompress_lz4_(const unsigned char *bytes, size_t len, size_t max, unsigned char **out, size_t *outlen)
+{
+	LZ4F_dctx *ctx;
+	size_t size, pos, used, in, avail, r;
+
+	if(LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	*out = NULL;
+	size = pos = used = 0;
+	r = 0;
+	while(used < len || r)
+	{
+		if(pos == size && mq_decompress_grow_(out, &size, len * 2, max))
+		{
+			break;
+		}
+		in = len - used;
+		avail = size - pos;
+		r = LZ4F_decompress(ctx, *out + pos, &avail, bytes + used, &in, NULL);
+		if(LZ4F_isError(r) || (r && used + in == len && !avail))
+		{
+			/* The body is corrupt or truncated */
+			errno = EBADMSG;
+			break;
+		}
+		used += in;
+		pos += avail;
+	}
+	LZ4F_freeDecompressionContext(ctx);
+	if(used < len || r)
+	{
+		free(*out);
+		*out = NULL;
+		return -1;
+	}
+	*outlen = pos;
+	return 0;
+}
+#endif /*WITH_LIBLZ4*/
@@ -61,10 +61,41 @@ mq_connect_send(const char *uri, const char *reserved1, const char *reserved2)
 	return mq;
 }
 
+/* Create a connection for sending messages to a queue which can be shared
+ * between threads
+ */
+MQ *
+mq_connect_send_shared(const char *uri, const char *reserved1, const char *reserved2)
+{
+	MQ *inner, *mq;
+
+	inner = mq_connect_send(uri, reserved1, reserved2);
+	if(!inner)
+	{
+		return NULL;
+	}
+	mq = mq_create_shared_(inner);
+	if(!mq)
+	{
+		inner->impl->release(inner);
+		return NULL;
+	}
+	return mq;
+}
+
 /* Close a connection */
 int
 mq_disconnect(MQ *connection)
 {
+	MQCOMMON *common;
+
+	common = MQ_COMMON(connection);
+	if(common)
+	{
+		mq_envelope_free_(connection, common);
+		mq_latency_free_(common);
+		mq_shards_free_(common);
+	}
 	connection->impl->release(connection);
 	return 0;
 }
@@ -94,9 +125,20 @@ mq_partition(MQ *connection)
 MQMESSAGE *
 mq_message_create(MQ *connection)
 {
+	MQCOMMON *common;
 	MQMESSAGE *message;
 
+	common = MQ_COMMON(connection);
 	message = NULL;
+	if(MQ_ENVELOPE_PACKING(common))
+	{
+		/* The message will be packed into an envelope when it's sent */
+		if(mq_envelope_create_(connection, &message))
+		{
+			return NULL;
+		}
+		return message;
+	}
 	if(connection->impl->create(connection, &message))
 	{
 		return NULL;
@@ -108,23 +150,449 @@ mq_message_create(MQ *connection)
 MQMESSAGE *
 mq_next(MQ *connection)
 {
+	MQCOMMON *common;
 	MQMESSAGE *message;
+	unsigned long long start;
 	int e;
 	
-	message = NULL;
+	common = MQ_COMMON(connection);
+	MQ_SHARDS_CHECK(common);
+	message = MQ_ENVELOPE_NEXT(common);
+	if(message)
+	{
+		mq_count_received_(common, &message, 1);
+		return message;
+	}
+	start = MQ_LATENCY_START(common);
 	if(connection->impl->next(connection, &message))
 	{
 		e = connection->impl->error(connection);
+		mq_count_error_(common);
 		return NULL;
 	}
+	if(start)
+	{
+		mq_latency_record_(common, MQL_NEXT, start);
+	}
+	if(common)
+	{
+		mq_envelope_unpack_(common, &message);
+	}
+	mq_count_received_(common, &message, 1);
 	return message;
 }
 
+/* Obtain up to count messages which have already arrived, waiting for
+ * some to arrive if none have
+ */
+size_t
+mq_next_batch(MQ *connection, MQMESSAGE **messages, size_t count)
+{
+	MQCOMMON *common;
+	unsigned long long start;
+	size_t n;
+	int r;
+
+	if(!count)
+	{
+		/* Nothing is received or waited for, whatever the engine */
+		errno = 0;
+		return 0;
+	}
+	common = MQ_COMMON(connection);
+	MQ_SHARDS_CHECK(common);
+	/* Messages unpacked from envelopes which have already been received
+	 * are returned without waiting for any more
+	 */
+	for(n = 0; n < count && (messages[n] = MQ_ENVELOPE_NEXT(common)); n++);
+	if(n)
+	{
+		mq_count_received_(common, messages, n);
+		return n;
+	}
+	start = MQ_LATENCY_START(common);
+	if(connection->impl->next_batch)
+	{
+		if(connection->impl->next_batch(connection, messages, count, &n))
+		{
+			mq_count_error_(common);
+			return 0;
+		}
+		if(start)
+		{
+			mq_latency_record_(common, MQL_NEXT, start);
+		}
+		if(common)
+		{
+			n = mq_envelope_expand_(common, messages, n, count);
+		}
+		mq_count_received_(common, messages, n);
+		return n;
+	}
+	/* The engine has no native support for batches, so fall back to
+	 * retrieving messages one at a time; if this fails part-way through,
+	 * the messages already obtained are returned and the error state is
+	 * left set on the connection
+	 */
+	for(n = 0; n < count; n++)
+	{
+		if(n && connection->impl->next_timed)
+		{
+			/* Only the first message is waited for */
+			r = connection->impl->next_timed(connection, &(messages[n]), 0);
+		}
+		else
+		{
+			r = connection->impl->next(connection, &(messages[n]));
+		}
+		if(r)
+		{
+			if(!n)
+			{
+				mq_count_error_(common);
+			}
+			break;
+		}
+		if(!n && start)
+		{
+			mq_latency_record_(common, MQL_NEXT, start);
+		}
+	}
+	if(common)
+	{
+		n = mq_envelope_expand_(common, messages, n, count);
+	}
+	mq_count_received_(common, messages, n);
+	return n;
+}
+
+/* Wait up to timeout milliseconds for the next message to arrive */
+MQMESSAGE *
+mq_next_timed(MQ *connection, int timeout)
+{
+	MQCOMMON *common;
+	MQMESSAGE *message;
+	unsigned long long start;
+
+	if(!connection->impl->next_timed)
+	{
+		if(timeout < 0)
+		{
+			return mq_next(connection);
+		}
+		errno = ENOTSUP;
+		return NULL;
+	}
+	common = MQ_COMMON(connection);
+	MQ_SHARDS_CHECK(common);
+	message = MQ_ENVELOPE_NEXT(common);
+	if(message)
+	{
+		mq_count_received_(common, &message, 1);
+		return message;
+	}
+	start = MQ_LATENCY_START(common);
+	if(connection->impl->next_timed(connection, &message, timeout))
+	{
+		mq_count_error_(common);
+		return NULL;
+	}
+	if(start)
+	{
+		mq_latency_record_(common, MQL_NEXT, start);
+	}
+	if(common)
+	{
+		mq_envelope_unpack_(common, &message);
+	}
+	mq_count_received_(common, &message, 1);
+	return message;
+}
+
+/* Set a connection option */
+int
+mq_set_option(MQ *connection, MQOPTION option, long value)
+{
+	MQCOMMON *common;
+
+	if(option == MQO_LATENCY)
+	{
+		/* Latency histograms are maintained by libmq itself */
+		common = MQ_COMMON(connection);
+		if(!common)
+		{
+			errno = ENOTSUP;
+			return -1;
+		}
+		return mq_latency_enable_(common, value != 0);
+	}
+	if(option == MQO_COMPRESSION || option == MQO_COMPRESS_THRESHOLD ||
+	   option == MQO_COMPRESS_LEVEL || option == MQO_DECOMPRESS_LIMIT)
+	{
+		/* Bodies are compressed by libmq itself */
+		common = MQ_COMMON(connection);
+		if(!common)
+		{
+			errno = ENOTSUP;
+			return -1;
+		}
+		return mq_compress_set_option_(common, option, value);
+	}
+	if(option == MQO_ENVELOPE_SIZE || option == MQO_ENVELOPE_DELAY)
+	{
+		/* Envelopes are packed by libmq itself */
+		common = MQ_COMMON(connection);
+		if(!common)
+		{
+			errno = ENOTSUP;
+			return -1;
+		}
+		return mq_envelope_set_option_(connection, common, option, value);
+	}
+	if(!connection->impl->set_option)
+	{
+		errno = ENOTSUP;
+		return -1;
+	}
+	return connection->impl->set_option(connection, option, value);
+}
+
+/* Send a set of messages and deliver them together */
+int
+mq_message_send_batch(MQ *connection, MQMESSAGE **messages, size_t count)
+{
+	MQCOMMON *common;
+	unsigned long long start;
+	size_t c, bytes;
+
+	common = MQ_COMMON(connection);
+	start = MQ_LATENCY_START(common);
+	bytes = 0;
+	if(common)
+	{
+		/* Bodies must be measured before sending, as an engine may
+		 * discard them once they have been sent
+		 */
+		for(c = 0; c < count; c++)
+		{
+			bytes += mq_message_len_(messages[c]);
+		}
+	}
+	MQ_STATS_ADD(common, delivers, 1);
+	if(connection->impl->send_batch && !(common && common->envelope))
+	{
+		if(connection->impl->send_batch(connection, messages, count))
+		{
+			mq_count_error_(common);
+			return -1;
+		}
+		MQ_STATS_ADD(common, sent, count);
+		MQ_STATS_ADD(common, sent_bytes, bytes);
+		if(start)
+		{
+			mq_latency_sent_(common, count, start);
+			mq_latency_record_(common, MQL_DELIVER, start);
+			mq_latency_settled_(common, start);
+		}
+		return 0;
+	}
+	for(c = 0; c < count; c++)
+	{
+		if(messages[c]->impl->send(messages[c]))
+		{
+			mq_count_error_(common);
+			return -1;
+		}
+	}
+	MQ_STATS_ADD(common, sent, count);
+	MQ_STATS_ADD(common, sent_bytes, bytes);
+	if(start)
+	{
+		mq_latency_sent_(common, count, start);
+		start = mq_latency_now_();
+	}
+	if(MQ_ENVELOPE_FLUSH(connection, common) ||
+	   connection->impl->deliver(connection))
+	{
+		mq_count_error_(common);
+		return -1;
+	}
+	if(start)
+	{
+		mq_latency_record_(common, MQL_DELIVER, start);
+		mq_latency_settled_(common, start);
+	}
+	return 0;
+}
+
+/* Obtain a pollable file descriptor for the connection */
+int
+mq_fd(MQ *connection, int *events)
+{
+	if(!connection->impl->fd)
+	{
+		errno = ENOTSUP;
+		return -1;
+	}
+	return connection->impl->fd(connection, events);
+}
+
+/* Perform any pending work on a connection without waiting */
+int
+mq_process(MQ *connection)
+{
+	MQCOMMON *common;
+
+	common = MQ_COMMON(connection);
+	MQ_SHARDS_CHECK(common);
+	if(common && common->envelope && mq_envelope_check_(connection, common))
+	{
+		mq_count_error_(common);
+		return -1;
+	}
+	if(!connection->impl->process)
+	{
+		return 0;
+	}
+	return connection->impl->process(connection);
+}
+
+/* Obtain the number of incoming messages which can be obtained without
+ * waiting
+ */
+int
+mq_pending(MQ *connection)
+{
+	MQCOMMON *common;
+	size_t queued;
+	int r;
+
+	common = MQ_COMMON(connection);
+	queued = common ? mq_envelope_pending_(common) : 0;
+	if(!connection->impl->pending)
+	{
+		if(queued)
+		{
+			return (int) queued;
+		}
+		errno = ENOTSUP;
+		return -1;
+	}
+	r = connection->impl->pending(connection);
+	if(r < 0)
+	{
+		return r;
+	}
+	return r + (int) queued;
+}
+
+/* Set the function invoked as outgoing messages' outcomes become known */
+int
+mq_set_sent_callback(MQ *connection, MQSENTFN fn, void *data)
+{
+	if(!connection->impl->set_sent_callback)
+	{
+		errno = ENOTSUP;
+		return -1;
+	}
+	return connection->impl->set_sent_callback(connection, fn, data);
+}
+
+/* Enable store-and-forward spooling of outgoing messages */
+int
+mq_set_spool(MQ *connection, const char *path)
+{
+	if(!path)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(!connection->impl->set_spool)
+	{
+		errno = ENOTSUP;
+		return -1;
+	}
+	return connection->impl->set_spool(connection, path);
+}
+
 /* Deliver any outgoing messages */
 int
 mq_deliver(MQ *connection)
 {
-	return connection->impl->deliver(connection);
+	MQCOMMON *common;
+	unsigned long long start;
+
+	common = MQ_COMMON(connection);
+	start = MQ_LATENCY_START(common);
+	MQ_STATS_ADD(common, delivers, 1);
+	if(MQ_ENVELOPE_FLUSH(connection, common) ||
+	   connection->impl->deliver(connection))
+	{
+		mq_count_error_(common);
+		return -1;
+	}
+	if(start)
+	{
+		mq_latency_record_(common, MQL_DELIVER, start);
+		mq_latency_settled_(common, start);
+	}
+	return 0;
+}
+
+/* Obtain a snapshot of a connection's statistics */
+int
+mq_stats(MQ *connection, MQSTATS *stats)
+{
+	MQCOMMON *common;
+
+	common = MQ_COMMON(connection);
+	if(!common)
+	{
+		errno = ENOTSUP;
+		return -1;
+	}
+	stats->sent = __atomic_load_n(&(common->stats.sent), __ATOMIC_RELAXED);
+	stats->sent_bytes = __atomic_load_n(&(common->stats.sent_bytes), __ATOMIC_RELAXED);
+	stats->received = __atomic_load_n(&(common->stats.received), __ATOMIC_RELAXED);
+	stats->received_bytes = __atomic_load_n(&(common->stats.received_bytes), __ATOMIC_RELAXED);
+	stats->accepted = __atomic_load_n(&(common->stats.accepted), __ATOMIC_RELAXED);
+	stats->rejected = __atomic_load_n(&(common->stats.rejected), __ATOMIC_RELAXED);
+	stats->passed = __atomic_load_n(&(common->stats.passed), __ATOMIC_RELAXED);
+	stats->delivers = __atomic_load_n(&(common->stats.delivers), __ATOMIC_RELAXED);
+	stats->errors = __atomic_load_n(&(common->stats.errors), __ATOMIC_RELAXED);
+	stats->backoffs = __atomic_load_n(&(common->stats.backoffs), __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* (Internal) count a failed operation; EAGAIN (which indicates that a
+ * non-blocking or timed operation would have had to wait) is not an error
+ */
+void
+mq_count_error_(MQCOMMON *common)
+{
+	if(errno != EAGAIN)
+	{
+		MQ_STATS_ADD(common, errors, 1);
+	}
+}
+
+/* (Internal) count a set of received messages */
+void
+mq_count_received_(MQCOMMON *common, MQMESSAGE **messages, size_t count)
+{
+	size_t c, bytes;
+
+	if(!common || !count)
+	{
+		return;
+	}
+	bytes = 0;
+	for(c = 0; c < count; c++)
+	{
+		bytes += mq_message_len_(messages[c]);
+	}
+	MQ_STATS_ADD(common, received, count);
+	MQ_STATS_ADD(common, received_bytes, bytes);
 }
 
 /* Obtain the error state for a connection */
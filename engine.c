@@ -24,24 +24,74 @@
 #include "p_libmq.h"
 
 # ifdef WITH_LIBQPID_PROTON
+#  ifdef WITH_PROTON_DRIVER
+MQ *mq_amqp_construct_(const char *uri, const char *reserved1, const char *reserved2);
+#  else
 MQ *mq_proton_construct_(const char *uri, const char *reserved1, const char *reserved2);
+#  endif
 # endif
 
+/* Engines are located by hashing the URI scheme into an open-addressed table.
+ * The table is never modified once it has been published: registering or
+ * un-registering an engine builds a replacement and swaps it in, so that
+ * mq_create_() can perform lookups without taking any lock at all.
+ *
+ * Because a reader may still be using a table (or an engine record) after it
+ * has been replaced, superseded tables and records are retired rather than
+ * freed straight away. Readers count themselves in and out of the registry:
+ * whenever the registry is updated while no reader is within it, or the last
+ * reader leaves it, nothing can still hold a retired table or record, and so
+ * they are all freed. Any which remain when the library is unloaded are
+ * freed then.
+ */
+
 struct mq_engine_struct
 {
+	struct mq_engine_struct *retired;
 	char *scheme;
+	size_t len;
+	unsigned long hash;
+	/* If construct is NULL, the engine is provided by a plug-in which
+	 * has not been loaded yet
+	 */
 	MQCONSTRUCTOR construct;
 	void *handle;
+	/* The filename of the plug-in providing the engine, if any */
+	char *plugin;
+};
+
+struct mq_registry_struct
+{
+	struct mq_registry_struct *retired;
+	/* The number of slots, which is always a power of two */
+	size_t size;
+	size_t count;
+	struct mq_engine_struct *slots[1];
 };
 
 static void mq_init_(void);
 static int mq_register_internal_(const char *scheme, MQCONSTRUCTOR construct, void *handle);
+static int mq_register_engine_(const char *scheme, MQCONSTRUCTOR construct, void *handle, const char *plugin, int replace);
+static MQCONSTRUCTOR mq_engine_find_(const char *scheme, size_t len);
+static unsigned long mq_scheme_hash_(const char *scheme, size_t len);
+static struct mq_engine_struct *mq_registry_lookup_(struct mq_registry_struct *registry, const char *scheme, size_t len, unsigned long hash);
+static int mq_registry_update_(struct mq_engine_struct *add, const char *scheme, MQCONSTRUCTOR construct, void *handle);
+static void mq_registry_enter_(void);
+static void mq_registry_leave_(void);
+static void mq_registry_reclaim_(void);
+static void mq_engine_fini_(void) __attribute__((destructor));
 
 static pthread_once_t mq_init_once_ = PTHREAD_ONCE_INIT;
 
-static pthread_rwlock_t enginelock = PTHREAD_RWLOCK_INITIALIZER;
-static struct mq_engine_struct *engines;
-static size_t enginecount;
+/* enginelock serialises updates to the registry; readers never wait for
+ * it, and only try to take it in order to free retired tables
+ */
+static pthread_mutex_t enginelock = PTHREAD_MUTEX_INITIALIZER;
+static struct mq_registry_struct *registry;
+static struct mq_registry_struct *retired_registries;
+static struct mq_engine_struct *retired_engines;
+/* The number of threads which may be using a registry table */
+static unsigned long readers;
 
 /* Register an MQ engine. handle is intended to be a module handle as returned
  * by dlopen(), or some similar kind of application-specific pointer; it's
@@ -59,108 +109,131 @@ mq_register(const char *scheme, MQCONSTRUCTOR construct, void *handle)
 int
 mq_unregister(const char *scheme, void *handle)
 {
-	size_t c;
+	int count;
 
-	pthread_rwlock_wrlock(&enginelock);
-	for(c = 0; c < enginecount; c++)
-	{
-		if(!engines[c].scheme)
-		{
-			continue;
-		}
-		if(!strcmp(engines[c].scheme, scheme) &&
-		   engines[c].handle == handle)
-		{
-			free(engines[c].scheme);
-			memset(&(engines[c]), 0, sizeof(struct mq_engine_struct));
-			pthread_rwlock_unlock(&enginelock);
-			return 1;
-		}
-	}
-	pthread_rwlock_unlock(&enginelock);
-	return 0;
+	pthread_mutex_lock(&enginelock);
+	count = mq_registry_update_(NULL, scheme, NULL, handle);
+	pthread_mutex_unlock(&enginelock);
+	return count < 0 ? 0 : count;
 }
 
 /* Un-register any schemes using a particular constructor function */
 int
 mq_unregister_constructor(MQCONSTRUCTOR construct)
 {
-	size_t c;
 	int count;
 
-	pthread_rwlock_wrlock(&enginelock);
-	count = 0;
-	for(c = 0; c < enginecount; c++)
-	{
-		if(!engines[c].scheme)
-		{
-			continue;
-		}
-		if(engines[c].construct == construct)
-		{
-			free(engines[c].scheme);
-			memset(&(engines[c]), 0, sizeof(struct mq_engine_struct));
-			count++;
-		}
-	}
-	pthread_rwlock_unlock(&enginelock);
-	return count;
+	pthread_mutex_lock(&enginelock);
+	count = mq_registry_update_(NULL, NULL, construct, NULL);
+	pthread_mutex_unlock(&enginelock);
+	return count < 0 ? 0 : count;
 }
 
 /* Un-register any schemes associated with a particular module handle */
 int
 mq_unregister_all(void *handle)
 {
-	size_t c;
 	int count;
 
-	pthread_rwlock_wrlock(&enginelock);
-	count = 0;
-	for(c = 0; c < enginecount; c++)
-	{
-		if(!engines[c].scheme)
-		{
-			continue;
-		}
-		if(engines[c].handle == handle)
-		{
-			free(engines[c].scheme);
-			memset(&(engines[c]), 0, sizeof(struct mq_engine_struct));
-			count++;
-		}
-	}
-	pthread_rwlock_unlock(&enginelock);
-	return count;
+	pthread_mutex_lock(&enginelock);
+	count = mq_registry_update_(NULL, NULL, NULL, handle);
+	pthread_mutex_unlock(&enginelock);
+	return count < 0 ? 0 : count;
 }
 
 /* (Internal) create a new disconnected MQ connection object */
 MQ *
 mq_create_(const char *uri, const char *reserved1, const char *reserved2)
 {
-	size_t c, l;
-	MQ *mq;
+	MQCONSTRUCTOR construct;
+	const char *p;
 
 	pthread_once(&mq_init_once_, mq_init_);
-	pthread_rwlock_rdlock(&enginelock);
-	for(c = 0; c < enginecount; c++)
+	p = strchr(uri, ':');
+	if(!p || p == uri)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	construct = mq_engine_find_(uri, p - uri);
+	if(!construct)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	return construct(uri, reserved1, reserved2);
+}
+
+/* Register an engine provided by a plug-in which will be loaded the first
+ * time the scheme is used; this won't replace an existing registration
+ */
+int
+mq_register_deferred_(const char *scheme, const char *plugin)
+{
+	return mq_register_engine_(scheme, NULL, NULL, plugin, 0);
+}
+
+/* Invoke fn for each registered engine which is provided by a plug-in */
+int
+mq_engine_foreach_(int (*fn)(const char *scheme, const char *plugin, void *data), void *data)
+{
+	struct mq_registry_struct *reg;
+	size_t c;
+	int r;
+
+	mq_registry_enter_();
+	reg = (struct mq_registry_struct *) MQ_ATOMIC_LOAD(&registry);
+	r = 0;
+	for(c = 0; !r && reg && c < reg->size; c++)
 	{
-		if(!engines[c].scheme)
+		if(reg->slots[c] && reg->slots[c]->plugin)
 		{
-			continue;
+			if(fn(reg->slots[c]->scheme, reg->slots[c]->plugin, data))
+			{
+				r = -1;
+			}
 		}
-		l = strlen(engines[c].scheme);
-		if(strlen(uri) > l &&
-		   !strncmp(uri, engines[c].scheme, l) &&
-		   uri[l] == ':')
+	}
+	mq_registry_leave_();
+	return r;
+}
+
+/* (Internal) locate the constructor for a scheme, loading plug-ins as
+ * needed
+ */
+static MQCONSTRUCTOR
+mq_engine_find_(const char *scheme, size_t len)
+{
+	struct mq_engine_struct *engine;
+	MQCONSTRUCTOR construct;
+	unsigned long hash;
+
+	hash = mq_scheme_hash_(scheme, len);
+	mq_registry_enter_();
+	engine = mq_registry_lookup_((struct mq_registry_struct *) MQ_ATOMIC_LOAD(&registry), scheme, len, hash);
+	if(engine && !engine->construct)
+	{
+		/* Load the plug-in named by the manifest; its entry-point
+		 * should replace this registration with the real one
+		 */
+		mq_plugin_load_(engine->plugin);
+		engine = mq_registry_lookup_((struct mq_registry_struct *) MQ_ATOMIC_LOAD(&registry), scheme, len, hash);
+	}
+	if(!engine || !engine->construct)
+	{
+		/* Either the scheme is unknown, or the manifest was wrong:
+		 * load all of the plug-ins (if this hasn't happened already)
+		 * and try again
+		 */
+		engine = NULL;
+		if(mq_plugin_scan_() > 0)
 		{
-			mq = engines[c].construct(uri, reserved1, reserved2);
-			pthread_rwlock_unlock(&enginelock);
-			return mq;
+			engine = mq_registry_lookup_((struct mq_registry_struct *) MQ_ATOMIC_LOAD(&registry), scheme, len, hash);
 		}
 	}
-	pthread_rwlock_unlock(&enginelock);
-	errno = EINVAL;
-	return NULL;
+	construct = engine ? engine->construct : NULL;
+	mq_registry_leave_();
+	return construct;
 }
 
 /* (Internal) initialise the list of MQ engines */
@@ -168,8 +241,13 @@ static void
 mq_init_(void)
 {
 #ifdef WITH_LIBQPID_PROTON
+# ifdef WITH_PROTON_DRIVER
+	mq_register_internal_("amqp", mq_amqp_construct_, NULL);
+	mq_register_internal_("amqps", mq_amqp_construct_, NULL);
+# else
 	mq_register_internal_("amqp", mq_proton_construct_, NULL);
 	mq_register_internal_("amqps", mq_proton_construct_, NULL);
+# endif
 #endif
 	mq_plugin_init_();
 }
@@ -178,52 +256,265 @@ mq_init_(void)
 static int
 mq_register_internal_(const char *scheme, MQ *(*construct)(const char *, const char *, const char *), void *handle)
 {
-	size_t c, spare;
+	/* If this is being invoked by a plug-in's entry-point, record which
+	 * plug-in provides the scheme so that it can be added to the manifest
+	 */
+	return mq_register_engine_(scheme, construct, handle, mq_plugin_loading_(handle), 1);
+}
+
+/* (Internal) add an engine record to the registry */
+static int
+mq_register_engine_(const char *scheme, MQCONSTRUCTOR construct, void *handle, const char *plugin, int replace)
+{
 	struct mq_engine_struct *p;
-	char *s;
 
-	pthread_rwlock_wrlock(&enginelock);
-	spare = (size_t) -1;
-	for(c = 0; c < enginecount; c++)
+	p = (struct mq_engine_struct *) calloc(1, sizeof(struct mq_engine_struct));
+	if(!p)
+	{
+		return -1;
+	}
+	p->scheme = strdup(scheme);
+	if(!p->scheme)
+	{
+		free(p);
+		return -1;
+	}
+	if(plugin)
 	{
-		if(!engines[c].scheme)
+		p->plugin = strdup(plugin);
+		if(!p->plugin)
 		{
-			spare = c;
-			continue;
+			free(p->scheme);
+			free(p);
+			return -1;
 		}
-		if(!strcmp(engines[c].scheme, scheme))
+	}
+	p->len = strlen(scheme);
+	p->hash = mq_scheme_hash_(scheme, p->len);
+	p->construct = construct;
+	p->handle = handle;
+	pthread_mutex_lock(&enginelock);
+	if((!replace && mq_registry_lookup_(registry, p->scheme, p->len, p->hash)) ||
+	   mq_registry_update_(p, NULL, NULL, NULL) < 0)
+	{
+		pthread_mutex_unlock(&enginelock);
+		free(p->plugin);
+		free(p->scheme);
+		free(p);
+		return replace ? -1 : 0;
+	}
+	pthread_mutex_unlock(&enginelock);
+	return 0;
+}
+
+/* (Internal) hash a URI scheme (FNV-1a) */
+static unsigned long
+mq_scheme_hash_(const char *scheme, size_t len)
+{
+	unsigned long h;
+	size_t c;
+
+	h = 2166136261UL;
+	for(c = 0; c < len; c++)
+	{
+		h ^= (unsigned char) scheme[c];
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+/* (Internal) locate the engine for a scheme in a registry table */
+static struct mq_engine_struct *
+mq_registry_lookup_(struct mq_registry_struct *reg, const char *scheme, size_t len, unsigned long hash)
+{
+	struct mq_engine_struct *engine;
+	size_t c, mask;
+
+	if(!reg)
+	{
+		return NULL;
+	}
+	mask = reg->size - 1;
+	for(c = hash & mask; (engine = reg->slots[c]); c = (c + 1) & mask)
+	{
+		if(engine->hash == hash &&
+		   engine->len == len &&
+		   !memcmp(engine->scheme, scheme, len))
 		{
-			engines[c].construct = construct;
-			engines[c].handle = handle;
-			pthread_rwlock_unlock(&enginelock);
-			return 0;
+			return engine;
 		}
 	}
-	s = strdup(scheme);
-	if(!s)
+	return NULL;
+}
+
+/* (Internal) build and publish a replacement registry table. If add is not
+ * NULL, it is added to the table, replacing any existing engine for the same
+ * scheme. Otherwise, engines are removed: if scheme is not NULL, those with
+ * that scheme and handle; if construct is not NULL, those with that
+ * constructor; or else, those with the given handle. Returns the number of
+ * engines removed or replaced, or -1 on error. The caller must hold
+ * enginelock.
+ */
+static int
+mq_registry_update_(struct mq_engine_struct *add, const char *scheme, MQCONSTRUCTOR construct, void *handle)
+{
+	struct mq_registry_struct *cur, *reg;
+	struct mq_engine_struct *engine, *removed;
+	size_t c, d, count, size, mask;
+	int matched;
+
+	cur = registry;
+	count = cur ? cur->count : 0;
+	if(add)
+	{
+		count++;
+	}
+	/* Keep the table no more than half full */
+	for(size = 8; size < count * 2; size *= 2);
+	reg = (struct mq_registry_struct *) calloc(1, sizeof(struct mq_registry_struct) + (sizeof(struct mq_engine_struct *) * (size - 1)));
+	if(!reg)
 	{
-		pthread_rwlock_unlock(&enginelock);
 		return -1;
 	}
-	if(spare == (size_t) -1)
+	reg->size = size;
+	mask = size - 1;
+	matched = 0;
+	removed = NULL;
+	for(c = 0; cur && c < cur->size; c++)
 	{
-		p = (struct mq_engine_struct *) realloc(engines, sizeof(struct mq_engine_struct) * (enginecount + 1));
-		if(!p)
+		engine = cur->slots[c];
+		if(!engine)
 		{
-			pthread_rwlock_unlock(&enginelock);
-			return -1;
+			continue;
+		}
+		if(add)
+		{
+			matched = (engine->len == add->len && !strcmp(engine->scheme, add->scheme));
+		}
+		else if(scheme)
+		{
+			matched = (!strcmp(engine->scheme, scheme) && engine->handle == handle);
+		}
+		else if(construct)
+		{
+			matched = (engine->construct == construct);
+		}
+		else
+		{
+			matched = (engine->handle == handle);
+		}
+		if(matched)
+		{
+			engine->retired = removed;
+			removed = engine;
+			continue;
 		}
-		engines = p;
-		p = &(engines[enginecount]);
-		enginecount++;
+		for(d = engine->hash & mask; reg->slots[d]; d = (d + 1) & mask);
+		reg->slots[d] = engine;
+		reg->count++;
 	}
-	else
+	if(add)
 	{
-		p = &(engines[spare]);
+		for(d = add->hash & mask; reg->slots[d]; d = (d + 1) & mask);
+		reg->slots[d] = add;
+		reg->count++;
 	}
-	p->scheme = s;
-	p->construct = construct;
-	p->handle = handle;
-	pthread_rwlock_unlock(&enginelock);
-	return 0;
+	else if(!removed)
+	{
+		/* Nothing changed */
+		free(reg);
+		return 0;
+	}
+	MQ_ATOMIC_STORE(&registry, reg);
+	if(cur)
+	{
+		cur->retired = retired_registries;
+		MQ_ATOMIC_STORE(&retired_registries, cur);
+	}
+	for(count = 0; removed; count++)
+	{
+		engine = removed->retired;
+		removed->retired = retired_engines;
+		MQ_ATOMIC_STORE(&retired_engines, removed);
+		removed = engine;
+	}
+	/* The new table has been published before readers is checked, so if
+	 * there are none, any which arrive later can only find the new one
+	 */
+	if(!__atomic_load_n(&readers, __ATOMIC_SEQ_CST))
+	{
+		mq_registry_reclaim_();
+	}
+	return (int) count;
+}
+
+/* (Internal) note that the calling thread is about to use the registry */
+static void
+mq_registry_enter_(void)
+{
+	__atomic_add_fetch(&readers, 1, __ATOMIC_SEQ_CST);
+}
+
+/* (Internal) note that the calling thread has finished using the registry,
+ * and holds no table or engine record obtained from it; if it was the last
+ * reader, anything retired while it was using the registry is freed, unless
+ * the registry is being updated
+ */
+static void
+mq_registry_leave_(void)
+{
+	if(__atomic_sub_fetch(&readers, 1, __ATOMIC_SEQ_CST) ||
+	   (!MQ_ATOMIC_LOAD(&retired_registries) && !MQ_ATOMIC_LOAD(&retired_engines)))
+	{
+		return;
+	}
+	if(pthread_mutex_trylock(&enginelock))
+	{
+		return;
+	}
+	/* A reader which has arrived since can only have found the current
+	 * table, which isn't retired
+	 */
+	if(!__atomic_load_n(&readers, __ATOMIC_SEQ_CST))
+	{
+		mq_registry_reclaim_();
+	}
+	pthread_mutex_unlock(&enginelock);
+}
+
+/* (Internal) free every retired table and engine record; the caller must
+ * hold enginelock, and no reader may be using the registry
+ */
+static void
+mq_registry_reclaim_(void)
+{
+	struct mq_registry_struct *reg;
+	struct mq_engine_struct *engine;
+
+	while((reg = retired_registries))
+	{
+		MQ_ATOMIC_STORE(&retired_registries, reg->retired);
+		free(reg);
+	}
+	while((engine = retired_engines))
+	{
+		MQ_ATOMIC_STORE(&retired_engines, engine->retired);
+		free(engine->plugin);
+		free(engine->scheme);
+		free(engine);
+	}
+}
+
+/* (Internal) free anything which remains retired when the library is
+ * unloaded, unless a thread is still using the registry
+ */
+static void
+mq_engine_fini_(void)
+{
+	pthread_mutex_lock(&enginelock);
+	if(!__atomic_load_n(&readers, __ATOMIC_SEQ_CST))
+	{
+		mq_registry_reclaim_();
+	}
+	pthread_mutex_unlock(&enginelock);
 }
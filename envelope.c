@@ -0,0 +1,1067 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* Envelopes pack many small logical messages into a single transport
+ * message. When MQO_ENVELOPE_SIZE is set on a connection, the messages
+ * created on it are plain buffers; sending one appends it to the
+ * connection's open envelope, which is sent as an ordinary message (with a
+ * content-type of MQ_ENVELOPE_TYPE) once it reaches MQO_ENVELOPE_SIZE bytes,
+ * once its oldest member has waited MQO_ENVELOPE_DELAY milliseconds, or
+ * when mq_deliver() is called. libmq has no timer of its own, and so the
+ * delay is only checked when a message is sent or mq_process() is called.
+ *
+ * The body of an envelope is a version byte followed by each member in
+ * turn: its type and subject, each as an unsigned LEB128 length (zero if
+ * absent) followed by that many bytes, the last of which is a NUL; then the
+ * length of its body, followed by the body itself.
+ *
+ * Envelopes are unpacked by mq_next(), mq_next_batch() and mq_next_timed()
+ * on any connection, whether or not MQO_ENVELOPE_SIZE is set: the first
+ * member is returned in place of the envelope, and the others are queued to
+ * be returned by subsequent calls. The members refer to the envelope's body
+ * rather than copying it, and the envelope is settled once every member has
+ * been: if any member was passed, the envelope is passed (and so every
+ * member will be received again); otherwise if any was rejected, it is
+ * rejected; otherwise, it is accepted. An envelope with a member which was
+ * freed without being settled is left for the engine to deal with, just as
+ * an ordinary message would be.
+ */
+
+#define MQ_MESSAGE_STRUCT_DEFINED      1
+
+#include "p_libmq.h"
+
+#define MQ_ENVELOPE_TYPE               "application/x-libmq-envelope"
+#define MQ_ENVELOPE_VERSION            1
+/* The default value of MQO_ENVELOPE_DELAY, in milliseconds */
+#define MQ_ENVELOPE_DELAY              10
+/* The longest possible encoding of a length */
+#define MQ_ENVELOPE_LENMAX             10
+
+/* The outcomes of an envelope's members, combined as a bitmask */
+#define MQ_ENVELOPE_REJECTED           1
+#define MQ_ENVELOPE_PASSED             2
+#define MQ_ENVELOPE_RELEASED           4
+
+struct mq_envelope_struct
+{
+	/* The open envelope of a sending connection */
+	size_t maxbytes;
+	unsigned long long maxdelay;
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+	size_t count;
+	unsigned long long opened;
+	char *address;
+	char *partition;
+	/* Messages which have been received (most of which are the members of
+	 * envelopes) but not yet returned, as a circular buffer
+	 */
+	MQMESSAGE **queue;
+	size_t qhead;
+	size_t qcount;
+	size_t qsize;
+};
+
+/* A received envelope, shared by its members */
+struct mq_envelope_in_struct
+{
+	MQMESSAGE *outer;
+	MQMESSAGE *members;
+	/* The number of members which haven't been settled, and which
+	 * haven't been freed
+	 */
+	int unsettled;
+	int refs;
+	int outcome;
+};
+
+struct mq_message_struct
+{
+	MQMESSAGEIMPL *impl;
+	MQ_MESSAGE_COMMON_MEMBERS;
+	/* The properties and body of an outgoing message are owned by it; those
+	 * of an incoming message are located within its envelope's body
+	 */
+	char *type;
+	char *subject;
+	char *address;
+	char *partition;
+	unsigned char *body;
+	size_t len;
+	size_t size;
+	MQFREEFN free_fn;
+	struct mq_envelope_in_struct *envelope;
+	int settled;
+};
+
+/* MQMESSAGE implementation members */
+static unsigned long mq_envelope_message_release_(MQMESSAGE *self);
+static MQMSGKIND mq_envelope_message_kind_(MQMESSAGE *self);
+static int mq_envelope_message_accept_(MQMESSAGE *self);
+static int mq_envelope_message_reject_(MQMESSAGE *self);
+static int mq_envelope_message_pass_(MQMESSAGE *self);
+static int mq_envelope_message_send_(MQMESSAGE *self);
+static int mq_envelope_message_set_type_(MQMESSAGE *self, const char *type);
+static const char *mq_envelope_message_type_(MQMESSAGE *self);
+static int mq_envelope_message_set_subject_(MQMESSAGE *self, const char *subject);
+static const char *mq_envelope_message_subject_(MQMESSAGE *self);
+static int mq_envelope_message_set_address_(MQMESSAGE *self, const char *address);
+static const char *mq_envelope_message_address_(MQMESSAGE *self);
+static const unsigned char *mq_envelope_message_body_(MQMESSAGE *self);
+static size_t mq_envelope_message_len_(MQMESSAGE *self);
+static int mq_envelope_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len);
+static int mq_envelope_message_set_partition_(MQMESSAGE *self, const char *partition);
+static const char *mq_envelope_message_partition_(MQMESSAGE *self);
+static int mq_envelope_message_add_bytes_owned_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn);
+static MQ *mq_envelope_message_connection_(MQMESSAGE *self);
+
+/* Internal utilities */
+static struct mq_envelope_struct *mq_envelope_state_(MQCOMMON *common);
+static int mq_envelope_is_(MQMESSAGE *message);
+static MQMESSAGE *mq_envelope_open_(struct mq_envelope_struct *env, MQMESSAGE *outer, int all);
+static int mq_envelope_append_(MQ *connection, struct mq_envelope_struct *env, MQMESSAGE *msg);
+static int mq_envelope_push_(struct mq_envelope_struct *env, MQMESSAGE *msg);
+static int mq_envelope_reserve_(struct mq_envelope_struct *env, size_t count);
+static size_t mq_envelope_count_(const unsigned char *body, size_t len);
+static size_t mq_envelope_put_(unsigned char *p, size_t value);
+static int mq_envelope_get_(const unsigned char **p, const unsigned char *end, size_t *value);
+static int mq_envelope_get_str_(const unsigned char **p, const unsigned char *end, char **str);
+static int mq_envelope_settle_(MQMESSAGE *self, int outcome);
+static int mq_envelope_strset_(MQMESSAGE *self, char **dest, const char *src);
+static int mq_envelope_strcmp_(const char *a, const char *b);
+
+static MQMESSAGEIMPL mq_envelope_message_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_envelope_message_release_,
+	mq_envelope_message_kind_,
+	mq_envelope_message_accept_,
+	mq_envelope_message_reject_,
+	mq_envelope_message_pass_,
+	mq_envelope_message_send_,
+	mq_envelope_message_set_type_,
+	mq_envelope_message_type_,
+	mq_envelope_message_set_subject_,
+	mq_envelope_message_subject_,
+	mq_envelope_message_set_address_,
+	mq_envelope_message_address_,
+	mq_envelope_message_body_,
+	mq_envelope_message_len_,
+	mq_envelope_message_add_bytes_,
+	mq_envelope_message_set_partition_,
+	mq_envelope_message_partition_,
+	/* add_iov */
+	NULL,
+	mq_envelope_message_add_bytes_owned_,
+	/* take_body */
+	NULL,
+	mq_envelope_message_connection_,
+	/* status */
+	NULL,
+	/* set_encoding */
+	NULL,
+	/* encoding */
+	NULL,
+	/* replace_body */
+	NULL
+};
+
+/* (Internal) set one of the envelope options of a connection; disabling
+ * packing sends the open envelope, if any
+ */
+int
+mq_envelope_set_option_(MQ *connection, MQCOMMON *common, MQOPTION option, long value)
+{
+	struct mq_envelope_struct *env;
+
+	if(value < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	env = mq_envelope_state_(common);
+	if(!env)
+	{
+		return -1;
+	}
+	switch(option)
+	{
+	case MQO_ENVELOPE_SIZE:
+		env->maxbytes = (size_t) value;
+		common->envelopesize = (size_t) value;
+		if(!value)
+		{
+			return mq_envelope_flush_(connection, common);
+		}
+		return 0;
+	case MQO_ENVELOPE_DELAY:
+		env->maxdelay = (unsigned long long) value * 1000000ULL;
+		return 0;
+	default:
+		break;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/* (Internal) create a message which will be packed into the connection's
+ * open envelope when it's sent
+ */
+int
+mq_envelope_create_(MQ *connection, MQMESSAGE **msg)
+{
+	MQMESSAGE *p;
+
+	p = (MQMESSAGE *) calloc(1, sizeof(MQMESSAGE));
+	if(!p)
+	{
+		return -1;
+	}
+	p->impl = &mq_envelope_message_impl_;
+	p->connection = connection;
+	p->kind = MQK_OUTGOING;
+	*msg = p;
+	return 0;
+}
+
+/* (Internal) send the connection's open envelope, if it has any members; if
+ * it can't be sent, it remains open so that the next attempt can retry it
+ */
+int
+mq_envelope_flush_(MQ *connection, MQCOMMON *common)
+{
+	struct mq_envelope_struct *env;
+	MQMESSAGE *msg;
+
+	env = common->envelope;
+	if(!env || !env->count)
+	{
+		return 0;
+	}
+	msg = NULL;
+	if(connection->impl->create(connection, &msg))
+	{
+		return -1;
+	}
+	if(msg->impl->set_type(msg, MQ_ENVELOPE_TYPE) ||
+	   (env->address && msg->impl->set_address(msg, env->address)) ||
+	   (env->partition && (!msg->impl->set_partition || msg->impl->set_partition(msg, env->partition))) ||
+	   mq_message_add_bytes(msg, env->buf, env->len) ||
+	   msg->impl->send(msg))
+	{
+		msg->impl->release(msg);
+		return -1;
+	}
+	msg->impl->release(msg);
+	env->len = 0;
+	env->count = 0;
+	free(env->address);
+	env->address = NULL;
+	free(env->partition);
+	env->partition = NULL;
+	return 0;
+}
+
+/* (Internal) send the connection's open envelope if its oldest member has
+ * waited for long enough
+ */
+int
+mq_envelope_check_(MQ *connection, MQCOMMON *common)
+{
+	struct mq_envelope_struct *env;
+
+	env = common->envelope;
+	if(!env || !env->count || mq_latency_now_() - env->opened < env->maxdelay)
+	{
+		return 0;
+	}
+	return mq_envelope_flush_(connection, common);
+}
+
+/* (Internal) obtain the next message which has been received (typically
+ * as part of an envelope) but not yet returned, if any
+ */
+MQMESSAGE *
+mq_envelope_next_(MQCOMMON *common)
+{
+	struct mq_envelope_struct *env;
+	MQMESSAGE *msg;
+
+	env = common->envelope;
+	if(!env->qcount)
+	{
+		return NULL;
+	}
+	msg = env->queue[env->qhead];
+	env->qhead = (env->qhead + 1) % env->qsize;
+	env->qcount--;
+	return msg;
+}
+
+/* (Internal) the number of messages which have been received but not yet
+ * returned
+ */
+size_t
+mq_envelope_pending_(MQCOMMON *common)
+{
+	return common->envelope ? common->envelope->qcount : 0;
+}
+
+/* (Internal) if a message which has just been received is an envelope,
+ * replace it with its first member, queueing the others
+ */
+int
+mq_envelope_unpack_(MQCOMMON *common, MQMESSAGE **message)
+{
+	struct mq_envelope_struct *env;
+	MQMESSAGE *first;
+
+	if(!mq_envelope_is_(*message))
+	{
+		return 0;
+	}
+	env = mq_envelope_state_(common);
+	if(!env)
+	{
+		return 0;
+	}
+	first = mq_envelope_open_(env, *message, 0);
+	if(first)
+	{
+		*message = first;
+	}
+	return 0;
+}
+
+/* (Internal) unpack any envelopes amongst n messages which have just been
+ * received, returning up to count of the resulting messages (in order) and
+ * queueing the remainder
+ */
+size_t
+mq_envelope_expand_(MQCOMMON *common, MQMESSAGE **messages, size_t n, size_t count)
+{
+	struct mq_envelope_struct *env;
+	size_t c, i;
+
+	for(c = 0; c < n; c++)
+	{
+		if(mq_envelope_is_(messages[c]))
+		{
+			break;
+		}
+	}
+	if(c == n)
+	{
+		return n;
+	}
+	/* Everything from the first envelope onwards passes through the queue
+	 * so that ordering is preserved; if the queue can't be grown, the
+	 * messages are returned as they are
+	 */
+	env = mq_envelope_state_(common);
+	if(!env || mq_envelope_reserve_(env, n - c))
+	{
+		return n;
+	}
+	for(i = c; i < n; i++)
+	{
+		if(!mq_envelope_is_(messages[i]) || !mq_envelope_open_(env, messages[i], 1))
+		{
+			mq_envelope_push_(env, messages[i]);
+		}
+	}
+	for(n = c; n < count && env->qcount; n++)
+	{
+		messages[n] = mq_envelope_next_(common);
+	}
+	return n;
+}
+
+/* (Internal) discard the envelope state of a connection which is being
+ * closed, sending its open envelope and freeing any messages which were
+ * received but never returned
+ */
+void
+mq_envelope_free_(MQ *connection, MQCOMMON *common)
+{
+	struct mq_envelope_struct *env;
+	MQMESSAGE *msg;
+
+	env = common->envelope;
+	if(!env)
+	{
+		return;
+	}
+	mq_envelope_flush_(connection, common);
+	while((msg = mq_envelope_next_(common)))
+	{
+		msg->impl->release(msg);
+	}
+	free(env->buf);
+	free(env->address);
+	free(env->partition);
+	free(env->queue);
+	free(env);
+	common->envelope = NULL;
+	common->envelopesize = 0;
+}
+
+/* (Internal) determine whether a message is an envelope */
+static int
+mq_envelope_is_(MQMESSAGE *message)
+{
+	const char *type;
+
+	type = message->impl->type(message);
+	return type && !strcmp(type, MQ_ENVELOPE_TYPE);
+}
+
+/* (Internal) unpack a received envelope, adding its members (either all of
+ * them, or all but the first) to the tail of the queue; returns the first
+ * member, or NULL if the envelope is malformed or can't be unpacked, in
+ * which case it's left as it is
+ */
+static MQMESSAGE *
+mq_envelope_open_(struct mq_envelope_struct *env, MQMESSAGE *outer, int all)
+{
+	struct mq_envelope_in_struct *in;
+	const unsigned char *body, *p, *end;
+	MQMESSAGE *m;
+	size_t len, count, c;
+
+	body = mq_message_body(outer);
+	len = mq_message_len(outer);
+	if(!body || len == (size_t) -1)
+	{
+		return NULL;
+	}
+	count = mq_envelope_count_(body, len);
+	if(!count || mq_envelope_reserve_(env, all ? count : count - 1))
+	{
+		return NULL;
+	}
+	in = (struct mq_envelope_in_struct *) calloc(1, sizeof(struct mq_envelope_in_struct));
+	if(!in)
+	{
+		return NULL;
+	}
+	in->members = (MQMESSAGE *) calloc(count, sizeof(MQMESSAGE));
+	if(!in->members)
+	{
+		free(in);
+		return NULL;
+	}
+	in->outer = outer;
+	in->unsettled = (int) count;
+	in->refs = (int) count;
+	p = body + 1;
+	end = body + len;
+	for(c = 0; c < count; c++)
+	{
+		/* The envelope has already been validated */
+		m = &(in->members[c]);
+		m->impl = &mq_envelope_message_impl_;
+		m->connection = MQ_MESSAGE_CONNECTION(outer);
+		m->kind = MQK_INCOMING;
+		m->envelope = in;
+		mq_envelope_get_str_(&p, end, &(m->type));
+		mq_envelope_get_str_(&p, end, &(m->subject));
+		mq_envelope_get_(&p, end, &(m->len));
+		m->body = (unsigned char *) p;
+		p += m->len;
+		if(c || all)
+		{
+			mq_envelope_push_(env, m);
+		}
+	}
+	return &(in->members[0]);
+}
+
+/* Free a message: once every member of a received envelope has been freed,
+ * so is the envelope
+ */
+static unsigned long
+mq_envelope_message_release_(MQMESSAGE *self)
+{
+	struct mq_envelope_in_struct *in;
+
+	if(self->kind == MQK_OUTGOING)
+	{
+		if(self->body && self->free_fn)
+		{
+			self->free_fn(self->body);
+		}
+		free(self->type);
+		free(self->subject);
+		free(self->address);
+		free(self->partition);
+		free(self);
+		return 0;
+	}
+	in = self->envelope;
+	if(!self->settled)
+	{
+		mq_envelope_settle_(self, MQ_ENVELOPE_RELEASED);
+	}
+	if(__atomic_sub_fetch(&(in->refs), 1, __ATOMIC_ACQ_REL))
+	{
+		return 0;
+	}
+	in->outer->impl->release(in->outer);
+	free(in->members);
+	free(in);
+	return 0;
+}
+
+static MQMSGKIND
+mq_envelope_message_kind_(MQMESSAGE *self)
+{
+	return self->kind;
+}
+
+static int
+mq_envelope_message_accept_(MQMESSAGE *self)
+{
+	return mq_envelope_settle_(self, 0);
+}
+
+static int
+mq_envelope_message_reject_(MQMESSAGE *self)
+{
+	return mq_envelope_settle_(self, MQ_ENVELOPE_REJECTED);
+}
+
+static int
+mq_envelope_message_pass_(MQMESSAGE *self)
+{
+	return mq_envelope_settle_(self, MQ_ENVELOPE_PASSED);
+}
+
+/* Pack a message into its connection's open envelope */
+static int
+mq_envelope_message_send_(MQMESSAGE *self)
+{
+	MQCOMMON *common;
+	struct mq_envelope_struct *env;
+
+	if(self->kind != MQK_OUTGOING)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	common = MQ_COMMON(self->connection);
+	env = mq_envelope_state_(common);
+	if(!env)
+	{
+		return -1;
+	}
+	return mq_envelope_append_(self->connection, env, self);
+}
+
+static int
+mq_envelope_message_set_type_(MQMESSAGE *self, const char *type)
+{
+	return mq_envelope_strset_(self, &(self->type), type);
+}
+
+static const char *
+mq_envelope_message_type_(MQMESSAGE *self)
+{
+	return self->type;
+}
+
+static int
+mq_envelope_message_set_subject_(MQMESSAGE *self, const char *subject)
+{
+	return mq_envelope_strset_(self, &(self->subject), subject);
+}
+
+static const char *
+mq_envelope_message_subject_(MQMESSAGE *self)
+{
+	return self->subject;
+}
+
+static int
+mq_envelope_message_set_address_(MQMESSAGE *self, const char *address)
+{
+	return mq_envelope_strset_(self, &(self->address), address);
+}
+
+/* The address of an incoming message is that of its envelope */
+static const char *
+mq_envelope_message_address_(MQMESSAGE *self)
+{
+	MQMESSAGE *outer;
+
+	if(self->kind == MQK_OUTGOING)
+	{
+		return self->address;
+	}
+	outer = self->envelope->outer;
+	return outer->impl->address(outer);
+}
+
+static const unsigned char *
+mq_envelope_message_body_(MQMESSAGE *self)
+{
+	return self->body;
+}
+
+static size_t
+mq_envelope_message_len_(MQMESSAGE *self)
+{
+	return self->len;
+}
+
+/* Add bytes to the body of an outgoing message */
+static int
+mq_envelope_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if(self->kind != MQK_OUTGOING)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(self->free_fn && self->free_fn != free)
+	{
+		/* The body was adopted from the caller and can't be extended
+		 * in place, so copy it first
+		 */
+		p = (unsigned char *) malloc(self->len + len);
+		if(!p)
+		{
+			return -1;
+		}
+		memcpy(p, self->body, self->len);
+		self->free_fn(self->body);
+		self->body = p;
+		self->size = self->len + len;
+		self->free_fn = free;
+	}
+	if(self->len + len > self->size)
+	{
+		size = self->len + len;
+		p = (unsigned char *) realloc(self->body, size);
+		if(!p)
+		{
+			return -1;
+		}
+		self->body = p;
+		self->size = size;
+		self->free_fn = free;
+	}
+	memcpy(&(self->body[self->len]), buf, len);
+	self->len += len;
+	return 0;
+}
+
+static int
+mq_envelope_message_set_partition_(MQMESSAGE *self, const char *partition)
+{
+	return mq_envelope_strset_(self, &(self->partition), partition);
+}
+
+/* The partition of an incoming message is that of its envelope */
+static const char *
+mq_envelope_message_partition_(MQMESSAGE *self)
+{
+	MQMESSAGE *outer;
+
+	if(self->kind == MQK_OUTGOING)
+	{
+		return self->partition;
+	}
+	outer = self->envelope->outer;
+	return outer->impl->partition ? outer->impl->partition(outer) : NULL;
+}
+
+/* Add a buffer to the body of an outgoing message, taking ownership of it */
+static int
+mq_envelope_message_add_bytes_owned_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn)
+{
+	if(self->kind != MQK_OUTGOING)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(self->body)
+	{
+		if(mq_envelope_message_add_bytes_(self, buf, len))
+		{
+			return -1;
+		}
+		if(free_fn)
+		{
+			free_fn(buf);
+		}
+		return 0;
+	}
+	self->body = buf;
+	self->len = len;
+	self->size = len;
+	self->free_fn = free_fn;
+	return 0;
+}
+
+static MQ *
+mq_envelope_message_connection_(MQMESSAGE *self)
+{
+	return self->connection;
+}
+
+/* (Internal) obtain the envelope state of a connection, creating it if
+ * necessary
+ */
+static struct mq_envelope_struct *
+mq_envelope_state_(MQCOMMON *common)
+{
+	struct mq_envelope_struct *env;
+
+	if(!common)
+	{
+		errno = ENOTSUP;
+		return NULL;
+	}
+	if(common->envelope)
+	{
+		return common->envelope;
+	}
+	env = (struct mq_envelope_struct *) calloc(1, sizeof(struct mq_envelope_struct));
+	if(!env)
+	{
+		return NULL;
+	}
+	env->maxbytes = common->envelopesize;
+	env->maxdelay = MQ_ENVELOPE_DELAY * 1000000ULL;
+	common->envelope = env;
+	return env;
+}
+
+/* (Internal) pack an outgoing message into the open envelope, sending the
+ * envelope first if the message won't fit, and afterwards if it's full or
+ * has been open for long enough. A message which is larger than the
+ * envelope size is sent in an envelope of its own.
+ */
+static int
+mq_envelope_append_(MQ *connection, struct mq_envelope_struct *env, MQMESSAGE *msg)
+{
+	MQCOMMON *common;
+	unsigned char *p;
+	size_t tlen, slen, need, size;
+
+	common = MQ_COMMON(connection);
+	if(env->count &&
+	   (mq_envelope_strcmp_(env->address, msg->address) ||
+		mq_envelope_strcmp_(env->partition, msg->partition)))
+	{
+		/* An envelope has a single address and partition */
+		if(mq_envelope_flush_(connection, common))
+		{
+			return -1;
+		}
+	}
+	tlen = msg->type ? strlen(msg->type) + 1 : 0;
+	slen = msg->subject ? strlen(msg->subject) + 1 : 0;
+	need = (MQ_ENVELOPE_LENMAX * 3) + tlen + slen + msg->len;
+	if(env->count && env->len + need > env->maxbytes &&
+	   mq_envelope_flush_(connection, common))
+	{
+		return -1;
+	}
+	if(!env->count)
+	{
+		need++;
+	}
+	if(env->len + need > env->size)
+	{
+		for(size = env->size ? env->size : 256; size < env->len + need; size *= 2);
+		p = (unsigned char *) realloc(env->buf, size);
+		if(!p)
+		{
+			return -1;
+		}
+		env->buf = p;
+		env->size = size;
+	}
+	if(!env->count)
+	{
+		if((msg->address && !(env->address = strdup(msg->address))) ||
+		   (msg->partition && !(env->partition = strdup(msg->partition))))
+		{
+			free(env->address);
+			env->address = NULL;
+			return -1;
+		}
+		env->buf[0] = MQ_ENVELOPE_VERSION;
+		env->len = 1;
+		env->opened = mq_latency_now_();
+	}
+	p = env->buf + env->len;
+	p += mq_envelope_put_(p, tlen);
+	memcpy(p, msg->type, tlen);
+	p += tlen;
+	p += mq_envelope_put_(p, slen);
+	memcpy(p, msg->subject, slen);
+	p += slen;
+	p += mq_envelope_put_(p, msg->len);
+	if(msg->len)
+	{
+		memcpy(p, msg->body, msg->len);
+		p += msg->len;
+	}
+	env->len = p - env->buf;
+	env->count++;
+	if(env->len >= env->maxbytes || mq_latency_now_() - env->opened >= env->maxdelay)
+	{
+		/* The message is already packed, so if the envelope can't be
+		 * sent now, it's retried by the next flush
+		 */
+		mq_envelope_flush_(connection, common);
+	}
+	return 0;
+}
+
+/* (Internal) add a message to the tail of the queue, which must have room */
+static int
+mq_envelope_push_(struct mq_envelope_struct *env, MQMESSAGE *msg)
+{
+	env->queue[(env->qhead + env->qcount) % env->qsize] = msg;
+	env->qcount++;
+	return 0;
+}
+
+/* (Internal) ensure that the queue has room for count more messages */
+static int
+mq_envelope_reserve_(struct mq_envelope_struct *env, size_t count)
+{
+	MQMESSAGE **p;
+	size_t size, c;
+
+	if(env->qcount + count <= env->qsize)
+	{
+		return 0;
+	}
+	for(size = env->qsize ? env->qsize * 2 : 64; size < env->qcount + count; size *= 2);
+	p = (MQMESSAGE **) malloc(size * sizeof(MQMESSAGE *));
+	if(!p)
+	{
+		return -1;
+	}
+	for(c = 0; c < env->qcount; c++)
+	{
+		p[c] = env->queue[(env->qhead + c) % env->qsize];
+	}
+	free(env->queue);
+	env->queue = p;
+	env->qhead = 0;
+	env->qsize = size;
+	return 0;
+}
+
+/* (Internal) validate the body of an envelope, returning the number of
+ * members it contains, or zero if it's malformed
+ */
+static size_t
+mq_envelope_count_(const unsigned char *body, size_t len)
+{
+	const unsigned char *p, *end;
+	char *str;
+	size_t count, n;
+
+	if(!len || body[0] != MQ_ENVELOPE_VERSION)
+	{
+		return 0;
+	}
+	p = body + 1;
+	end = body + len;
+	for(count = 0; p < end; count++)
+	{
+		if(mq_envelope_get_str_(&p, end, &str) ||
+		   mq_envelope_get_str_(&p, end, &str) ||
+		   mq_envelope_get_(&p, end, &n) ||
+		   n > (size_t) (end - p))
+		{
+			return 0;
+		}
+		p += n;
+	}
+	return count;
+}
+
+/* (Internal) encode a length as unsigned LEB128, returning the number of
+ * bytes written
+ */
+static size_t
+mq_envelope_put_(unsigned char *p, size_t value)
+{
+	size_t n;
+
+	for(n = 0; value >= 0x80; n++)
+	{
+		p[n] = (unsigned char) (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	p[n] = (unsigned char) value;
+	return n + 1;
+}
+
+/* (Internal) decode an unsigned LEB128 length */
+static int
+mq_envelope_get_(const unsigned char **p, const unsigned char *end, size_t *value)
+{
+	const unsigned char *s;
+	unsigned int shift;
+
+	*value = 0;
+	for(s = *p, shift = 0; s < end && shift < sizeof(size_t) * 8; s++, shift += 7)
+	{
+		*value |= (size_t) (*s & 0x7f) << shift;
+		if(!(*s & 0x80))
+		{
+			*p = s + 1;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* (Internal) locate a NUL-terminated string within an envelope */
+static int
+mq_envelope_get_str_(const unsigned char **p, const unsigned char *end, char **str)
+{
+	size_t n;
+
+	if(mq_envelope_get_(p, end, &n) || n > (size_t) (end - *p))
+	{
+		return -1;
+	}
+	if(!n)
+	{
+		*str = NULL;
+		return 0;
+	}
+	if((*p)[n - 1])
+	{
+		return -1;
+	}
+	*str = (char *) *p;
+	*p += n;
+	return 0;
+}
+
+/* (Internal) record the outcome of a member of an envelope; once every
+ * member has an outcome, the envelope itself is settled
+ */
+static int
+mq_envelope_settle_(MQMESSAGE *self, int outcome)
+{
+	struct mq_envelope_in_struct *in;
+	MQMESSAGE *outer;
+
+	if(self->kind != MQK_INCOMING || self->settled)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	self->settled = 1;
+	in = self->envelope;
+	if(outcome)
+	{
+		__atomic_fetch_or(&(in->outcome), outcome, __ATOMIC_ACQ_REL);
+	}
+	if(__atomic_sub_fetch(&(in->unsettled), 1, __ATOMIC_ACQ_REL))
+	{
+		return 0;
+	}
+	outer = in->outer;
+	outcome = MQ_ATOMIC_LOAD(&(in->outcome));
+	if(outcome & MQ_ENVELOPE_RELEASED)
+	{
+		return 0;
+	}
+	if(outcome & MQ_ENVELOPE_PASSED)
+	{
+		errno = 0;
+		if(!outer->impl->pass(outer))
+		{
+			return 0;
+		}
+		if(errno == EAGAIN)
+		{
+			/* The envelope couldn't be passed on yet: leave this
+			 * member unsettled, so that passing it can be retried
+			 */
+			self->settled = 0;
+			__atomic_add_fetch(&(in->unsettled), 1, __ATOMIC_ACQ_REL);
+		}
+		return -1;
+	}
+	if(outcome & MQ_ENVELOPE_REJECTED)
+	{
+		return outer->impl->reject(outer);
+	}
+	return outer->impl->accept(outer);
+}
+
+static int
+mq_envelope_strset_(MQMESSAGE *self, char **dest, const char *src)
+{
+	char *p;
+
+	if(self->kind != MQK_OUTGOING)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	p = NULL;
+	if(src)
+	{
+		p = strdup(src);
+		if(!p)
+		{
+			return -1;
+		}
+	}
+	free(*dest);
+	*dest = p;
+	return 0;
+}
+
+/* (Internal) compare two strings, either of which may be NULL */
+static int
+mq_envelope_strcmp_(const char *a, const char *b)
+{
+	if(!a || !b)
+	{
+		return a != b;
+	}
+	return strcmp(a, b);
+}
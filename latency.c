@@ -0,0 +1,357 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libmq.h"
+
+#include <time.h>
+
+/* Latency histograms are log-bucketed, in the manner of HdrHistogram: each
+ * power of two is divided into MQ_LATENCY_SUBBUCKETS linear sub-buckets, so
+ * that any recorded value is within 1/MQ_LATENCY_SUBBUCKETS of the bucket
+ * it is counted in. Values below MQ_LATENCY_SUBBUCKETS nanoseconds are
+ * counted exactly, and values of 2^MQ_LATENCY_MAXBITS nanoseconds (about 4.9
+ * hours) or more are clamped.
+ *
+ * The time from sending a message to its delivery is measured by recording
+ * the time of each send in a ring of up to MQ_LATENCY_PENDING entries, all of
+ * which are settled by the next successful mq_deliver(). Sends which occur
+ * while the ring is full aren't measured.
+ */
+
+#define MQ_LATENCY_SUBBITS             5
+#define MQ_LATENCY_SUBBUCKETS          (1 << MQ_LATENCY_SUBBITS)
+#define MQ_LATENCY_MAXBITS             44
+#define MQ_LATENCY_BUCKETS             ((MQ_LATENCY_MAXBITS - MQ_LATENCY_SUBBITS + 1) * MQ_LATENCY_SUBBUCKETS)
+#define MQ_LATENCY_KINDS               (MQL_SETTLE + 1)
+#define MQ_LATENCY_PENDING             4096
+
+struct mq_histogram_struct
+{
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long buckets[MQ_LATENCY_BUCKETS];
+};
+
+struct mq_latency_struct
+{
+	struct mq_histogram_struct hist[MQ_LATENCY_KINDS];
+	/* lock protects the ring of pending send times, which may be
+	 * updated by several threads at once via a shared sender
+	 */
+	pthread_mutex_t lock;
+	unsigned long long pending[MQ_LATENCY_PENDING];
+	size_t phead;
+	size_t pcount;
+};
+
+static struct mq_histogram_struct *mq_latency_histogram_(MQ *connection, MQLATENCYKIND kind);
+static void mq_latency_add_(struct mq_histogram_struct *hist, unsigned long long value);
+static size_t mq_latency_index_(unsigned long long value);
+static unsigned long long mq_latency_value_(size_t index);
+static unsigned long long mq_latency_at_(struct mq_histogram_struct *hist, double percentile);
+static void mq_latency_clear_(struct mq_latency_struct *latency);
+
+/* Obtain a summary of one of a connection's latency histograms */
+int
+mq_latency(MQ *connection, MQLATENCYKIND kind, MQLATENCY *latency)
+{
+	struct mq_histogram_struct *hist;
+
+	hist = mq_latency_histogram_(connection, kind);
+	if(!hist)
+	{
+		return -1;
+	}
+	memset(latency, 0, sizeof(MQLATENCY));
+	latency->count = __atomic_load_n(&(hist->count), __ATOMIC_RELAXED);
+	if(!latency->count)
+	{
+		return 0;
+	}
+	latency->min = __atomic_load_n(&(hist->min), __ATOMIC_RELAXED);
+	latency->max = __atomic_load_n(&(hist->max), __ATOMIC_RELAXED);
+	latency->mean = __atomic_load_n(&(hist->sum), __ATOMIC_RELAXED) / latency->count;
+	latency->p50 = mq_latency_at_(hist, 50);
+	latency->p90 = mq_latency_at_(hist, 90);
+	latency->p99 = mq_latency_at_(hist, 99);
+	latency->p999 = mq_latency_at_(hist, 99.9);
+	return 0;
+}
+
+/* Obtain a percentile of one of a connection's latency histograms; returns
+ * zero if the histogram is empty or unavailable
+ */
+unsigned long long
+mq_latency_percentile(MQ *connection, MQLATENCYKIND kind, double percentile)
+{
+	struct mq_histogram_struct *hist;
+
+	hist = mq_latency_histogram_(connection, kind);
+	if(!hist || percentile < 0 || percentile > 100)
+	{
+		return 0;
+	}
+	return mq_latency_at_(hist, percentile);
+}
+
+/* Reset all of a connection's latency histograms */
+int
+mq_latency_reset(MQ *connection)
+{
+	MQCOMMON *common;
+
+	common = MQ_COMMON(connection);
+	if(!common || !common->latency)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	mq_latency_clear_(common->latency);
+	return 0;
+}
+
+/* (Internal) enable or disable latency histograms for a connection */
+int
+mq_latency_enable_(MQCOMMON *common, int enable)
+{
+	struct mq_latency_struct *latency;
+
+	if(!enable)
+	{
+		mq_latency_free_(common);
+		return 0;
+	}
+	if(common->latency)
+	{
+		return 0;
+	}
+	latency = (struct mq_latency_struct *) malloc(sizeof(struct mq_latency_struct));
+	if(!latency)
+	{
+		return -1;
+	}
+	pthread_mutex_init(&(latency->lock), NULL);
+	mq_latency_clear_(latency);
+	common->latency = latency;
+	return 0;
+}
+
+/* (Internal) discard a connection's latency histograms */
+void
+mq_latency_free_(MQCOMMON *common)
+{
+	if(!common->latency)
+	{
+		return;
+	}
+	pthread_mutex_destroy(&(common->latency->lock));
+	free(common->latency);
+	common->latency = NULL;
+}
+
+/* (Internal) obtain the current time from the monotonic clock, in
+ * nanoseconds
+ */
+unsigned long long
+mq_latency_now_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/* (Internal) record the time elapsed since start */
+void
+mq_latency_record_(MQCOMMON *common, MQLATENCYKIND kind, unsigned long long start)
+{
+	unsigned long long now;
+
+	if(!common->latency)
+	{
+		return;
+	}
+	now = mq_latency_now_();
+	mq_latency_add_(&(common->latency->hist[kind]), now > start ? now - start : 0);
+}
+
+/* (Internal) note that count messages have been sent at time when */
+void
+mq_latency_sent_(MQCOMMON *common, size_t count, unsigned long long when)
+{
+	struct mq_latency_struct *latency;
+
+	latency = common->latency;
+	if(!latency)
+	{
+		return;
+	}
+	pthread_mutex_lock(&(latency->lock));
+	for(; count && latency->pcount < MQ_LATENCY_PENDING; count--)
+	{
+		latency->pending[(latency->phead + latency->pcount) % MQ_LATENCY_PENDING] = when;
+		latency->pcount++;
+	}
+	pthread_mutex_unlock(&(latency->lock));
+}
+
+/* (Internal) record the settlement of every message sent before when */
+void
+mq_latency_settled_(MQCOMMON *common, unsigned long long when)
+{
+	struct mq_latency_struct *latency;
+	unsigned long long sent, now;
+
+	latency = common->latency;
+	if(!latency)
+	{
+		return;
+	}
+	now = mq_latency_now_();
+	pthread_mutex_lock(&(latency->lock));
+	while(latency->pcount)
+	{
+		sent = latency->pending[latency->phead];
+		if(sent > when)
+		{
+			/* Sent after the delivery began (by another thread) */
+			break;
+		}
+		mq_latency_add_(&(latency->hist[MQL_SETTLE]), now - sent);
+		latency->phead = (latency->phead + 1) % MQ_LATENCY_PENDING;
+		latency->pcount--;
+	}
+	pthread_mutex_unlock(&(latency->lock));
+}
+
+/* (Internal) locate a connection's histogram for a particular operation */
+static struct mq_histogram_struct *
+mq_latency_histogram_(MQ *connection, MQLATENCYKIND kind)
+{
+	MQCOMMON *common;
+
+	common = MQ_COMMON(connection);
+	if(!common || !common->latency || (int) kind < 0 || kind >= MQ_LATENCY_KINDS)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	return &(common->latency->hist[kind]);
+}
+
+/* (Internal) add a value to a histogram */
+static void
+mq_latency_add_(struct mq_histogram_struct *hist, unsigned long long value)
+{
+	unsigned long long cur;
+
+	__atomic_add_fetch(&(hist->buckets[mq_latency_index_(value)]), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(hist->sum), value, __ATOMIC_RELAXED);
+	cur = __atomic_load_n(&(hist->min), __ATOMIC_RELAXED);
+	while(value < cur && !__atomic_compare_exchange_n(&(hist->min), &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	cur = __atomic_load_n(&(hist->max), __ATOMIC_RELAXED);
+	while(value > cur && !__atomic_compare_exchange_n(&(hist->max), &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_add_fetch(&(hist->count), 1, __ATOMIC_RELAXED);
+}
+
+/* (Internal) determine which bucket a value is counted in */
+static size_t
+mq_latency_index_(unsigned long long value)
+{
+	int shift;
+
+	if(value < MQ_LATENCY_SUBBUCKETS)
+	{
+		return (size_t) value;
+	}
+	if(value >> MQ_LATENCY_MAXBITS)
+	{
+		value = (1ULL << MQ_LATENCY_MAXBITS) - 1;
+	}
+	shift = (63 - __builtin_clzll(value)) - MQ_LATENCY_SUBBITS;
+	return ((size_t) (shift + 1) << MQ_LATENCY_SUBBITS) | (size_t) ((value >> shift) & (MQ_LATENCY_SUBBUCKETS - 1));
+}
+
+/* (Internal) determine the highest value counted in a bucket */
+static unsigned long long
+mq_latency_value_(size_t index)
+{
+	int shift;
+
+	if(index < MQ_LATENCY_SUBBUCKETS)
+	{
+		return index;
+	}
+	shift = (int) (index >> MQ_LATENCY_SUBBITS) - 1;
+	return (((unsigned long long) (MQ_LATENCY_SUBBUCKETS | (index & (MQ_LATENCY_SUBBUCKETS - 1))) + 1) << shift) - 1;
+}
+
+/* (Internal) find the value at a given percentile of a histogram */
+static unsigned long long
+mq_latency_at_(struct mq_histogram_struct *hist, double percentile)
+{
+	unsigned long long count, target, seen, value, max;
+	size_t c;
+
+	count = __atomic_load_n(&(hist->count), __ATOMIC_RELAXED);
+	if(!count)
+	{
+		return 0;
+	}
+	target = (unsigned long long) ((percentile / 100.0) * count + 0.5);
+	if(target < 1)
+	{
+		target = 1;
+	}
+	max = __atomic_load_n(&(hist->max), __ATOMIC_RELAXED);
+	seen = 0;
+	for(c = 0; c < MQ_LATENCY_BUCKETS; c++)
+	{
+		seen += __atomic_load_n(&(hist->buckets[c]), __ATOMIC_RELAXED);
+		if(seen >= target)
+		{
+			value = mq_latency_value_(c);
+			return value < max ? value : max;
+		}
+	}
+	return max;
+}
+
+/* (Internal) reset a set of histograms and discard pending send times */
+static void
+mq_latency_clear_(struct mq_latency_struct *latency)
+{
+	size_t c;
+
+	pthread_mutex_lock(&(latency->lock));
+	for(c = 0; c < MQ_LATENCY_KINDS; c++)
+	{
+		memset(&(latency->hist[c]), 0, sizeof(struct mq_histogram_struct));
+		latency->hist[c].min = ~0ULL;
+	}
+	latency->phead = 0;
+	latency->pcount = 0;
+	pthread_mutex_unlock(&(latency->lock));
+}
@@ -40,8 +40,38 @@ typedef struct mq_message_impl_struct MQMESSAGEIMPL;
 
 typedef int (*MQENTRY)(void *self);
 
+typedef struct mq_common_struct MQCOMMON;
+
 typedef MQ *(*MQCONSTRUCTOR)(const char *uri, const char *reserved1, const char *reserved2);
 
+/* State which is maintained by libmq itself on behalf of a connection; an
+ * engine which includes MQ_CONNECTION_COMMON_MEMBERS in its connection
+ * structure should return a pointer to it from its common() method, and
+ * otherwise leave it alone.
+ */
+struct mq_common_struct
+{
+	MQSTATS stats;
+	/* Latency histograms, if enabled with MQO_LATENCY; private to libmq */
+	struct mq_latency_struct *latency;
+	/* Shard assignment, if enabled with mq_set_shards(); private to libmq */
+	struct mq_shards_struct *shards;
+	/* Compression of outgoing message bodies (MQO_COMPRESSION, etc.),
+	 * where compressmin is zero until set, and the limit on the size of
+	 * decompressed incoming bodies (MQO_DECOMPRESS_LIMIT), which is zero
+	 * until set; private to libmq
+	 */
+	int compression;
+	int compresslevel;
+	long compressmin;
+	long decompressmax;
+	/* Packing of outgoing messages into envelopes (MQO_ENVELOPE_SIZE),
+	 * and messages unpacked from received envelopes; private to libmq
+	 */
+	size_t envelopesize;
+	struct mq_envelope_struct *envelope;
+};
+
 /* Define a generic MQ structure. Individual implementations should define
  * MQ_CONNECTION_STRUCT_DEFINED before including this file and declare their
  * own struct mq_connection_struct, ensuring the first member is a pointer to
@@ -60,7 +90,9 @@ typedef MQ *(*MQCONSTRUCTOR)(const char *uri, const char *reserved1, const char
 	char *errmsg;					  \
 	char *uri;						  \
 	CLUSTER *cluster;				  \
-	struct timeval backoff;
+	struct timeval backoff;			  \
+	int nonblock;					  \
+	MQCOMMON common;
 
 # ifndef MQ_CONNECTION_STRUCT_DEFINED
 struct mq_connection_struct
@@ -125,7 +157,8 @@ struct mq_message_struct
 /* Set the backoff timer to n seconds in the future */
 # define BACKOFF_SECS(conn, n)					\
 	gettimeofday(&(conn->backoff), NULL);		\
-	conn->backoff.tv_sec += n;
+	conn->backoff.tv_sec += n;					\
+	__atomic_add_fetch(&(conn->common.stats.backoffs), 1, __ATOMIC_RELAXED);
 
 struct mq_connection_impl_struct
 {
@@ -160,6 +193,51 @@ struct mq_connection_impl_struct
 	int (*set_partition)(MQ *self, const char *partition);
 	/* Obtain the partition that this queue is associated with */
 	const char *(*partition)(MQ *self);
+	/* The following members are optional and may be NULL, in which case
+	 * libmq will provide a generic implementation in terms of the
+	 * mandatory members above.
+	 */
+	/* Obtain up to count messages which have already arrived, blocking
+	 * at most once if none have; on success, *received is set to the
+	 * number of messages stored in msgs
+	 */
+	int (*next_batch)(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received);
+	/* Send a set of outgoing messages and deliver them */
+	int (*send_batch)(MQ *self, MQMESSAGE **msgs, size_t count);
+	/* Wait up to timeout milliseconds for the next message to arrive,
+	 * setting the error state to EAGAIN if none does
+	 */
+	int (*next_timed)(MQ *self, MQMESSAGE **msg, int timeout);
+	/* Set a connection option (MQO_*) */
+	int (*set_option)(MQ *self, MQOPTION option, long value);
+	/* Obtain a pollable file descriptor for the connection, setting
+	 * *events to the MQE_* events which should be polled for
+	 */
+	int (*fd)(MQ *self, int *events);
+	/* Perform any pending work without blocking */
+	int (*process)(MQ *self);
+	/* Obtain the state maintained by libmq for the connection; if this
+	 * is NULL, no statistics are available
+	 */
+	MQCOMMON *(*common)(MQ *self);
+	/* Enable store-and-forward spooling of outgoing messages, using the
+	 * directory path
+	 */
+	int (*set_spool)(MQ *self, const char *path);
+	/* Obtain the number of incoming messages which have arrived but not
+	 * yet been obtained
+	 */
+	int (*pending)(MQ *self);
+	/* Set the function invoked as outgoing messages' outcomes become
+	 * known
+	 */
+	int (*set_sent_callback)(MQ *self, MQSENTFN fn, void *data);
+	/* Replace the connection's partition with a set of partitions, all
+	 * of which are consumed from when receiving; count is zero to revert
+	 * to the partition set with set_partition(). Subscriptions to
+	 * partitions which remain in the set should be left undisturbed.
+	 */
+	int (*set_partitions)(MQ *self, const char *const *partitions, size_t count);
 };
 
 struct mq_message_impl_struct
@@ -201,16 +279,56 @@ struct mq_message_impl_struct
 	int (*set_partition)(MQMESSAGE *self, const char *partition);
 	/* Obtain the partition that this message is associated with */
 	const char *(*partition)(MQMESSAGE *self);	
+	/* The following members are optional and may be NULL */
+	/* Add a sequence of bytes gathered from a set of buffers to an
+	 * outgoing message
+	 */
+	int (*add_iov)(MQMESSAGE *self, const struct iovec *iov, int iovcnt);
+	/* Add a buffer to an outgoing message, taking ownership of it; if
+	 * this fails, ownership remains with the caller
+	 */
+	int (*add_bytes_owned)(MQMESSAGE *self, unsigned char *buf, size_t buflen, MQFREEFN free_fn);
+	/* Detach the body of a message, returning a buffer which must be
+	 * freed with free()
+	 */
+	unsigned char *(*take_body)(MQMESSAGE *self, size_t *buflen);
+	/* Obtain the connection that a message is associated with */
+	MQ *(*connection)(MQMESSAGE *self);
+	/* Obtain the delivery status of an outgoing message */
+	MQSTATUS (*status)(MQMESSAGE *self);
+	/* Set the content-encoding of an outgoing message's body */
+	int (*set_encoding)(MQMESSAGE *self, const char *encoding);
+	/* Obtain the content-encoding of a message's body, if any */
+	const char *(*encoding)(MQMESSAGE *self);
+	/* Replace the body of an incoming message with its decoded form,
+	 * taking ownership of buf; the message has no content-encoding
+	 * thereafter
+	 */
+	int (*replace_body)(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn);
 };
 
+/* The version of the interface between libmq and its engines defined by
+ * this file, which changes whenever MQ_CONNECTION_COMMON_MEMBERS, MQCOMMON,
+ * MQCONNIMPL or MQMESSAGEIMPL do. libmq reads members of the structures which
+ * an engine provides that didn't exist when older engines were built, and so
+ * refuses to load a plug-in built against any other version: each plug-in
+ * must include MQ_ENGINE_PLUGIN once at file scope, and plug-ins built
+ * before it existed must be rebuilt.
+ */
+# define MQ_ENGINE_ABI                  1
+
+# define MQ_ENGINE_PLUGIN \
+	const int mq_engine_abi = MQ_ENGINE_ABI
+
 int mq_register(const char *scheme, MQCONSTRUCTOR construct, void *handle);
 int mq_unregister(const char *scheme, void *handle);
 int mq_unregister_constructor(MQCONSTRUCTOR construct);
 int mq_unregister_all(void *handle);
 
-/* Forward declaration for the plug-in entry-point */
+/* Forward declarations for the plug-in entry-point and interface version */
 
 int mq_entry(void *self);
+extern const int mq_engine_abi;
 
 END_DECLS_;
 
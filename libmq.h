@@ -21,6 +21,7 @@
 # define LIBMQ_H_                       1
 
 # include <stddef.h>
+# include <sys/uio.h>
 # include <libcluster.h>
 
 # undef BEGIN_DECLS_
@@ -36,6 +37,11 @@
 typedef struct mq_connection_struct MQ;
 typedef struct mq_message_struct MQMESSAGE;
 
+/* A function used to free a buffer whose ownership has been transferred to
+ * a message
+ */
+typedef void (*MQFREEFN)(void *ptr);
+
 typedef enum
 {
 	MQS_DISCONNECTED,
@@ -49,12 +55,221 @@ typedef enum
 	MQK_INCOMING
 } MQMSGKIND;
 
+typedef enum
+{
+	/* If non-zero, mq_next() and mq_next_batch() return immediately with
+	 * errno set to EAGAIN if no messages are available, rather than waiting.
+	 * On a shared sender (see mq_connect_send_shared()), sending fails with
+	 * EAGAIN rather than waiting if too many messages are already queued.
+	 */
+	MQO_NONBLOCK,
+	/* The maximum number of released message objects which a connection
+	 * retains for re-use; negative (the default) means there is no limit,
+	 * while zero disables re-use altogether
+	 */
+	MQO_POOL,
+	/* If non-zero, latency histograms (see mq_latency()) are recorded for
+	 * the connection; this should be set immediately after connecting.
+	 * Setting it to zero discards any histograms recorded so far.
+	 */
+	MQO_LATENCY,
+	/* The time, in milliseconds, for which mq_deliver() on a spooled
+	 * connection (see mq_set_spool()) waits for outgoing messages to be
+	 * forwarded before writing them to the spool on disk; the default is
+	 * 1000
+	 */
+	MQO_SPOOL_DEADLINE,
+	/* The number of bytes of encoded messages which a spooled connection
+	 * holds in memory before writing them to the spool on disk; negative
+	 * means there is no limit, and the default is 16MiB
+	 */
+	MQO_SPOOL_MEMORY,
+	/* The maximum size, in bytes, of the spool on disk, beyond which
+	 * sending fails with ENOSPC; negative means there is no limit, and
+	 * the default is 1GiB
+	 */
+	MQO_SPOOL_DISK,
+	/* The number of incoming messages which a receiving connection asks
+	 * to be sent ahead of the application's requests for them, where
+	 * this is supported; zero (the default) leaves this to the engine. A
+	 * negative value enables adaptive prefetch of up to -value messages,
+	 * which grows while the application keeps up with the messages
+	 * arriving and shrinks when it falls behind.
+	 */
+	MQO_PREFETCH,
+	/* The number of outgoing messages whose delivery status is tracked
+	 * (see mq_message_status()); the status of a message sent when this
+	 * many more have been sent after it is no longer known. The default
+	 * is 1, which is also the minimum. A message whose status is still
+	 * pending can't be sent again (EBUSY).
+	 */
+	MQO_OUTGOING_WINDOW,
+	/* The algorithm (MQZ_*) used to compress the bodies of outgoing
+	 * messages, which are tagged with a content-encoding naming it; the
+	 * default is MQZ_NONE. Incoming messages with a body compressed with
+	 * a supported algorithm are decompressed when the body is first
+	 * obtained, regardless of this option, while those without a
+	 * content-encoding are left untouched. Only engines which can convey a
+	 * content-encoding compress bodies.
+	 */
+	MQO_COMPRESSION,
+	/* The size, in bytes, below which bodies aren't compressed; the
+	 * default is 1024
+	 */
+	MQO_COMPRESS_THRESHOLD,
+	/* The compression level, whose meaning depends upon the algorithm;
+	 * zero (the default) uses the algorithm's own default
+	 */
+	MQO_COMPRESS_LEVEL,
+	/* The maximum size, in bytes, of the envelopes into which messages
+	 * sent on the connection are packed, so that many small messages are
+	 * sent as a single transport message; zero (the default) disables
+	 * packing. Envelopes are unpacked by mq_next() and friends on any
+	 * connection, and an envelope is only settled once all of the messages
+	 * within it have been.
+	 */
+	MQO_ENVELOPE_SIZE,
+	/* The longest time, in milliseconds, that a message may wait in an
+	 * envelope before it's sent; the default is 10. This is only checked
+	 * when a message is sent or mq_process() is called, while mq_deliver()
+	 * always sends the open envelope.
+	 */
+	MQO_ENVELOPE_DELAY,
+	/* The maximum size, in bytes, to which a compressed incoming body may
+	 * be decompressed; obtaining the body of a message which exceeds it
+	 * fails with EMSGSIZE. Negative means there is no limit, and the
+	 * default is 64MiB.
+	 */
+	MQO_DECOMPRESS_LIMIT
+} MQOPTION;
+
+/* Algorithms which can be used to compress message bodies */
+typedef enum
+{
+	MQZ_NONE,
+	/* LZ4 frames, with a content-encoding of "lz4" */
+	MQZ_LZ4,
+	/* Zstandard frames, with a content-encoding of "zstd" */
+	MQZ_ZSTD
+} MQCOMPRESSION;
+
+/* The delivery status of an outgoing message */
+typedef enum
+{
+	/* The message hasn't been sent, or its status isn't tracked */
+	MQT_UNKNOWN,
+	/* The message has been sent, but its outcome isn't yet known */
+	MQT_PENDING,
+	MQT_ACCEPTED,
+	MQT_REJECTED,
+	MQT_RELEASED,
+	MQT_MODIFIED,
+	MQT_ABORTED,
+	/* The message was settled without an outcome being given */
+	MQT_SETTLED
+} MQSTATUS;
+
+/* A function invoked once the outcome of an outgoing message is known */
+typedef void (*MQSENTFN)(MQMESSAGE *message, MQSTATUS status, void *data);
+
+/* A pool of threads processing the messages received by a connection */
+typedef struct mq_workers_struct MQWORKERS;
+
+/* An incoming message being processed by a worker pool: its properties and
+ * body are obtained by the thread running the pool before it is handed to a
+ * lane, and remain valid until it has been processed
+ */
+typedef struct
+{
+	MQMESSAGE *message;
+	const char *type;
+	const char *subject;
+	const char *address;
+	const unsigned char *body;
+	size_t len;
+} MQWORKITEM;
+
+/* A function invoked by a worker pool to process an incoming message,
+ * returning MQT_ACCEPTED, MQT_REJECTED or MQT_RELEASED (to pass it on); any
+ * other value causes the message to be freed without an outcome
+ */
+typedef MQSTATUS (*MQWORKFN)(const MQWORKITEM *item, void *data);
+
+/* A function which obtains the key of an incoming message, which determines
+ * the order in which it is processed by a worker pool
+ */
+typedef const char *(*MQKEYFN)(MQMESSAGE *message, void *data);
+
+typedef enum
+{
+	MQE_READ = (1<<0),
+	MQE_WRITE = (1<<1)
+} MQEVENTS;
+
+/* Statistics maintained for each connection, as returned by mq_stats() */
+typedef struct
+{
+	/* Outgoing messages sent, and the total size of their bodies */
+	unsigned long long sent;
+	unsigned long long sent_bytes;
+	/* Incoming messages received, and the total size of their bodies */
+	unsigned long long received;
+	unsigned long long received_bytes;
+	/* Incoming messages accepted, rejected and passed */
+	unsigned long long accepted;
+	unsigned long long rejected;
+	unsigned long long passed;
+	/* Calls to mq_deliver() (including via mq_message_send_batch()) */
+	unsigned long long delivers;
+	/* Operations which have failed */
+	unsigned long long errors;
+	/* The number of times the connection has backed off after a failure */
+	unsigned long long backoffs;
+} MQSTATS;
+
+/* The operations whose latency can be recorded */
+typedef enum
+{
+	/* Time spent waiting in mq_next(), mq_next_timed() and mq_next_batch()
+	 * for messages to arrive
+	 */
+	MQL_NEXT,
+	/* Time spent blocked in mq_deliver() */
+	MQL_DELIVER,
+	/* Time from an outgoing message being sent to its delivery having
+	 * been completed by mq_deliver()
+	 */
+	MQL_SETTLE
+} MQLATENCYKIND;
+
+/* A summary of a latency histogram, as returned by mq_latency(); all values
+ * are in nanoseconds, and accurate to within about 3%
+ */
+typedef struct
+{
+	unsigned long long count;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long mean;
+	unsigned long long p50;
+	unsigned long long p90;
+	unsigned long long p99;
+	unsigned long long p999;
+} MQLATENCY;
+
 BEGIN_DECLS_;
 
 /* Create a connection for receiving messages from a queue */
 MQ *mq_connect_recv(const char *uri, const char *reserved1, const char *reserved2);
 /* Create a connection for sending messages to a queue */
 MQ *mq_connect_send(const char *uri, const char *reserved1, const char *reserved2);
+/* Create a connection for sending messages to a queue which may be used by
+ * any number of threads at once; messages are forwarded to the queue by a
+ * dedicated thread, and mq_deliver() waits for them to have been flushed.
+ * Sending waits while the number of messages yet to be forwarded is at its
+ * limit (1024), unless MQO_NONBLOCK is set.
+ */
+MQ *mq_connect_send_shared(const char *uri, const char *reserved1, const char *reserved2);
 /* Close a connection */
 int mq_disconnect(MQ *connection);
 /* Set the name of the partition, if any */
@@ -63,6 +278,59 @@ int mq_set_partition(MQ *connection, const char *partition);
 const char *mq_partition(MQ *connection);
 /* Wait for the next message to arrive */
 MQMESSAGE *mq_next(MQ *connection);
+/* Obtain up to count messages which have already arrived, waiting (at most
+ * once) for some to arrive if none have; returns the number of messages
+ * stored in messages, or zero upon error. If count is zero, zero is returned
+ * immediately, with errno set to zero, for every engine.
+ */
+size_t mq_next_batch(MQ *connection, MQMESSAGE **messages, size_t count);
+/* Wait up to timeout milliseconds for the next message to arrive (a negative
+ * timeout waits indefinitely); if none does, NULL is returned and errno is
+ * set to EAGAIN
+ */
+MQMESSAGE *mq_next_timed(MQ *connection, int timeout);
+/* Set a connection option (MQO_*) */
+int mq_set_option(MQ *connection, MQOPTION option, long value);
+/* Obtain a file descriptor which can be polled to determine when the
+ * connection is able to make progress; *events is set to the MQE_* events
+ * which should be waited for. Once this has been called, mq_next() and
+ * mq_deliver() may not wait, and mq_process() must be called whenever the
+ * descriptor is ready.
+ */
+int mq_fd(MQ *connection, int *events);
+/* Perform any pending work on a connection without waiting */
+int mq_process(MQ *connection);
+/* Obtain the number of incoming messages which have arrived but not yet been
+ * obtained with mq_next() or mq_next_batch(), and so can be obtained without
+ * waiting
+ */
+int mq_pending(MQ *connection);
+/* Enable store-and-forward spooling on a sending connection: outgoing
+ * messages are handed to a background thread which forwards them in order,
+ * and any which have not been forwarded by the time mq_deliver() has waited
+ * for MQO_SPOOL_DEADLINE milliseconds are appended to a spool file in the
+ * directory path, to be forwarded once the destination becomes available.
+ * Messages left in the spool by a previous connection are forwarded first.
+ */
+int mq_set_spool(MQ *connection, const char *path);
+/* Set a function to be invoked, from within mq_deliver() and mq_process(),
+ * as the outcome of each outgoing message sent via the connection becomes
+ * known, in the order the messages were sent; messages whose outcome is
+ * still unknown when the connection is closed are reported as MQT_UNKNOWN.
+ * A message which has been freed is retained until then, and remains valid
+ * until the function returns.
+ */
+int mq_set_sent_callback(MQ *connection, MQSENTFN fn, void *data);
+/* Obtain a snapshot of a connection's statistics */
+int mq_stats(MQ *connection, MQSTATS *stats);
+/* Obtain a summary of one of a connection's latency histograms */
+int mq_latency(MQ *connection, MQLATENCYKIND kind, MQLATENCY *latency);
+/* Obtain a percentile (0-100) of one of a connection's latency histograms, in
+ * nanoseconds
+ */
+unsigned long long mq_latency_percentile(MQ *connection, MQLATENCYKIND kind, double percentile);
+/* Reset all of a connection's latency histograms */
+int mq_latency_reset(MQ *connection);
 /* Deliver any buffered outgoing messages */
 int mq_deliver(MQ *connection);
 /* Obtain the error state for a connection */
@@ -75,6 +343,31 @@ const char *mq_errmsg(MQ *connection);
 int mq_set_cluster(MQ *mq, CLUSTER *cluster);
 /* Obtain the cluster (if any) that this connection is part of */
 CLUSTER *mq_cluster(MQ *mq);
+/* Divide the queue into count shards (partitions named "0", "1", ...), and
+ * consume only from the shards assigned to this connection's member of its
+ * cluster (worker being the index of the worker within this instance);
+ * shards are assigned by rendezvous hashing, so that a change in the size of
+ * the cluster only moves the shards which must move. A count of zero
+ * disables sharding. mq_set_cluster() must be called first.
+ */
+int mq_set_shards(MQ *connection, unsigned int count, int worker);
+/* Obtain the shard which messages with a particular key are assigned to */
+int mq_shard(MQ *connection, const char *key);
+/* Obtain the index of the cluster member which consumes the shard that
+ * messages with a particular key are assigned to
+ */
+int mq_shard_owner(MQ *connection, const char *key);
+/* Determine whether a shard is assigned to this connection */
+int mq_shard_owned(MQ *connection, int shard);
+/* Reassign shards as member index of a cluster of total members */
+int mq_rebalance(MQ *connection, int index, int total);
+/* A balancing callback which may be passed to cluster_set_balancer() (or
+ * invoked by an application's own), so that sharded connections following
+ * the cluster are reassigned when its membership changes; the change is
+ * applied by the next mq_next(), mq_next_batch(), mq_next_timed() or
+ * mq_process() on each connection
+ */
+int mq_cluster_balancer(CLUSTER *cluster, CLUSTERSTATE *state);
 
 /* Create a message */
 MQMESSAGE *mq_message_create(MQ *connection);
@@ -86,7 +379,10 @@ MQMSGKIND mq_message_kind(MQMESSAGE *message);
 int mq_message_accept(MQMESSAGE *message);
 /* Reject a message */
 int mq_message_reject(MQMESSAGE *message);
-/* Pass on a message */
+/* Pass on a message; if it can't be passed on without waiting, -1 is
+ * returned with errno set to EAGAIN and the message is not freed, so that it
+ * can be passed on again later (or freed)
+ */
 int mq_message_pass(MQMESSAGE *message);
 /* Return the content type of a message */
 const char *mq_message_type(MQMESSAGE *message);
@@ -106,12 +402,58 @@ int mq_message_set_subject(MQMESSAGE *message, const char *subject);
 int mq_message_set_address(MQMESSAGE *message, const char *address);
 /* Add binary data to the body of a message */
 int mq_message_add_bytes(MQMESSAGE *message, unsigned char *bytes, size_t len);
+/* Add a buffer to the body of a message, transferring ownership of it to the
+ * message so that it need not be copied; free_fn (if not NULL) is invoked
+ * once the buffer is no longer needed. If this fails, the buffer remains
+ * owned by the caller.
+ */
+int mq_message_add_bytes_owned(MQMESSAGE *message, unsigned char *bytes, size_t len, MQFREEFN free_fn);
+/* Detach the body from a message so that it remains valid after the message
+ * has been freed, storing its length in *len; the caller must free() the
+ * buffer which is returned
+ */
+unsigned char *mq_message_take_body(MQMESSAGE *message, size_t *len);
+/* Add binary data gathered from a set of buffers to the body of a message */
+int mq_message_add_iov(MQMESSAGE *message, const struct iovec *iov, int iovcnt);
 /* Send a message */
 int mq_message_send(MQMESSAGE *message);
+/* Send a set of messages created on a connection and deliver them together */
+int mq_message_send_batch(MQ *connection, MQMESSAGE **messages, size_t count);
 /* Override the queue's partition for an individual message */
 int mq_message_set_partition(MQMESSAGE *message, const char *partition);
 /* Obtain the message partition, if any */
 const char *mq_message_partition(MQMESSAGE *message);
+/* Send a message to a shard, as obtained from mq_shard() */
+int mq_message_set_shard(MQMESSAGE *message, int shard);
+/* Obtain the delivery status of an outgoing message which has been sent;
+ * this is updated as mq_deliver() and mq_process() are called
+ */
+MQSTATUS mq_message_status(MQMESSAGE *message);
+
+/* Create a pool of lanes (one per processor if lanes is zero), each with its
+ * own thread, which process the messages received by a connection with fn.
+ * Messages with the same key (by default, their subject) are always
+ * processed by the same lane, in the order they were received; messages
+ * without a key may be processed by any lane. fn must not pass item->message
+ * to any libmq function (which may update the state of the connection that
+ * it belongs to), nor use the connection: item provides its properties.
+ */
+MQWORKERS *mq_workers_create(MQ *connection, size_t lanes, MQWORKFN fn, void *data);
+/* Set the function used to obtain the key of each message */
+int mq_workers_set_key(MQWORKERS *workers, MQKEYFN fn, void *data);
+/* Obtain messages from the connection and dispatch them to the lanes until
+ * mq_workers_stop() is called (or an error occurs); the calling thread
+ * settles each message once it has been processed, and is the only one
+ * which may use the connection while this runs
+ */
+int mq_workers_run(MQWORKERS *workers);
+/* Ask mq_workers_run() to return once every message which it has dispatched
+ * has been processed; this may be called from any thread, and takes effect
+ * within a fraction of a second even if no messages are arriving
+ */
+int mq_workers_stop(MQWORKERS *workers);
+/* Stop a worker pool's threads and free it */
+int mq_workers_free(MQWORKERS *workers);
 
 END_DECLS_;
 
@@ -23,6 +23,8 @@
 
 #include "p_libmq.h"
 
+static int mq_message_adopt_(MQMESSAGE *message, unsigned char *bytes, size_t len, MQFREEFN free_fn);
+
 /* Determine the kind of a message */
 MQMSGKIND
 mq_message_kind(MQMESSAGE *message)
@@ -34,10 +36,16 @@ mq_message_kind(MQMESSAGE *message)
 int
 mq_message_accept(MQMESSAGE *message)
 {
+	MQ *connection;
 	int r;
 
+	connection = MQ_MESSAGE_CONNECTION(message);
 	r = message->impl->accept(message);
 	message->impl->release(message);
+	if(connection)
+	{
+		MQ_STATS_ADD_RESULT(MQ_COMMON(connection), r, accepted);
+	}
 	return r;
 }
 
@@ -45,21 +53,40 @@ mq_message_accept(MQMESSAGE *message)
 int
 mq_message_reject(MQMESSAGE *message)
 {
+	MQ *connection;
 	int r;
 
+	connection = MQ_MESSAGE_CONNECTION(message);
 	r = message->impl->reject(message);
 	message->impl->release(message);
+	if(connection)
+	{
+		MQ_STATS_ADD_RESULT(MQ_COMMON(connection), r, rejected);
+	}
 	return r;
 }
 
-/* Pass on and free a message */
+/* Pass on and free a message; a message which can't be passed on without
+ * waiting (EAGAIN) is left intact for the caller to try again
+ */
 int
 mq_message_pass(MQMESSAGE *message)
 {
+	MQ *connection;
 	int r;
 
+	connection = MQ_MESSAGE_CONNECTION(message);
+	errno = 0;
 	r = message->impl->pass(message);
+	if(r && errno == EAGAIN)
+	{
+		return r;
+	}
 	message->impl->release(message);
+	if(connection)
+	{
+		MQ_STATS_ADD_RESULT(MQ_COMMON(connection), r, passed);
+	}
 	return r;
 }
 
@@ -113,27 +140,197 @@ mq_message_address(MQMESSAGE *message)
 	return message->impl->address(message);
 }
 
-/* Return the message body */
+/* Return the message body, decompressing it first if necessary */
 const unsigned char *
 mq_message_body(MQMESSAGE *message)
 {
+	if(mq_decompress_(message))
+	{
+		return NULL;
+	}
 	return message->impl->body(message);
 }
 
-/* Return the length of the message body */
+/* Return the length of the message body, decompressing it first if
+ * necessary
+ */
 size_t
 mq_message_len(MQMESSAGE *message)
 {
+	if(mq_decompress_(message))
+	{
+		return (size_t) -1;
+	}
 	return message->impl->len(message);
 }
 
-/* Add bytes to the message body */
+/* Add bytes to the message body, compressing them if the connection
+ * compresses bodies
+ */
 int
 mq_message_add_bytes(MQMESSAGE *message, unsigned char *bytes, size_t len)
-{	
+{
+	unsigned char *out;
+	size_t outlen;
+
+	switch(mq_compress_(message, bytes, len, &out, &outlen))
+	{
+	case -1:
+		return -1;
+	case 1:
+		if(mq_message_adopt_(message, out, outlen, free))
+		{
+			free(out);
+			return -1;
+		}
+		return 0;
+	}
 	return message->impl->add_bytes(message, bytes, len);
 }
 
+/* Add a buffer to the message body, transferring ownership of it */
+int
+mq_message_add_bytes_owned(MQMESSAGE *message, unsigned char *bytes, size_t len, MQFREEFN free_fn)
+{
+	unsigned char *out;
+	size_t outlen;
+
+	switch(mq_compress_(message, bytes, len, &out, &outlen))
+	{
+	case -1:
+		return -1;
+	case 1:
+		/* The compressed buffer is added in place of the original */
+		if(mq_message_adopt_(message, out, outlen, free))
+		{
+			free(out);
+			return -1;
+		}
+		if(free_fn)
+		{
+			free_fn(bytes);
+		}
+		return 0;
+	}
+	return mq_message_adopt_(message, bytes, len, free_fn);
+}
+
+/* Detach the body from a message */
+unsigned char *
+mq_message_take_body(MQMESSAGE *message, size_t *len)
+{
+	const unsigned char *body;
+	unsigned char *p;
+	size_t l;
+
+	if(mq_decompress_(message))
+	{
+		return NULL;
+	}
+	if(message->impl->take_body)
+	{
+		return message->impl->take_body(message, len);
+	}
+	/* The engine can't detach the body, so it must be copied */
+	body = message->impl->body(message);
+	l = message->impl->len(message);
+	if(!body || l == (size_t) -1)
+	{
+		return NULL;
+	}
+	p = (unsigned char *) malloc(l ? l : 1);
+	if(!p)
+	{
+		return NULL;
+	}
+	memcpy(p, body, l);
+	if(len)
+	{
+		*len = l;
+	}
+	return p;
+}
+
+/* Add bytes gathered from a set of buffers to the message body */
+int
+mq_message_add_iov(MQMESSAGE *message, const struct iovec *iov, int iovcnt)
+{
+	unsigned char *buf, *p;
+	size_t len;
+	int c, r;
+
+	if(mq_compress_enabled_(message))
+	{
+		/* The buffers must be assembled so that they can be compressed
+		 * together
+		 */
+		if(iovcnt == 1)
+		{
+			return mq_message_add_bytes(message, (unsigned char *) iov[0].iov_base, iov[0].iov_len);
+		}
+	}
+	else if(message->impl->add_iov)
+	{
+		return message->impl->add_iov(message, iov, iovcnt);
+	}
+	else if(iovcnt == 1)
+	{
+		return message->impl->add_bytes(message, (unsigned char *) iov[0].iov_base, iov[0].iov_len);
+	}
+	/* The engine can't add scattered buffers itself, so assemble them
+	 * into a single buffer first
+	 */
+	len = 0;
+	for(c = 0; c < iovcnt; c++)
+	{
+		len += iov[c].iov_len;
+	}
+	buf = (unsigned char *) malloc(len ? len : 1);
+	if(!buf)
+	{
+		return -1;
+	}
+	for(c = 0, p = buf; c < iovcnt; c++)
+	{
+		memcpy(p, iov[c].iov_base, iov[c].iov_len);
+		p += iov[c].iov_len;
+	}
+	if(mq_compress_enabled_(message))
+	{
+		if(mq_message_add_bytes_owned(message, buf, len, free))
+		{
+			free(buf);
+			return -1;
+		}
+		return 0;
+	}
+	r = message->impl->add_bytes(message, buf, len);
+	free(buf);
+	return r;
+}
+
+/* (Internal) add a buffer to the message body, transferring ownership of it
+ * to the engine if it's able to adopt it
+ */
+static int
+mq_message_adopt_(MQMESSAGE *message, unsigned char *bytes, size_t len, MQFREEFN free_fn)
+{
+	if(message->impl->add_bytes_owned)
+	{
+		return message->impl->add_bytes_owned(message, bytes, len, free_fn);
+	}
+	/* The engine can't adopt the buffer, so it must be copied */
+	if(message->impl->add_bytes(message, bytes, len))
+	{
+		return -1;
+	}
+	if(free_fn)
+	{
+		free_fn(bytes);
+	}
+	return 0;
+}
+
 /* Override the queue's partition for an individual message */
 int
 mq_message_set_partition(MQMESSAGE *message, const char *partition)
@@ -148,9 +345,66 @@ mq_message_partition(MQMESSAGE *message)
 	return message->impl->partition(message);
 }
 
+/* Obtain the delivery status of an outgoing message */
+MQSTATUS
+mq_message_status(MQMESSAGE *message)
+{
+	if(!message->impl->status)
+	{
+		return MQT_UNKNOWN;
+	}
+	return message->impl->status(message);
+}
+
 /* Send a message */
 int
 mq_message_send(MQMESSAGE *message)
-{	
-	return message->impl->send(message);
+{
+	MQ *connection;
+	MQCOMMON *common;
+	unsigned long long start;
+	size_t len;
+
+	connection = MQ_MESSAGE_CONNECTION(message);
+	common = connection ? MQ_COMMON(connection) : NULL;
+	if(!common)
+	{
+		return message->impl->send(message);
+	}
+	/* The body must be measured before sending, as an engine may discard
+	 * it once the message has been sent
+	 */
+	len = mq_message_len_(message);
+	start = MQ_LATENCY_START(common);
+	if(message->impl->send(message))
+	{
+		mq_count_error_(common);
+		return -1;
+	}
+	MQ_STATS_ADD(common, sent, 1);
+	MQ_STATS_ADD(common, sent_bytes, len);
+	if(start)
+	{
+		mq_latency_sent_(common, 1, start);
+	}
+	return 0;
+}
+
+/* (Internal) obtain the length of a message body for the purposes of
+ * statistics, preserving errno; a message without a body is counted as empty
+ */
+size_t
+mq_message_len_(MQMESSAGE *message)
+{
+	size_t len;
+	int e;
+
+	e = errno;
+	len = message->impl->len(message);
+	errno = e;
+	if(len == (size_t) -1)
+	{
+		return 0;
+	}
+	return len;
 }
@@ -0,0 +1,681 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* A minimal stand-in AMQP 1.0 broker, so that the amqp: engine can be
+ * benchmarked (with mq-bench) without an external broker: messages sent to
+ * an address are queued in memory and distributed between the links
+ * receiving from it, round-robin, as their credit allows. Every message is
+ * accepted on arrival and forgotten once the receiver settles it; nothing is
+ * persisted, and only anonymous connections are supported.
+ *
+ * Usage: mq-amqp-broker [-p PORT] [-c CREDIT]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+
+#include <proton/connection_driver.h>
+#include <proton/delivery.h>
+#include <proton/link.h>
+#include <proton/sasl.h>
+#include <proton/session.h>
+#include <proton/terminus.h>
+
+#define MAXEVENTS                       32
+
+struct message_struct
+{
+	struct message_struct *next;
+	size_t len;
+	char data[1];
+};
+
+/* A link receiving from one of the broker's queues */
+struct consumer_struct
+{
+	struct consumer_struct *next;
+	struct queue_struct *queue;
+	pn_link_t *link;
+};
+
+struct queue_struct
+{
+	struct queue_struct *next;
+	char *name;
+	struct message_struct *head;
+	struct message_struct *tail;
+	size_t count;
+	struct consumer_struct *consumers;
+};
+
+struct client_struct
+{
+	struct client_struct *next;
+	int fd;
+	uint32_t events;
+	pn_connection_driver_t driver;
+};
+
+static const char *short_program_name = "mq-amqp-broker";
+static int epfd = -1;
+static int credit = 256;
+static uint64_t tag;
+static struct queue_struct *queues;
+static struct client_struct *clients;
+static volatile sig_atomic_t stop;
+
+static void usage(void);
+static void stop_handler(int signo);
+static int listen_port(const char *port);
+static void accept_client(int lfd);
+static void client_read(struct client_struct *client);
+static void client_run(struct client_struct *client);
+static void client_free(struct client_struct *client);
+static void client_event(pn_event_t *event);
+static struct queue_struct *queue_get(const char *name);
+static void queue_dispatch(struct queue_struct *queue);
+static void link_open(pn_link_t *link);
+static void link_close(pn_link_t *link);
+static void link_received(pn_link_t *link, pn_delivery_t *delivery);
+static pn_timestamp_t now_ms(void);
+
+int
+main(int argc, char **argv)
+{
+	struct epoll_event ev[MAXEVENTS];
+	struct client_struct *client, *next, **prev;
+	const char *port;
+	int c, lfd, n, i;
+
+	if(argv[0])
+	{
+		if((short_program_name = strrchr(argv[0], '/')))
+		{
+			short_program_name++;
+		}
+		else
+		{
+			short_program_name = argv[0];
+		}
+	}
+	port = "5672";
+	while((c = getopt(argc, argv, "hp:c:")) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage();
+			return 0;
+		case 'p':
+			port = optarg;
+			break;
+		case 'c':
+			credit = atoi(optarg);
+			if(credit < 1)
+			{
+				fprintf(stderr, "%s: credit must be a positive integer\n", short_program_name);
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if(optind != argc)
+	{
+		usage();
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stop_handler);
+	signal(SIGTERM, stop_handler);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd == -1)
+	{
+		fprintf(stderr, "%s: epoll_create1: %s\n", short_program_name, strerror(errno));
+		return 1;
+	}
+	lfd = listen_port(port);
+	if(lfd == -1)
+	{
+		return 1;
+	}
+	fprintf(stderr, "%s: listening on port %s\n", short_program_name, port);
+	while(!stop)
+	{
+		n = epoll_wait(epfd, ev, MAXEVENTS, 1000);
+		for(i = 0; i < n; i++)
+		{
+			if(!ev[i].data.ptr)
+			{
+				accept_client(lfd);
+				continue;
+			}
+			client = (struct client_struct *) ev[i].data.ptr;
+			if(ev[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+			{
+				client_read(client);
+			}
+		}
+		/* Dispatching a message received by one client produces work
+		 * for another, so every client is run on each pass
+		 */
+		for(client = clients; client; client = client->next)
+		{
+			client_run(client);
+		}
+		for(prev = &clients; (client = *prev); )
+		{
+			next = client->next;
+			if(pn_connection_driver_finished(&(client->driver)))
+			{
+				*prev = next;
+				client_free(client);
+				continue;
+			}
+			prev = &(client->next);
+		}
+	}
+	while((client = clients))
+	{
+		clients = client->next;
+		client_free(client);
+	}
+	close(lfd);
+	close(epfd);
+	return 0;
+}
+
+static void
+usage(void)
+{
+	printf("Usage: %s [OPTIONS]\n"
+		   "\n"
+		   "OPTIONS is one or more of:\n"
+		   "  -h                  Print this usage message and exit\n"
+		   "  -p PORT             Listen on PORT (default=5672)\n"
+		   "  -c CREDIT           Grant senders up to CREDIT messages (default=256)\n",
+		   short_program_name);
+}
+
+static void
+stop_handler(int signo)
+{
+	(void) signo;
+
+	stop = 1;
+}
+
+static int
+listen_port(const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	struct epoll_event ev;
+	int fd, r, one;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if((r = getaddrinfo(NULL, port, &hints, &res)))
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, port, gai_strerror(r));
+		return -1;
+	}
+	fd = -1;
+	for(ai = res; ai; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, ai->ai_protocol);
+		if(fd == -1)
+		{
+			continue;
+		}
+		one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if(!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, SOMAXCONN))
+		{
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if(fd == -1)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, port, strerror(errno));
+		return -1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+	{
+		fprintf(stderr, "%s: epoll_ctl: %s\n", short_program_name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+accept_client(int lfd)
+{
+	struct client_struct *client;
+	struct epoll_event ev;
+	pn_transport_t *transport;
+	int fd, one;
+
+	while((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) != -1)
+	{
+		one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		client = (struct client_struct *) calloc(1, sizeof(struct client_struct));
+		transport = pn_transport();
+		if(!client || !transport)
+		{
+			fprintf(stderr, "%s: failed to allocate memory for client\n", short_program_name);
+			free(client);
+			close(fd);
+			continue;
+		}
+		pn_transport_set_server(transport);
+		pn_sasl_allowed_mechs(pn_sasl(transport), "ANONYMOUS");
+		if(pn_connection_driver_init(&(client->driver), NULL, transport))
+		{
+			fprintf(stderr, "%s: failed to initialise connection driver\n", short_program_name);
+			pn_transport_free(transport);
+			free(client);
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = client->events = EPOLLIN|EPOLLOUT;
+		ev.data.ptr = client;
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+		{
+			fprintf(stderr, "%s: epoll_ctl: %s\n", short_program_name, strerror(errno));
+			pn_connection_driver_destroy(&(client->driver));
+			free(client);
+			close(fd);
+			continue;
+		}
+		client->next = clients;
+		clients = client;
+	}
+}
+
+static void
+client_read(struct client_struct *client)
+{
+	pn_rwbytes_t buf;
+	ssize_t n;
+
+	for(;;)
+	{
+		buf = pn_connection_driver_read_buffer(&(client->driver));
+		if(!buf.size)
+		{
+			return;
+		}
+		n = recv(client->fd, buf.start, buf.size, 0);
+		if(n > 0)
+		{
+			pn_connection_driver_read_done(&(client->driver), (size_t) n);
+			continue;
+		}
+		if(n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(!n || (errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			pn_connection_driver_read_close(&(client->driver));
+		}
+		return;
+	}
+}
+
+/* Handle a client's events and write whatever can be written */
+static void
+client_run(struct client_struct *client)
+{
+	struct epoll_event ev;
+	pn_event_t *event;
+	pn_bytes_t buf;
+	uint32_t events;
+	ssize_t n;
+
+	pn_connection_driver_tick(&(client->driver), now_ms());
+	while((event = pn_connection_driver_next_event(&(client->driver))))
+	{
+		client_event(event);
+	}
+	for(;;)
+	{
+		buf = pn_connection_driver_write_buffer(&(client->driver));
+		if(!buf.size)
+		{
+			break;
+		}
+		n = send(client->fd, buf.start, buf.size, MSG_NOSIGNAL);
+		if(n >= 0)
+		{
+			pn_connection_driver_write_done(&(client->driver), (size_t) n);
+			continue;
+		}
+		if(errno == EINTR)
+		{
+			continue;
+		}
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			pn_connection_driver_write_close(&(client->driver));
+		}
+		break;
+	}
+	/* Closing may have produced further events */
+	while((event = pn_connection_driver_next_event(&(client->driver))))
+	{
+		client_event(event);
+	}
+	events = 0;
+	if(pn_connection_driver_read_buffer(&(client->driver)).size)
+	{
+		events |= EPOLLIN;
+	}
+	if(pn_connection_driver_write_buffer(&(client->driver)).size)
+	{
+		events |= EPOLLOUT;
+	}
+	if(events != client->events)
+	{
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.ptr = client;
+		if(!epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev))
+		{
+			client->events = events;
+		}
+	}
+}
+
+/* Free a client, first removing its links from any queues' consumers */
+static void
+client_free(struct client_struct *client)
+{
+	pn_link_t *link;
+
+	for(link = pn_link_head(client->driver.connection, 0); link; link = pn_link_next(link, 0))
+	{
+		link_close(link);
+	}
+	epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	pn_connection_driver_destroy(&(client->driver));
+	free(client);
+}
+
+static void
+client_event(pn_event_t *event)
+{
+	pn_connection_t *connection;
+	pn_session_t *session;
+	pn_link_t *link;
+	pn_delivery_t *delivery;
+	struct consumer_struct *consumer;
+
+	switch(pn_event_type(event))
+	{
+	case PN_CONNECTION_REMOTE_OPEN:
+		connection = pn_event_connection(event);
+		pn_connection_open(connection);
+		break;
+	case PN_CONNECTION_REMOTE_CLOSE:
+		connection = pn_event_connection(event);
+		pn_connection_close(connection);
+		break;
+	case PN_SESSION_REMOTE_OPEN:
+		session = pn_event_session(event);
+		pn_session_open(session);
+		break;
+	case PN_SESSION_REMOTE_CLOSE:
+		session = pn_event_session(event);
+		pn_session_close(session);
+		break;
+	case PN_LINK_REMOTE_OPEN:
+		link_open(pn_event_link(event));
+		break;
+	case PN_LINK_REMOTE_CLOSE:
+	case PN_LINK_REMOTE_DETACH:
+		link = pn_event_link(event);
+		link_close(link);
+		pn_link_close(link);
+		break;
+	case PN_LINK_FLOW:
+		link = pn_event_link(event);
+		consumer = (struct consumer_struct *) pn_link_get_context(link);
+		if(consumer && pn_link_is_sender(link))
+		{
+			queue_dispatch(consumer->queue);
+		}
+		break;
+	case PN_DELIVERY:
+		delivery = pn_event_delivery(event);
+		link = pn_delivery_link(delivery);
+		if(pn_link_is_receiver(link))
+		{
+			link_received(link, delivery);
+		}
+		else if(pn_delivery_updated(delivery) || pn_delivery_settled(delivery))
+		{
+			/* The receiver has settled the message, or determined
+			 * its outcome, and so it's done with
+			 */
+			pn_delivery_settle(delivery);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static struct queue_struct *
+queue_get(const char *name)
+{
+	struct queue_struct *queue;
+
+	name = name ? name : "";
+	for(queue = queues; queue; queue = queue->next)
+	{
+		if(!strcmp(queue->name, name))
+		{
+			return queue;
+		}
+	}
+	queue = (struct queue_struct *) calloc(1, sizeof(struct queue_struct));
+	if(!queue || !(queue->name = strdup(name)))
+	{
+		fprintf(stderr, "%s: failed to allocate memory for queue\n", short_program_name);
+		abort();
+	}
+	queue->next = queues;
+	queues = queue;
+	return queue;
+}
+
+/* Send queued messages to the queue's consumers, round-robin, for as long
+ * as any of them has credit
+ */
+static void
+queue_dispatch(struct queue_struct *queue)
+{
+	struct consumer_struct *consumer;
+	struct message_struct *msg;
+	int sent;
+
+	while(queue->head)
+	{
+		sent = 0;
+		for(consumer = queue->consumers; consumer && queue->head; consumer = consumer->next)
+		{
+			if(pn_link_credit(consumer->link) <= 0)
+			{
+				continue;
+			}
+			msg = queue->head;
+			queue->head = msg->next;
+			if(!queue->head)
+			{
+				queue->tail = NULL;
+			}
+			queue->count--;
+			tag++;
+			pn_delivery(consumer->link, pn_dtag((const char *) &tag, sizeof(tag)));
+			pn_link_send(consumer->link, msg->data, msg->len);
+			pn_link_advance(consumer->link);
+			free(msg);
+			sent = 1;
+		}
+		if(!sent)
+		{
+			return;
+		}
+	}
+}
+
+/* Accept a link opened by a client, using the addresses it requested */
+static void
+link_open(pn_link_t *link)
+{
+	struct consumer_struct *consumer;
+	struct queue_struct *queue;
+
+	pn_terminus_copy(pn_link_source(link), pn_link_remote_source(link));
+	pn_terminus_copy(pn_link_target(link), pn_link_remote_target(link));
+	pn_link_open(link);
+	if(pn_link_is_receiver(link))
+	{
+		pn_link_flow(link, credit);
+		return;
+	}
+	queue = queue_get(pn_terminus_get_address(pn_link_remote_source(link)));
+	consumer = (struct consumer_struct *) calloc(1, sizeof(struct consumer_struct));
+	if(!consumer)
+	{
+		fprintf(stderr, "%s: failed to allocate memory for consumer\n", short_program_name);
+		abort();
+	}
+	consumer->queue = queue;
+	consumer->link = link;
+	consumer->next = queue->consumers;
+	queue->consumers = consumer;
+	pn_link_set_context(link, consumer);
+}
+
+/* Remove a link from its queue's consumers, if it is one */
+static void
+link_close(pn_link_t *link)
+{
+	struct consumer_struct *consumer, **prev;
+
+	consumer = (struct consumer_struct *) pn_link_get_context(link);
+	if(!consumer)
+	{
+		return;
+	}
+	for(prev = &(consumer->queue->consumers); *prev != consumer; prev = &((*prev)->next));
+	*prev = consumer->next;
+	pn_link_set_context(link, NULL);
+	free(consumer);
+}
+
+/* Queue a message once it has been received in full, and top up the sender's
+ * credit
+ */
+static void
+link_received(pn_link_t *link, pn_delivery_t *delivery)
+{
+	struct message_struct *msg;
+	struct queue_struct *queue;
+	size_t len;
+	ssize_t n;
+
+	if(!pn_delivery_readable(delivery) || pn_delivery_partial(delivery))
+	{
+		return;
+	}
+	len = pn_delivery_pending(delivery);
+	msg = (struct message_struct *) malloc(sizeof(struct message_struct) + len);
+	if(!msg)
+	{
+		fprintf(stderr, "%s: failed to allocate memory for message\n", short_program_name);
+		abort();
+	}
+	n = pn_link_recv(link, msg->data, len);
+	msg->len = n > 0 ? (size_t) n : 0;
+	msg->next = NULL;
+	if(!pn_delivery_settled(delivery))
+	{
+		pn_delivery_update(delivery, PN_ACCEPTED);
+	}
+	pn_delivery_settle(delivery);
+	pn_link_advance(link);
+	if(pn_link_credit(link) <= credit / 2)
+	{
+		pn_link_flow(link, credit - pn_link_credit(link));
+	}
+	queue = queue_get(pn_terminus_get_address(pn_link_remote_target(link)));
+	if(queue->tail)
+	{
+		queue->tail->next = msg;
+	}
+	else
+	{
+		queue->head = msg;
+	}
+	queue->tail = msg;
+	queue->count++;
+	queue_dispatch(queue);
+}
+
+static pn_timestamp_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((pn_timestamp_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
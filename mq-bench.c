@@ -0,0 +1,741 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* Measure end-to-end throughput and latency: a set of producer threads send
+ * messages to a queue while a set of consumer threads receive them. Each
+ * message body begins with a header containing the time at which it was
+ * sent, from which consumers calculate the latency of each message.
+ *
+ * The time is obtained from CLOCK_REALTIME so that producers and consumers
+ * may be run in separate processes (using -p 0 and -c 0) on hosts with
+ * synchronised clocks.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libmq.h"
+
+/* The header at the start of each message body */
+#define BENCH_MAGIC                    "MQBENCH1"
+#define BENCH_HEADER                   16
+
+/* Latencies are counted in a log-bucketed histogram: each power of two is
+ * divided into 2^HIST_SUBBITS linear buckets
+ */
+#define HIST_SUBBITS                   5
+#define HIST_SUB                       (1 << HIST_SUBBITS)
+#define HIST_MAXBITS                   44
+#define HIST_BUCKETS                   ((HIST_MAXBITS - HIST_SUBBITS + 1) * HIST_SUB)
+
+/* The largest message size which can be requested */
+#define MAX_SIZE                       (64 * 1024 * 1024)
+
+/* Once the producers have finished, consumers are given until they have
+ * received as many messages as were sent, or this many nanoseconds pass
+ * without them receiving any
+ */
+#define DRAIN_IDLE                     2000000000ULL
+
+struct histogram_struct
+{
+	unsigned long long count;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long buckets[HIST_BUCKETS];
+};
+
+struct worker_struct
+{
+	pthread_t thread;
+	unsigned int seed;
+	unsigned long long messages;
+	unsigned long long bytes;
+	unsigned long long untimed;
+	struct histogram_struct hist;
+	int failed;
+};
+
+static const char *progname = "mq-bench";
+static const char *uri;
+static size_t minsize = 64, maxsize = 64;
+static int exponential;
+static double rate;
+static size_t batch = 1;
+static int shared;
+static long prefetch;
+static MQ *sharedconn;
+static volatile int producing, consuming;
+
+static void usage(void);
+static int parse_size(const char *str);
+static void *producer(void *arg);
+static void *consumer(void *arg);
+static size_t message_size(struct worker_struct *self);
+static unsigned long long now(void);
+static void sleep_until(unsigned long long when);
+static void drain(struct worker_struct *consumers, int count, unsigned long long expected);
+static void hist_add(struct histogram_struct *hist, unsigned long long value);
+static void hist_merge(struct histogram_struct *dest, struct histogram_struct *src);
+static unsigned long long hist_at(struct histogram_struct *hist, double percentile);
+static void report(const char *what, struct worker_struct *workers, int count, double elapsed);
+
+int
+main(int argc, char **argv)
+{
+	struct worker_struct *workers;
+	struct histogram_struct *hist;
+	unsigned long long start, finish;
+	unsigned long long untimed, expected;
+	double duration, elapsed;
+	int c, nproducers, nconsumers, failed;
+
+	progname = argv[0];
+	nproducers = 1;
+	nconsumers = 1;
+	duration = 5;
+	while((c = getopt(argc, argv, "hp:c:s:r:b:d:SP:")) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage();
+			return 0;
+		case 'p':
+			nproducers = atoi(optarg);
+			break;
+		case 'c':
+			nconsumers = atoi(optarg);
+			break;
+		case 's':
+			if(parse_size(optarg))
+			{
+				usage();
+				return 1;
+			}
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'b':
+			batch = (size_t) atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'S':
+			shared = 1;
+			break;
+		case 'P':
+			prefetch = atol(optarg);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc != 1 || nproducers < 0 || nconsumers < 0 || (!nproducers && !nconsumers) ||
+	   rate < 0 || batch < 1 || duration <= 0)
+	{
+		usage();
+		return 1;
+	}
+	uri = argv[0];
+	workers = (struct worker_struct *) calloc(nproducers + nconsumers, sizeof(struct worker_struct));
+	hist = (struct histogram_struct *) calloc(1, sizeof(struct histogram_struct));
+	if(!workers || !hist)
+	{
+		fprintf(stderr, "%s: failed to allocate memory: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	if(shared && nproducers)
+	{
+		sharedconn = mq_connect_send_shared(uri, NULL, NULL);
+		if(!sharedconn)
+		{
+			fprintf(stderr, "%s: cannot connect to '%s'\n", progname, uri);
+			return 1;
+		}
+	}
+	/* Start the consumers first, so that they are ready to receive the
+	 * first messages sent
+	 */
+	producing = 1;
+	consuming = 1;
+	for(c = 0; c < nproducers + nconsumers; c++)
+	{
+		workers[c].seed = (unsigned int) (now() + c);
+	}
+	for(c = 0; c < nconsumers; c++)
+	{
+		if(pthread_create(&(workers[nproducers + c].thread), NULL, consumer, &(workers[nproducers + c])))
+		{
+			fprintf(stderr, "%s: failed to create thread\n", progname);
+			return 1;
+		}
+	}
+	start = now();
+	for(c = 0; c < nproducers; c++)
+	{
+		if(pthread_create(&(workers[c].thread), NULL, producer, &(workers[c])))
+		{
+			fprintf(stderr, "%s: failed to create thread\n", progname);
+			return 1;
+		}
+	}
+	sleep_until(start + (unsigned long long) (duration * 1000000000.0));
+	producing = 0;
+	failed = 0;
+	for(c = 0; c < nproducers; c++)
+	{
+		pthread_join(workers[c].thread, NULL);
+		failed |= workers[c].failed;
+	}
+	if(sharedconn)
+	{
+		if(mq_deliver(sharedconn))
+		{
+			fprintf(stderr, "%s: failed to deliver messages: %s\n", progname, mq_errmsg(sharedconn));
+			failed = 1;
+		}
+		mq_disconnect(sharedconn);
+	}
+	if(nproducers && nconsumers)
+	{
+		expected = 0;
+		for(c = 0; c < nproducers; c++)
+		{
+			expected += workers[c].messages;
+		}
+		drain(&(workers[nproducers]), nconsumers, expected);
+	}
+	consuming = 0;
+	for(c = 0; c < nconsumers; c++)
+	{
+		pthread_join(workers[nproducers + c].thread, NULL);
+		failed |= workers[nproducers + c].failed;
+	}
+	finish = now();
+	elapsed = (finish - start) / 1000000000.0;
+	if(nproducers)
+	{
+		report("sent", workers, nproducers, elapsed);
+	}
+	if(nconsumers)
+	{
+		report("received", &(workers[nproducers]), nconsumers, elapsed);
+		hist->min = ~0ULL;
+		untimed = 0;
+		for(c = 0; c < nconsumers; c++)
+		{
+			hist_merge(hist, &(workers[nproducers + c].hist));
+			untimed += workers[nproducers + c].untimed;
+		}
+		if(hist->count)
+		{
+			printf("%-10s %12s %12s %12s %12s %12s %12s\n", "latency/us", "min", "p50", "p90", "p99", "p99.9", "max");
+			printf("%-10s %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f\n", "",
+				   hist->min / 1000.0,
+				   hist_at(hist, 50) / 1000.0,
+				   hist_at(hist, 90) / 1000.0,
+				   hist_at(hist, 99) / 1000.0,
+				   hist_at(hist, 99.9) / 1000.0,
+				   hist->max / 1000.0);
+		}
+		if(untimed)
+		{
+			printf("%llu messages received without timestamps\n", untimed);
+		}
+	}
+	free(hist);
+	free(workers);
+	return failed ? 1 : 0;
+}
+
+/* Send messages until the benchmark ends */
+static void *
+producer(void *arg)
+{
+	struct worker_struct *self = (struct worker_struct *) arg;
+	MQ *connection;
+	MQMESSAGE **msgs;
+	struct timespec ts;
+	unsigned char *buf;
+	unsigned long long start, sent;
+	size_t c, n, size, len;
+
+	if(sharedconn)
+	{
+		connection = sharedconn;
+	}
+	else
+	{
+		connection = mq_connect_send(uri, NULL, NULL);
+		if(!connection)
+		{
+			fprintf(stderr, "%s: cannot connect to '%s'\n", progname, uri);
+			self->failed = 1;
+			return NULL;
+		}
+	}
+	msgs = (MQMESSAGE **) calloc(batch, sizeof(MQMESSAGE *));
+	if(!msgs)
+	{
+		self->failed = 1;
+		return NULL;
+	}
+	start = now();
+	sent = 0;
+	while(producing && !self->failed)
+	{
+		if(rate > 0)
+		{
+			sleep_until(start + (unsigned long long) (sent * (1000000000.0 / rate)));
+			if(!producing)
+			{
+				break;
+			}
+		}
+		for(n = 0, len = 0; n < batch; n++)
+		{
+			msgs[n] = mq_message_create(connection);
+			if(!msgs[n])
+			{
+				fprintf(stderr, "%s: failed to create message: %s\n", progname, mq_errmsg(connection));
+				self->failed = 1;
+				break;
+			}
+			mq_message_set_type(msgs[n], "application/octet-stream");
+			size = message_size(self);
+			buf = (unsigned char *) malloc(size);
+			if(!buf)
+			{
+				fprintf(stderr, "%s: failed to allocate message body: %s\n", progname, strerror(errno));
+				mq_message_free(msgs[n]);
+				self->failed = 1;
+				break;
+			}
+			for(c = BENCH_HEADER; c < size; c++)
+			{
+				buf[c] = (unsigned char) c;
+			}
+			if(size >= BENCH_HEADER)
+			{
+				clock_gettime(CLOCK_REALTIME, &ts);
+				memcpy(buf, BENCH_MAGIC, 8);
+				buf[8] = (unsigned char) (ts.tv_sec >> 24);
+				buf[9] = (unsigned char) (ts.tv_sec >> 16);
+				buf[10] = (unsigned char) (ts.tv_sec >> 8);
+				buf[11] = (unsigned char) ts.tv_sec;
+				buf[12] = (unsigned char) (ts.tv_nsec >> 24);
+				buf[13] = (unsigned char) (ts.tv_nsec >> 16);
+				buf[14] = (unsigned char) (ts.tv_nsec >> 8);
+				buf[15] = (unsigned char) ts.tv_nsec;
+			}
+			if(mq_message_add_bytes_owned(msgs[n], buf, size, free))
+			{
+				free(buf);
+				fprintf(stderr, "%s: failed to add message body: %s\n", progname, mq_errmsg(connection));
+				mq_message_free(msgs[n]);
+				self->failed = 1;
+				break;
+			}
+			len += size;
+		}
+		if(!self->failed)
+		{
+			if(sharedconn)
+			{
+				/* The shared sender is flushed by its own thread */
+				for(c = 0; c < n; c++)
+				{
+					if(mq_message_send(msgs[c]))
+					{
+						self->failed = 1;
+					}
+				}
+			}
+			else if(mq_message_send_batch(connection, msgs, n))
+			{
+				self->failed = 1;
+			}
+			if(self->failed)
+			{
+				fprintf(stderr, "%s: failed to send messages: %s\n", progname, mq_errmsg(connection));
+			}
+			else
+			{
+				self->messages += n;
+				self->bytes += len;
+				sent += n;
+			}
+		}
+		for(c = 0; c < n; c++)
+		{
+			mq_message_free(msgs[c]);
+		}
+	}
+	free(msgs);
+	if(!sharedconn)
+	{
+		mq_disconnect(connection);
+	}
+	return NULL;
+}
+
+/* Receive messages until the benchmark ends */
+static void *
+consumer(void *arg)
+{
+	struct worker_struct *self = (struct worker_struct *) arg;
+	MQ *connection;
+	MQMESSAGE **msgs;
+	struct timespec ts;
+	const unsigned char *body;
+	unsigned long long sent, received;
+	size_t c, n, len;
+	int nonblock;
+
+	connection = mq_connect_recv(uri, NULL, NULL);
+	if(!connection)
+	{
+		fprintf(stderr, "%s: cannot connect to '%s'\n", progname, uri);
+		self->failed = 1;
+		return NULL;
+	}
+	msgs = (MQMESSAGE **) calloc(batch, sizeof(MQMESSAGE *));
+	if(!msgs)
+	{
+		self->failed = 1;
+		mq_disconnect(connection);
+		return NULL;
+	}
+	/* If possible, avoid waiting indefinitely so that the benchmark can
+	 * end even if no messages arrive
+	 */
+	nonblock = !mq_set_option(connection, MQO_NONBLOCK, 1);
+	if(prefetch && mq_set_option(connection, MQO_PREFETCH, prefetch))
+	{
+		fprintf(stderr, "%s: cannot set prefetch: %s\n", progname, strerror(errno));
+	}
+	self->hist.min = ~0ULL;
+	while(consuming)
+	{
+		n = mq_next_batch(connection, msgs, batch);
+		if(!n)
+		{
+			if(nonblock && errno == EAGAIN)
+			{
+				usleep(100);
+				continue;
+			}
+			fprintf(stderr, "%s: failed to receive messages: %s\n", progname, mq_errmsg(connection));
+			self->failed = 1;
+			break;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		received = ((unsigned long long) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+		for(c = 0; c < n; c++)
+		{
+			body = mq_message_body(msgs[c]);
+			len = mq_message_len(msgs[c]);
+			if(body && len != (size_t) -1)
+			{
+				self->bytes += len;
+			}
+			if(body && len != (size_t) -1 && len >= BENCH_HEADER && !memcmp(body, BENCH_MAGIC, 8))
+			{
+				sent = (((unsigned long long) body[8] << 24) |
+						((unsigned long long) body[9] << 16) |
+						((unsigned long long) body[10] << 8) |
+						(unsigned long long) body[11]) * 1000000000ULL;
+				sent += ((unsigned long long) body[12] << 24) |
+					((unsigned long long) body[13] << 16) |
+					((unsigned long long) body[14] << 8) |
+					(unsigned long long) body[15];
+				hist_add(&(self->hist), received > sent ? received - sent : 0);
+			}
+			else
+			{
+				self->untimed++;
+			}
+			mq_message_accept(msgs[c]);
+		}
+		__atomic_add_fetch(&(self->messages), n, __ATOMIC_RELAXED);
+	}
+	free(msgs);
+	mq_disconnect(connection);
+	return NULL;
+}
+
+/* Parse a message size specification */
+static int
+parse_size(const char *str)
+{
+	char *t;
+	long a, b;
+
+	exponential = 0;
+	if(*str == '~')
+	{
+		exponential = 1;
+		str++;
+	}
+	a = strtol(str, &t, 10);
+	b = a;
+	if(!exponential && *t == '-')
+	{
+		b = strtol(t + 1, &t, 10);
+	}
+	if(*t || a < 0 || b < a || b > MAX_SIZE)
+	{
+		return -1;
+	}
+	minsize = (size_t) a;
+	maxsize = (size_t) b;
+	return 0;
+}
+
+/* Choose the size of the next message according to the distribution */
+static size_t
+message_size(struct worker_struct *self)
+{
+	double r;
+
+	if(exponential)
+	{
+		r = (rand_r(&(self->seed)) + 1.0) / (RAND_MAX + 1.0);
+		r = -log(r) * minsize;
+		return r > MAX_SIZE ? MAX_SIZE : (size_t) r;
+	}
+	if(maxsize == minsize)
+	{
+		return minsize;
+	}
+	return minsize + (size_t) (rand_r(&(self->seed)) % (maxsize - minsize + 1));
+}
+
+static unsigned long long
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void
+sleep_until(unsigned long long when)
+{
+	unsigned long long t;
+	struct timespec ts;
+
+	t = now();
+	if(when <= t)
+	{
+		return;
+	}
+	ts.tv_sec = (when - t) / 1000000000ULL;
+	ts.tv_nsec = (when - t) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+/* Wait for the consumers to receive the expected number of messages, or to
+ * stop receiving them
+ */
+static void
+drain(struct worker_struct *consumers, int count, unsigned long long expected)
+{
+	unsigned long long received, last, idle;
+	int c;
+
+	last = 0;
+	idle = now();
+	for(;;)
+	{
+		received = 0;
+		for(c = 0; c < count; c++)
+		{
+			received += __atomic_load_n(&(consumers[c].messages), __ATOMIC_RELAXED);
+		}
+		if(received >= expected)
+		{
+			return;
+		}
+		if(received != last)
+		{
+			last = received;
+			idle = now();
+		}
+		else if(now() - idle >= DRAIN_IDLE)
+		{
+			return;
+		}
+		usleep(1000);
+	}
+}
+
+static void
+hist_add(struct histogram_struct *hist, unsigned long long value)
+{
+	int shift;
+	size_t idx;
+
+	hist->count++;
+	if(value < hist->min)
+	{
+		hist->min = value;
+	}
+	if(value > hist->max)
+	{
+		hist->max = value;
+	}
+	if(value >> HIST_MAXBITS)
+	{
+		value = (1ULL << HIST_MAXBITS) - 1;
+	}
+	if(value < HIST_SUB)
+	{
+		idx = (size_t) value;
+	}
+	else
+	{
+		shift = (63 - __builtin_clzll(value)) - HIST_SUBBITS;
+		idx = ((size_t) (shift + 1) << HIST_SUBBITS) | (size_t) ((value >> shift) & (HIST_SUB - 1));
+	}
+	hist->buckets[idx]++;
+}
+
+static void
+hist_merge(struct histogram_struct *dest, struct histogram_struct *src)
+{
+	size_t c;
+
+	if(!src->count)
+	{
+		return;
+	}
+	dest->count += src->count;
+	if(src->min < dest->min)
+	{
+		dest->min = src->min;
+	}
+	if(src->max > dest->max)
+	{
+		dest->max = src->max;
+	}
+	for(c = 0; c < HIST_BUCKETS; c++)
+	{
+		dest->buckets[c] += src->buckets[c];
+	}
+}
+
+/* Find the value at a percentile, as the upper bound of its bucket */
+static unsigned long long
+hist_at(struct histogram_struct *hist, double percentile)
+{
+	unsigned long long target, seen, value;
+	size_t c;
+	int shift;
+
+	target = (unsigned long long) ((percentile / 100.0) * hist->count + 0.5);
+	if(target < 1)
+	{
+		target = 1;
+	}
+	seen = 0;
+	for(c = 0; c < HIST_BUCKETS; c++)
+	{
+		seen += hist->buckets[c];
+		if(seen < target)
+		{
+			continue;
+		}
+		if(c < HIST_SUB)
+		{
+			value = c;
+		}
+		else
+		{
+			shift = (int) (c >> HIST_SUBBITS) - 1;
+			value = (((unsigned long long) (HIST_SUB | (c & (HIST_SUB - 1))) + 1) << shift) - 1;
+		}
+		return value < hist->max ? value : hist->max;
+	}
+	return hist->max;
+}
+
+static void
+report(const char *what, struct worker_struct *workers, int count, double elapsed)
+{
+	unsigned long long messages, bytes;
+	int c;
+
+	messages = 0;
+	bytes = 0;
+	for(c = 0; c < count; c++)
+	{
+		messages += workers[c].messages;
+		bytes += workers[c].bytes;
+	}
+	printf("%-10s %12llu msgs %12.0f msgs/s %10.2f MB/s (%d thread%s)\n", what,
+		   messages, messages / elapsed, bytes / elapsed / 1000000.0,
+		   count, count == 1 ? "" : "s");
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS] URI\n"
+			"\n"
+			"Sends messages to and receives messages from URI, reporting throughput\n"
+			"and end-to-end latency.\n"
+			"\n"
+			"OPTIONS is one or more of:\n\n"
+			"  -h                   Print this notice and exit\n"
+			"  -p PRODUCERS         Number of producer threads (default 1)\n"
+			"  -c CONSUMERS         Number of consumer threads (default 1)\n"
+			"  -s SIZE              Message body size in bytes (default 64)\n"
+			"  -s MIN-MAX           Uniformly-distributed message body sizes\n"
+			"  -s ~MEAN             Exponentially-distributed message body sizes\n"
+			"  -r RATE              Messages per second per producer (default unlimited)\n"
+			"  -b BATCH             Messages sent and received at a time (default 1)\n"
+			"  -d SECONDS           Duration of the run (default 5)\n"
+			"  -S                   Producers share a single connection\n"
+			"  -P PREFETCH          Messages prefetched by each consumer (negative\n"
+			"                       for adaptive prefetch of up to -PREFETCH)\n"
+			"\n"
+			"Message bodies of at least %d bytes carry the time at which they were\n"
+			"sent, from which latency is calculated. For queues which can't be sent\n"
+			"to, such as 'random:', specify -p 0.\n"
+			"\n",
+			progname, BENCH_HEADER);
+}
@@ -0,0 +1,181 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* Measure the rate at which connections can be created and destroyed as the
+ * number of threads doing so increases
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "libmq.h"
+
+struct worker_struct
+{
+	pthread_t thread;
+	unsigned long count;
+	int failed;
+};
+
+static const char *progname = "mq-connect-bench";
+static const char *uri = "random:";
+static volatile int running;
+
+static void usage(void);
+static void *worker(void *arg);
+static double now(void);
+
+int
+main(int argc, char **argv)
+{
+	struct worker_struct *workers;
+	unsigned long total;
+	double start, elapsed, duration;
+	int c, n, maxthreads;
+
+	progname = argv[0];
+	maxthreads = 8;
+	duration = 2;
+	while((c = getopt(argc, argv, "hn:d:")) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage();
+			return 0;
+		case 'n':
+			maxthreads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc > 1 || maxthreads < 1 || duration <= 0)
+	{
+		usage();
+		return 1;
+	}
+	if(argc)
+	{
+		uri = argv[0];
+	}
+	workers = (struct worker_struct *) calloc(maxthreads, sizeof(struct worker_struct));
+	if(!workers)
+	{
+		fprintf(stderr, "%s: failed to allocate memory: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	printf("%8s %14s %14s\n", "threads", "connects/s", "per-thread/s");
+	for(n = 1; n <= maxthreads; n *= 2)
+	{
+		memset(workers, 0, sizeof(struct worker_struct) * n);
+		running = 1;
+		start = now();
+		for(c = 0; c < n; c++)
+		{
+			if(pthread_create(&(workers[c].thread), NULL, worker, &(workers[c])))
+			{
+				fprintf(stderr, "%s: failed to create thread\n", progname);
+				return 1;
+			}
+		}
+		usleep((useconds_t) (duration * 1000000));
+		running = 0;
+		total = 0;
+		for(c = 0; c < n; c++)
+		{
+			pthread_join(workers[c].thread, NULL);
+			if(workers[c].failed)
+			{
+				fprintf(stderr, "%s: cannot connect to '%s'\n", progname, uri);
+				return 1;
+			}
+			total += workers[c].count;
+		}
+		elapsed = now() - start;
+		printf("%8d %14.0f %14.0f\n", n, total / elapsed, total / elapsed / n);
+		if(n < maxthreads && n * 2 > maxthreads)
+		{
+			/* Always finish with the requested number of threads */
+			n = maxthreads / 2;
+		}
+	}
+	free(workers);
+	return 0;
+}
+
+static void *
+worker(void *arg)
+{
+	struct worker_struct *self = (struct worker_struct *) arg;
+	MQ *connection;
+
+	while(running)
+	{
+		connection = mq_connect_recv(uri, NULL, NULL);
+		if(!connection)
+		{
+			self->failed = 1;
+			break;
+		}
+		mq_disconnect(connection);
+		self->count++;
+	}
+	return NULL;
+}
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS] [URI]\n"
+			"\n"
+			"Repeatedly connects to and disconnects from URI (by default, 'random:')\n"
+			"from an increasing number of threads and reports the rate achieved.\n"
+			"\n"
+			"OPTIONS is one or more of:\n\n"
+			"  -h                   Print this notice and exit\n"
+			"  -n THREADS           Maximum number of threads (default 8)\n"
+			"  -d SECONDS           Duration of each run (default 2)\n"
+			"\n",
+			progname);
+}
@@ -0,0 +1,89 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* Generate the plug-in manifest: every plug-in in the plug-in directory (or
+ * the directory given with -d, such as a staging directory beneath DESTDIR)
+ * is loaded, and the schemes which they register are written to the
+ * manifest in that directory. This is run when libmq is installed, and
+ * should be run again whenever plug-ins are added or removed.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libmq.h"
+
+#include <unistd.h>
+
+static const char *progname;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS]\n"
+			"\n"
+			"Generates the manifest of schemes provided by libmq plug-ins.\n"
+			"\n"
+			"OPTIONS is one or more of:\n\n"
+			"  -h                   Print this notice and exit\n"
+			"  -v                   Report each plug-in as it is loaded\n"
+			"  -d DIRECTORY         Plug-in directory (default %s)\n",
+			progname, PLUGINDIR);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *dir;
+	int c, verbose;
+
+	progname = argv[0];
+	dir = PLUGINDIR;
+	verbose = 0;
+	while((c = getopt(argc, argv, "hvd:")) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage();
+			return 0;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if(optind != argc)
+	{
+		usage();
+		return 1;
+	}
+	if(mq_plugin_manifest_(dir, verbose))
+	{
+		fprintf(stderr, "%s: cannot generate the manifest for '%s': %s\n", progname, dir, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
@@ -122,7 +122,8 @@ main(int argc, char **argv)
 		mq_message_set_type(msg, type);
 	}
 	fprintf(stderr, "%s: sending %s message '%s' to <%s>\n", progname, type, subj, argv[0]);
-	if(mq_message_add_bytes(msg, (unsigned char *) buffer, buflen))
+	/* Hand the buffer over to the message, which will free it */
+	if(mq_message_add_bytes_owned(msg, (unsigned char *) buffer, buflen, free))
 	{
 		fprintf(stderr, "%s: failed to add to outgoing message buffer: %s\n", progname, mq_errmsg(connection));
 		return 1;
@@ -142,7 +143,6 @@ main(int argc, char **argv)
 
 	/* Clean up and exit */
 	mq_message_free(msg);
-	free(buffer);
 	mq_disconnect(connection);
 
 	return 0;
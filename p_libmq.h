@@ -35,7 +35,124 @@
 
 # define PLUGINDIR                      LIBDIR "/mq/plugins"
 
+/* The AMQP engines map a partition to a distinct address on the same host,
+ * formed by appending this separator and the partition's name
+ */
+# define MQ_AMQP_PARTITION_SEP          "."
+
+/* Atomic operations used by lock-free structures: loads and stores have
+ * acquire and release semantics respectively
+ */
+# define MQ_ATOMIC_LOAD(ptr)            __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+# define MQ_ATOMIC_STORE(ptr, val)      __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+/* Obtain the MQCOMMON for a connection, or NULL if the engine doesn't
+ * provide one
+ */
+# define MQ_COMMON(conn) \
+	((conn)->impl->common ? (conn)->impl->common(conn) : NULL)
+
+/* Obtain the connection for a message, or NULL if the engine can't provide
+ * it
+ */
+# define MQ_MESSAGE_CONNECTION(msg) \
+	((msg)->impl->connection ? (msg)->impl->connection(msg) : NULL)
+
+/* Add n to one of the statistics counters in an MQCOMMON (which may be NULL);
+ * counters are only ever read as a snapshot, and so no ordering is required
+ */
+# define MQ_STATS_ADD(common, member, n) \
+	do \
+	{ \
+		if(common) \
+		{ \
+			__atomic_add_fetch(&((common)->stats.member), n, __ATOMIC_RELAXED); \
+		} \
+	} while(0)
+
+/* Count the outcome of an operation: if r is zero, member is incremented,
+ * otherwise the error count is
+ */
+# define MQ_STATS_ADD_RESULT(common, r, member) \
+	do \
+	{ \
+		if(r) \
+		{ \
+			mq_count_error_(common); \
+		} \
+		else \
+		{ \
+			MQ_STATS_ADD(common, member, 1); \
+		} \
+	} while(0)
+
+/* Obtain the time at which an operation whose latency is being recorded
+ * began, or zero if latency histograms aren't enabled
+ */
+# define MQ_LATENCY_START(common) \
+	(((common) && (common)->latency) ? mq_latency_now_() : 0)
+
+/* Apply any change in cluster membership to a sharded connection */
+# define MQ_SHARDS_CHECK(common) \
+	(((common) && (common)->shards) ? mq_shards_check_(common) : 0)
+
+/* Determine whether messages created on a connection are packed into
+ * envelopes
+ */
+# define MQ_ENVELOPE_PACKING(common) \
+	((common) && (common)->envelopesize)
+
+/* Obtain the next message unpacked from a received envelope, if any */
+# define MQ_ENVELOPE_NEXT(common) \
+	(((common) && (common)->envelope) ? mq_envelope_next_(common) : NULL)
+
+/* Send the open envelope of a connection, if any */
+# define MQ_ENVELOPE_FLUSH(connection, common) \
+	(((common) && (common)->envelope) ? mq_envelope_flush_(connection, common) : 0)
+
+/* The plug-in manifest, listing the scheme(s) provided by each plug-in */
+# define PLUGINMANIFEST_NAME            "plugins.manifest"
+# define PLUGINMANIFEST                 PLUGINDIR "/" PLUGINMANIFEST_NAME
+
 MQ *mq_create_(const char *uri, const char *reserved1, const char *reserved2);
+int mq_register_deferred_(const char *scheme, const char *plugin);
+MQ *mq_create_shared_(MQ *inner);
+void mq_count_error_(MQCOMMON *common);
+size_t mq_message_len_(MQMESSAGE *message);
+
+int mq_latency_enable_(MQCOMMON *common, int enable);
+void mq_latency_free_(MQCOMMON *common);
+unsigned long long mq_latency_now_(void);
+void mq_latency_record_(MQCOMMON *common, MQLATENCYKIND kind, unsigned long long start);
+void mq_latency_sent_(MQCOMMON *common, size_t count, unsigned long long when);
+void mq_latency_settled_(MQCOMMON *common, unsigned long long when);
+
+int mq_shards_check_(MQCOMMON *common);
+void mq_shards_free_(MQCOMMON *common);
+unsigned long long mq_key_hash_(const char *key);
+
+int mq_compress_set_option_(MQCOMMON *common, MQOPTION option, long value);
+MQCOMMON *mq_compress_enabled_(MQMESSAGE *message);
+int mq_compress_(MQMESSAGE *message, const unsigned char *bytes, size_t len, unsigned char **out, size_t *outlen);
+int mq_decompress_(MQMESSAGE *message);
+
+int mq_envelope_set_option_(MQ *connection, MQCOMMON *common, MQOPTION option, long value);
+int mq_envelope_create_(MQ *connection, MQMESSAGE **msg);
+int mq_envelope_flush_(MQ *connection, MQCOMMON *common);
+int mq_envelope_check_(MQ *connection, MQCOMMON *common);
+MQMESSAGE *mq_envelope_next_(MQCOMMON *common);
+size_t mq_envelope_pending_(MQCOMMON *common);
+int mq_envelope_unpack_(MQCOMMON *common, MQMESSAGE **message);
+size_t mq_envelope_expand_(MQCOMMON *common, MQMESSAGE **messages, size_t n, size_t count);
+void mq_envelope_free_(MQ *connection, MQCOMMON *common);
+
+void mq_count_received_(MQCOMMON *common, MQMESSAGE **messages, size_t count);
+int mq_engine_foreach_(int (*fn)(const char *scheme, const char *plugin, void *data), void *data);
+
 int mq_plugin_init_(void);
+int mq_plugin_load_(const char *name);
+int mq_plugin_scan_(void);
+int mq_plugin_manifest_(const char *dir, int verbose);
+const char *mq_plugin_loading_(void *handle);
 
 #endif /*!P_LIBMQ_H_*/
@@ -23,25 +23,94 @@
 
 #include "p_libmq.h"
 
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Plug-ins are located using a manifest, PLUGINMANIFEST, which lists the
+ * scheme(s) provided by each plug-in in PLUGINDIR, one per line:
+ *
+ *   SCHEME  FILENAME
+ *
+ * If the manifest is present and up to date, each scheme is registered as a
+ * deferred engine, and its plug-in is loaded only when a connection using the
+ * scheme is first created. Otherwise, every plug-in in PLUGINDIR is loaded
+ * up-front.
+ *
+ * The manifest is considered stale if it is older than PLUGINDIR itself (as
+ * happens when a plug-in is installed or removed) or any of the plug-ins
+ * it lists. It is generated by mq-manifest when libmq is installed (and
+ * should be re-generated in the same way when plug-ins are added or
+ * removed): PLUGINDIR is never written to at runtime.
+ */
+
+struct mq_manifest_entry_struct
+{
+	char *scheme;
+	char *plugin;
+};
+
+static int mq_plugin_manifest_read_(int verbose);
+static int mq_plugin_manifest_write_(const char *dir, int verbose);
+static int mq_plugin_manifest_entry_(const char *scheme, const char *plugin, void *data);
+static int mq_plugin_load_locked_(const char *dir, const char *name, int verbose);
+static int mq_plugin_is_module_(const char *name);
+
+/* pluginlock serialises loading plug-ins and scanning PLUGINDIR */
+static pthread_mutex_t pluginlock = PTHREAD_MUTEX_INITIALIZER;
+static int scanned;
+static char **loaded;
+static size_t nloaded;
+/* The plug-in whose entry-point is currently being invoked */
+static void *loading_handle;
+static const char *loading_name;
+
 int
 mq_plugin_init_(void)
+{
+	int verbose = !!(getenv("MQ_PLUGIN_DEBUG"));
+
+	if(!mq_plugin_manifest_read_(verbose))
+	{
+		return 0;
+	}
+	return mq_plugin_scan_() < 0 ? -1 : 0;
+}
+
+/* Load an individual plug-in from PLUGINDIR, if it hasn't been already */
+int
+mq_plugin_load_(const char *name)
+{
+	int r;
+
+	pthread_mutex_lock(&pluginlock);
+	r = mq_plugin_load_locked_(PLUGINDIR, name, !!(getenv("MQ_PLUGIN_DEBUG")));
+	pthread_mutex_unlock(&pluginlock);
+	return r;
+}
+
+/* Load every plug-in in PLUGINDIR; this only happens once, and so returns 1
+ * if the scan was performed by this call, or 0 if it was performed
+ * previously
+ */
+int
+mq_plugin_scan_(void)
 {
 	int verbose = !!(getenv("MQ_PLUGIN_DEBUG"));
 	DIR *dir;
-	struct dirent direntry, *de;
-	const char *t;
-	char *buf, *p;
-	size_t buflen, baselen, namelen;
-	void *handle;
-	MQENTRY entry;
+	struct dirent *de;
 
+	pthread_mutex_lock(&pluginlock);
+	if(scanned)
+	{
+		pthread_mutex_unlock(&pluginlock);
+		return 0;
+	}
+	scanned = 1;
 	if(verbose)
 	{
 		fprintf(stderr, "MQ: loading plug-ins from %s\n", PLUGINDIR);
 	}
-	buf = NULL;
-	buflen = 0;
-	baselen = strlen(PLUGINDIR);   
 	dir = opendir(PLUGINDIR);
 	if(!dir)
 	{
@@ -49,75 +118,349 @@ mq_plugin_init_(void)
 		{
 			fprintf(stderr, "MQ: cannot open '%s': %s\n", PLUGINDIR, strerror(errno));
 		}
-		return (errno == ENOENT ? 0 : -1);
+		pthread_mutex_unlock(&pluginlock);
+		return (errno == ENOENT ? 1 : -1);
 	}
-	while(!readdir_r(dir, &direntry, &de) && de)
+	while((de = readdir(dir)))
 	{
-		if(de->d_name[0] == '.')
+		if(!mq_plugin_is_module_(de->d_name))
 		{
 			continue;
 		}
-		if(!(t = strrchr(de->d_name, '.')))
+		mq_plugin_load_locked_(PLUGINDIR, de->d_name, verbose);
+	}
+	closedir(dir);
+	pthread_mutex_unlock(&pluginlock);
+	return 1;
+}
+
+/* Load every plug-in in dir (which need not be PLUGINDIR, so that a
+ * manifest can be generated in a staging directory) and replace the
+ * manifest in dir with the list of schemes that they provide; this is used
+ * by mq-manifest, and should not be invoked by a process which has created
+ * any connections
+ */
+int
+mq_plugin_manifest_(const char *dir, int verbose)
+{
+	DIR *d;
+	struct dirent *de;
+	int r;
+
+	pthread_mutex_lock(&pluginlock);
+	d = opendir(dir);
+	if(!d)
+	{
+		pthread_mutex_unlock(&pluginlock);
+		return -1;
+	}
+	while((de = readdir(d)))
+	{
+		if(!mq_plugin_is_module_(de->d_name))
 		{
 			continue;
 		}
-		if(!strcasecmp(t, ".so") ||
-		   !strcasecmp(t, ".dylib") ||
-		   !strcasecmp(t, ".bundle") ||
-		   !strcasecmp(t, ".dll"))
+		mq_plugin_load_locked_(dir, de->d_name, verbose);
+	}
+	closedir(d);
+	r = mq_plugin_manifest_write_(dir, verbose);
+	pthread_mutex_unlock(&pluginlock);
+	return r;
+}
+
+/* If handle is that of the plug-in whose entry-point is being invoked,
+ * return its filename
+ */
+const char *
+mq_plugin_loading_(void *handle)
+{
+	if(handle && handle == loading_handle)
+	{
+		return loading_name;
+	}
+	return NULL;
+}
+
+/* (Internal) load a plug-in from dir and invoke its entry-point; the caller
+ * must hold pluginlock
+ */
+static int
+mq_plugin_load_locked_(const char *dir, const char *name, int verbose)
+{
+	char *buf, **p;
+	size_t c;
+	void *handle;
+	MQENTRY entry;
+	const int *abi;
+
+	for(c = 0; c < nloaded; c++)
+	{
+		if(!strcmp(loaded[c], name))
+		{
+			return 0;
+		}
+	}
+	p = (char **) realloc(loaded, sizeof(char *) * (nloaded + 1));
+	if(!p)
+	{
+		fprintf(stderr, "MQ: failed to allocate memory for plug-in list\n");
+		return -1;
+	}
+	loaded = p;
+	loaded[nloaded] = strdup(name);
+	if(!loaded[nloaded])
+	{
+		fprintf(stderr, "MQ: failed to allocate memory for plug-in list\n");
+		return -1;
+	}
+	nloaded++;
+	if(verbose)
+	{
+		fprintf(stderr, "MQ: loading plug-in %s\n", name);
+	}
+	buf = (char *) malloc(strlen(dir) + strlen(name) + 2);
+	if(!buf)
+	{
+		fprintf(stderr, "MQ: failed to allocate pathname buffer\n");
+		return -1;
+	}
+	sprintf(buf, "%s/%s", dir, name);
+	handle = dlopen(buf, RTLD_NOW|RTLD_LOCAL);
+	if(!handle)
+	{
+		fprintf(stderr, "MQ: failed to load %s: %s\n", buf, dlerror());
+		free(buf);
+		return -1;
+	}
+	entry = (MQENTRY) dlsym(handle, "mq_entry");
+	if(!entry)
+	{
+		fprintf(stderr, "MQ: %s has no initialisation function\n", buf);
+		dlclose(handle);
+		free(buf);
+		return -1;
+	}
+	/* The entry-point can't be invoked unless the plug-in was built
+	 * against the same engine interface as libmq
+	 */
+	abi = (const int *) dlsym(handle, "mq_engine_abi");
+	if(!abi || *abi != MQ_ENGINE_ABI)
+	{
+		fprintf(stderr, "MQ: %s was built for a different version of libmq and must be rebuilt\n", buf);
+		dlclose(handle);
+		free(buf);
+		return -1;
+	}
+	loading_handle = handle;
+	loading_name = loaded[nloaded - 1];
+	if(entry(handle))
+	{
+		loading_handle = NULL;
+		loading_name = NULL;
+		fprintf(stderr, "MQ: %s: initialisation failed\n", buf);
+		mq_unregister_all(handle);
+		dlclose(handle);
+		free(buf);
+		return -1;
+	}
+	loading_handle = NULL;
+	loading_name = NULL;
+	if(verbose)
+	{
+		fprintf(stderr, "MQ: %s initialised\n", buf);
+	}
+	free(buf);
+	return 0;
+}
+
+/* (Internal) determine whether a filename is that of a loadable module */
+static int
+mq_plugin_is_module_(const char *name)
+{
+	const char *t;
+
+	if(name[0] == '.' || strchr(name, '/'))
+	{
+		return 0;
+	}
+	if(!(t = strrchr(name, '.')))
+	{
+		return 0;
+	}
+	return (!strcasecmp(t, ".so") ||
+			!strcasecmp(t, ".dylib") ||
+			!strcasecmp(t, ".bundle") ||
+			!strcasecmp(t, ".dll"));
+}
+
+/* (Internal) read the manifest and register its schemes as deferred engines;
+ * returns -1 if the manifest is missing, stale or invalid
+ */
+static int
+mq_plugin_manifest_read_(int verbose)
+{
+	struct mq_manifest_entry_struct *entries, *p;
+	struct stat dirsb, sb;
+	char line[256], *scheme, *plugin, *path, *s;
+	size_t c, count;
+	FILE *f;
+	int r;
+
+	if(stat(PLUGINDIR, &dirsb))
+	{
+		return -1;
+	}
+	f = fopen(PLUGINMANIFEST, "r");
+	if(!f)
+	{
+		if(verbose)
+		{
+			fprintf(stderr, "MQ: cannot open '%s': %s\n", PLUGINMANIFEST, strerror(errno));
+		}
+		return -1;
+	}
+	if(fstat(fileno(f), &sb) || sb.st_mtime < dirsb.st_mtime)
+	{
+		if(verbose)
+		{
+			fprintf(stderr, "MQ: %s is out of date\n", PLUGINMANIFEST);
+		}
+		fclose(f);
+		return -1;
+	}
+	/* Read and check the whole manifest before registering anything */
+	entries = NULL;
+	count = 0;
+	r = 0;
+	path = (char *) malloc(strlen(PLUGINDIR) + sizeof(line) + 2);
+	if(!path)
+	{
+		fclose(f);
+		return -1;
+	}
+	while(!r && fgets(line, sizeof(line), f))
+	{
+		for(s = line; *s == ' ' || *s == '\t'; s++);
+		if(!*s || *s == '#' || *s == '\n')
+		{
+			continue;
+		}
+		scheme = strtok(s, " \t\r\n");
+		plugin = strtok(NULL, " \t\r\n");
+		if(!scheme || !plugin || !mq_plugin_is_module_(plugin))
+		{
+			r = -1;
+			break;
+		}
+		sprintf(path, "%s/%s", PLUGINDIR, plugin);
+		if(stat(path, &dirsb) || dirsb.st_mtime > sb.st_mtime)
+		{
+			r = -1;
+			break;
+		}
+		p = (struct mq_manifest_entry_struct *) realloc(entries, sizeof(struct mq_manifest_entry_struct) * (count + 1));
+		if(!p)
+		{
+			r = -1;
+			break;
+		}
+		entries = p;
+		entries[count].scheme = strdup(scheme);
+		entries[count].plugin = strdup(plugin);
+		count++;
+		if(!entries[count - 1].scheme || !entries[count - 1].plugin)
+		{
+			r = -1;
+		}
+	}
+	fclose(f);
+	free(path);
+	if(r && verbose)
+	{
+		fprintf(stderr, "MQ: %s is out of date or invalid\n", PLUGINMANIFEST);
+	}
+	for(c = 0; c < count; c++)
+	{
+		if(!r)
 		{
-			namelen = baselen + strlen(de->d_name) + 2;
-			if(verbose)
-			{
-				fprintf(stderr, "MQ: loading plug-in %s\n", de->d_name);
-			}
-			if(namelen > buflen)
-			{
-				p = (char *) realloc(buf, namelen);
-				if(!p)
-				{
-					fprintf(stderr, "MQ: failed to allocate pathname buffer\n");
-					free(buf);
-					closedir(dir);
-					return -1;
-				}
-				if(!buf)
-				{
-					strncpy(p, PLUGINDIR, namelen);
-					p[baselen] = '/';
-				}
-				buf = p;
-				buflen = namelen;
-			}
-			buf[baselen + 1] = 0;
-			strncat(buf, de->d_name, namelen);
-			handle = dlopen(buf, RTLD_NOW|RTLD_LOCAL);
-			if(!handle)
-			{
-				fprintf(stderr, "MQ: failed to load %s: %s\n", buf, dlerror());
-				continue;
-			}
-			entry = dlsym(handle, "mq_entry");
-			if(!entry)
-			{
-				fprintf(stderr, "MQ: %s has no initialisation function\n", buf);
-				dlclose(handle);
-				continue;
-			}
-			if(entry(handle))
-			{
-				fprintf(stderr, "MQ: %s: initialisation failed\n", buf);
-				dlclose(handle);
-				continue;
-			}
 			if(verbose)
 			{
-				fprintf(stderr, "MQ: %s initialised\n", buf);
+				fprintf(stderr, "MQ: scheme '%s' is provided by %s\n", entries[c].scheme, entries[c].plugin);
 			}
+			r = mq_register_deferred_(entries[c].scheme, entries[c].plugin);
 		}
+		free(entries[c].scheme);
+		free(entries[c].plugin);
 	}
-	free(buf);
-	closedir(dir);
+	free(entries);
+	return r;
+}
+
+/* (Internal) replace the manifest in dir with the list of schemes registered
+ * by the plug-ins which have been loaded; the caller must hold pluginlock
+ */
+static int
+mq_plugin_manifest_write_(const char *dir, int verbose)
+{
+	char *path, *tmp;
+	FILE *f;
+	int r, e;
+
+	path = (char *) malloc(strlen(dir) + strlen(PLUGINMANIFEST_NAME) + 2);
+	tmp = (char *) malloc(strlen(dir) + strlen(PLUGINMANIFEST_NAME) + 32);
+	if(!path || !tmp)
+	{
+		free(path);
+		free(tmp);
+		errno = ENOMEM;
+		return -1;
+	}
+	sprintf(path, "%s/%s", dir, PLUGINMANIFEST_NAME);
+	sprintf(tmp, "%s.%lu", path, (unsigned long) getpid());
+	f = fopen(tmp, "w");
+	if(!f)
+	{
+		e = errno;
+		free(tmp);
+		free(path);
+		errno = e;
+		return -1;
+	}
+	fprintf(f, "# Generated by mq-manifest: schemes provided by plug-ins in this directory\n");
+	r = mq_engine_foreach_(mq_plugin_manifest_entry_, f);
+	if(fclose(f))
+	{
+		r = -1;
+	}
+	if(r || rename(tmp, path))
+	{
+		e = errno;
+		unlink(tmp);
+		free(tmp);
+		free(path);
+		errno = e;
+		return -1;
+	}
+	/* Renaming the manifest into place updates the modification time of
+	 * the directory; ensure that the manifest isn't considered older than it
+	 */
+	utimes(path, NULL);
+	if(verbose)
+	{
+		fprintf(stderr, "MQ: updated %s\n", path);
+	}
+	free(tmp);
+	free(path);
 	return 0;
 }
 
+/* (Internal) write a manifest entry */
+static int
+mq_plugin_manifest_entry_(const char *scheme, const char *plugin, void *data)
+{
+	if(fprintf((FILE *) data, "%s\t%s\n", scheme, plugin) < 0)
+	{
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,3813 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* The AMQP engine built on the Qpid Proton connection driver, which is used
+ * for amqp: and amqps: URIs in place of the Messenger-based engine when
+ * libmq is configured with --enable-proton-driver.
+ *
+ * All of the AMQP connections made by a process are driven by a single
+ * event loop thread, which owns every socket and every Proton object and
+ * performs all I/O without blocking. MQ connections whose URIs share a
+ * scheme, user, host and port share an AMQP connection (and a session), each
+ * attaching its own links to it: a receiving connection has a receiver link
+ * from its address (or one from each of its partitions, if it has been
+ * given a set of them), while a sending connection has a sender link to its
+ * address plus one for each other address which messages are sent to.
+ *
+ * Application threads never touch Proton objects belonging to a connection.
+ * Outgoing messages are encoded by the sending thread and queued for the
+ * event loop, which transfers them as the link's credit allows; incoming
+ * messages are read by the event loop and queued for the receiving thread,
+ * which decodes them. Requests in either direction are made under the AMQP
+ * connection's lock, and the event loop is woken via an eventfd.
+ *
+ * Should the AMQP connection fail, it is re-established after a back-off,
+ * and the links re-attached. Messages which were in flight at the time are
+ * reported as MQT_ABORTED, and cause mq_deliver() to fail; those which had
+ * not yet been transferred are sent once the connection is re-established.
+ */
+
+#if defined(WITH_LIBQPID_PROTON) && defined(WITH_PROTON_DRIVER)
+
+# define MQ_CONNECTION_STRUCT_DEFINED   1
+# define MQ_MESSAGE_STRUCT_DEFINED      1
+
+# include "p_libmq.h"
+
+# include <proton/connection_driver.h>
+# include <proton/delivery.h>
+# include <proton/link.h>
+# include <proton/message.h>
+# include <proton/sasl.h>
+# include <proton/session.h>
+# include <proton/ssl.h>
+# include <proton/terminus.h>
+# include <unistd.h>
+# include <limits.h>
+# include <stdint.h>
+# include <time.h>
+# include <netdb.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+
+# define MQ_ERRBUF_LEN                  128
+# define MQ_AMQP_PORT                   "5672"
+# define MQ_AMQPS_PORT                  "5671"
+/* The credit granted by a receiving connection if MQO_PREFETCH is zero */
+# define MQ_AMQP_PREFETCH               64
+/* The maximum number of events handled by each pass of the event loop */
+# define MQ_AMQP_MAXEVENTS              32
+/* The longest interval, in seconds, between attempts to re-establish a
+ * connection
+ */
+# define MQ_AMQP_BACKOFF                32
+/* The time, in milliseconds, allowed for an AMQP connection which is no
+ * longer used to be closed cleanly
+ */
+# define MQ_AMQP_CLOSE_TIMEOUT          2000
+
+/* The holders of a reference to an entry (see below) */
+# define MQ_AMQP_LOOP                   (1<<0)
+# define MQ_AMQP_MESSAGE                (1<<1)
+
+typedef struct mq_amqp_conn_struct MQAMQPCONN;
+typedef struct mq_amqp_link_struct MQAMQPLINK;
+typedef struct mq_amqp_entry_struct MQAMQPENTRY;
+
+/* An encoded message passing between an application thread and the event
+ * loop. An entry is freed once neither the event loop nor a message refers
+ * to it; refs is protected by the AMQP connection's lock for as long as the
+ * MQ connection is attached to one.
+ */
+struct mq_amqp_entry_struct
+{
+	MQAMQPENTRY *next;
+	MQAMQPENTRY *prev;
+	int refs;
+	/* The delivery, once it has been transferred, and the generation of
+	 * the AMQP connection it was transferred over
+	 */
+	pn_delivery_t *delivery;
+	unsigned long generation;
+	/* The link an outgoing message was transferred over */
+	MQAMQPLINK *link;
+	/* The status of an outgoing message */
+	MQSTATUS status;
+	/* The disposition requested for an incoming message (zero to settle
+	 * it without one)
+	 */
+	uint64_t disposition;
+	/* The address an outgoing message is sent to, if it isn't the MQ
+	 * connection's own
+	 */
+	char *address;
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/* A link attached on behalf of an MQ connection; owned by the event loop */
+struct mq_amqp_link_struct
+{
+	MQAMQPLINK *next;
+	MQ *owner;
+	pn_link_t *link;
+	int receiver;
+	/* The source address of a receiver, or the target address of a
+	 * sender other than the MQ connection's own (otherwise NULL)
+	 */
+	char *address;
+	/* An incoming message whose transfer isn't yet complete */
+	MQAMQPENTRY *partial;
+};
+
+/* An AMQP connection, shared by the MQ connections attached to it */
+struct mq_amqp_conn_struct
+{
+	MQAMQPCONN *next;
+	/* The scheme, user-info, host and port which the connection was
+	 * established with
+	 */
+	char *key;
+	char *host;
+	char *port;
+	char *user;
+	char *password;
+	int tls;
+	char container[64];
+	/* The number of MQ connections using this connection, and whether it
+	 * is being closed because there are none; protected by looplock
+	 */
+	unsigned long refs;
+	int closing;
+	/* lock protects the members below, and the shared members of each
+	 * attached MQ connection
+	 */
+	pthread_mutex_t lock;
+	MQ *mqs;
+	/* Set to request a pass of the event loop over this connection */
+	int kick;
+	/* Incremented each time the connection is re-established */
+	unsigned long generation;
+	/* The reason for the most recent failure */
+	char condition[MQ_ERRBUF_LEN];
+	/* The remaining members are used only by the event loop */
+	int fd;
+	int active;
+	int connecting;
+	uint32_t events;
+	pn_connection_driver_t driver;
+	pn_session_t *session;
+	/* The time of the next connection attempt (or, while closing, the
+	 * time by which closing must complete), and the current back-off
+	 */
+	unsigned long long retry;
+	int backoff;
+	pn_timestamp_t deadline;
+	uint64_t tag;
+	unsigned long links;
+};
+
+/* The event loop shared by all AMQP connections, protected by looplock */
+typedef struct
+{
+	pthread_t thread;
+	int running;
+	int stopping;
+	int stop;
+	int epfd;
+	int wakefd;
+	/* The number of attached MQ connections */
+	unsigned long users;
+	unsigned long serial;
+	MQAMQPCONN *conns;
+} MQAMQPLOOP;
+
+/* MQ implementation members */
+static unsigned long mq_amqp_release_(MQ *self);
+static int mq_amqp_error_(MQ *self);
+static const char *mq_amqp_errmsg_(MQ *self);
+static MQSTATE mq_amqp_state_(MQ *self);
+static int mq_amqp_connect_recv_(MQ *self);
+static int mq_amqp_connect_send_(MQ *self);
+static int mq_amqp_disconnect_(MQ *self);
+static int mq_amqp_next_(MQ *self, MQMESSAGE **msg);
+static int mq_amqp_deliver_(MQ *self);
+static int mq_amqp_create_(MQ *self, MQMESSAGE **msg);
+static int mq_amqp_set_cluster_(MQ *self, CLUSTER *cluster);
+static CLUSTER *mq_amqp_cluster_(MQ *self);
+static int mq_amqp_set_partition_(MQ *self, const char *partition);
+static const char *mq_amqp_partition_(MQ *self);
+static int mq_amqp_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received);
+static int mq_amqp_send_batch_(MQ *self, MQMESSAGE **msgs, size_t count);
+static int mq_amqp_next_timed_(MQ *self, MQMESSAGE **msg, int timeout);
+static int mq_amqp_set_option_(MQ *self, MQOPTION option, long value);
+static int mq_amqp_fd_(MQ *self, int *events);
+static int mq_amqp_process_(MQ *self);
+static MQCOMMON *mq_amqp_common_(MQ *self);
+static int mq_amqp_pending_(MQ *self);
+static int mq_amqp_set_sent_callback_(MQ *self, MQSENTFN fn, void *data);
+static int mq_amqp_set_partitions_(MQ *self, const char *const *partitions, size_t count);
+
+/* MQMESSAGE implementation members */
+static unsigned long mq_amqp_message_release_(MQMESSAGE *self);
+static MQMSGKIND mq_amqp_message_kind_(MQMESSAGE *self);
+static int mq_amqp_message_accept_(MQMESSAGE *self);
+static int mq_amqp_message_reject_(MQMESSAGE *self);
+static int mq_amqp_message_pass_(MQMESSAGE *self);
+static int mq_amqp_message_send_(MQMESSAGE *self);
+static int mq_amqp_message_set_type_(MQMESSAGE *self, const char *type);
+static const char *mq_amqp_message_type_(MQMESSAGE *self);
+static int mq_amqp_message_set_subject_(MQMESSAGE *self, const char *type);
+static const char *mq_amqp_message_subject_(MQMESSAGE *self);
+static int mq_amqp_message_set_address_(MQMESSAGE *self, const char *address);
+static const char *mq_amqp_message_address_(MQMESSAGE *self);
+static const unsigned char *mq_amqp_message_body_(MQMESSAGE *self);
+static size_t mq_amqp_message_len_(MQMESSAGE *self);
+static int mq_amqp_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len);
+static int mq_amqp_message_set_partition_(MQMESSAGE *self, const char *partition);
+static const char *mq_amqp_message_partition_(MQMESSAGE *self);
+static int mq_amqp_message_add_iov_(MQMESSAGE *self, const struct iovec *iov, int iovcnt);
+static MQ *mq_amqp_message_connection_(MQMESSAGE *self);
+static MQSTATUS mq_amqp_message_status_(MQMESSAGE *self);
+static int mq_amqp_message_set_encoding_(MQMESSAGE *self, const char *encoding);
+static const char *mq_amqp_message_encoding_(MQMESSAGE *self);
+static int mq_amqp_message_replace_body_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn);
+
+/* Internal utilities: application threads */
+static int mq_amqp_parse_(MQ *self, const char *uri);
+static int mq_amqp_connect_(MQ *self, MQSTATE state);
+static int mq_amqp_wait_(MQ *self, int timeout);
+static MQMESSAGE *mq_amqp_take_(MQ *self);
+static void mq_amqp_adapt_(MQ *self);
+static void mq_amqp_flow_check_(MQ *self);
+static int mq_amqp_dispose_(MQMESSAGE *self, uint64_t disposition);
+static void mq_amqp_settle_(MQ *self, MQAMQPENTRY *entry, uint64_t disposition);
+static void mq_amqp_unref_(MQ *self, MQAMQPENTRY *entry, int ref);
+static int mq_amqp_failed_(MQ *self);
+static void mq_amqp_sent_(MQ *self);
+static void mq_amqp_sent_discard_(MQ *self);
+static int mq_amqp_target_(MQ *self, const char *address, const char **target);
+static int mq_amqp_scratch_(MQ *self, size_t len);
+static MQMESSAGE *mq_amqp_message_construct_(MQ *self);
+static void mq_amqp_message_recycle_(MQMESSAGE *self);
+static void mq_amqp_pool_trim_(MQ *self, size_t limit);
+static void mq_amqp_pool_fill_(MQ *self, size_t count);
+static int mq_amqp_message_decode_body_(MQMESSAGE *self);
+static int mq_amqp_loop_attach_(MQ *self);
+static void mq_amqp_loop_detach_(MQ *self);
+static void mq_amqp_kick_(MQAMQPCONN *conn);
+
+/* Internal utilities: the event loop */
+static void *mq_amqp_loop_thread_(void *arg);
+static int mq_amqp_loop_service_(void);
+static void mq_amqp_loop_shutdown_(void);
+static int mq_amqp_conn_start_(MQAMQPCONN *conn);
+static void mq_amqp_conn_stop_(MQAMQPCONN *conn);
+static void mq_amqp_conn_fail_(MQAMQPCONN *conn, const char *reason);
+static void mq_amqp_conn_free_(MQAMQPCONN *conn);
+static void mq_amqp_conn_io_(MQAMQPCONN *conn, uint32_t events);
+static void mq_amqp_conn_run_(MQAMQPCONN *conn);
+static void mq_amqp_conn_read_(MQAMQPCONN *conn);
+static void mq_amqp_conn_write_(MQAMQPCONN *conn);
+static void mq_amqp_conn_service_(MQAMQPCONN *conn);
+static void mq_amqp_conn_event_(MQAMQPCONN *conn, pn_event_t *event);
+static void mq_amqp_condition_(MQAMQPCONN *conn, pn_condition_t *condition, char *buf);
+static void mq_amqp_detach_(MQAMQPCONN *conn, MQ *mq);
+static MQAMQPLINK *mq_amqp_link_open_(MQAMQPCONN *conn, MQ *mq, const char *address, int sender);
+static void mq_amqp_link_close_(MQAMQPCONN *conn, MQAMQPLINK *ml, const char *reason);
+static void mq_amqp_link_drop_(MQ *mq, MQAMQPLINK *ml);
+static void mq_amqp_receivers_(MQAMQPCONN *conn, MQ *mq);
+static int mq_amqp_sources_(MQ *self, const char *const *partitions, size_t count);
+static void mq_amqp_sources_free_(char **sources, size_t count);
+static void mq_amqp_links_free_(MQ *mq);
+static void mq_amqp_send_(MQAMQPCONN *conn, MQ *mq);
+static void mq_amqp_flow_(MQ *mq);
+static void mq_amqp_received_(MQAMQPCONN *conn, pn_link_t *link, pn_delivery_t *delivery);
+static void mq_amqp_updated_(pn_delivery_t *delivery);
+static void mq_amqp_done_(MQ *mq, MQAMQPENTRY *entry, MQSTATUS status);
+static void mq_amqp_abort_(MQ *mq, MQAMQPLINK *ml, MQSTATUS status);
+static void mq_amqp_notify_(MQ *mq);
+static MQAMQPENTRY *mq_amqp_entry_get_(MQ *mq);
+static void mq_amqp_entry_recycle_(MQ *mq, MQAMQPENTRY *entry);
+static void mq_amqp_entry_free_(MQAMQPENTRY *entry);
+static unsigned long long mq_amqp_now_(void);
+
+struct mq_connection_struct
+{
+	MQCONNIMPL *impl;
+	MQ_CONNECTION_COMMON_MEMBERS;
+	/* The parts of the URI */
+	char *key;
+	char *host;
+	char *port;
+	char *user;
+	char *password;
+	char *address;
+	int tls;
+	/* The partition set with mq_set_partition() (or by the cluster) */
+	char *partition;
+	/* The AMQP connection, while attached, and the next MQ connection
+	 * attached to it; the members which follow, up to the sent callback,
+	 * are protected by the AMQP connection's lock
+	 */
+	MQAMQPCONN *conn;
+	MQ *next;
+	pthread_cond_t cond;
+	int notifyfd;
+	/* Set by the event loop once the connection's links have been
+	 * attached, and cleared to request that they are again
+	 */
+	int attached;
+	/* Set to request that the connection is detached, and by the event
+	 * loop once it has been
+	 */
+	int detaching;
+	int detached;
+	/* Set to request that the event loop grants more credit */
+	int wantflow;
+	/* The addresses which receivers receive from, if they aren't the
+	 * connection's own: that of its partition, or those of the partitions
+	 * set with set_partitions() (in which case sharded is set)
+	 */
+	char **sources;
+	size_t nsources;
+	int sharded;
+	/* The links attached for the connection (owned by the event loop),
+	 * including its receivers, if any
+	 */
+	MQAMQPLINK *links;
+	size_t receivers;
+	/* Outgoing messages awaiting transfer, and those awaiting an outcome */
+	MQAMQPENTRY *outhead;
+	MQAMQPENTRY *outtail;
+	size_t outcount;
+	MQAMQPENTRY *inflight;
+	size_t unsettled;
+	/* The number of outgoing messages which were in flight when the link
+	 * or connection failed
+	 */
+	unsigned long aborted;
+	/* Incoming messages awaiting the application, and those which are
+	 * awaiting settlement
+	 */
+	MQAMQPENTRY *inhead;
+	MQAMQPENTRY *intail;
+	size_t incount;
+	MQAMQPENTRY *settlehead;
+	MQAMQPENTRY *settletail;
+	/* Settled incoming entries, retained (along with their buffers) for
+	 * re-use by the event loop
+	 */
+	MQAMQPENTRY *spare;
+	size_t sparecount;
+	/* The credit which the receivers should be granted between them
+	 * (adjusted by adaptive prefetch), and the credit they had when last
+	 * examined by the event loop
+	 */
+	int credit;
+	int linkcredit;
+	/* Incremented on each failure of the connection or its links, with
+	 * failtext describing the most recent
+	 */
+	unsigned long failures;
+	char failtext[MQ_ERRBUF_LEN];
+	/* The remaining members are used only by the application */
+	unsigned long seenfailures;
+	char errtext[MQ_ERRBUF_LEN];
+	int polled;
+	long prefetch;
+	int lagging;
+	int outgoing_window;
+	unsigned long long sentseq;
+	MQSENTFN sentfn;
+	void *sentdata;
+	MQMESSAGE *sent;
+	MQMESSAGE *senttail;
+	MQMESSAGE *pool;
+	size_t poolcount;
+	long poollimit;
+	char *scratch;
+	size_t scratchsize;
+};
+
+struct mq_message_struct
+{
+	MQMESSAGEIMPL *impl;
+	MQ_MESSAGE_COMMON_MEMBERS;
+	pn_message_t *msg;
+	/* The body of an incoming message is located on first use; bytes.size
+	 * is the total length of an outgoing message's body
+	 */
+	pn_data_t *body;
+	pn_bytes_t bytes;
+	int decoded:1;
+	/* A decoded body which has replaced that of an incoming message */
+	unsigned char *plain;
+	MQFREEFN plainfree;
+	/* The entry for an incoming message until it has been settled, or for
+	 * an outgoing message once it has been sent
+	 */
+	MQAMQPENTRY *entry;
+	/* The sequence number of an outgoing message, used to determine
+	 * whether it is within the outgoing window
+	 */
+	unsigned long long seq;
+	MQSTATUS status;
+	int addressed:1;
+	/* Set while the message is in the connection's list of sent messages,
+	 * and if it has been freed in the meantime
+	 */
+	int tracked:1;
+	int released:1;
+	MQMESSAGE *nextsent;
+	/* The partition set with mq_message_set_partition(), if any: an
+	 * empty string means no partition, regardless of the connection's
+	 */
+	char *partition;
+	/* The next message in the connection's pool */
+	MQMESSAGE *next;
+};
+
+static MQCONNIMPL mq_amqp_connection_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_amqp_release_,
+	mq_amqp_error_,
+	mq_amqp_errmsg_,
+	mq_amqp_state_,
+	mq_amqp_connect_recv_,
+	mq_amqp_connect_send_,
+	mq_amqp_disconnect_,
+	mq_amqp_next_,
+	mq_amqp_deliver_,
+	mq_amqp_create_,
+	mq_amqp_set_cluster_,
+	mq_amqp_cluster_,
+	mq_amqp_set_partition_,
+	mq_amqp_partition_,
+	mq_amqp_next_batch_,
+	mq_amqp_send_batch_,
+	mq_amqp_next_timed_,
+	mq_amqp_set_option_,
+	mq_amqp_fd_,
+	mq_amqp_process_,
+	mq_amqp_common_,
+	/* set_spool */
+	NULL,
+	mq_amqp_pending_,
+	mq_amqp_set_sent_callback_,
+	mq_amqp_set_partitions_
+};
+
+static MQMESSAGEIMPL mq_amqp_message_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_amqp_message_release_,
+	mq_amqp_message_kind_,
+	mq_amqp_message_accept_,
+	mq_amqp_message_reject_,
+	mq_amqp_message_pass_,
+	mq_amqp_message_send_,
+	mq_amqp_message_set_type_,
+	mq_amqp_message_type_,
+	mq_amqp_message_set_subject_,
+	mq_amqp_message_subject_,
+	mq_amqp_message_set_address_,
+	mq_amqp_message_address_,
+	mq_amqp_message_body_,
+	mq_amqp_message_len_,
+	mq_amqp_message_add_bytes_,
+	mq_amqp_message_set_partition_,
+	mq_amqp_message_partition_,
+	mq_amqp_message_add_iov_,
+	/* add_bytes_owned: pn_data_put_binary() always copies */
+	NULL,
+	/* take_body */
+	NULL,
+	mq_amqp_message_connection_,
+	mq_amqp_message_status_,
+	mq_amqp_message_set_encoding_,
+	mq_amqp_message_encoding_,
+	mq_amqp_message_replace_body_
+};
+
+/* looplock protects the event loop and the list of AMQP connections, and is
+ * held by the event loop while it services them; loopidle is signalled once
+ * a stopping event loop has finished
+ */
+static pthread_mutex_t looplock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loopidle = PTHREAD_COND_INITIALIZER;
+static MQAMQPLOOP loop;
+
+MQ *mq_amqp_construct_(const char *uri, const char *reserved1, const char *reserved2);
+
+/* AMQP connection-driver message queue constructor: this is invoked by libmq
+ * to create a new amqp: or amqps: MQ instance
+ */
+MQ *
+mq_amqp_construct_(const char *uri, const char *reserved1, const char *reserved2)
+{
+	MQ *mq;
+
+	(void) reserved1;
+	(void) reserved2;
+
+	mq = (MQ *) calloc(1, sizeof(MQ));
+	if(!mq)
+	{
+		return NULL;
+	}
+	mq->impl = &mq_amqp_connection_impl_;
+	pthread_cond_init(&(mq->cond), NULL);
+	mq->notifyfd = -1;
+	if(mq_amqp_parse_(mq, uri))
+	{
+		mq_amqp_release_(mq);
+		return NULL;
+	}
+	mq->credit = MQ_AMQP_PREFETCH;
+	mq->outgoing_window = 1;
+	mq->poollimit = -1;
+	return mq;
+}
+
+/* Free an MQ connection object */
+static unsigned long
+mq_amqp_release_(MQ *self)
+{
+	mq_amqp_disconnect_(self);
+	mq_amqp_pool_trim_(self, 0);
+	pthread_cond_destroy(&(self->cond));
+	free(self->scratch);
+	free(self->errmsg);
+	free(self->key);
+	free(self->host);
+	free(self->port);
+	free(self->user);
+	free(self->password);
+	free(self->address);
+	free(self->partition);
+	mq_amqp_sources_free_(self->sources, self->nsources);
+	free(self->uri);
+	free(self);
+	return 0;
+}
+
+/* Return an indicator as to whether the connection is in an error state */
+static int
+mq_amqp_error_(MQ *self)
+{
+	if(self->errcode || self->syserr)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* Return the error message for the connection */
+static const char *
+mq_amqp_errmsg_(MQ *self)
+{
+	if(!self->errmsg)
+	{
+		self->errmsg = (char *) malloc(MQ_ERRBUF_LEN);
+		if(!self->errmsg)
+		{
+			return "Memory allocation error obtaining error message";
+		}
+	}
+	self->errmsg[0] = 0;
+	if(self->syserr)
+	{
+		strerror_r(self->syserr, self->errmsg, MQ_ERRBUF_LEN);
+		return self->errmsg;
+	}
+	if(self->errcode)
+	{
+		if(self->errtext[0])
+		{
+			return self->errtext;
+		}
+		snprintf(self->errmsg, MQ_ERRBUF_LEN, "Unknown error #%d", self->errcode);
+		return self->errmsg;
+	}
+	return "Success";
+}
+
+/* Return the MQ connection state */
+static MQSTATE
+mq_amqp_state_(MQ *self)
+{
+	RESET_ERROR(self);
+	return self->state;
+}
+
+/* Establish a connection for receiving */
+static int
+mq_amqp_connect_recv_(MQ *self)
+{
+	RESET_ERROR(self);
+	if(!self->address[0])
+	{
+		/* There must be an address to receive from */
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	if(mq_amqp_connect_(self, MQS_RECV))
+	{
+		return -1;
+	}
+	/* Construct the message objects which will be in use at once up
+	 * front, so that receiving doesn't allocate any in steady state
+	 */
+	mq_amqp_pool_fill_(self, (size_t) (self->prefetch < 0 ? -self->prefetch : self->credit));
+	return 0;
+}
+
+/* Establish a connection for sending */
+static int
+mq_amqp_connect_send_(MQ *self)
+{
+	RESET_ERROR(self);
+	return mq_amqp_connect_(self, MQS_SEND);
+}
+
+/* Disconnect from a message queue: once the event loop has detached the
+ * connection, it no longer refers to anything belonging to it
+ */
+static int
+mq_amqp_disconnect_(MQ *self)
+{
+	MQAMQPCONN *conn;
+
+	RESET_ERROR(self);
+	if(self->state == MQS_DISCONNECTED)
+	{
+		return 0;
+	}
+	conn = self->conn;
+	pthread_mutex_lock(&(conn->lock));
+	self->detaching = 1;
+	mq_amqp_kick_(conn);
+	while(!self->detached)
+	{
+		pthread_cond_wait(&(self->cond), &(conn->lock));
+	}
+	pthread_mutex_unlock(&(conn->lock));
+	mq_amqp_loop_detach_(self);
+	if(self->sent)
+	{
+		mq_amqp_sent_(self);
+		mq_amqp_sent_discard_(self);
+	}
+	if(self->notifyfd != -1)
+	{
+		close(self->notifyfd);
+		self->notifyfd = -1;
+	}
+	self->polled = 0;
+	self->state = MQS_DISCONNECTED;
+	return 0;
+}
+
+/* Wait for a message to arrive via a connection */
+static int
+mq_amqp_next_(MQ *self, MQMESSAGE **msg)
+{
+	return mq_amqp_next_timed_(self, msg, self->nonblock ? 0 : -1);
+}
+
+/* Wait up to timeout milliseconds for a message to arrive via a connection */
+static int
+mq_amqp_next_timed_(MQ *self, MQMESSAGE **msg, int timeout)
+{
+	MQMESSAGE *p;
+
+	RESET_ERROR(self);
+	if(mq_amqp_wait_(self, timeout))
+	{
+		return -1;
+	}
+	p = mq_amqp_take_(self);
+	if(!p)
+	{
+		return -1;
+	}
+	*msg = p;
+	return 0;
+}
+
+/* Obtain up to count buffered messages, waiting for some to arrive if there
+ * are none
+ */
+static int
+mq_amqp_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received)
+{
+	size_t n;
+
+	RESET_ERROR(self);
+	*received = 0;
+	if(!count)
+	{
+		return 0;
+	}
+	if(mq_amqp_wait_(self, self->nonblock ? 0 : -1))
+	{
+		return -1;
+	}
+	for(n = 0; n < count; n++)
+	{
+		msgs[n] = mq_amqp_take_(self);
+		if(!msgs[n])
+		{
+			break;
+		}
+	}
+	if(!n)
+	{
+		return -1;
+	}
+	/* If we obtained at least one message, don't report a failure to
+	 * obtain any subsequent ones
+	 */
+	RESET_ERROR(self);
+	*received = n;
+	return 0;
+}
+
+/* Wait for every outgoing message to be transferred and for its outcome to
+ * be known; if messages were in flight when
+ * the connection failed, or it fails while waiting, this fails
+ */
+static int
+mq_amqp_deliver_(MQ *self)
+{
+	unsigned long failures, aborted;
+	int r;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	r = 0;
+	pthread_mutex_lock(&(self->conn->lock));
+	failures = self->failures;
+	while(self->outcount || self->unsettled)
+	{
+		if(self->failures != failures)
+		{
+			break;
+		}
+		if(self->polled)
+		{
+			/* Delivery will complete as mq_process() is called */
+			SET_SYSERR(self, EAGAIN);
+			r = -1;
+			break;
+		}
+		pthread_cond_wait(&(self->cond), &(self->conn->lock));
+	}
+	aborted = self->aborted;
+	self->aborted = 0;
+	if(!r && (aborted || self->failures != failures))
+	{
+		r = mq_amqp_failed_(self);
+	}
+	pthread_mutex_unlock(&(self->conn->lock));
+	mq_amqp_sent_(self);
+	return r;
+}
+
+/* Queue a set of outgoing messages and then deliver them all at once: as the
+ * event loop is only woken when the queue was empty, the messages are
+ * transferred together
+ */
+static int
+mq_amqp_send_batch_(MQ *self, MQMESSAGE **msgs, size_t count)
+{
+	size_t c;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	for(c = 0; c < count; c++)
+	{
+		if(msgs[c]->connection != self)
+		{
+			SET_SYSERR(self, EINVAL);
+			return -1;
+		}
+		if(mq_amqp_message_send_(msgs[c]))
+		{
+			return -1;
+		}
+	}
+	return mq_amqp_deliver_(self);
+}
+
+/* Create a new outgoing message */
+static int
+mq_amqp_create_(MQ *self, MQMESSAGE **msg)
+{
+	MQMESSAGE *p;
+
+	RESET_ERROR(self);
+	p = mq_amqp_message_construct_(self);
+	if(!p)
+	{
+		return -1;
+	}
+	p->kind = MQK_OUTGOING;
+	*msg = p;
+	return 0;
+}
+
+/* Set the cluster associated with a connection, and use its partition */
+static int
+mq_amqp_set_cluster_(MQ *self, CLUSTER *cluster)
+{
+	self->cluster = cluster;
+	/* Following the cluster's partition is best-effort: a failure is left
+	 * in the connection's error state, but doesn't fail the association
+	 */
+	self->impl->set_partition(self, cluster ? cluster_partition(cluster) : NULL);
+	return 0;
+}
+
+/* Obtain the cluster (if any) associated with a connection */
+static CLUSTER *
+mq_amqp_cluster_(MQ *self)
+{
+	return self->cluster;
+}
+
+/* Set the partition associated with this connection (NULL or an empty
+ * string will unset it): messages are sent to, or received from, the
+ * partition's own address on the same host. If the connection is receiving,
+ * its receiver is re-attached to the new address over the same AMQP
+ * connection; messages which have already arrived can still be obtained.
+ */
+static int
+mq_amqp_set_partition_(MQ *self, const char *partition)
+{
+	char *p;
+
+	RESET_ERROR(self);
+	p = NULL;
+	if(partition && partition[0])
+	{
+		p = strdup(partition);
+		if(!p)
+		{
+			SET_SYSERR(self, ENOMEM);
+			return -1;
+		}
+	}
+	free(self->partition);
+	self->partition = p;
+	if(self->sharded)
+	{
+		/* The set of partitions takes precedence */
+		return 0;
+	}
+	if(mq_amqp_sources_(self, NULL, 0))
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	return 0;
+}
+
+/* Set the partitions which a receiving connection receives from, in place of
+ * its own partition (or address): a receiver is attached from each, and
+ * those from partitions which are no longer in the set are detached, while
+ * the others are left undisturbed
+ */
+static int
+mq_amqp_set_partitions_(MQ *self, const char *const *partitions, size_t count)
+{
+	RESET_ERROR(self);
+	if(mq_amqp_sources_(self, partitions, count))
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	self->sharded = (count > 0);
+	return 0;
+}
+
+/* Return the connection partition */
+static const char *
+mq_amqp_partition_(MQ *self)
+{
+	return self->partition;
+}
+
+/* Set a connection option */
+static int
+mq_amqp_set_option_(MQ *self, MQOPTION option, long value)
+{
+	RESET_ERROR(self);
+	switch(option)
+	{
+	case MQO_NONBLOCK:
+		self->nonblock = !!value;
+		return 0;
+	case MQO_POOL:
+		self->poollimit = value < 0 ? -1 : value;
+		if(value >= 0)
+		{
+			mq_amqp_pool_trim_(self, (size_t) value);
+		}
+		return 0;
+	case MQO_PREFETCH:
+		if(value > INT_MAX || value < -INT_MAX)
+		{
+			SET_SYSERR(self, EINVAL);
+			return -1;
+		}
+		/* Adaptive prefetch starts from a single message */
+		self->prefetch = value;
+		self->lagging = 0;
+		if(self->conn)
+		{
+			pthread_mutex_lock(&(self->conn->lock));
+		}
+		self->credit = value > 0 ? (int) value : (value ? 1 : MQ_AMQP_PREFETCH);
+		if(self->conn)
+		{
+			mq_amqp_flow_check_(self);
+			pthread_mutex_unlock(&(self->conn->lock));
+		}
+		if(self->state == MQS_RECV)
+		{
+			mq_amqp_pool_fill_(self, (size_t) (value < 0 ? -value : self->credit));
+		}
+		return 0;
+	case MQO_OUTGOING_WINDOW:
+		if(value < 1 || value > INT_MAX)
+		{
+			SET_SYSERR(self, EINVAL);
+			return -1;
+		}
+		self->outgoing_window = (int) value;
+		return 0;
+	default:
+		break;
+	}
+	SET_SYSERR(self, ENOTSUP);
+	return -1;
+}
+
+/* Obtain a pollable file descriptor for the connection: this is an eventfd
+ * which the event loop makes readable whenever incoming messages are waiting
+ * to be obtained, or the outcome of outgoing messages has become known
+ */
+static int
+mq_amqp_fd_(MQ *self, int *events)
+{
+	uint64_t one;
+	int fd;
+
+	RESET_ERROR(self);
+	if(self->state == MQS_DISCONNECTED)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	if(self->notifyfd == -1)
+	{
+		fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if(fd == -1)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+		pthread_mutex_lock(&(self->conn->lock));
+		self->notifyfd = fd;
+		self->polled = 1;
+		if(self->incount || self->failures != self->seenfailures)
+		{
+			one = 1;
+			if(write(fd, &one, sizeof(one)) < 0)
+			{
+				/* The counter can't overflow, as it's only ever
+				 * incremented by one and read back to zero
+				 */
+			}
+		}
+		pthread_mutex_unlock(&(self->conn->lock));
+	}
+	if(events)
+	{
+		*events = MQE_READ;
+	}
+	return self->notifyfd;
+}
+
+/* Perform any pending work on the connection without waiting: the event loop
+ * does the work itself, so this only invokes the sent callback and reports
+ * any failure which has occurred
+ */
+static int
+mq_amqp_process_(MQ *self)
+{
+	uint64_t value;
+	int r;
+
+	RESET_ERROR(self);
+	if(self->state == MQS_DISCONNECTED)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	r = 0;
+	pthread_mutex_lock(&(self->conn->lock));
+	if(self->notifyfd != -1)
+	{
+		if(read(self->notifyfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		{
+			SET_ERRNO(self);
+			r = -1;
+		}
+		if(self->incount)
+		{
+			/* Remain readable until the messages are obtained */
+			mq_amqp_notify_(self);
+		}
+	}
+	if(!r && self->failures != self->seenfailures)
+	{
+		self->seenfailures = self->failures;
+		r = mq_amqp_failed_(self);
+	}
+	pthread_mutex_unlock(&(self->conn->lock));
+	mq_amqp_sent_(self);
+	return r;
+}
+
+/* Obtain the state maintained by libmq for the connection */
+static MQCOMMON *
+mq_amqp_common_(MQ *self)
+{
+	return &(self->common);
+}
+
+/* Obtain the number of incoming messages waiting to be obtained */
+static int
+mq_amqp_pending_(MQ *self)
+{
+	size_t incount;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_RECV)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	pthread_mutex_lock(&(self->conn->lock));
+	incount = self->incount;
+	pthread_mutex_unlock(&(self->conn->lock));
+	return incount > INT_MAX ? INT_MAX : (int) incount;
+}
+
+/* Set the function invoked as outgoing messages' outcomes become known;
+ * only messages sent after it has been set are reported
+ */
+static int
+mq_amqp_set_sent_callback_(MQ *self, MQSENTFN fn, void *data)
+{
+	RESET_ERROR(self);
+	self->sentfn = fn;
+	self->sentdata = data;
+	return 0;
+}
+
+/* Release (destroy) a message: an incoming message which hasn't been
+ * accepted, rejected or passed is settled without an outcome
+ */
+static unsigned long
+mq_amqp_message_release_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->tracked)
+	{
+		/* The message is recycled once its outcome is known */
+		self->released = 1;
+		return 0;
+	}
+	mq_amqp_message_recycle_(self);
+	return 0;
+}
+
+static MQMSGKIND
+mq_amqp_message_kind_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->kind;
+}
+
+/* Mark an incoming message as being accepted */
+static int
+mq_amqp_message_accept_(MQMESSAGE *self)
+{
+	return mq_amqp_dispose_(self, PN_ACCEPTED);
+}
+
+/* Mark an incoming message as being rejected */
+static int
+mq_amqp_message_reject_(MQMESSAGE *self)
+{
+	return mq_amqp_dispose_(self, PN_REJECTED);
+}
+
+/* Pass on an incoming message, releasing it so that it may be delivered
+ * again (possibly to another receiver)
+ */
+static int
+mq_amqp_message_pass_(MQMESSAGE *self)
+{
+	return mq_amqp_dispose_(self, PN_RELEASED);
+}
+
+/* Set the content-type of an outgoing message */
+static int
+mq_amqp_message_set_type_(MQMESSAGE *self, const char *type)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING || !self->msg)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return pn_message_set_content_type(self->msg, type);
+}
+
+/* Retrieve the content-type of a message */
+static const char *
+mq_amqp_message_type_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(!self->msg)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return NULL;
+	}
+	return pn_message_get_content_type(self->msg);
+}
+
+/* Set the subject of a message */
+static int
+mq_amqp_message_set_subject_(MQMESSAGE *self, const char *subject)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING || !self->msg)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return pn_message_set_subject(self->msg, subject);
+}
+
+/* Retrieve the subject of a message */
+static const char *
+mq_amqp_message_subject_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(!self->msg)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return NULL;
+	}
+	return pn_message_get_subject(self->msg);
+}
+
+/* Set the address (destination) of an outgoing message: this may be an
+ * address on the connection's host, or a URI with the same scheme, user,
+ * host and port as the connection
+ */
+static int
+mq_amqp_message_set_address_(MQMESSAGE *self, const char *address)
+{
+	const char *target;
+	int r;
+
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING || !self->msg ||
+	   mq_amqp_target_(self->connection, address, &target))
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	r = pn_message_set_address(self->msg, address);
+	if(!r)
+	{
+		self->addressed = 1;
+	}
+	return r;
+}
+
+/* Retrieve the address of a message: if it's an outgoing message, it's the
+ * destination; if it's an incoming message, it's the source
+ */
+static const char *
+mq_amqp_message_address_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(!self->msg)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return NULL;
+	}
+	return pn_message_get_address(self->msg);
+}
+
+/* Retrieve the body of an incoming message */
+static const unsigned char *
+mq_amqp_message_body_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(!self->msg || mq_amqp_message_decode_body_(self))
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return NULL;
+	}
+	return (const unsigned char *) self->bytes.start;
+}
+
+/* Retrieve the length of an incoming message body, in bytes */
+static size_t
+mq_amqp_message_len_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->msg && self->kind == MQK_OUTGOING)
+	{
+		return self->bytes.size;
+	}
+	if(!self->msg || mq_amqp_message_decode_body_(self))
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return (size_t) -1;
+	}
+	return self->bytes.size;
+}
+
+/* Add a sequence of bytes to an outgoing message body */
+static int
+mq_amqp_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING || !self->msg)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	if(!self->body)
+	{
+		self->body = pn_message_body(self->msg);
+		if(!self->body)
+		{
+			SET_SYSERR(self->connection, ENOMEM);
+			return -1;
+		}
+	}
+	if(pn_data_put_binary(self->body, pn_bytes(len, (char *) buf)))
+	{
+		SET_SYSERR(self->connection, ENOMEM);
+		return -1;
+	}
+	self->bytes.size += len;
+	return 0;
+}
+
+/* Add a sequence of bytes gathered from a set of buffers to an outgoing
+ * message body; the buffers are assembled in the connection's scratch buffer
+ * so that the body is added as a single binary value
+ */
+static int
+mq_amqp_message_add_iov_(MQMESSAGE *self, const struct iovec *iov, int iovcnt)
+{
+	MQ *conn;
+	size_t len;
+	char *p;
+	int c;
+
+	conn = self->connection;
+	if(iovcnt == 1)
+	{
+		return mq_amqp_message_add_bytes_(self, (unsigned char *) iov[0].iov_base, iov[0].iov_len);
+	}
+	RESET_ERROR(conn);
+	if(self->kind != MQK_OUTGOING || !self->msg || iovcnt < 0)
+	{
+		SET_SYSERR(conn, EINVAL);
+		return -1;
+	}
+	len = 0;
+	for(c = 0; c < iovcnt; c++)
+	{
+		len += iov[c].iov_len;
+	}
+	if(mq_amqp_scratch_(conn, len))
+	{
+		return -1;
+	}
+	for(c = 0, p = conn->scratch; c < iovcnt; c++)
+	{
+		memcpy(p, iov[c].iov_base, iov[c].iov_len);
+		p += iov[c].iov_len;
+	}
+	return mq_amqp_message_add_bytes_(self, (unsigned char *) conn->scratch, len);
+}
+
+/* Set the partition that this message is associated with: NULL causes the
+ * connection's partition to be used, while an empty string means that the
+ * message isn't sent to any partition
+ */
+static int
+mq_amqp_message_set_partition_(MQMESSAGE *self, const char *partition)
+{
+	char *p;
+
+	if(partition)
+	{
+		p = strdup(partition);
+		if(!p)
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		p = NULL;
+	}
+	free(self->partition);
+	self->partition = p;
+	return 0;
+}
+
+/* Obtain the partition that this message is associated with: if none has
+ * been set, it's the connection's
+ */
+static const char *
+mq_amqp_message_partition_(MQMESSAGE *self)
+{
+	if(!self->partition)
+	{
+		return self->connection->partition;
+	}
+	if(!self->partition[0])
+	{
+		return NULL;
+	}
+	return self->partition;
+}
+
+/* Send an outgoing message: it is encoded and queued for the event loop,
+ * which is woken if the queue was empty. A message associated with a
+ * partition is sent to the partition's address, over a link of its own.
+ */
+static int
+mq_amqp_message_send_(MQMESSAGE *self)
+{
+	MQ *conn;
+	MQAMQPENTRY *entry;
+	const char *target, *partition;
+	size_t len, tlen;
+	int r;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	if(self->kind != MQK_OUTGOING || !self->msg || conn->state != MQS_SEND)
+	{
+		SET_SYSERR(conn, EINVAL);
+		return -1;
+	}
+	target = NULL;
+	if(self->addressed)
+	{
+		mq_amqp_target_(conn, pn_message_get_address(self->msg), &target);
+	}
+	else if(pn_message_set_address(self->msg, conn->uri))
+	{
+		SET_SYSERR(conn, ENOMEM);
+		return -1;
+	}
+	if(mq_amqp_scratch_(conn, 1))
+	{
+		return -1;
+	}
+	for(;;)
+	{
+		len = conn->scratchsize;
+		r = pn_message_encode(self->msg, conn->scratch, &len);
+		if(r != PN_OVERFLOW)
+		{
+			break;
+		}
+		if(mq_amqp_scratch_(conn, conn->scratchsize * 2))
+		{
+			return -1;
+		}
+	}
+	if(r)
+	{
+		SET_SYSERR(conn, EINVAL);
+		return -1;
+	}
+	partition = mq_amqp_message_partition_(self);
+	if(partition)
+	{
+		target = target ? target : conn->address;
+		tlen = strlen(target) + strlen(MQ_AMQP_PARTITION_SEP) + strlen(partition) + 1;
+	}
+	else
+	{
+		tlen = target ? strlen(target) + 1 : 0;
+	}
+	entry = (MQAMQPENTRY *) calloc(1, sizeof(MQAMQPENTRY) + tlen);
+	if(!entry || !(entry->data = (char *) malloc(len)))
+	{
+		SET_ERRNO(conn);
+		free(entry);
+		return -1;
+	}
+	memcpy(entry->data, conn->scratch, len);
+	entry->len = entry->size = len;
+	if(partition)
+	{
+		entry->address = (char *) (entry + 1);
+		snprintf(entry->address, tlen, "%s%s%s", target, MQ_AMQP_PARTITION_SEP, partition);
+	}
+	else if(target)
+	{
+		entry->address = (char *) (entry + 1);
+		memcpy(entry->address, target, tlen);
+	}
+	entry->status = MQT_PENDING;
+	entry->refs = MQ_AMQP_LOOP|MQ_AMQP_MESSAGE;
+	if(self->entry)
+	{
+		/* The message is being sent again */
+		mq_amqp_unref_(conn, self->entry, MQ_AMQP_MESSAGE);
+	}
+	self->entry = entry;
+	pthread_mutex_lock(&(conn->conn->lock));
+	if(conn->outtail)
+	{
+		conn->outtail->next = entry;
+	}
+	else
+	{
+		conn->outhead = entry;
+		mq_amqp_kick_(conn->conn);
+	}
+	conn->outtail = entry;
+	conn->outcount++;
+	pthread_mutex_unlock(&(conn->conn->lock));
+	conn->sentseq++;
+	self->seq = conn->sentseq;
+	self->status = MQT_PENDING;
+	if(conn->sentfn && !self->tracked)
+	{
+		self->tracked = 1;
+		self->nextsent = NULL;
+		if(conn->senttail)
+		{
+			conn->senttail->nextsent = self;
+		}
+		else
+		{
+			conn->sent = self;
+		}
+		conn->senttail = self;
+	}
+	return 0;
+}
+
+/* Obtain the connection that a message is associated with */
+static MQ *
+mq_amqp_message_connection_(MQMESSAGE *self)
+{
+	return self->connection;
+}
+
+/* Obtain the delivery status of an outgoing message: once it is outside the
+ * outgoing window, its status is unknown unless it is being tracked for the
+ * sent callback
+ */
+static MQSTATUS
+mq_amqp_message_status_(MQMESSAGE *self)
+{
+	MQ *conn;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(conn, EINVAL);
+		return MQT_UNKNOWN;
+	}
+	if(self->entry)
+	{
+		if(conn->conn)
+		{
+			pthread_mutex_lock(&(conn->conn->lock));
+			self->status = self->entry->status;
+			pthread_mutex_unlock(&(conn->conn->lock));
+		}
+		else
+		{
+			self->status = self->entry->status;
+		}
+	}
+	if(!self->tracked && conn->sentseq - self->seq >= (unsigned long long) conn->outgoing_window)
+	{
+		return MQT_UNKNOWN;
+	}
+	return self->status;
+}
+
+/* Set the content-encoding of an outgoing message */
+static int
+mq_amqp_message_set_encoding_(MQMESSAGE *self, const char *encoding)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING || !self->msg)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return pn_message_set_content_encoding(self->msg, encoding);
+}
+
+/* Retrieve the content-encoding of a message; once the body of an incoming
+ * message has been decoded, it has none
+ */
+static const char *
+mq_amqp_message_encoding_(MQMESSAGE *self)
+{
+	if(!self->msg || self->plain)
+	{
+		return NULL;
+	}
+	return pn_message_get_content_encoding(self->msg);
+}
+
+/* Replace the body of an incoming message with a decoded one, which the
+ * message takes ownership of
+ */
+static int
+mq_amqp_message_replace_body_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_INCOMING || !self->msg || mq_amqp_message_decode_body_(self))
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	if(self->plain && self->plainfree)
+	{
+		self->plainfree(self->plain);
+	}
+	self->plain = buf;
+	self->plainfree = free_fn;
+	self->bytes = pn_bytes(len, (char *) buf);
+	return 0;
+}
+
+/* (Internal) parse an amqp: or amqps: URI, of the form
+ * amqp[s]://[USER[:PASSWORD]@]HOST[:PORT][/ADDRESS]
+ */
+static int
+mq_amqp_parse_(MQ *self, const char *uri)
+{
+	const char *p, *authority, *end, *at, *colon, *host, *hostend;
+
+	p = strchr(uri, ':');
+	if(!p || strncmp(p, "://", 3))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	self->tls = ((size_t) (p - uri) == 5 && !strncasecmp(uri, "amqps", 5));
+	authority = p + 3;
+	end = strchr(authority, '/');
+	if(!end)
+	{
+		end = authority + strlen(authority);
+	}
+	at = NULL;
+	for(p = authority; p < end; p++)
+	{
+		if(*p == '@')
+		{
+			at = p;
+		}
+	}
+	host = at ? at + 1 : authority;
+	if(*host == '[')
+	{
+		/* An IPv6 literal */
+		hostend = strchr(host, ']');
+		if(!hostend || hostend >= end)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		colon = (hostend + 1 < end && hostend[1] == ':') ? hostend + 1 : NULL;
+		host++;
+	}
+	else
+	{
+		colon = memchr(host, ':', end - host);
+		hostend = colon ? colon : end;
+	}
+	if(hostend == host)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	self->uri = strdup(uri);
+	self->key = strndup(uri, end - uri);
+	self->host = strndup(host, hostend - host);
+	self->port = (colon && colon + 1 < end) ? strndup(colon + 1, end - colon - 1) : strdup(self->tls ? MQ_AMQPS_PORT : MQ_AMQP_PORT);
+	self->address = strdup(*end ? end + 1 : "");
+	if(!self->uri || !self->key || !self->host || !self->port || !self->address)
+	{
+		return -1;
+	}
+	if(at)
+	{
+		colon = memchr(authority, ':', at - authority);
+		self->user = strndup(authority, (colon ? colon : at) - authority);
+		self->password = colon ? strndup(colon + 1, at - colon - 1) : NULL;
+		if(!self->user || (colon && !self->password))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* (Internal) attach a connection to the event loop, sharing an existing AMQP
+ * connection if there is one
+ */
+static int
+mq_amqp_connect_(MQ *self, MQSTATE state)
+{
+	if(self->state != MQS_DISCONNECTED)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	self->state = state;
+	if(mq_amqp_loop_attach_(self))
+	{
+		SET_ERRNO(self);
+		self->state = MQS_DISCONNECTED;
+		return -1;
+	}
+	return 0;
+}
+
+/* (Internal) wait up to timeout milliseconds (or indefinitely, if timeout is
+ * negative) until at least one incoming message is waiting; a failure is
+ * reported once any messages which arrived beforehand have been obtained
+ */
+static int
+mq_amqp_wait_(MQ *self, int timeout)
+{
+	MQAMQPCONN *conn;
+	struct timespec deadline;
+	int r;
+
+	if(self->state != MQS_RECV)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	if(self->polled)
+	{
+		timeout = 0;
+	}
+	conn = self->conn;
+	r = 0;
+	pthread_mutex_lock(&(conn->lock));
+	mq_amqp_adapt_(self);
+	if(!self->incount && self->receivers < (self->nsources ? self->nsources : 1) && self->attached)
+	{
+		/* A receiver link failed: ask for it to be attached again */
+		self->attached = 0;
+		mq_amqp_kick_(conn);
+	}
+	if(timeout > 0)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	while(!self->incount)
+	{
+		if(self->failures != self->seenfailures)
+		{
+			self->seenfailures = self->failures;
+			r = mq_amqp_failed_(self);
+			break;
+		}
+		if(!timeout)
+		{
+			SET_SYSERR(self, EAGAIN);
+			r = -1;
+			break;
+		}
+		if(timeout < 0)
+		{
+			pthread_cond_wait(&(self->cond), &(conn->lock));
+		}
+		else if(pthread_cond_timedwait(&(self->cond), &(conn->lock), &deadline) == ETIMEDOUT)
+		{
+			timeout = 0;
+		}
+	}
+	pthread_mutex_unlock(&(conn->lock));
+	return r;
+}
+
+/* (Internal) obtain the next waiting incoming message, decoding it into a
+ * message object
+ */
+static MQMESSAGE *
+mq_amqp_take_(MQ *self)
+{
+	MQAMQPCONN *conn;
+	MQAMQPENTRY *entry;
+	MQMESSAGE *p;
+	uint64_t value;
+
+	conn = self->conn;
+	pthread_mutex_lock(&(conn->lock));
+	entry = self->inhead;
+	if(!entry)
+	{
+		pthread_mutex_unlock(&(conn->lock));
+		SET_SYSERR(self, EAGAIN);
+		return NULL;
+	}
+	self->inhead = entry->next;
+	if(!self->inhead)
+	{
+		self->intail = NULL;
+	}
+	self->incount--;
+	if(!self->incount && self->notifyfd != -1)
+	{
+		if(read(self->notifyfd, &value, sizeof(value)) < 0)
+		{
+			/* It wasn't readable */
+		}
+	}
+	entry->next = NULL;
+	entry->refs = MQ_AMQP_MESSAGE;
+	mq_amqp_flow_check_(self);
+	pthread_mutex_unlock(&(conn->lock));
+	p = mq_amqp_message_construct_(self);
+	if(!p)
+	{
+		/* Release the delivery, so that the message isn't left
+		 * unsettled (and so redelivered) for as long as the
+		 * connection lasts
+		 */
+		mq_amqp_settle_(self, entry, PN_RELEASED);
+		return NULL;
+	}
+	p->kind = MQK_INCOMING;
+	p->entry = entry;
+	if(pn_message_decode(p->msg, entry->data, entry->len))
+	{
+		/* The message can never be processed */
+		mq_amqp_dispose_(p, PN_REJECTED);
+		mq_amqp_message_recycle_(p);
+		SET_SYSERR(self, EBADMSG);
+		return NULL;
+	}
+	/* The entry's buffer is retained until it is settled, so that it can
+	 * be re-used for another message
+	 */
+	return p;
+}
+
+/* (Internal) adjust the credit granted by a connection with adaptive
+ * prefetch, given the number of messages waiting when the application asks
+ * for another: the credit doubles each time the application has consumed
+ * every waiting message, and halves once it has found as many waiting as the
+ * credit on as many successive occasions. The caller must hold the AMQP
+ * connection's lock.
+ */
+static void
+mq_amqp_adapt_(MQ *self)
+{
+	int max;
+
+	if(self->prefetch >= 0)
+	{
+		return;
+	}
+	max = (int) -self->prefetch;
+	if(!self->incount)
+	{
+		self->lagging = 0;
+		self->credit = self->credit > max / 2 ? max : self->credit * 2;
+		mq_amqp_flow_check_(self);
+		return;
+	}
+	if(self->incount < (size_t) self->credit)
+	{
+		self->lagging = 0;
+		return;
+	}
+	self->lagging++;
+	if(self->lagging >= self->credit && self->credit > 1)
+	{
+		self->credit /= 2;
+		self->lagging = 0;
+	}
+}
+
+/* (Internal) ask the event loop to grant more credit if, as far as we know,
+ * the receiver's credit and the messages waiting fall short of the credit to
+ * be granted by half or more. The caller must hold the AMQP connection's lock.
+ */
+static void
+mq_amqp_flow_check_(MQ *self)
+{
+	long deficit;
+
+	if(self->wantflow || self->state != MQS_RECV)
+	{
+		return;
+	}
+	deficit = (long) self->credit - self->linkcredit - (long) self->incount;
+	if(deficit > 0 && (deficit * 2 >= self->credit || !self->linkcredit))
+	{
+		self->wantflow = 1;
+		mq_amqp_kick_(self->conn);
+	}
+}
+
+/* (Internal) request that an incoming message is settled with a particular
+ * disposition; once it has been, there is nothing more to do
+ */
+static int
+mq_amqp_dispose_(MQMESSAGE *self, uint64_t disposition)
+{
+	MQ *conn;
+	MQAMQPENTRY *entry;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	if(self->kind != MQK_INCOMING || !self->msg)
+	{
+		SET_SYSERR(conn, EINVAL);
+		return -1;
+	}
+	entry = self->entry;
+	if(!entry)
+	{
+		return 0;
+	}
+	self->entry = NULL;
+	mq_amqp_settle_(conn, entry, disposition);
+	return 0;
+}
+
+/* (Internal) hand an incoming entry to the event loop, which updates its
+ * delivery with disposition (if non-zero) and settles it
+ */
+static void
+mq_amqp_settle_(MQ *self, MQAMQPENTRY *entry, uint64_t disposition)
+{
+	if(!self->conn)
+	{
+		/* The connection has been closed, so the message will be
+		 * delivered again
+		 */
+		mq_amqp_entry_free_(entry);
+		return;
+	}
+	pthread_mutex_lock(&(self->conn->lock));
+	entry->disposition = disposition;
+	entry->refs = MQ_AMQP_LOOP;
+	entry->next = NULL;
+	if(self->settletail)
+	{
+		self->settletail->next = entry;
+	}
+	else
+	{
+		self->settlehead = entry;
+		mq_amqp_kick_(self->conn);
+	}
+	self->settletail = entry;
+	pthread_mutex_unlock(&(self->conn->lock));
+}
+
+/* (Internal) drop a reference to an entry, freeing it if it was the last */
+static void
+mq_amqp_unref_(MQ *self, MQAMQPENTRY *entry, int ref)
+{
+	int refs;
+
+	if(self->conn)
+	{
+		pthread_mutex_lock(&(self->conn->lock));
+		refs = (entry->refs &= ~ref);
+		pthread_mutex_unlock(&(self->conn->lock));
+	}
+	else
+	{
+		refs = (entry->refs &= ~ref);
+	}
+	if(!refs)
+	{
+		mq_amqp_entry_free_(entry);
+	}
+}
+
+/* (Internal) set the error state of a connection to reflect the most recent
+ * failure of its AMQP connection or links. The caller must hold the AMQP
+ * connection's lock.
+ */
+static int
+mq_amqp_failed_(MQ *self)
+{
+	memcpy(self->errtext, self->failtext, MQ_ERRBUF_LEN);
+	SET_ERROR(self, PN_ERR);
+	return -1;
+}
+
+/* (Internal) invoke the sent callback for each of the tracked messages, in
+ * the order they were sent, whose outcome has become known; a message which
+ * has been freed is recycled once the callback returns
+ */
+static void
+mq_amqp_sent_(MQ *self)
+{
+	MQMESSAGE *head, *p;
+	MQSTATUS status;
+	int released;
+
+	if(!self->sent)
+	{
+		return;
+	}
+	head = NULL;
+	if(self->conn)
+	{
+		pthread_mutex_lock(&(self->conn->lock));
+	}
+	while((p = self->sent) && p->entry->status != MQT_PENDING)
+	{
+		p->status = p->entry->status;
+		self->sent = p->nextsent;
+		head = head ? head : p;
+	}
+	if(!self->sent)
+	{
+		self->senttail = NULL;
+	}
+	if(self->conn)
+	{
+		pthread_mutex_unlock(&(self->conn->lock));
+	}
+	while(head && head != self->sent)
+	{
+		p = head;
+		head = p->nextsent;
+		p->nextsent = NULL;
+		p->tracked = 0;
+		status = p->status;
+		/* If the message hasn't been freed, the callback may free it */
+		released = p->released;
+		if(self->sentfn)
+		{
+			self->sentfn(p, status, self->sentdata);
+		}
+		if(released)
+		{
+			mq_amqp_message_recycle_(p);
+		}
+	}
+}
+
+/* (Internal) stop tracking sent messages when disconnecting: the outcome of
+ * any which remain will never be known
+ */
+static void
+mq_amqp_sent_discard_(MQ *self)
+{
+	MQMESSAGE *p;
+	int released;
+
+	while((p = self->sent))
+	{
+		self->sent = p->nextsent;
+		p->nextsent = NULL;
+		p->tracked = 0;
+		p->status = MQT_UNKNOWN;
+		released = p->released;
+		if(self->sentfn)
+		{
+			self->sentfn(p, MQT_UNKNOWN, self->sentdata);
+		}
+		if(released)
+		{
+			mq_amqp_message_recycle_(p);
+		}
+	}
+	self->senttail = NULL;
+}
+
+/* (Internal) determine the target of a message sent to address: *target is
+ * set to NULL if it is the connection's own address, or otherwise to the
+ * address on the connection's host
+ */
+static int
+mq_amqp_target_(MQ *self, const char *address, const char **target)
+{
+	size_t len;
+
+	*target = NULL;
+	if(!address || !strcmp(address, self->uri))
+	{
+		return 0;
+	}
+	if(strstr(address, "://"))
+	{
+		len = strlen(self->key);
+		if(strncmp(address, self->key, len) || (address[len] && address[len] != '/'))
+		{
+			/* Messages can only be sent to the connection's host */
+			return -1;
+		}
+		address += len + (address[len] ? 1 : 0);
+	}
+	if(strcmp(address, self->address))
+	{
+		*target = address;
+	}
+	return 0;
+}
+
+/* (Internal) ensure that the connection's scratch buffer is at least len
+ * bytes long; it grows geometrically, so that it settles at the size of the
+ * largest message encoded on this connection
+ */
+static int
+mq_amqp_scratch_(MQ *self, size_t len)
+{
+	size_t size;
+	char *p;
+
+	if(len <= self->scratchsize)
+	{
+		return 0;
+	}
+	size = self->scratchsize ? self->scratchsize : 1024;
+	while(size < len)
+	{
+		size *= 2;
+	}
+	p = (char *) realloc(self->scratch, size);
+	if(!p)
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	self->scratch = p;
+	self->scratchsize = size;
+	return 0;
+}
+
+/* (Internal) create a new MQ message object */
+static MQMESSAGE *
+mq_amqp_message_construct_(MQ *self)
+{
+	MQMESSAGE *p;
+
+	if(self->pool)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		p->next = NULL;
+		return p;
+	}
+	p = (MQMESSAGE *) calloc(1, sizeof(MQMESSAGE));
+	if(!p)
+	{
+		SET_ERRNO(self);
+		return NULL;
+	}
+	p->msg = pn_message();
+	if(!p->msg)
+	{
+		SET_ERRNO(self);
+		free(p);
+		return NULL;
+	}
+	p->impl = &mq_amqp_message_impl_;
+	p->connection = self;
+	return p;
+}
+
+/* (Internal) return a message object to the connection's pool, clearing its
+ * pn_message_t for re-use, or destroy it if the pool is full; an incoming
+ * message which is still unsettled is settled first
+ */
+static void
+mq_amqp_message_recycle_(MQMESSAGE *self)
+{
+	MQ *conn;
+	pn_message_t *msg;
+
+	conn = self->connection;
+	free(self->partition);
+	if(self->plain && self->plainfree)
+	{
+		self->plainfree(self->plain);
+	}
+	if(self->entry)
+	{
+		if(self->kind == MQK_INCOMING)
+		{
+			mq_amqp_dispose_(self, 0);
+		}
+		else
+		{
+			mq_amqp_unref_(conn, self->entry, MQ_AMQP_MESSAGE);
+		}
+		self->entry = NULL;
+	}
+	if(conn->poollimit >= 0 && conn->poolcount >= (size_t) conn->poollimit)
+	{
+		pn_message_free(self->msg);
+		free(self);
+		return;
+	}
+	msg = self->msg;
+	pn_message_clear(msg);
+	memset(self, 0, sizeof(MQMESSAGE));
+	self->impl = &mq_amqp_message_impl_;
+	self->connection = conn;
+	self->msg = msg;
+	self->next = conn->pool;
+	conn->pool = self;
+	conn->poolcount++;
+}
+
+/* (Internal) destroy pooled message objects until no more than limit remain */
+static void
+mq_amqp_pool_trim_(MQ *self, size_t limit)
+{
+	MQMESSAGE *p;
+
+	while(self->poolcount > limit)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		pn_message_free(p->msg);
+		free(p);
+	}
+}
+
+/* (Internal) construct message objects and add them to the connection's
+ * pool until it holds count of them (or as many as its limit allows)
+ */
+static void
+mq_amqp_pool_fill_(MQ *self, size_t count)
+{
+	MQMESSAGE *p;
+
+	if(self->poollimit >= 0 && count > (size_t) self->poollimit)
+	{
+		count = (size_t) self->poollimit;
+	}
+	while(self->poolcount < count)
+	{
+		p = (MQMESSAGE *) calloc(1, sizeof(MQMESSAGE));
+		if(!p)
+		{
+			return;
+		}
+		p->msg = pn_message();
+		if(!p->msg)
+		{
+			free(p);
+			return;
+		}
+		p->impl = &mq_amqp_message_impl_;
+		p->connection = self;
+		p->next = self->pool;
+		self->pool = p;
+		self->poolcount++;
+	}
+}
+
+/* (Internal) locate the body of an incoming message, if it hasn't been
+ * already; as messages are recycled, the pn_data_t holding it is re-used
+ */
+static int
+mq_amqp_message_decode_body_(MQMESSAGE *self)
+{
+	if(!self->decoded && self->kind == MQK_INCOMING)
+	{
+		self->decoded = 1;
+		self->body = pn_message_body(self->msg);
+		if(self->body)
+		{
+			pn_data_rewind(self->body);
+			pn_data_next(self->body);
+			self->bytes = pn_data_get_binary(self->body);
+		}
+	}
+	return self->body ? 0 : -1;
+}
+
+/* (Internal) attach a connection to the AMQP connection for its scheme,
+ * user, host and port, starting the event loop and creating the AMQP
+ * connection if necessary
+ */
+static int
+mq_amqp_loop_attach_(MQ *self)
+{
+	struct epoll_event ev;
+	MQAMQPCONN *conn;
+	int e;
+
+	pthread_mutex_lock(&looplock);
+	while(loop.stopping)
+	{
+		pthread_cond_wait(&loopidle, &looplock);
+	}
+	if(!loop.running)
+	{
+		loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+		loop.wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if(loop.epfd == -1 || loop.wakefd == -1 ||
+		   epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.wakefd, &ev) ||
+		   (errno = pthread_create(&(loop.thread), NULL, mq_amqp_loop_thread_, NULL)))
+		{
+			e = errno;
+			if(loop.epfd != -1)
+			{
+				close(loop.epfd);
+			}
+			if(loop.wakefd != -1)
+			{
+				close(loop.wakefd);
+			}
+			pthread_mutex_unlock(&looplock);
+			errno = e;
+			return -1;
+		}
+		loop.stop = 0;
+		loop.running = 1;
+	}
+	for(conn = loop.conns; conn; conn = conn->next)
+	{
+		/* The key includes the user-info, if any */
+		if(!conn->closing && !strcmp(conn->key, self->key))
+		{
+			break;
+		}
+	}
+	if(!conn)
+	{
+		conn = (MQAMQPCONN *) calloc(1, sizeof(MQAMQPCONN));
+		if(conn)
+		{
+			conn->key = strdup(self->key);
+			conn->host = strdup(self->host);
+			conn->port = strdup(self->port);
+			conn->user = self->user ? strdup(self->user) : NULL;
+			conn->password = self->password ? strdup(self->password) : NULL;
+			if(!conn->key || !conn->host || !conn->port ||
+			   (self->user && !conn->user) || (self->password && !conn->password))
+			{
+				mq_amqp_conn_free_(conn);
+				conn = NULL;
+			}
+		}
+		if(!conn)
+		{
+			e = errno;
+			if(!loop.users)
+			{
+				/* Don't leave an idle event loop running */
+				loop.users++;
+				pthread_mutex_unlock(&looplock);
+				mq_amqp_loop_detach_(NULL);
+				errno = e;
+				return -1;
+			}
+			pthread_mutex_unlock(&looplock);
+			errno = e;
+			return -1;
+		}
+		pthread_mutex_init(&(conn->lock), NULL);
+		conn->tls = self->tls;
+		conn->fd = -1;
+		loop.serial++;
+		snprintf(conn->container, sizeof(conn->container), "libmq-%ld-%lu", (long) getpid(), loop.serial);
+		conn->next = loop.conns;
+		loop.conns = conn;
+	}
+	conn->refs++;
+	loop.users++;
+	pthread_mutex_unlock(&looplock);
+	pthread_mutex_lock(&(conn->lock));
+	self->conn = conn;
+	self->attached = 0;
+	self->detaching = 0;
+	self->detached = 0;
+	self->wantflow = 0;
+	self->linkcredit = 0;
+	self->aborted = 0;
+	self->seenfailures = self->failures;
+	self->next = conn->mqs;
+	conn->mqs = self;
+	mq_amqp_kick_(conn);
+	pthread_mutex_unlock(&(conn->lock));
+	return 0;
+}
+
+/* (Internal) drop a connection's reference to its AMQP connection, once the
+ * event loop has detached it, and stop the event loop if it was the last
+ * connection attached to it (self may be NULL to drop a reference to the
+ * event loop alone)
+ */
+static void
+mq_amqp_loop_detach_(MQ *self)
+{
+	uint64_t one;
+
+	pthread_mutex_lock(&looplock);
+	if(self)
+	{
+		self->conn->refs--;
+		self->conn = NULL;
+	}
+	loop.users--;
+	one = 1;
+	if(loop.users)
+	{
+		/* The AMQP connection will be closed if it is now unused */
+		if(write(loop.wakefd, &one, sizeof(one)) < 0)
+		{
+			/* The event loop is already awake */
+		}
+		pthread_mutex_unlock(&looplock);
+		return;
+	}
+	loop.stopping = 1;
+	MQ_ATOMIC_STORE(&(loop.stop), 1);
+	if(write(loop.wakefd, &one, sizeof(one)) < 0)
+	{
+		/* The event loop is already awake */
+	}
+	pthread_mutex_unlock(&looplock);
+	pthread_join(loop.thread, NULL);
+	pthread_mutex_lock(&looplock);
+	close(loop.wakefd);
+	close(loop.epfd);
+	loop.running = 0;
+	loop.stopping = 0;
+	pthread_cond_broadcast(&loopidle);
+	pthread_mutex_unlock(&looplock);
+}
+
+/* (Internal) request a pass of the event loop over an AMQP connection. The
+ * caller must hold the connection's lock.
+ */
+static void
+mq_amqp_kick_(MQAMQPCONN *conn)
+{
+	uint64_t one;
+
+	if(conn->kick)
+	{
+		return;
+	}
+	conn->kick = 1;
+	one = 1;
+	if(write(loop.wakefd, &one, sizeof(one)) < 0)
+	{
+		/* The event loop is already awake */
+	}
+}
+
+/* (Internal) the event loop thread */
+static void *
+mq_amqp_loop_thread_(void *arg)
+{
+	struct epoll_event ev[MQ_AMQP_MAXEVENTS];
+	uint64_t value;
+	int n, i, timeout;
+
+	(void) arg;
+
+	timeout = 0;
+	while(!MQ_ATOMIC_LOAD(&(loop.stop)))
+	{
+		n = epoll_wait(loop.epfd, ev, MQ_AMQP_MAXEVENTS, timeout);
+		for(i = 0; i < n; i++)
+		{
+			if(!ev[i].data.ptr)
+			{
+				if(read(loop.wakefd, &value, sizeof(value)) < 0)
+				{
+					/* Woken spuriously */
+				}
+				continue;
+			}
+			mq_amqp_conn_io_((MQAMQPCONN *) ev[i].data.ptr, ev[i].events);
+		}
+		timeout = mq_amqp_loop_service_();
+	}
+	mq_amqp_loop_shutdown_();
+	return NULL;
+}
+
+/* (Internal) make a pass over every AMQP connection, closing those which are
+ * no longer used, (re-)establishing those which need it, and servicing any
+ * requests made of those which are active; returns the time in milliseconds
+ * until the event loop must next make a pass (or -1 if there's no need)
+ */
+static int
+mq_amqp_loop_service_(void)
+{
+	MQAMQPCONN *conn, **prev;
+	unsigned long long now, next;
+	int kick;
+
+	now = mq_amqp_now_();
+	next = 0;
+	pthread_mutex_lock(&looplock);
+	for(prev = &(loop.conns); (conn = *prev); )
+	{
+		if(!conn->refs && !conn->closing)
+		{
+			conn->closing = 1;
+			conn->retry = now + MQ_AMQP_CLOSE_TIMEOUT;
+			if(conn->active)
+			{
+				pthread_mutex_lock(&(conn->lock));
+				pn_connection_close(conn->driver.connection);
+				pthread_mutex_unlock(&(conn->lock));
+				mq_amqp_conn_run_(conn);
+			}
+		}
+		if(conn->closing && conn->active && now >= conn->retry)
+		{
+			/* The peer hasn't responded */
+			mq_amqp_conn_stop_(conn);
+		}
+		if(conn->closing && !conn->active)
+		{
+			*prev = conn->next;
+			mq_amqp_conn_free_(conn);
+			continue;
+		}
+		prev = &(conn->next);
+		if(!conn->active && !conn->closing && now >= conn->retry)
+		{
+			if(mq_amqp_conn_start_(conn))
+			{
+				mq_amqp_conn_fail_(conn, NULL);
+			}
+		}
+		if(conn->active)
+		{
+			pthread_mutex_lock(&(conn->lock));
+			kick = conn->kick;
+			pthread_mutex_unlock(&(conn->lock));
+			if(kick || (conn->deadline && (unsigned long long) conn->deadline <= now))
+			{
+				mq_amqp_conn_run_(conn);
+			}
+		}
+		else
+		{
+			/* There may be requests (such as to detach) which don't
+			 * need the AMQP connection to be active
+			 */
+			pthread_mutex_lock(&(conn->lock));
+			conn->kick = 0;
+			mq_amqp_conn_service_(conn);
+			pthread_mutex_unlock(&(conn->lock));
+		}
+		if(conn->active && conn->deadline)
+		{
+			if(!next || (unsigned long long) conn->deadline < next)
+			{
+				next = (unsigned long long) conn->deadline;
+			}
+		}
+		if(!conn->active || conn->closing)
+		{
+			if(!next || conn->retry < next)
+			{
+				next = conn->retry;
+			}
+		}
+	}
+	pthread_mutex_unlock(&looplock);
+	if(!next)
+	{
+		return -1;
+	}
+	return next > now ? (next - now > INT_MAX ? INT_MAX : (int) (next - now)) : 0;
+}
+
+/* (Internal) close and free every AMQP connection as the event loop stops;
+ * as no connection is attached to any of them by now, nothing waits for them
+ * to close cleanly
+ */
+static void
+mq_amqp_loop_shutdown_(void)
+{
+	MQAMQPCONN *conn;
+
+	pthread_mutex_lock(&looplock);
+	while((conn = loop.conns))
+	{
+		loop.conns = conn->next;
+		if(conn->active)
+		{
+			pn_connection_close(conn->driver.connection);
+			mq_amqp_conn_run_(conn);
+			mq_amqp_conn_stop_(conn);
+		}
+		mq_amqp_conn_free_(conn);
+	}
+	pthread_mutex_unlock(&looplock);
+}
+
+/* (Internal) begin establishing an AMQP connection: the socket connects in
+ * the background, and the connection, session and the links of every
+ * attached MQ connection are opened immediately, so that the frames to do so
+ * are sent as soon as it has
+ */
+static int
+mq_amqp_conn_start_(MQAMQPCONN *conn)
+{
+	struct addrinfo hints, *res, *ai;
+	struct epoll_event ev;
+	pn_transport_t *transport;
+	pn_ssl_domain_t *domain;
+	pn_sasl_t *sasl;
+	pn_ssl_t *ssl;
+	MQ *mq;
+	int fd, r, one;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	res = NULL;
+	if((r = getaddrinfo(conn->host, conn->port, &hints, &res)))
+	{
+		pthread_mutex_lock(&(conn->lock));
+		snprintf(conn->condition, sizeof(conn->condition), "%s:%s: %s", conn->host, conn->port, gai_strerror(r));
+		pthread_mutex_unlock(&(conn->lock));
+		return -1;
+	}
+	fd = -1;
+	for(ai = res; ai; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, ai->ai_protocol);
+		if(fd == -1)
+		{
+			continue;
+		}
+		if(!connect(fd, ai->ai_addr, ai->ai_addrlen) || errno == EINPROGRESS)
+		{
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if(fd == -1)
+	{
+		pthread_mutex_lock(&(conn->lock));
+		snprintf(conn->condition, sizeof(conn->condition), "%s:%s: %s", conn->host, conn->port, strerror(errno));
+		pthread_mutex_unlock(&(conn->lock));
+		return -1;
+	}
+	one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	transport = pn_transport();
+	if(!transport)
+	{
+		close(fd);
+		return -1;
+	}
+	sasl = pn_sasl(transport);
+	if(conn->user)
+	{
+		/* PLAIN may be used over an unencrypted connection, as
+		 * Messenger allows
+		 */
+		pn_sasl_set_allow_insecure_mechs(sasl, true);
+	}
+	if(conn->tls)
+	{
+		domain = pn_ssl_domain(PN_SSL_MODE_CLIENT);
+		ssl = domain ? pn_ssl(transport) : NULL;
+		r = (ssl ? pn_ssl_init(ssl, domain, NULL) : -1);
+		if(domain)
+		{
+			/* The transport retains its own reference */
+			pn_ssl_domain_free(domain);
+		}
+		if(r || pn_ssl_set_peer_hostname(ssl, conn->host))
+		{
+			pn_transport_free(transport);
+			close(fd);
+			return -1;
+		}
+	}
+	if(pn_connection_driver_init(&(conn->driver), NULL, transport))
+	{
+		pn_transport_free(transport);
+		close(fd);
+		return -1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN|EPOLLOUT;
+	ev.data.ptr = conn;
+	if(epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev))
+	{
+		pn_connection_driver_destroy(&(conn->driver));
+		close(fd);
+		return -1;
+	}
+	conn->fd = fd;
+	conn->events = ev.events;
+	conn->active = 1;
+	conn->connecting = 1;
+	conn->deadline = 0;
+	pthread_mutex_lock(&(conn->lock));
+	pn_connection_set_container(conn->driver.connection, conn->container);
+	pn_connection_set_hostname(conn->driver.connection, conn->host);
+	if(conn->user)
+	{
+		pn_connection_set_user(conn->driver.connection, conn->user);
+		if(conn->password)
+		{
+			pn_connection_set_password(conn->driver.connection, conn->password);
+		}
+	}
+	pn_connection_open(conn->driver.connection);
+	conn->session = pn_session(conn->driver.connection);
+	pn_session_open(conn->session);
+	for(mq = conn->mqs; mq; mq = mq->next)
+	{
+		/* Each connection's links are attached by the next pass */
+		mq->attached = 0;
+	}
+	conn->kick = 1;
+	pthread_mutex_unlock(&(conn->lock));
+	return 0;
+}
+
+/* (Internal) tear down an active AMQP connection */
+static void
+mq_amqp_conn_stop_(MQAMQPCONN *conn)
+{
+	MQ *mq;
+
+	epoll_ctl(loop.epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	conn->fd = -1;
+	pthread_mutex_lock(&(conn->lock));
+	for(mq = conn->mqs; mq; mq = mq->next)
+	{
+		/* Deliveries belong to the connection, which is about to be
+		 * freed
+		 */
+		mq_amqp_abort_(mq, NULL, MQT_ABORTED);
+		mq_amqp_links_free_(mq);
+	}
+	conn->generation++;
+	conn->session = NULL;
+	pthread_mutex_unlock(&(conn->lock));
+	pn_connection_driver_destroy(&(conn->driver));
+	conn->active = 0;
+	conn->connecting = 0;
+	conn->deadline = 0;
+}
+
+/* (Internal) note the failure of an AMQP connection (or of an attempt to
+ * establish one), notifying every connection attached to it, and schedule
+ * the next attempt
+ */
+static void
+mq_amqp_conn_fail_(MQAMQPCONN *conn, const char *reason)
+{
+	MQ *mq;
+
+	conn->backoff = conn->backoff ? (conn->backoff * 2 > MQ_AMQP_BACKOFF ? MQ_AMQP_BACKOFF : conn->backoff * 2) : 1;
+	conn->retry = mq_amqp_now_() + ((unsigned long long) conn->backoff * 1000);
+	pthread_mutex_lock(&(conn->lock));
+	if(reason)
+	{
+		snprintf(conn->condition, sizeof(conn->condition), "%s", reason);
+	}
+	if(!conn->condition[0])
+	{
+		snprintf(conn->condition, sizeof(conn->condition), "%s:%s: connection failed", conn->host, conn->port);
+	}
+	for(mq = conn->mqs; mq; mq = mq->next)
+	{
+		mq->failures++;
+		memcpy(mq->failtext, conn->condition, MQ_ERRBUF_LEN);
+		MQ_STATS_ADD(&(mq->common), backoffs, 1);
+		mq_amqp_notify_(mq);
+		pthread_cond_broadcast(&(mq->cond));
+	}
+	conn->condition[0] = 0;
+	pthread_mutex_unlock(&(conn->lock));
+}
+
+/* (Internal) free an AMQP connection which isn't active */
+static void
+mq_amqp_conn_free_(MQAMQPCONN *conn)
+{
+	if(conn->key && conn->host && conn->port)
+	{
+		/* Otherwise, the lock was never initialised */
+		pthread_mutex_destroy(&(conn->lock));
+	}
+	free(conn->key);
+	free(conn->host);
+	free(conn->port);
+	free(conn->user);
+	free(conn->password);
+	free(conn);
+}
+
+/* (Internal) handle readiness of an AMQP connection's socket */
+static void
+mq_amqp_conn_io_(MQAMQPCONN *conn, uint32_t events)
+{
+	socklen_t len;
+	int e;
+
+	if(!conn->active)
+	{
+		return;
+	}
+	if(conn->connecting)
+	{
+		if(!(events & (EPOLLOUT|EPOLLERR|EPOLLHUP)))
+		{
+			return;
+		}
+		e = 0;
+		len = sizeof(e);
+		if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &e, &len) || e)
+		{
+			pthread_mutex_lock(&(conn->lock));
+			snprintf(conn->condition, sizeof(conn->condition), "%s:%s: %s", conn->host, conn->port, strerror(e ? e : errno));
+			pthread_mutex_unlock(&(conn->lock));
+			mq_amqp_conn_stop_(conn);
+			if(!conn->closing)
+			{
+				mq_amqp_conn_fail_(conn, NULL);
+			}
+			return;
+		}
+		conn->connecting = 0;
+	}
+	if(events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+	{
+		mq_amqp_conn_read_(conn);
+	}
+	mq_amqp_conn_run_(conn);
+}
+
+/* (Internal) service an active AMQP connection's requests and handle its
+ * events until there are none, writing whatever can be written; once both
+ * directions have closed, the connection is torn down
+ */
+static void
+mq_amqp_conn_run_(MQAMQPCONN *conn)
+{
+	struct epoll_event ev;
+	pn_event_t *event;
+	pn_rwbytes_t rbuf;
+	pn_bytes_t wbuf;
+	uint32_t events;
+
+	conn->deadline = pn_connection_driver_tick(&(conn->driver), (pn_timestamp_t) mq_amqp_now_());
+	do
+	{
+		pthread_mutex_lock(&(conn->lock));
+		conn->kick = 0;
+		mq_amqp_conn_service_(conn);
+		while((event = pn_connection_driver_next_event(&(conn->driver))))
+		{
+			mq_amqp_conn_event_(conn, event);
+		}
+		pthread_mutex_unlock(&(conn->lock));
+		if(!conn->connecting)
+		{
+			mq_amqp_conn_write_(conn);
+		}
+	}
+	while(pn_connection_driver_has_event(&(conn->driver)));
+	if(pn_connection_driver_finished(&(conn->driver)))
+	{
+		mq_amqp_conn_stop_(conn);
+		if(!conn->closing)
+		{
+			mq_amqp_conn_fail_(conn, NULL);
+		}
+		return;
+	}
+	events = 0;
+	rbuf = pn_connection_driver_read_buffer(&(conn->driver));
+	if(rbuf.size)
+	{
+		events |= EPOLLIN;
+	}
+	wbuf = pn_connection_driver_write_buffer(&(conn->driver));
+	if(conn->connecting || wbuf.size)
+	{
+		events |= EPOLLOUT;
+	}
+	if(events != conn->events)
+	{
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.ptr = conn;
+		if(!epoll_ctl(loop.epfd, EPOLL_CTL_MOD, conn->fd, &ev))
+		{
+			conn->events = events;
+		}
+	}
+}
+
+/* (Internal) read whatever is available from an AMQP connection's socket */
+static void
+mq_amqp_conn_read_(MQAMQPCONN *conn)
+{
+	pn_rwbytes_t buf;
+	ssize_t n;
+
+	for(;;)
+	{
+		buf = pn_connection_driver_read_buffer(&(conn->driver));
+		if(!buf.size)
+		{
+			return;
+		}
+		n = recv(conn->fd, buf.start, buf.size, 0);
+		if(n > 0)
+		{
+			pn_connection_driver_read_done(&(conn->driver), (size_t) n);
+			if((size_t) n < buf.size)
+			{
+				return;
+			}
+			continue;
+		}
+		if(!n)
+		{
+			pn_connection_driver_read_close(&(conn->driver));
+			return;
+		}
+		if(errno == EINTR)
+		{
+			continue;
+		}
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			pn_connection_driver_errorf(&(conn->driver), "proton:io", "%s:%s: %s", conn->host, conn->port, strerror(errno));
+			pn_connection_driver_read_close(&(conn->driver));
+		}
+		return;
+	}
+}
+
+/* (Internal) write as much as possible to an AMQP connection's socket */
+static void
+mq_amqp_conn_write_(MQAMQPCONN *conn)
+{
+	pn_bytes_t buf;
+	ssize_t n;
+
+	for(;;)
+	{
+		buf = pn_connection_driver_write_buffer(&(conn->driver));
+		if(!buf.size)
+		{
+			return;
+		}
+		n = send(conn->fd, buf.start, buf.size, MSG_NOSIGNAL);
+		if(n >= 0)
+		{
+			pn_connection_driver_write_done(&(conn->driver), (size_t) n);
+			continue;
+		}
+		if(errno == EINTR)
+		{
+			continue;
+		}
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			pn_connection_driver_errorf(&(conn->driver), "proton:io", "%s:%s: %s", conn->host, conn->port, strerror(errno));
+			pn_connection_driver_write_close(&(conn->driver));
+		}
+		return;
+	}
+}
+
+/* (Internal) act on the requests made of an AMQP connection by the MQ
+ * connections attached to it. The caller must hold the connection's lock.
+ */
+static void
+mq_amqp_conn_service_(MQAMQPCONN *conn)
+{
+	MQAMQPENTRY *entry;
+	MQ *mq, **prev;
+
+	for(prev = &(conn->mqs); (mq = *prev); )
+	{
+		if(mq->detaching)
+		{
+			*prev = mq->next;
+			mq_amqp_detach_(conn, mq);
+			continue;
+		}
+		prev = &(mq->next);
+		while((entry = mq->settlehead))
+		{
+			mq->settlehead = entry->next;
+			if(conn->session && entry->generation == conn->generation)
+			{
+				if(entry->disposition)
+				{
+					pn_delivery_update(entry->delivery, entry->disposition);
+				}
+				pn_delivery_settle(entry->delivery);
+			}
+			mq_amqp_entry_recycle_(mq, entry);
+		}
+		mq->settletail = NULL;
+		if(!conn->session)
+		{
+			continue;
+		}
+		if(!mq->attached)
+		{
+			mq->attached = 1;
+			if(mq->state == MQS_RECV)
+			{
+				mq_amqp_receivers_(conn, mq);
+			}
+		}
+		if(mq->outhead)
+		{
+			mq_amqp_send_(conn, mq);
+		}
+		if(mq->wantflow)
+		{
+			mq_amqp_flow_(mq);
+		}
+	}
+}
+
+/* (Internal) handle an event on an AMQP connection. The caller must hold the
+ * connection's lock.
+ */
+static void
+mq_amqp_conn_event_(MQAMQPCONN *conn, pn_event_t *event)
+{
+	MQAMQPLINK *ml;
+	pn_link_t *link;
+	pn_delivery_t *delivery;
+	char reason[MQ_ERRBUF_LEN];
+
+	switch(pn_event_type(event))
+	{
+	case PN_CONNECTION_REMOTE_OPEN:
+		/* The connection has been established successfully */
+		conn->backoff = 0;
+		break;
+	case PN_CONNECTION_REMOTE_CLOSE:
+		mq_amqp_condition_(conn, pn_connection_remote_condition(pn_event_connection(event)), conn->condition);
+		pn_connection_close(pn_event_connection(event));
+		break;
+	case PN_LINK_REMOTE_CLOSE:
+	case PN_LINK_REMOTE_DETACH:
+		link = pn_event_link(event);
+		ml = (MQAMQPLINK *) pn_link_get_context(link);
+		if(ml)
+		{
+			/* The peer has detached a link we didn't ask it to, such
+			 * as one to an address which doesn't exist
+			 */
+			reason[0] = 0;
+			mq_amqp_condition_(conn, pn_link_remote_condition(link), reason);
+			mq_amqp_link_close_(conn, ml, reason);
+		}
+		else if(pn_link_state(link) & PN_LOCAL_ACTIVE)
+		{
+			pn_link_close(link);
+		}
+		break;
+	case PN_LINK_FLOW:
+		link = pn_event_link(event);
+		ml = (MQAMQPLINK *) pn_link_get_context(link);
+		if(ml && pn_link_is_sender(link) && ml->owner->outhead)
+		{
+			mq_amqp_send_(conn, ml->owner);
+		}
+		break;
+	case PN_DELIVERY:
+		delivery = pn_event_delivery(event);
+		link = pn_delivery_link(delivery);
+		if(pn_link_is_receiver(link))
+		{
+			mq_amqp_received_(conn, link, delivery);
+		}
+		else if(pn_delivery_updated(delivery))
+		{
+			mq_amqp_updated_(delivery);
+		}
+		break;
+	case PN_TRANSPORT_CLOSED:
+		if(!conn->condition[0])
+		{
+			mq_amqp_condition_(conn, pn_transport_condition(pn_event_transport(event)), conn->condition);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* (Internal) describe an AMQP error condition, if one is set */
+static void
+mq_amqp_condition_(MQAMQPCONN *conn, pn_condition_t *condition, char *buf)
+{
+	const char *desc;
+
+	if(!condition || !pn_condition_is_set(condition))
+	{
+		return;
+	}
+	desc = pn_condition_get_description(condition);
+	snprintf(buf, MQ_ERRBUF_LEN, "%s:%s: %s%s%s", conn->host, conn->port, pn_condition_get_name(condition), desc ? ": " : "", desc ? desc : "");
+}
+
+/* (Internal) detach an MQ connection from its AMQP connection: its links are
+ * closed, incoming messages which the application hasn't obtained are
+ * released, and the event loop drops its references to any outgoing
+ * messages. The caller must hold the connection's lock.
+ */
+static void
+mq_amqp_detach_(MQAMQPCONN *conn, MQ *mq)
+{
+	MQAMQPENTRY *entry;
+	MQAMQPLINK *ml;
+
+	while((entry = mq->settlehead))
+	{
+		mq->settlehead = entry->next;
+		if(conn->session && entry->generation == conn->generation)
+		{
+			if(entry->disposition)
+			{
+				pn_delivery_update(entry->delivery, entry->disposition);
+			}
+			pn_delivery_settle(entry->delivery);
+		}
+		mq_amqp_entry_free_(entry);
+	}
+	mq->settletail = NULL;
+	while((entry = mq->spare))
+	{
+		mq->spare = entry->next;
+		mq_amqp_entry_free_(entry);
+	}
+	mq->sparecount = 0;
+	while((entry = mq->inhead))
+	{
+		mq->inhead = entry->next;
+		if(conn->session && entry->generation == conn->generation)
+		{
+			pn_delivery_update(entry->delivery, PN_RELEASED);
+			pn_delivery_settle(entry->delivery);
+		}
+		mq_amqp_entry_free_(entry);
+	}
+	mq->intail = NULL;
+	mq->incount = 0;
+	mq_amqp_abort_(mq, NULL, MQT_UNKNOWN);
+	while((entry = mq->outhead))
+	{
+		mq->outhead = entry->next;
+		entry->status = MQT_UNKNOWN;
+		entry->refs &= ~MQ_AMQP_LOOP;
+		if(!entry->refs)
+		{
+			mq_amqp_entry_free_(entry);
+		}
+	}
+	mq->outtail = NULL;
+	mq->outcount = 0;
+	for(ml = mq->links; ml && conn->session; ml = ml->next)
+	{
+		pn_link_set_context(ml->link, NULL);
+		pn_link_close(ml->link);
+	}
+	mq_amqp_links_free_(mq);
+	mq->next = NULL;
+	mq->detached = 1;
+	pthread_cond_broadcast(&(mq->cond));
+}
+
+/* (Internal) set the addresses which a connection's receivers receive from
+ * to those of a set of partitions (or, if count is zero, to that of the
+ * connection's own partition, if it has one), and ask for the receivers of a
+ * receiving connection to be re-attached accordingly
+ */
+static int
+mq_amqp_sources_(MQ *self, const char *const *partitions, size_t count)
+{
+	char **sources, **prev;
+	size_t c, len, nprev;
+
+	if(!count && self->partition)
+	{
+		partitions = (const char *const *) &(self->partition);
+		count = 1;
+	}
+	sources = NULL;
+	if(count)
+	{
+		sources = (char **) calloc(count, sizeof(char *));
+		if(!sources)
+		{
+			return -1;
+		}
+	}
+	for(c = 0; c < count; c++)
+	{
+		len = strlen(self->address) + strlen(MQ_AMQP_PARTITION_SEP) + strlen(partitions[c]) + 1;
+		sources[c] = (char *) malloc(len);
+		if(!sources[c])
+		{
+			mq_amqp_sources_free_(sources, c);
+			return -1;
+		}
+		snprintf(sources[c], len, "%s%s%s", self->address, MQ_AMQP_PARTITION_SEP, partitions[c]);
+	}
+	if(self->conn)
+	{
+		pthread_mutex_lock(&(self->conn->lock));
+	}
+	prev = self->sources;
+	nprev = self->nsources;
+	self->sources = sources;
+	self->nsources = count;
+	if(self->conn)
+	{
+		if(self->state == MQS_RECV)
+		{
+			self->attached = 0;
+			mq_amqp_kick_(self->conn);
+		}
+		pthread_mutex_unlock(&(self->conn->lock));
+	}
+	mq_amqp_sources_free_(prev, nprev);
+	return 0;
+}
+
+/* (Internal) free a set of source addresses */
+static void
+mq_amqp_sources_free_(char **sources, size_t count)
+{
+	size_t c;
+
+	for(c = 0; c < count; c++)
+	{
+		free(sources[c]);
+	}
+	free(sources);
+}
+
+/* (Internal) open a sender or receiver link on behalf of an MQ connection,
+ * to or from the given address (or, if it's NULL, the connection's own). The
+ * caller must hold the connection's lock.
+ */
+static MQAMQPLINK *
+mq_amqp_link_open_(MQAMQPCONN *conn, MQ *mq, const char *address, int sender)
+{
+	MQAMQPLINK *ml;
+	char name[96];
+
+	ml = (MQAMQPLINK *) calloc(1, sizeof(MQAMQPLINK));
+	if(!ml)
+	{
+		return NULL;
+	}
+	if(address && !(ml->address = strdup(address)))
+	{
+		free(ml);
+		return NULL;
+	}
+	conn->links++;
+	snprintf(name, sizeof(name), "%s-%lu", conn->container, conn->links);
+	ml->owner = mq;
+	if(sender)
+	{
+		ml->link = pn_sender(conn->session, name);
+		pn_terminus_set_address(pn_link_target(ml->link), address ? address : mq->address);
+	}
+	else
+	{
+		ml->link = pn_receiver(conn->session, name);
+		pn_terminus_set_address(pn_link_source(ml->link), address ? address : mq->address);
+		ml->receiver = 1;
+		mq->receivers++;
+	}
+	pn_link_set_context(ml->link, ml);
+	pn_link_open(ml->link);
+	ml->next = mq->links;
+	mq->links = ml;
+	return ml;
+}
+
+/* (Internal) close a link which the peer has detached, and note its failure:
+ * outgoing messages which were in flight over it are aborted. The caller must
+ * hold the connection's lock.
+ */
+static void
+mq_amqp_link_close_(MQAMQPCONN *conn, MQAMQPLINK *ml, const char *reason)
+{
+	MQ *mq;
+
+	mq = ml->owner;
+	mq_amqp_link_drop_(mq, ml);
+	mq->failures++;
+	if(reason[0])
+	{
+		memcpy(mq->failtext, reason, MQ_ERRBUF_LEN);
+	}
+	else
+	{
+		snprintf(mq->failtext, MQ_ERRBUF_LEN, "%s:%s: link detached", conn->host, conn->port);
+	}
+	mq_amqp_notify_(mq);
+	pthread_cond_broadcast(&(mq->cond));
+}
+
+/* (Internal) close one of an MQ connection's links and free its record:
+ * outgoing messages which were in flight over it are aborted, and incoming
+ * messages which arrive over it from now on are released. The caller must
+ * hold the connection's lock.
+ */
+static void
+mq_amqp_link_drop_(MQ *mq, MQAMQPLINK *ml)
+{
+	MQAMQPLINK **prev;
+
+	mq_amqp_abort_(mq, ml, MQT_ABORTED);
+	pn_link_set_context(ml->link, NULL);
+	pn_link_close(ml->link);
+	for(prev = &(mq->links); *prev != ml; prev = &((*prev)->next));
+	*prev = ml->next;
+	if(ml->receiver)
+	{
+		mq->receivers--;
+		mq->linkcredit -= pn_link_credit(ml->link);
+		if(mq->linkcredit < 0)
+		{
+			mq->linkcredit = 0;
+		}
+	}
+	if(ml->partial)
+	{
+		mq_amqp_entry_free_(ml->partial);
+	}
+	free(ml->address);
+	free(ml);
+}
+
+/* (Internal) free an MQ connection's link records (but not the links, which
+ * belong to the AMQP connection). The caller must hold the connection's lock.
+ */
+static void
+mq_amqp_links_free_(MQ *mq)
+{
+	MQAMQPLINK *ml;
+
+	while((ml = mq->links))
+	{
+		mq->links = ml->next;
+		if(ml->partial)
+		{
+			mq_amqp_entry_free_(ml->partial);
+		}
+		free(ml->address);
+		free(ml);
+	}
+	mq->receivers = 0;
+	mq->linkcredit = 0;
+}
+
+/* (Internal) transfer as many queued outgoing messages as the credit of the
+ * links they are sent over allows; messages are transferred in the order
+ * they were sent. The caller must hold the connection's lock.
+ */
+static void
+mq_amqp_send_(MQAMQPCONN *conn, MQ *mq)
+{
+	MQAMQPENTRY *entry;
+	MQAMQPLINK *ml;
+	pn_delivery_t *delivery;
+
+	while((entry = mq->outhead))
+	{
+		for(ml = mq->links; ml; ml = ml->next)
+		{
+			if(!ml->receiver &&
+			   (entry->address ? (ml->address && !strcmp(ml->address, entry->address)) : !ml->address))
+			{
+				break;
+			}
+		}
+		if(!ml && !(ml = mq_amqp_link_open_(conn, mq, entry->address, 1)))
+		{
+			return;
+		}
+		if(pn_link_credit(ml->link) <= 0)
+		{
+			/* Sending resumes when credit is granted */
+			return;
+		}
+		conn->tag++;
+		delivery = pn_delivery(ml->link, pn_dtag((const char *) &(conn->tag), sizeof(conn->tag)));
+		pn_link_send(ml->link, entry->data, entry->len);
+		pn_link_advance(ml->link);
+		mq->outhead = entry->next;
+		if(!mq->outhead)
+		{
+			mq->outtail = NULL;
+		}
+		mq->outcount--;
+		/* The link has its own copy of the message */
+		free(entry->data);
+		entry->data = NULL;
+		entry->generation = conn->generation;
+		entry->link = ml;
+		entry->prev = NULL;
+		entry->next = mq->inflight;
+		if(mq->inflight)
+		{
+			mq->inflight->prev = entry;
+		}
+		mq->inflight = entry;
+		mq->unsettled++;
+		entry->delivery = delivery;
+		pn_delivery_set_context(delivery, entry);
+	}
+	pthread_cond_broadcast(&(mq->cond));
+}
+
+/* (Internal) grant each receiver more credit if its credit and its share of
+ * the messages waiting fall short of its share of the credit to be granted by
+ * half or more (or if it has none, and none are waiting); the credit is
+ * divided evenly between the receivers, each having at least one. The caller
+ * must hold the connection's lock.
+ */
+static void
+mq_amqp_flow_(MQ *mq)
+{
+	MQAMQPLINK *ml;
+	long deficit, target, waiting;
+	int credit;
+
+	mq->wantflow = 0;
+	mq->linkcredit = 0;
+	if(!mq->receivers)
+	{
+		return;
+	}
+	target = (long) mq->credit / (long) mq->receivers;
+	if(target < 1)
+	{
+		target = 1;
+	}
+	waiting = (long) (mq->incount / mq->receivers);
+	for(ml = mq->links; ml; ml = ml->next)
+	{
+		if(!ml->receiver)
+		{
+			continue;
+		}
+		credit = pn_link_credit(ml->link);
+		deficit = target - credit - waiting;
+		if(deficit > 0 && (deficit * 2 >= target || !credit))
+		{
+			pn_link_flow(ml->link, (int) deficit);
+		}
+		mq->linkcredit += pn_link_credit(ml->link);
+	}
+}
+
+/* (Internal) attach a receiver from each of an MQ connection's sources which
+ * doesn't have one, and detach those from addresses which are no longer
+ * among them. The caller must hold the connection's lock.
+ */
+static void
+mq_amqp_receivers_(MQAMQPCONN *conn, MQ *mq)
+{
+	MQAMQPLINK *ml, *next;
+	size_t c, count;
+	const char *source;
+
+	count = mq->nsources ? mq->nsources : 1;
+	for(ml = mq->links; ml; ml = next)
+	{
+		next = ml->next;
+		if(!ml->receiver)
+		{
+			continue;
+		}
+		for(c = 0; c < count; c++)
+		{
+			source = mq->nsources ? mq->sources[c] : mq->address;
+			if(!strcmp(ml->address, source))
+			{
+				break;
+			}
+		}
+		if(c == count)
+		{
+			mq_amqp_link_drop_(mq, ml);
+		}
+	}
+	for(c = 0; c < count; c++)
+	{
+		source = mq->nsources ? mq->sources[c] : mq->address;
+		for(ml = mq->links; ml; ml = ml->next)
+		{
+			if(ml->receiver && !strcmp(ml->address, source))
+			{
+				break;
+			}
+		}
+		if(!ml)
+		{
+			mq_amqp_link_open_(conn, mq, source, 0);
+		}
+	}
+	mq->wantflow = 1;
+}
+
+/* (Internal) read an incoming message: once its transfer is complete, it is
+ * queued for the application. The caller must hold the connection's lock.
+ */
+static void
+mq_amqp_received_(MQAMQPCONN *conn, pn_link_t *link, pn_delivery_t *delivery)
+{
+	MQAMQPLINK *ml;
+	MQAMQPENTRY *entry;
+	MQ *mq;
+	size_t pending, size;
+	ssize_t n;
+	char *p, discard[512];
+
+	if(!pn_delivery_readable(delivery))
+	{
+		return;
+	}
+	ml = (MQAMQPLINK *) pn_link_get_context(link);
+	if(!ml)
+	{
+		/* The link has been detached: discard the message, and release
+		 * it once it has been transferred
+		 */
+		while(pn_link_recv(link, discard, sizeof(discard)) > 0);
+		if(!pn_delivery_partial(delivery))
+		{
+			pn_delivery_update(delivery, PN_RELEASED);
+			pn_delivery_settle(delivery);
+		}
+		return;
+	}
+	mq = ml->owner;
+	entry = ml->partial;
+	if(!entry)
+	{
+		entry = mq_amqp_entry_get_(mq);
+		if(!entry)
+		{
+			/* Leave it to be read when there's another event */
+			return;
+		}
+		ml->partial = entry;
+	}
+	while((pending = pn_delivery_pending(delivery)))
+	{
+		if(entry->len + pending > entry->size)
+		{
+			for(size = entry->size ? entry->size : 1024; size < entry->len + pending; size *= 2);
+			p = (char *) realloc(entry->data, size);
+			if(!p)
+			{
+				return;
+			}
+			entry->data = p;
+			entry->size = size;
+		}
+		n = pn_link_recv(link, entry->data + entry->len, pending);
+		if(n <= 0)
+		{
+			break;
+		}
+		entry->len += (size_t) n;
+	}
+	if(pn_delivery_partial(delivery))
+	{
+		return;
+	}
+	ml->partial = NULL;
+	pn_link_advance(link);
+	entry->delivery = delivery;
+	entry->generation = conn->generation;
+	entry->refs = MQ_AMQP_LOOP;
+	if(mq->intail)
+	{
+		mq->intail->next = entry;
+	}
+	else
+	{
+		mq->inhead = entry;
+	}
+	mq->intail = entry;
+	mq->incount++;
+	if(mq->linkcredit > 0)
+	{
+		mq->linkcredit--;
+	}
+	if(mq->incount == 1)
+	{
+		mq_amqp_notify_(mq);
+		pthread_cond_broadcast(&(mq->cond));
+	}
+}
+
+/* (Internal) note a change to the remote state of an outgoing message: once
+ * it has an outcome, or has been settled by the peer, it is settled. The
+ * caller must hold the connection's lock.
+ */
+static void
+mq_amqp_updated_(pn_delivery_t *delivery)
+{
+	MQAMQPENTRY *entry;
+	MQSTATUS status;
+
+	switch(pn_delivery_remote_state(delivery))
+	{
+	case PN_ACCEPTED:
+		status = MQT_ACCEPTED;
+		break;
+	case PN_REJECTED:
+		status = MQT_REJECTED;
+		break;
+	case PN_RELEASED:
+		status = MQT_RELEASED;
+		break;
+	case PN_MODIFIED:
+		status = MQT_MODIFIED;
+		break;
+	default:
+		if(!pn_delivery_settled(delivery))
+		{
+			/* Not yet */
+			return;
+		}
+		status = MQT_SETTLED;
+		break;
+	}
+	entry = (MQAMQPENTRY *) pn_delivery_get_context(delivery);
+	if(!entry)
+	{
+		/* It has already been aborted (and settled) */
+		return;
+	}
+	pn_delivery_set_context(delivery, NULL);
+	pn_delivery_settle(delivery);
+	entry->delivery = NULL;
+	mq_amqp_done_(entry->link->owner, entry, status);
+}
+
+/* (Internal) record the outcome of an in-flight outgoing message, and drop
+ * the event loop's reference to it. The caller must hold the connection's
+ * lock.
+ */
+static void
+mq_amqp_done_(MQ *mq, MQAMQPENTRY *entry, MQSTATUS status)
+{
+	if(entry->prev)
+	{
+		entry->prev->next = entry->next;
+	}
+	else
+	{
+		mq->inflight = entry->next;
+	}
+	if(entry->next)
+	{
+		entry->next->prev = entry->prev;
+	}
+	entry->next = entry->prev = NULL;
+	entry->link = NULL;
+	entry->status = status;
+	mq->unsettled--;
+	entry->refs &= ~MQ_AMQP_LOOP;
+	if(!entry->refs)
+	{
+		mq_amqp_entry_free_(entry);
+	}
+	mq_amqp_notify_(mq);
+	if(!mq->unsettled && !mq->outcount)
+	{
+		pthread_cond_broadcast(&(mq->cond));
+	}
+}
+
+/* (Internal) give up on the outgoing messages in flight over a link (or, if
+ * ml is NULL, all of an MQ connection's links), recording status as their
+ * outcome. The caller must hold the connection's lock.
+ */
+static void
+mq_amqp_abort_(MQ *mq, MQAMQPLINK *ml, MQSTATUS status)
+{
+	MQAMQPENTRY *entry, *next;
+
+	for(entry = mq->inflight; entry; entry = next)
+	{
+		next = entry->next;
+		if(ml && entry->link != ml)
+		{
+			continue;
+		}
+		if(entry->delivery)
+		{
+			pn_delivery_set_context(entry->delivery, NULL);
+			pn_delivery_settle(entry->delivery);
+			entry->delivery = NULL;
+		}
+		if(status == MQT_ABORTED)
+		{
+			mq->aborted++;
+		}
+		mq_amqp_done_(mq, entry, status);
+	}
+}
+
+/* (Internal) make a connection's pollable descriptor (if any) readable. The
+ * caller must hold the connection's lock.
+ */
+static void
+mq_amqp_notify_(MQ *mq)
+{
+	uint64_t one;
+
+	if(mq->notifyfd == -1)
+	{
+		return;
+	}
+	one = 1;
+	if(write(mq->notifyfd, &one, sizeof(one)) < 0)
+	{
+		/* It's already readable */
+	}
+}
+
+/* (Internal) obtain an entry for an incoming message, re-using a settled
+ * one if possible. The caller must hold the connection's lock.
+ */
+static MQAMQPENTRY *
+mq_amqp_entry_get_(MQ *mq)
+{
+	MQAMQPENTRY *entry;
+
+	entry = mq->spare;
+	if(!entry)
+	{
+		return (MQAMQPENTRY *) calloc(1, sizeof(MQAMQPENTRY));
+	}
+	mq->spare = entry->next;
+	mq->sparecount--;
+	entry->next = NULL;
+	return entry;
+}
+
+/* (Internal) retain a settled incoming entry for re-use, keeping its buffer,
+ * unless as many are retained as the receiver's credit (which bounds the
+ * number in use at once). The caller must hold the connection's lock.
+ */
+static void
+mq_amqp_entry_recycle_(MQ *mq, MQAMQPENTRY *entry)
+{
+	char *data;
+	size_t size;
+
+	if(mq->sparecount >= (size_t) mq->credit)
+	{
+		mq_amqp_entry_free_(entry);
+		return;
+	}
+	data = entry->data;
+	size = entry->size;
+	memset(entry, 0, sizeof(MQAMQPENTRY));
+	entry->data = data;
+	entry->size = size;
+	entry->next = mq->spare;
+	mq->spare = entry;
+	mq->sparecount++;
+}
+
+/* (Internal) free an entry */
+static void
+mq_amqp_entry_free_(MQAMQPENTRY *entry)
+{
+	free(entry->data);
+	free(entry);
+}
+
+/* (Internal) obtain the current time from the monotonic clock, in
+ * milliseconds
+ */
+static unsigned long long
+mq_amqp_now_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+#endif /*WITH_LIBQPID_PROTON && WITH_PROTON_DRIVER*/
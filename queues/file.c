@@ -0,0 +1,2259 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* The file: engine is a durable queue stored in a local directory.
+ *
+ * Connections to file:PATH (or file://PATH) use the directory PATH, or the
+ * subdirectory PATH/PARTITION for a partition, creating it if necessary. The
+ * URI may include a query string with the following parameters:
+ *
+ *   segment=BYTES     the size of newly-created log segments (default 64MiB)
+ *   sync=MS           the group-commit interval (default 100ms)
+ *   syncbytes=BYTES   the group-commit threshold (default 1MiB)
+ *
+ * Messages are appended to a series of fixed-size, memory-mapped log
+ * segments, each named after the position of its first byte in the log.
+ * Written data is flushed to disk once sync milliseconds have passed since
+ * the oldest unflushed message was sent, or once syncbytes bytes are
+ * unflushed, whichever is sooner; these are checked whenever a message is
+ * sent or mq_process() is called, and mq_deliver() flushes everything.
+ * Setting sync=0 flushes each message as it is sent.
+ *
+ * A receiver reads the log sequentially, starting at the offset stored in
+ * the directory's consumer file. Received messages are views directly into
+ * the mapped segment. Accepting or rejecting a message acknowledges it, and
+ * the stored offset advances past each message once it and every message
+ * before it has been acknowledged; a segment is removed once the offset has
+ * moved beyond it. Messages which are passed (or simply freed) are left
+ * unacknowledged, and so will be received again when the queue is next
+ * opened.
+ *
+ * Each directory may have only one sender and one receiver at a time, which
+ * is enforced with advisory locks. Receivers wait for new messages by
+ * polling the log.
+ */
+
+#define MQ_CONNECTION_STRUCT_DEFINED   1
+#define MQ_MESSAGE_STRUCT_DEFINED      1
+
+#include "p_libmq.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define MQ_ERRBUF_LEN                  128
+#define MQ_FILE_MAGIC                  0x4d514c47UL
+#define MQ_FILE_VERSION                1
+/* The size of the header at the start of each segment */
+#define MQ_FILE_HDRSIZE                64
+/* Records are aligned to 8 bytes */
+#define MQ_FILE_ALIGN                  8
+/* The record size which marks the end of a segment */
+#define MQ_FILE_END                    0xffffffffUL
+/* The length of a record string which is not present */
+#define MQ_FILE_ABSENT                 0xffffffffUL
+/* The default, minimum and maximum segment size */
+#define MQ_FILE_SEGMENT                (64UL << 20)
+#define MQ_FILE_MINSEGMENT             (1UL << 20)
+#define MQ_FILE_MAXSEGMENT             (1UL << 30)
+/* The default group-commit interval (ms) and threshold (bytes) */
+#define MQ_FILE_SYNC                   100
+#define MQ_FILE_SYNCBYTES              (1UL << 20)
+/* Receivers poll for new messages at intervals which start at MQ_FILE_POLLMIN
+ * and double up to MQ_FILE_POLLMAX microseconds
+ */
+#define MQ_FILE_POLLMIN                50
+#define MQ_FILE_POLLMAX                10000
+/* The number of times the log is polled before sleeping */
+#define MQ_FILE_SPIN                   64
+/* The initial number of unacknowledged messages which can be tracked */
+#define MQ_FILE_PENDING                64
+
+typedef struct mq_file_journal_struct MQFILEJOURNAL;
+typedef struct mq_file_segment_struct MQFILESEGMENT;
+typedef struct mq_file_record_struct MQFILERECORD;
+
+/* MQ implementation members */
+static unsigned long mq_file_release_(MQ *self);
+static int mq_file_error_(MQ *self);
+static const char *mq_file_errmsg_(MQ *self);
+static MQSTATE mq_file_state_(MQ *self);
+static int mq_file_connect_recv_(MQ *self);
+static int mq_file_connect_send_(MQ *self);
+static int mq_file_disconnect_(MQ *self);
+static int mq_file_next_(MQ *self, MQMESSAGE **msg);
+static int mq_file_deliver_(MQ *self);
+static int mq_file_create_(MQ *self, MQMESSAGE **msg);
+static int mq_file_set_cluster_(MQ *self, CLUSTER *cluster);
+static CLUSTER *mq_file_cluster_(MQ *self);
+static int mq_file_set_partition_(MQ *self, const char *partition);
+static const char *mq_file_partition_(MQ *self);
+static int mq_file_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received);
+static int mq_file_next_timed_(MQ *self, MQMESSAGE **msg, int timeout);
+static int mq_file_process_(MQ *self);
+static int mq_file_set_option_(MQ *self, MQOPTION option, long value);
+static MQCOMMON *mq_file_common_(MQ *self);
+
+/* MQMESSAGE implementation members */
+static unsigned long mq_file_message_release_(MQMESSAGE *self);
+static MQMSGKIND mq_file_message_kind_(MQMESSAGE *self);
+static int mq_file_message_accept_(MQMESSAGE *self);
+static int mq_file_message_reject_(MQMESSAGE *self);
+static int mq_file_message_pass_(MQMESSAGE *self);
+static int mq_file_message_send_(MQMESSAGE *self);
+static int mq_file_message_set_type_(MQMESSAGE *self, const char *type);
+static const char *mq_file_message_type_(MQMESSAGE *self);
+static int mq_file_message_set_subject_(MQMESSAGE *self, const char *type);
+static const char *mq_file_message_subject_(MQMESSAGE *self);
+static int mq_file_message_set_address_(MQMESSAGE *self, const char *address);
+static const char *mq_file_message_address_(MQMESSAGE *self);
+static const unsigned char *mq_file_message_body_(MQMESSAGE *self);
+static size_t mq_file_message_len_(MQMESSAGE *self);
+static int mq_file_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len);
+static int mq_file_message_set_partition_(MQMESSAGE *self, const char *partition);
+static const char *mq_file_message_partition_(MQMESSAGE *self);
+static int mq_file_message_add_iov_(MQMESSAGE *self, const struct iovec *iov, int iovcnt);
+static int mq_file_message_add_bytes_owned_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn);
+static unsigned char *mq_file_message_take_body_(MQMESSAGE *self, size_t *buflen);
+static MQ *mq_file_message_connection_(MQMESSAGE *self);
+
+/* The header at the start of each segment */
+struct mq_file_header_struct
+{
+	uint32_t magic;
+	uint32_t version;
+	/* The position of the first byte of the segment in the log */
+	uint64_t base;
+	/* The size of the segment, including this header */
+	uint64_t size;
+};
+
+/* A record in a segment, which is followed by the (nul-terminated) type,
+ * subject and address of the message, if present, and then the body. The
+ * size is written last, so that a record is visible to receivers only once
+ * it is complete; a size of zero indicates that no record has been written
+ * yet.
+ */
+struct mq_file_record_struct
+{
+	/* The size of the record, including this header, or MQ_FILE_END */
+	uint32_t size;
+	/* A hash of the remainder of the record, used to detect records which
+	 * were incompletely written before a crash
+	 */
+	uint32_t check;
+	uint32_t typelen;
+	uint32_t subjectlen;
+	uint32_t addresslen;
+	uint32_t reserved;
+	uint64_t len;
+};
+
+/* A mapped segment */
+struct mq_file_segment_struct
+{
+	/* The journal and each incoming message read from the segment hold a
+	 * reference to it
+	 */
+	unsigned long refcount;
+	uint64_t base;
+	uint64_t size;
+	unsigned char *map;
+};
+
+/* An unacknowledged incoming message */
+struct mq_file_pending_struct
+{
+	/* The position following the message */
+	uint64_t end;
+	int done;
+};
+
+/* The state of a connection's use of a log directory */
+struct mq_file_journal_struct
+{
+	/* Each incoming message holds a reference to its receiver's journal */
+	unsigned long refcount;
+	char *partition;
+	char *dir;
+	/* The descriptor holding the directory's sender or receiver lock */
+	int lockfd;
+	MQFILESEGMENT *segment;
+	/* The position of the next record to be written or read */
+	uint64_t pos;
+	/* Senders: the position up to which the log has been flushed, and the
+	 * time at which the oldest unflushed message was written
+	 */
+	uint64_t synced;
+	unsigned long long unsynced;
+	/* Receivers: the mapped consumer offset, the unacknowledged messages
+	 * (a ring of pcount entries starting at phead, the first of which has
+	 * sequence number pseq), and the base and end of the oldest segment
+	 * which hasn't yet been removed
+	 */
+	uint64_t *offset;
+	uint64_t committed;
+	struct mq_file_pending_struct *pending;
+	size_t pcap;
+	size_t phead;
+	size_t pcount;
+	uint64_t pseq;
+	uint64_t retained;
+	uint64_t retainedend;
+};
+
+struct mq_connection_struct
+{
+	MQCONNIMPL *impl;
+	MQ_CONNECTION_COMMON_MEMBERS;
+	char *path;
+	char *partition;
+	/* Parameters */
+	uint64_t segsize;
+	long syncms;
+	uint64_t syncbytes;
+	/* The journal a receiver reads from */
+	MQFILEJOURNAL *journal;
+	/* The journals a sender has written to */
+	MQFILEJOURNAL **journals;
+	size_t njournals;
+	/* Released message objects retained for re-use, and the maximum
+	 * number to retain (negative for no limit)
+	 */
+	MQMESSAGE *pool;
+	size_t poolcount;
+	long poollimit;
+};
+
+struct mq_message_struct
+{
+	MQMESSAGEIMPL *impl;
+	MQ_MESSAGE_COMMON_MEMBERS;
+	/* For incoming messages, the journal and segment the message was read
+	 * from, and its sequence number for acknowledgement. The properties
+	 * and body are views into the segment.
+	 */
+	MQFILEJOURNAL *journal;
+	MQFILESEGMENT *segment;
+	uint64_t seq;
+	/* For outgoing messages, the properties and body are owned by the
+	 * message
+	 */
+	char *type;
+	char *subject;
+	char *address;
+	char *partition;
+	unsigned char *body;
+	size_t len;
+	size_t size;
+	MQFREEFN free_fn;
+	/* The next message in the connection's pool */
+	MQMESSAGE *next;
+};
+
+static MQCONNIMPL mq_file_connection_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_file_release_,
+	mq_file_error_,
+	mq_file_errmsg_,
+	mq_file_state_,
+	mq_file_connect_recv_,
+	mq_file_connect_send_,
+	mq_file_disconnect_,
+	mq_file_next_,
+	mq_file_deliver_,
+	mq_file_create_,
+	mq_file_set_cluster_,
+	mq_file_cluster_,
+	mq_file_set_partition_,
+	mq_file_partition_,
+	mq_file_next_batch_,
+	/* send_batch */
+	NULL,
+	mq_file_next_timed_,
+	mq_file_set_option_,
+	/* fd */
+	NULL,
+	mq_file_process_,
+	mq_file_common_,
+	/* set_spool */
+	NULL,
+	/* pending */
+	NULL,
+	/* set_sent_callback */
+	NULL,
+	/* set_partitions */
+	NULL
+};
+
+static MQMESSAGEIMPL mq_file_message_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_file_message_release_,
+	mq_file_message_kind_,
+	mq_file_message_accept_,
+	mq_file_message_reject_,
+	mq_file_message_pass_,
+	mq_file_message_send_,
+	mq_file_message_set_type_,
+	mq_file_message_type_,
+	mq_file_message_set_subject_,
+	mq_file_message_subject_,
+	mq_file_message_set_address_,
+	mq_file_message_address_,
+	mq_file_message_body_,
+	mq_file_message_len_,
+	mq_file_message_add_bytes_,
+	mq_file_message_set_partition_,
+	mq_file_message_partition_,
+	mq_file_message_add_iov_,
+	mq_file_message_add_bytes_owned_,
+	mq_file_message_take_body_,
+	mq_file_message_connection_,
+	/* status */
+	NULL,
+	/* set_encoding */
+	NULL,
+	/* encoding */
+	NULL,
+	/* replace_body */
+	NULL
+};
+
+MQ *mq_file_construct_(const char *uri, const char *reserved1, const char *reserved2);
+
+/* Internal utilities */
+static int mq_file_parse_(MQ *self, const char *query);
+static MQMESSAGE *mq_file_message_construct_(MQ *self);
+static void mq_file_pool_trim_(MQ *self, size_t limit);
+static MQFILEJOURNAL *mq_file_journal_open_(MQ *self, const char *partition, int writer);
+static int mq_file_journal_writer_(MQ *self, MQFILEJOURNAL *journal);
+static int mq_file_journal_reader_(MQFILEJOURNAL *journal);
+static void mq_file_journal_put_(MQFILEJOURNAL *journal);
+static MQFILEJOURNAL *mq_file_sender_journal_(MQ *self, const char *partition);
+static int mq_file_find_(MQFILEJOURNAL *journal, uint64_t pos, uint64_t *base);
+static MQFILESEGMENT *mq_file_segment_open_(MQFILEJOURNAL *journal, uint64_t base);
+static MQFILESEGMENT *mq_file_segment_create_(MQFILEJOURNAL *journal, uint64_t base, uint64_t size);
+static void mq_file_segment_put_(MQFILESEGMENT *seg);
+static char *mq_file_segment_path_(MQFILEJOURNAL *journal, uint64_t base, const char *suffix);
+static int mq_file_recover_(MQFILEJOURNAL *journal);
+static int mq_file_append_(MQ *self, MQFILEJOURNAL *journal, MQMESSAGE *msg);
+static int mq_file_sync_(MQ *self, MQFILEJOURNAL *journal, int force);
+static int mq_file_read_(MQ *self, MQMESSAGE **msg);
+static int mq_file_next_wait_(MQ *self, MQMESSAGE **msg, int timeout);
+static void mq_file_ack_(MQMESSAGE *self);
+static void mq_file_retire_(MQFILEJOURNAL *journal);
+static int mq_file_sync_dir_(MQFILEJOURNAL *journal);
+static int mq_file_valid_(const MQFILERECORD *record, uint32_t size, uint64_t avail);
+static uint32_t mq_file_check_(const MQFILERECORD *record);
+static unsigned long long mq_file_now_(void);
+static int mq_file_grow_(MQMESSAGE *self, size_t len);
+static int mq_file_strset_(MQMESSAGE *self, char **dest, const char *src);
+
+MQ_ENGINE_PLUGIN;
+
+int
+mq_entry(void *self)
+{
+	if(mq_register("file", mq_file_construct_, self))
+	{
+		fprintf(stderr, "MQ: file: constructor registration failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Local journal message queue constructor: this is invoked by libmq to create
+ * a new file-flavoured MQ instance
+ */
+MQ *
+mq_file_construct_(const char *uri, const char *reserved1, const char *reserved2)
+{
+	MQ *mq;
+	const char *path, *query;
+	size_t len;
+
+	(void) reserved1;
+	(void) reserved2;
+
+	path = strchr(uri, ':');
+	path = path ? path + 1 : uri;
+	if(!strncmp(path, "//", 2))
+	{
+		path += 2;
+	}
+	query = strchr(path, '?');
+	len = query ? (size_t) (query - path) : strlen(path);
+	if(!len)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	mq = (MQ *) calloc(1, sizeof(MQ));
+	if(!mq)
+	{
+		return NULL;
+	}
+	mq->impl = &mq_file_connection_impl_;
+	mq->segsize = MQ_FILE_SEGMENT;
+	mq->syncms = MQ_FILE_SYNC;
+	mq->syncbytes = MQ_FILE_SYNCBYTES;
+	mq->poollimit = -1;
+	if(query && mq_file_parse_(mq, query + 1))
+	{
+		free(mq);
+		errno = EINVAL;
+		return NULL;
+	}
+	mq->uri = strdup(uri);
+	mq->path = (char *) malloc(len + 1);
+	if(!mq->uri || !mq->path)
+	{
+		free(mq->uri);
+		free(mq->path);
+		free(mq);
+		return NULL;
+	}
+	memcpy(mq->path, path, len);
+	mq->path[len] = 0;
+	return mq;
+}
+
+/* Free an MQ connection object */
+static unsigned long
+mq_file_release_(MQ *self)
+{
+	mq_file_disconnect_(self);
+	mq_file_pool_trim_(self, 0);
+	free(self->journals);
+	free(self->partition);
+	free(self->path);
+	free(self->errmsg);
+	free(self->uri);
+	free(self);
+	return 0;
+}
+
+/* Return an indicator as to whether the connection is in an error state */
+static int
+mq_file_error_(MQ *self)
+{
+	if(self->errcode || self->syserr)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* Return the error message for the connection */
+static const char *
+mq_file_errmsg_(MQ *self)
+{
+	if(!self->errmsg)
+	{
+		self->errmsg = (char *) malloc(MQ_ERRBUF_LEN);
+		if(!self->errmsg)
+		{
+			return "Memory allocation error obtaining error message";
+		}
+	}
+	self->errmsg[0] = 0;
+	if(self->syserr)
+	{
+		strerror_r(self->syserr, self->errmsg, MQ_ERRBUF_LEN);
+		return self->errmsg;
+	}
+	if(self->errcode)
+	{
+		snprintf(self->errmsg, MQ_ERRBUF_LEN, "Unknown error #%d", self->errcode);
+		return self->errmsg;
+	}
+	return "Success";
+}
+
+/* Return the MQ connection state */
+static MQSTATE
+mq_file_state_(MQ *self)
+{
+	RESET_ERROR(self);
+	return self->state;
+}
+
+/* Establish a connection for receiving, opening the journal for the
+ * connection's partition
+ */
+static int
+mq_file_connect_recv_(MQ *self)
+{
+	RESET_ERROR(self);
+	if(self->state != MQS_DISCONNECTED)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	self->journal = mq_file_journal_open_(self, self->partition, 0);
+	if(!self->journal)
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	self->state = MQS_RECV;
+	return 0;
+}
+
+/* Establish a connection for sending; journals are opened as messages are
+ * sent to them
+ */
+static int
+mq_file_connect_send_(MQ *self)
+{
+	RESET_ERROR(self);
+	if(self->state != MQS_DISCONNECTED)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	self->state = MQS_SEND;
+	return 0;
+}
+
+/* Disconnect from a message queue, flushing any unflushed messages */
+static int
+mq_file_disconnect_(MQ *self)
+{
+	size_t c;
+
+	RESET_ERROR(self);
+	if(self->journal)
+	{
+		mq_file_journal_put_(self->journal);
+		self->journal = NULL;
+	}
+	for(c = 0; c < self->njournals; c++)
+	{
+		mq_file_sync_(self, self->journals[c], 1);
+		mq_file_journal_put_(self->journals[c]);
+	}
+	self->njournals = 0;
+	self->state = MQS_DISCONNECTED;
+	return 0;
+}
+
+/* Wait for a message to arrive via a connection */
+static int
+mq_file_next_(MQ *self, MQMESSAGE **msg)
+{
+	return mq_file_next_wait_(self, msg, self->nonblock ? 0 : -1);
+}
+
+/* Wait up to timeout milliseconds for a message to arrive */
+static int
+mq_file_next_timed_(MQ *self, MQMESSAGE **msg, int timeout)
+{
+	return mq_file_next_wait_(self, msg, timeout);
+}
+
+/* Obtain up to count messages, waiting only for the first */
+static int
+mq_file_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received)
+{
+	size_t n;
+
+	*received = 0;
+	if(!count)
+	{
+		RESET_ERROR(self);
+		return 0;
+	}
+	if(mq_file_next_(self, &(msgs[0])))
+	{
+		return -1;
+	}
+	for(n = 1; n < count; n++)
+	{
+		if(mq_file_read_(self, &(msgs[n])))
+		{
+			break;
+		}
+	}
+	*received = n;
+	RESET_ERROR(self);
+	return 0;
+}
+
+/* Flush all of the messages which have been sent to disk */
+static int
+mq_file_deliver_(MQ *self)
+{
+	size_t c;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	for(c = 0; c < self->njournals; c++)
+	{
+		if(mq_file_sync_(self, self->journals[c], 1))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Flush the messages which have been sent if the group-commit interval or
+ * threshold has been reached, so that an idle sender doesn't leave them
+ * unflushed indefinitely
+ */
+static int
+mq_file_process_(MQ *self)
+{
+	size_t c;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND)
+	{
+		return 0;
+	}
+	for(c = 0; c < self->njournals; c++)
+	{
+		if(mq_file_sync_(self, self->journals[c], 0))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Create a new outgoing message */
+static int
+mq_file_create_(MQ *self, MQMESSAGE **msg)
+{
+	MQMESSAGE *p;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	p = mq_file_message_construct_(self);
+	if(!p)
+	{
+		return -1;
+	}
+	p->kind = MQK_OUTGOING;
+	*msg = p;
+	return 0;
+}
+
+/* Set the cluster associated with a connection */
+static int
+mq_file_set_cluster_(MQ *self, CLUSTER *cluster)
+{
+	self->cluster = cluster;
+	return self->impl->set_partition(self, cluster_partition(cluster));
+}
+
+/* Obtain the cluster (if any) associated with a connection */
+static CLUSTER *
+mq_file_cluster_(MQ *self)
+{
+	return self->cluster;
+}
+
+/* Set the name of the partition this queue uses (NULL or an empty string
+ * will unset it); a receiver switches to the partition's journal
+ */
+static int
+mq_file_set_partition_(MQ *self, const char *partition)
+{
+	MQFILEJOURNAL *journal;
+	char *p;
+
+	RESET_ERROR(self);
+	p = NULL;
+	if(partition && partition[0])
+	{
+		if(strchr(partition, '/') || partition[0] == '.')
+		{
+			SET_SYSERR(self, EINVAL);
+			return -1;
+		}
+		p = strdup(partition);
+		if(!p)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+	}
+	if(self->state == MQS_RECV)
+	{
+		/* Release the current journal (and so its lock) first */
+		mq_file_journal_put_(self->journal);
+		self->journal = NULL;
+		journal = mq_file_journal_open_(self, p, 0);
+		if(!journal)
+		{
+			SET_ERRNO(self);
+			free(p);
+			self->state = MQS_DISCONNECTED;
+			return -1;
+		}
+		self->journal = journal;
+	}
+	free(self->partition);
+	self->partition = p;
+	return 0;
+}
+
+/* Obtain the partition (if any) associated with a connection */
+static const char *
+mq_file_partition_(MQ *self)
+{
+	return self->partition;
+}
+
+/* Set a connection option */
+static int
+mq_file_set_option_(MQ *self, MQOPTION option, long value)
+{
+	RESET_ERROR(self);
+	switch(option)
+	{
+	case MQO_NONBLOCK:
+		self->nonblock = !!value;
+		return 0;
+	case MQO_POOL:
+		self->poollimit = value < 0 ? -1 : value;
+		if(value >= 0)
+		{
+			mq_file_pool_trim_(self, (size_t) value);
+		}
+		return 0;
+	default:
+		break;
+	}
+	SET_SYSERR(self, ENOTSUP);
+	return -1;
+}
+
+/* Obtain the state maintained by libmq for the connection */
+static MQCOMMON *
+mq_file_common_(MQ *self)
+{
+	return &(self->common);
+}
+
+/* Release (destroy) a message */
+static unsigned long
+mq_file_message_release_(MQMESSAGE *self)
+{
+	MQ *conn;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	if(self->kind == MQK_INCOMING)
+	{
+		if(self->segment)
+		{
+			mq_file_segment_put_(self->segment);
+		}
+		if(self->journal)
+		{
+			mq_file_journal_put_(self->journal);
+		}
+	}
+	else
+	{
+		if(self->body && self->free_fn)
+		{
+			self->free_fn(self->body);
+		}
+		free(self->type);
+		free(self->subject);
+		free(self->address);
+		free(self->partition);
+	}
+	self->journal = NULL;
+	self->segment = NULL;
+	self->type = self->subject = self->address = self->partition = NULL;
+	self->body = NULL;
+	self->len = self->size = 0;
+	self->free_fn = NULL;
+	if(conn->poollimit >= 0 && conn->poolcount >= (size_t) conn->poollimit)
+	{
+		free(self);
+		return 0;
+	}
+	self->next = conn->pool;
+	conn->pool = self;
+	conn->poolcount++;
+	return 0;
+}
+
+static MQMSGKIND
+mq_file_message_kind_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->kind;
+}
+
+/* Acknowledge an incoming message */
+static int
+mq_file_message_accept_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_INCOMING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	mq_file_ack_(self);
+	return 0;
+}
+
+/* Reject an incoming message: as there's nowhere else for it to go, it is
+ * acknowledged so that it won't be received again
+ */
+static int
+mq_file_message_reject_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_INCOMING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	mq_file_ack_(self);
+	return 0;
+}
+
+/* Pass on an incoming message: it is left unacknowledged */
+static int
+mq_file_message_pass_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_INCOMING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return 0;
+}
+
+/* Send an outgoing message, appending it to the journal for its partition */
+static int
+mq_file_message_send_(MQMESSAGE *self)
+{
+	MQ *conn;
+	MQFILEJOURNAL *journal;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(conn, EINVAL);
+		return -1;
+	}
+	journal = mq_file_sender_journal_(conn, mq_file_message_partition_(self));
+	if(!journal)
+	{
+		return -1;
+	}
+	if(mq_file_append_(conn, journal, self))
+	{
+		return -1;
+	}
+	return mq_file_sync_(conn, journal, 0);
+}
+
+/* Set the content-type of an outgoing message */
+static int
+mq_file_message_set_type_(MQMESSAGE *self, const char *type)
+{
+	return mq_file_strset_(self, &(self->type), type);
+}
+
+/* Retrieve the content-type of a message */
+static const char *
+mq_file_message_type_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->type;
+}
+
+/* Set the subject of a message */
+static int
+mq_file_message_set_subject_(MQMESSAGE *self, const char *subject)
+{
+	return mq_file_strset_(self, &(self->subject), subject);
+}
+
+/* Retrieve the subject of a message */
+static const char *
+mq_file_message_subject_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->subject;
+}
+
+/* Set the address (destination) of an outgoing message */
+static int
+mq_file_message_set_address_(MQMESSAGE *self, const char *address)
+{
+	return mq_file_strset_(self, &(self->address), address);
+}
+
+/* Retrieve the address of a message: if none was set when it was sent, this
+ * is the URI of the connection
+ */
+static const char *
+mq_file_message_address_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->address)
+	{
+		return self->address;
+	}
+	return self->connection->uri;
+}
+
+/* Retrieve the body of a message; for an incoming message, this is a view
+ * into the log which remains valid until the message is freed
+ */
+static const unsigned char *
+mq_file_message_body_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(!self->body)
+	{
+		return (const unsigned char *) "";
+	}
+	return self->body;
+}
+
+/* Retrieve the length of a message body, in bytes */
+static size_t
+mq_file_message_len_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->len;
+}
+
+/* Add a sequence of bytes to an outgoing message body */
+static int
+mq_file_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	if(mq_file_grow_(self, len))
+	{
+		return -1;
+	}
+	memcpy(&(self->body[self->len]), buf, len);
+	self->len += len;
+	return 0;
+}
+
+/* Add a sequence of bytes gathered from a set of buffers to an outgoing
+ * message body
+ */
+static int
+mq_file_message_add_iov_(MQMESSAGE *self, const struct iovec *iov, int iovcnt)
+{
+	size_t len;
+	int c;
+
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	len = 0;
+	for(c = 0; c < iovcnt; c++)
+	{
+		len += iov[c].iov_len;
+	}
+	if(mq_file_grow_(self, len))
+	{
+		return -1;
+	}
+	for(c = 0; c < iovcnt; c++)
+	{
+		memcpy(&(self->body[self->len]), iov[c].iov_base, iov[c].iov_len);
+		self->len += iov[c].iov_len;
+	}
+	return 0;
+}
+
+/* Add a buffer to an outgoing message body: if the body is empty, the
+ * buffer is adopted until the message is sent
+ */
+static int
+mq_file_message_add_bytes_owned_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	if(self->body)
+	{
+		if(mq_file_message_add_bytes_(self, buf, len))
+		{
+			return -1;
+		}
+		if(free_fn)
+		{
+			free_fn(buf);
+		}
+		return 0;
+	}
+	self->body = buf;
+	self->len = len;
+	self->size = len;
+	self->free_fn = free_fn;
+	return 0;
+}
+
+/* Detach the body of a message: the body of an incoming message is a view
+ * into the log, and so is always copied
+ */
+static unsigned char *
+mq_file_message_take_body_(MQMESSAGE *self, size_t *buflen)
+{
+	unsigned char *p;
+
+	RESET_ERROR(self->connection);
+	if(self->kind == MQK_OUTGOING && self->body && self->free_fn == free)
+	{
+		p = self->body;
+	}
+	else
+	{
+		p = (unsigned char *) malloc(self->len ? self->len : 1);
+		if(!p)
+		{
+			SET_ERRNO(self->connection);
+			return NULL;
+		}
+		if(self->len)
+		{
+			memcpy(p, self->body, self->len);
+		}
+		if(self->kind == MQK_OUTGOING && self->body && self->free_fn)
+		{
+			self->free_fn(self->body);
+		}
+	}
+	if(buflen)
+	{
+		*buflen = self->len;
+	}
+	self->body = NULL;
+	self->len = self->size = 0;
+	self->free_fn = NULL;
+	return p;
+}
+
+/* Set the partition used for a message: NULL will cause the connection's
+ * partition to be used, while an empty string will cause the message to be
+ * written to the queue's default journal regardless of the connection's
+ * settings
+ */
+static int
+mq_file_message_set_partition_(MQMESSAGE *self, const char *partition)
+{
+	if(partition && (strchr(partition, '/') || partition[0] == '.'))
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return mq_file_strset_(self, &(self->partition), partition);
+}
+
+/* Obtain the partition for a message: for an incoming message, this is the
+ * partition of the journal it was read from; for an outgoing message, it
+ * defaults to that of its connection
+ */
+static const char *
+mq_file_message_partition_(MQMESSAGE *self)
+{
+	if(self->kind == MQK_INCOMING)
+	{
+		return self->journal ? self->journal->partition : NULL;
+	}
+	if(!self->partition)
+	{
+		return self->connection->partition;
+	}
+	if(!self->partition[0])
+	{
+		return NULL;
+	}
+	return self->partition;
+}
+
+/* Obtain the connection that a message is associated with */
+static MQ *
+mq_file_message_connection_(MQMESSAGE *self)
+{
+	return self->connection;
+}
+
+/* (Internal) parse the query-string of a URI */
+static int
+mq_file_parse_(MQ *self, const char *query)
+{
+	const char *value;
+	char *end;
+	unsigned long n;
+	size_t len;
+
+	while(*query)
+	{
+		len = strcspn(query, "&");
+		value = memchr(query, '=', len);
+		if(!value)
+		{
+			return -1;
+		}
+		value++;
+		n = strtoul(value, &end, 10);
+		if(end == value || end != query + len)
+		{
+			return -1;
+		}
+		if(!strncmp(query, "segment=", 8))
+		{
+			if(n < MQ_FILE_MINSEGMENT || n > MQ_FILE_MAXSEGMENT)
+			{
+				return -1;
+			}
+			self->segsize = (n + MQ_FILE_ALIGN - 1) & ~((unsigned long) MQ_FILE_ALIGN - 1);
+		}
+		else if(!strncmp(query, "sync=", 5))
+		{
+			if(n > LONG_MAX / 1000000)
+			{
+				return -1;
+			}
+			self->syncms = (long) n;
+		}
+		else if(!strncmp(query, "syncbytes=", 10))
+		{
+			self->syncbytes = n;
+		}
+		else
+		{
+			return -1;
+		}
+		query += len;
+		if(*query)
+		{
+			query++;
+		}
+	}
+	return 0;
+}
+
+/* (Internal) create a new MQ message object */
+static MQMESSAGE *
+mq_file_message_construct_(MQ *self)
+{
+	MQMESSAGE *p;
+
+	if(self->pool)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		p->next = NULL;
+		return p;
+	}
+	p = (MQMESSAGE *) calloc(1, sizeof(MQMESSAGE));
+	if(!p)
+	{
+		SET_ERRNO(self);
+		return NULL;
+	}
+	p->impl = &mq_file_message_impl_;
+	p->connection = self;
+	return p;
+}
+
+/* (Internal) destroy pooled message objects until no more than limit remain */
+static void
+mq_file_pool_trim_(MQ *self, size_t limit)
+{
+	MQMESSAGE *p;
+
+	while(self->poolcount > limit)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		free(p);
+	}
+}
+
+/* (Internal) open the journal for a partition of the connection's queue,
+ * creating its directory if necessary and taking its sender or receiver
+ * lock
+ */
+static MQFILEJOURNAL *
+mq_file_journal_open_(MQ *self, const char *partition, int writer)
+{
+	MQFILEJOURNAL *journal;
+	char *lockpath;
+	int e;
+
+	journal = (MQFILEJOURNAL *) calloc(1, sizeof(MQFILEJOURNAL));
+	if(!journal)
+	{
+		return NULL;
+	}
+	journal->refcount = 1;
+	journal->lockfd = -1;
+	journal->dir = (char *) malloc(strlen(self->path) + (partition ? strlen(partition) + 1 : 0) + 1);
+	lockpath = (char *) malloc(strlen(self->path) + (partition ? strlen(partition) + 1 : 0) + 16);
+	if(partition)
+	{
+		journal->partition = strdup(partition);
+	}
+	if(!journal->dir || !lockpath || (partition && !journal->partition))
+	{
+		free(lockpath);
+		mq_file_journal_put_(journal);
+		errno = ENOMEM;
+		return NULL;
+	}
+	strcpy(journal->dir, self->path);
+	if(mkdir(journal->dir, 0777) && errno != EEXIST)
+	{
+		goto failed;
+	}
+	if(partition)
+	{
+		strcat(journal->dir, "/");
+		strcat(journal->dir, partition);
+		if(mkdir(journal->dir, 0777) && errno != EEXIST)
+		{
+			goto failed;
+		}
+	}
+	sprintf(lockpath, "%s/%s", journal->dir, writer ? "sender.lock" : "consumer");
+	journal->lockfd = open(lockpath, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+	if(journal->lockfd == -1)
+	{
+		goto failed;
+	}
+	if(flock(journal->lockfd, LOCK_EX|LOCK_NB))
+	{
+		if(errno == EWOULDBLOCK)
+		{
+			errno = EBUSY;
+		}
+		goto failed;
+	}
+	if(writer ? mq_file_journal_writer_(self, journal) : mq_file_journal_reader_(journal))
+	{
+		goto failed;
+	}
+	free(lockpath);
+	return journal;
+failed:
+	e = errno;
+	free(lockpath);
+	mq_file_journal_put_(journal);
+	errno = e;
+	return NULL;
+}
+
+/* (Internal) prepare a journal for writing: map the most recent segment
+ * (creating the first if there is none) and find the end of its valid
+ * records
+ */
+static int
+mq_file_journal_writer_(MQ *self, MQFILEJOURNAL *journal)
+{
+	uint64_t base;
+
+	if(mq_file_find_(journal, ~(uint64_t) 0, &base))
+	{
+		if(errno != ENOENT)
+		{
+			return -1;
+		}
+		journal->segment = mq_file_segment_create_(journal, 0, self->segsize);
+	}
+	else
+	{
+		journal->segment = mq_file_segment_open_(journal, base);
+	}
+	if(!journal->segment)
+	{
+		return -1;
+	}
+	if(mq_file_recover_(journal))
+	{
+		return -1;
+	}
+	journal->synced = journal->pos;
+	return 0;
+}
+
+/* (Internal) prepare a journal for reading: map the consumer offset and
+ * locate the segment holding it, if it exists yet
+ */
+static int
+mq_file_journal_reader_(MQFILEJOURNAL *journal)
+{
+	struct stat sbuf;
+	uint64_t base;
+	int isnew;
+
+	if(fstat(journal->lockfd, &sbuf))
+	{
+		return -1;
+	}
+	isnew = (sbuf.st_size < (off_t) sizeof(uint64_t));
+	if(isnew && ftruncate(journal->lockfd, sizeof(uint64_t)))
+	{
+		return -1;
+	}
+	journal->offset = (uint64_t *) mmap(NULL, sizeof(uint64_t), PROT_READ|PROT_WRITE, MAP_SHARED, journal->lockfd, 0);
+	if(journal->offset == (uint64_t *) MAP_FAILED)
+	{
+		journal->offset = NULL;
+		return -1;
+	}
+	journal->pos = *(journal->offset);
+	/* Without a stored offset, start at the oldest segment */
+	if(mq_file_find_(journal, isnew ? 0 : journal->pos, &base))
+	{
+		if(errno != ENOENT)
+		{
+			return -1;
+		}
+		/* Nothing has been written yet: wait for the first segment */
+		journal->retained = journal->retainedend = journal->pos;
+		journal->committed = journal->pos;
+		return 0;
+	}
+	journal->segment = mq_file_segment_open_(journal, base);
+	if(!journal->segment)
+	{
+		return -1;
+	}
+	if(isnew || journal->pos < base)
+	{
+		journal->pos = base;
+	}
+	if(journal->pos - base < MQ_FILE_HDRSIZE)
+	{
+		journal->pos = base + MQ_FILE_HDRSIZE;
+	}
+	journal->committed = journal->pos;
+	journal->retained = base;
+	journal->retainedend = base + journal->segment->size;
+	return 0;
+}
+
+/* (Internal) release a reference to a journal, closing it once there are
+ * none left
+ */
+static void
+mq_file_journal_put_(MQFILEJOURNAL *journal)
+{
+	journal->refcount--;
+	if(journal->refcount)
+	{
+		return;
+	}
+	if(journal->offset)
+	{
+		msync(journal->offset, sizeof(uint64_t), MS_SYNC);
+		munmap(journal->offset, sizeof(uint64_t));
+	}
+	if(journal->segment)
+	{
+		mq_file_segment_put_(journal->segment);
+	}
+	if(journal->lockfd != -1)
+	{
+		close(journal->lockfd);
+	}
+	free(journal->pending);
+	free(journal->partition);
+	free(journal->dir);
+	free(journal);
+}
+
+/* (Internal) find the journal a sender should write to for a partition,
+ * opening it if necessary
+ */
+static MQFILEJOURNAL *
+mq_file_sender_journal_(MQ *self, const char *partition)
+{
+	MQFILEJOURNAL *journal, **p;
+	size_t c;
+
+	for(c = 0; c < self->njournals; c++)
+	{
+		journal = self->journals[c];
+		if(partition ? (journal->partition && !strcmp(journal->partition, partition)) : !journal->partition)
+		{
+			return journal;
+		}
+	}
+	p = (MQFILEJOURNAL **) realloc(self->journals, sizeof(MQFILEJOURNAL *) * (self->njournals + 1));
+	if(!p)
+	{
+		SET_ERRNO(self);
+		return NULL;
+	}
+	self->journals = p;
+	journal = mq_file_journal_open_(self, partition, 1);
+	if(!journal)
+	{
+		SET_ERRNO(self);
+		return NULL;
+	}
+	self->journals[self->njournals] = journal;
+	self->njournals++;
+	return journal;
+}
+
+/* (Internal) find the base of the segment which holds position pos: this is
+ * the latest segment starting at or before pos, or the earliest segment if
+ * there are none; returns -1 with errno set to ENOENT if there are no
+ * segments at all
+ */
+static int
+mq_file_find_(MQFILEJOURNAL *journal, uint64_t pos, uint64_t *base)
+{
+	DIR *dir;
+	struct dirent *de;
+	unsigned long long n;
+	uint64_t before, after;
+	int hasbefore, hasafter;
+	char *end;
+
+	dir = opendir(journal->dir);
+	if(!dir)
+	{
+		return -1;
+	}
+	hasbefore = hasafter = 0;
+	before = after = 0;
+	while((de = readdir(dir)))
+	{
+		if(strlen(de->d_name) != 24 || strcmp(&(de->d_name[20]), ".log"))
+		{
+			continue;
+		}
+		n = strtoull(de->d_name, &end, 10);
+		if(end != &(de->d_name[20]))
+		{
+			continue;
+		}
+		if(n <= pos)
+		{
+			if(!hasbefore || n > before)
+			{
+				before = n;
+				hasbefore = 1;
+			}
+		}
+		else if(!hasafter || n < after)
+		{
+			after = n;
+			hasafter = 1;
+		}
+	}
+	closedir(dir);
+	if(hasbefore)
+	{
+		*base = before;
+		return 0;
+	}
+	if(hasafter)
+	{
+		*base = after;
+		return 0;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+/* (Internal) map an existing segment */
+static MQFILESEGMENT *
+mq_file_segment_open_(MQFILEJOURNAL *journal, uint64_t base)
+{
+	struct mq_file_header_struct *header;
+	MQFILESEGMENT *seg;
+	struct stat sbuf;
+	char *path;
+	int fd, e;
+
+	path = mq_file_segment_path_(journal, base, ".log");
+	if(!path)
+	{
+		return NULL;
+	}
+	fd = open(path, O_RDWR|O_CLOEXEC);
+	free(path);
+	if(fd == -1)
+	{
+		return NULL;
+	}
+	seg = (MQFILESEGMENT *) calloc(1, sizeof(MQFILESEGMENT));
+	if(!seg || fstat(fd, &sbuf))
+	{
+		goto failed;
+	}
+	if(sbuf.st_size < MQ_FILE_HDRSIZE + MQ_FILE_ALIGN)
+	{
+		errno = EINVAL;
+		goto failed;
+	}
+	seg->map = (unsigned char *) mmap(NULL, sbuf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(seg->map == (unsigned char *) MAP_FAILED)
+	{
+		seg->map = NULL;
+		goto failed;
+	}
+	seg->size = sbuf.st_size;
+	header = (struct mq_file_header_struct *) seg->map;
+	if(header->magic != MQ_FILE_MAGIC || header->version != MQ_FILE_VERSION ||
+	   header->base != base || header->size != seg->size)
+	{
+		errno = EINVAL;
+		goto failed;
+	}
+	close(fd);
+	seg->base = base;
+	seg->refcount = 1;
+	return seg;
+failed:
+	e = errno;
+	close(fd);
+	if(seg)
+	{
+		if(seg->map)
+		{
+			munmap(seg->map, seg->size);
+		}
+		free(seg);
+	}
+	errno = e;
+	return NULL;
+}
+
+/* (Internal) create and map a new segment: it is prepared under a temporary
+ * name, so that it only appears once it is complete
+ */
+static MQFILESEGMENT *
+mq_file_segment_create_(MQFILEJOURNAL *journal, uint64_t base, uint64_t size)
+{
+	struct mq_file_header_struct *header;
+	MQFILESEGMENT *seg;
+	char *tmppath, *path;
+	int fd, e;
+
+	tmppath = mq_file_segment_path_(journal, base, ".tmp");
+	path = mq_file_segment_path_(journal, base, ".log");
+	seg = (MQFILESEGMENT *) calloc(1, sizeof(MQFILESEGMENT));
+	fd = -1;
+	if(!tmppath || !path || !seg)
+	{
+		errno = ENOMEM;
+		goto failed;
+	}
+	fd = open(tmppath, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if(fd == -1 || ftruncate(fd, (off_t) size))
+	{
+		goto failed;
+	}
+	seg->map = (unsigned char *) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(seg->map == (unsigned char *) MAP_FAILED)
+	{
+		seg->map = NULL;
+		goto failed;
+	}
+	seg->size = size;
+	seg->base = base;
+	header = (struct mq_file_header_struct *) seg->map;
+	header->magic = MQ_FILE_MAGIC;
+	header->version = MQ_FILE_VERSION;
+	header->base = base;
+	header->size = size;
+	if(msync(seg->map, MQ_FILE_HDRSIZE, MS_SYNC) || rename(tmppath, path) ||
+	   mq_file_sync_dir_(journal))
+	{
+		goto failed;
+	}
+	close(fd);
+	free(tmppath);
+	free(path);
+	seg->refcount = 1;
+	return seg;
+failed:
+	e = errno;
+	if(fd != -1)
+	{
+		close(fd);
+		unlink(tmppath);
+	}
+	if(seg && seg->map)
+	{
+		munmap(seg->map, seg->size);
+	}
+	free(seg);
+	free(tmppath);
+	free(path);
+	errno = e;
+	return NULL;
+}
+
+/* (Internal) release a reference to a segment, unmapping it once there are
+ * none left
+ */
+static void
+mq_file_segment_put_(MQFILESEGMENT *seg)
+{
+	seg->refcount--;
+	if(seg->refcount)
+	{
+		return;
+	}
+	munmap(seg->map, seg->size);
+	free(seg);
+}
+
+/* (Internal) generate the path of a segment file */
+static char *
+mq_file_segment_path_(MQFILEJOURNAL *journal, uint64_t base, const char *suffix)
+{
+	char *path;
+
+	path = (char *) malloc(strlen(journal->dir) + 32);
+	if(!path)
+	{
+		return NULL;
+	}
+	sprintf(path, "%s/%020llu%s", journal->dir, (unsigned long long) base, suffix);
+	return path;
+}
+
+/* (Internal) find the end of the valid records in a writer's segment; any
+ * record which was incompletely written is discarded, along with everything
+ * following it
+ */
+static int
+mq_file_recover_(MQFILEJOURNAL *journal)
+{
+	MQFILESEGMENT *seg, *next;
+	MQFILERECORD *record;
+	uint64_t offset;
+
+	seg = journal->segment;
+	offset = MQ_FILE_HDRSIZE;
+	while(offset + MQ_FILE_ALIGN <= seg->size)
+	{
+		record = (MQFILERECORD *) (seg->map + offset);
+		if(record->size == MQ_FILE_END)
+		{
+			/* The segment was completed, but its successor was never
+			 * created
+			 */
+			next = mq_file_segment_create_(journal, seg->base + seg->size, seg->size);
+			if(!next)
+			{
+				return -1;
+			}
+			mq_file_segment_put_(seg);
+			journal->segment = seg = next;
+			offset = MQ_FILE_HDRSIZE;
+			continue;
+		}
+		if(offset + sizeof(MQFILERECORD) > seg->size ||
+		   !mq_file_valid_(record, record->size, seg->size - offset) ||
+		   record->check != mq_file_check_(record))
+		{
+			break;
+		}
+		offset += record->size;
+	}
+	if(offset < seg->size)
+	{
+		memset(seg->map + offset, 0, seg->size - offset);
+		if(msync(seg->map, seg->size, MS_SYNC))
+		{
+			return -1;
+		}
+	}
+	journal->pos = seg->base + offset;
+	return 0;
+}
+
+/* (Internal) append a message to a journal, moving on to a new segment if
+ * there isn't room for it in the current one; there is always room for an
+ * end-of-segment marker after the last record
+ */
+static int
+mq_file_append_(MQ *self, MQFILEJOURNAL *journal, MQMESSAGE *msg)
+{
+	MQFILESEGMENT *seg, *next;
+	MQFILERECORD *record;
+	unsigned char *p;
+	uint64_t size, offset;
+
+	size = sizeof(MQFILERECORD) + msg->len;
+	size += msg->type ? strlen(msg->type) + 1 : 0;
+	size += msg->subject ? strlen(msg->subject) + 1 : 0;
+	size += msg->address ? strlen(msg->address) + 1 : 0;
+	size = (size + MQ_FILE_ALIGN - 1) & ~((uint64_t) MQ_FILE_ALIGN - 1);
+	seg = journal->segment;
+	if(size + MQ_FILE_HDRSIZE + MQ_FILE_ALIGN > self->segsize || size >= MQ_FILE_END)
+	{
+		SET_SYSERR(self, EMSGSIZE);
+		return -1;
+	}
+	offset = journal->pos - seg->base;
+	if(offset + size + MQ_FILE_ALIGN > seg->size)
+	{
+		/* Create the next segment before marking the end of this one,
+		 * so that it exists by the time a receiver looks for it
+		 */
+		next = mq_file_segment_create_(journal, seg->base + seg->size, self->segsize);
+		if(!next)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+		record = (MQFILERECORD *) (seg->map + offset);
+		__atomic_store_n(&(record->size), (uint32_t) MQ_FILE_END, __ATOMIC_RELEASE);
+		journal->pos = seg->base + offset + MQ_FILE_ALIGN;
+		if(mq_file_sync_(self, journal, 1))
+		{
+			mq_file_segment_put_(next);
+			return -1;
+		}
+		mq_file_segment_put_(seg);
+		journal->segment = seg = next;
+		journal->pos = journal->synced = seg->base + MQ_FILE_HDRSIZE;
+		offset = MQ_FILE_HDRSIZE;
+	}
+	record = (MQFILERECORD *) (seg->map + offset);
+	record->len = msg->len;
+	record->reserved = 0;
+	p = (unsigned char *) (record + 1);
+#define MQ_FILE_COPYSTR_(str, member) \
+	if(str) \
+	{ \
+		record->member = (uint32_t) strlen(str); \
+		memcpy(p, str, record->member + 1); \
+		p += record->member + 1; \
+	} \
+	else \
+	{ \
+		record->member = (uint32_t) MQ_FILE_ABSENT; \
+	}
+	MQ_FILE_COPYSTR_(msg->type, typelen);
+	MQ_FILE_COPYSTR_(msg->subject, subjectlen);
+	MQ_FILE_COPYSTR_(msg->address, addresslen);
+#undef MQ_FILE_COPYSTR_
+	if(msg->len)
+	{
+		memcpy(p, msg->body, msg->len);
+	}
+	record->check = mq_file_check_(record);
+	/* Publish the record */
+	__atomic_store_n(&(record->size), (uint32_t) size, __ATOMIC_RELEASE);
+	if(journal->pos == journal->synced)
+	{
+		journal->unsynced = mq_file_now_();
+	}
+	journal->pos += size;
+	return 0;
+}
+
+/* (Internal) flush a journal's unflushed records to disk if the group-commit
+ * interval or threshold has been reached, or if force is set
+ */
+static int
+mq_file_sync_(MQ *self, MQFILEJOURNAL *journal, int force)
+{
+	MQFILESEGMENT *seg;
+	uint64_t start, end;
+	long pagesize;
+
+	if(journal->pos == journal->synced)
+	{
+		return 0;
+	}
+	if(!force && self->syncms &&
+	   journal->pos - journal->synced < self->syncbytes &&
+	   mq_file_now_() - journal->unsynced < (unsigned long long) self->syncms * 1000000ULL)
+	{
+		return 0;
+	}
+	seg = journal->segment;
+	pagesize = sysconf(_SC_PAGESIZE);
+	start = journal->synced > seg->base ? journal->synced - seg->base : 0;
+	start &= ~((uint64_t) pagesize - 1);
+	end = journal->pos - seg->base;
+	if(msync(seg->map + start, end - start, MS_SYNC))
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	journal->synced = journal->pos;
+	return 0;
+}
+
+/* (Internal) read the next record from a receiver's journal without waiting;
+ * returns -1 with the error set to EAGAIN if there is none yet
+ */
+static int
+mq_file_read_(MQ *self, MQMESSAGE **msg)
+{
+	MQFILEJOURNAL *journal;
+	MQFILESEGMENT *seg, *next;
+	MQFILERECORD *record;
+	MQMESSAGE *p;
+	struct mq_file_pending_struct *pending;
+	uint64_t base, offset;
+	uint32_t size;
+	size_t c;
+	char *s;
+
+	journal = self->journal;
+	if(!journal->segment)
+	{
+		/* Wait for the first segment to be created */
+		if(mq_file_find_(journal, journal->pos, &base) ||
+		   !(journal->segment = mq_file_segment_open_(journal, base)))
+		{
+			SET_SYSERR(self, EAGAIN);
+			return -1;
+		}
+		journal->pos = journal->committed = base + MQ_FILE_HDRSIZE;
+		journal->retained = base;
+		journal->retainedend = base + journal->segment->size;
+	}
+	for(;;)
+	{
+		seg = journal->segment;
+		offset = journal->pos - seg->base;
+		if(offset + MQ_FILE_ALIGN > seg->size)
+		{
+			SET_SYSERR(self, EAGAIN);
+			return -1;
+		}
+		record = (MQFILERECORD *) (seg->map + offset);
+		size = __atomic_load_n(&(record->size), __ATOMIC_ACQUIRE);
+		if(size != MQ_FILE_END)
+		{
+			break;
+		}
+		next = mq_file_segment_open_(journal, seg->base + seg->size);
+		if(!next)
+		{
+			SET_SYSERR(self, EAGAIN);
+			return -1;
+		}
+		mq_file_segment_put_(seg);
+		journal->segment = next;
+		journal->pos = next->base + MQ_FILE_HDRSIZE;
+	}
+	/* A record is only published once it has been completely written, and
+	 * a record torn by a crash is discarded by recovery when the queue is
+	 * next opened for sending, so records aren't re-hashed here; a record
+	 * which is inconsistent with its segment is treated as not yet written.
+	 * Only the size loaded above is used: the writer may publish the
+	 * record at any point after it was loaded.
+	 */
+	if(!size || offset + sizeof(MQFILERECORD) > seg->size ||
+	   !mq_file_valid_(record, size, seg->size - offset))
+	{
+		SET_SYSERR(self, EAGAIN);
+		return -1;
+	}
+	if(journal->pcount == journal->pcap)
+	{
+		c = journal->pcap ? journal->pcap * 2 : MQ_FILE_PENDING;
+		pending = (struct mq_file_pending_struct *) malloc(sizeof(struct mq_file_pending_struct) * c);
+		if(!pending)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+		for(c = 0; c < journal->pcount; c++)
+		{
+			pending[c] = journal->pending[(journal->phead + c) % journal->pcap];
+		}
+		free(journal->pending);
+		journal->pending = pending;
+		journal->pcap = journal->pcap ? journal->pcap * 2 : MQ_FILE_PENDING;
+		journal->phead = 0;
+	}
+	p = mq_file_message_construct_(self);
+	if(!p)
+	{
+		return -1;
+	}
+	pending = &(journal->pending[(journal->phead + journal->pcount) % journal->pcap]);
+	pending->end = journal->pos + size;
+	pending->done = 0;
+	p->kind = MQK_INCOMING;
+	p->seq = journal->pseq + journal->pcount;
+	journal->pcount++;
+	p->journal = journal;
+	journal->refcount++;
+	p->segment = seg;
+	seg->refcount++;
+	s = (char *) (record + 1);
+#define MQ_FILE_VIEWSTR_(member, len) \
+	if(record->len != (uint32_t) MQ_FILE_ABSENT) \
+	{ \
+		p->member = s; \
+		s += record->len + 1; \
+	}
+	MQ_FILE_VIEWSTR_(type, typelen);
+	MQ_FILE_VIEWSTR_(subject, subjectlen);
+	MQ_FILE_VIEWSTR_(address, addresslen);
+#undef MQ_FILE_VIEWSTR_
+	p->body = (unsigned char *) s;
+	p->len = record->len;
+	journal->pos += size;
+	*msg = p;
+	return 0;
+}
+
+/* (Internal) obtain the next message from a receiver's journal, waiting up to
+ * timeout milliseconds (or indefinitely, if timeout is negative) for one to
+ * be written; the log is polled at increasing intervals
+ */
+static int
+mq_file_next_wait_(MQ *self, MQMESSAGE **msg, int timeout)
+{
+	unsigned long long deadline, now;
+	useconds_t interval;
+	int spin;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_RECV)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	deadline = timeout > 0 ? mq_file_now_() + (unsigned long long) timeout * 1000000ULL : 0;
+	interval = MQ_FILE_POLLMIN;
+	for(spin = 0; mq_file_read_(self, msg); spin++)
+	{
+		if(self->syserr != EAGAIN || !timeout)
+		{
+			return -1;
+		}
+		RESET_ERROR(self);
+		if(spin < MQ_FILE_SPIN)
+		{
+			sched_yield();
+			continue;
+		}
+		if(timeout > 0)
+		{
+			now = mq_file_now_();
+			if(now >= deadline)
+			{
+				SET_SYSERR(self, EAGAIN);
+				return -1;
+			}
+			if((deadline - now) / 1000 < interval)
+			{
+				interval = (useconds_t) ((deadline - now) / 1000) + 1;
+			}
+		}
+		usleep(interval);
+		if(interval < MQ_FILE_POLLMAX)
+		{
+			interval *= 2;
+		}
+	}
+	return 0;
+}
+
+/* (Internal) acknowledge an incoming message, advancing the stored consumer
+ * offset past every message at the start of the log which has now been
+ * acknowledged
+ */
+static void
+mq_file_ack_(MQMESSAGE *self)
+{
+	MQFILEJOURNAL *journal;
+	struct mq_file_pending_struct *pending;
+
+	journal = self->journal;
+	if(!journal || self->seq < journal->pseq || self->seq - journal->pseq >= journal->pcount)
+	{
+		return;
+	}
+	journal->pending[(journal->phead + (self->seq - journal->pseq)) % journal->pcap].done = 1;
+	if(self->seq != journal->pseq)
+	{
+		return;
+	}
+	while(journal->pcount)
+	{
+		pending = &(journal->pending[journal->phead]);
+		if(!pending->done)
+		{
+			break;
+		}
+		journal->committed = pending->end;
+		journal->phead = (journal->phead + 1) % journal->pcap;
+		journal->pcount--;
+		journal->pseq++;
+	}
+	*(journal->offset) = journal->committed;
+	mq_file_retire_(journal);
+}
+
+/* (Internal) remove any segments which lie entirely before a receiver's
+ * stored offset
+ */
+static void
+mq_file_retire_(MQFILEJOURNAL *journal)
+{
+	struct mq_file_header_struct header;
+	char *path;
+	int fd;
+
+	while(journal->retainedend > journal->retained && journal->committed >= journal->retainedend)
+	{
+		/* Ensure the offset is on disk before removing anything */
+		msync(journal->offset, sizeof(uint64_t), MS_SYNC);
+		path = mq_file_segment_path_(journal, journal->retained, ".log");
+		if(!path)
+		{
+			return;
+		}
+		unlink(path);
+		free(path);
+		journal->retained = journal->retainedend;
+		path = mq_file_segment_path_(journal, journal->retained, ".log");
+		if(!path)
+		{
+			return;
+		}
+		fd = open(path, O_RDONLY|O_CLOEXEC);
+		free(path);
+		if(fd == -1)
+		{
+			return;
+		}
+		if(pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == MQ_FILE_MAGIC)
+		{
+			journal->retainedend = journal->retained + header.size;
+		}
+		close(fd);
+	}
+}
+
+/* (Internal) flush a journal directory, so that a segment which has been
+ * created (or renamed) within it survives a crash
+ */
+static int
+mq_file_sync_dir_(MQFILEJOURNAL *journal)
+{
+	int fd, r, e;
+
+	fd = open(journal->dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(fd == -1)
+	{
+		return -1;
+	}
+	r = fsync(fd);
+	e = errno;
+	close(fd);
+	errno = e;
+	return r;
+}
+
+/* (Internal) determine whether a record's size, as already loaded by the
+ * caller, is consistent with the avail bytes of the segment which follow it
+ * and with the lengths of its contents, which must be checked before the
+ * record is hashed or read
+ */
+static int
+mq_file_valid_(const MQFILERECORD *record, uint32_t size, uint64_t avail)
+{
+	uint64_t need;
+
+	if(!size || size < sizeof(MQFILERECORD) || size > avail)
+	{
+		return 0;
+	}
+	need = sizeof(MQFILERECORD) + record->len;
+	need += record->typelen != (uint32_t) MQ_FILE_ABSENT ? (uint64_t) record->typelen + 1 : 0;
+	need += record->subjectlen != (uint32_t) MQ_FILE_ABSENT ? (uint64_t) record->subjectlen + 1 : 0;
+	need += record->addresslen != (uint32_t) MQ_FILE_ABSENT ? (uint64_t) record->addresslen + 1 : 0;
+	/* record->len may be large enough for need to have wrapped */
+	return record->len < size && need <= size;
+}
+
+/* (Internal) compute the check value of a record, a 32-bit FNV-1a hash of
+ * everything following the check member
+ */
+static uint32_t
+mq_file_check_(const MQFILERECORD *record)
+{
+	const unsigned char *p, *end;
+	uint32_t hash;
+
+	p = (const unsigned char *) &(record->typelen);
+	end = (const unsigned char *) (record + 1) + record->len;
+	end += record->typelen != (uint32_t) MQ_FILE_ABSENT ? record->typelen + 1 : 0;
+	end += record->subjectlen != (uint32_t) MQ_FILE_ABSENT ? record->subjectlen + 1 : 0;
+	end += record->addresslen != (uint32_t) MQ_FILE_ABSENT ? record->addresslen + 1 : 0;
+	hash = 2166136261UL;
+	for(; p < end; p++)
+	{
+		hash ^= *p;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/* (Internal) obtain the current time from the monotonic clock, in
+ * nanoseconds
+ */
+static unsigned long long
+mq_file_now_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/* (Internal) ensure that an outgoing message's body has room for len more
+ * bytes; a body which was adopted with a free function other than free() is
+ * copied first
+ */
+static int
+mq_file_grow_(MQMESSAGE *self, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if(self->body && self->free_fn != free)
+	{
+		p = (unsigned char *) malloc(self->len + len ? self->len + len : 1);
+		if(!p)
+		{
+			SET_ERRNO(self->connection);
+			return -1;
+		}
+		memcpy(p, self->body, self->len);
+		if(self->free_fn)
+		{
+			self->free_fn(self->body);
+		}
+		self->body = p;
+		self->size = self->len + len;
+		self->free_fn = free;
+		return 0;
+	}
+	if(self->body && self->len + len <= self->size)
+	{
+		return 0;
+	}
+	size = self->size ? self->size : 64;
+	while(size < self->len + len)
+	{
+		size <<= 1;
+	}
+	p = (unsigned char *) realloc(self->body, size);
+	if(!p)
+	{
+		SET_ERRNO(self->connection);
+		return -1;
+	}
+	self->body = p;
+	self->size = size;
+	self->free_fn = free;
+	return 0;
+}
+
+/* (Internal) replace one of an outgoing message's string properties */
+static int
+mq_file_strset_(MQMESSAGE *self, char **dest, const char *src)
+{
+	char *p;
+
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	p = NULL;
+	if(src)
+	{
+		p = strdup(src);
+		if(!p)
+		{
+			SET_ERRNO(self->connection);
+			return -1;
+		}
+	}
+	free(*dest);
+	*dest = p;
+	return 0;
+}
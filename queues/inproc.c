@@ -0,0 +1,1785 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* The inproc: engine passes messages between threads of the same process.
+ *
+ * Connections to inproc:NAME (or inproc://NAME) with the same NAME share a
+ * queue; each partition of a queue is a separate bounded lock-free ring of
+ * message payloads, whose capacity may be specified when the ring is first
+ * created with inproc:NAME?capacity=N. Sending a message moves its payload
+ * (including its body buffer) onto the ring, and receiving one moves it off
+ * again, so bodies are never copied.
+ *
+ * Receivers wait for an empty ring, and senders for a full one, by spinning
+ * briefly before sleeping on a futex (or, where futexes aren't available, a
+ * condition variable). Rings which still hold messages when the last
+ * connection using them goes away are retained, so that messages can be sent
+ * before anything is listening for them.
+ */
+
+#define MQ_CONNECTION_STRUCT_DEFINED   1
+#define MQ_MESSAGE_STRUCT_DEFINED      1
+
+#include "p_libmq.h"
+
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#ifdef HAVE_LINUX_FUTEX_H
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
+
+#define MQ_ERRBUF_LEN                  128
+/* The default and maximum number of messages a ring can hold */
+#define MQ_INPROC_CAPACITY             1024
+#define MQ_INPROC_MAXCAPACITY          (1 << 24)
+/* The number of times an empty or full ring is polled before sleeping */
+#define MQ_INPROC_SPIN                 128
+
+typedef struct mq_inproc_ring_struct MQINPROCRING;
+typedef struct mq_inproc_payload_struct MQINPROCPAYLOAD;
+
+/* MQ implementation members */
+static unsigned long mq_inproc_release_(MQ *self);
+static int mq_inproc_error_(MQ *self);
+static const char *mq_inproc_errmsg_(MQ *self);
+static MQSTATE mq_inproc_state_(MQ *self);
+static int mq_inproc_connect_recv_(MQ *self);
+static int mq_inproc_connect_send_(MQ *self);
+static int mq_inproc_disconnect_(MQ *self);
+static int mq_inproc_next_(MQ *self, MQMESSAGE **msg);
+static int mq_inproc_deliver_(MQ *self);
+static int mq_inproc_create_(MQ *self, MQMESSAGE **msg);
+static int mq_inproc_set_cluster_(MQ *self, CLUSTER *cluster);
+static CLUSTER *mq_inproc_cluster_(MQ *self);
+static int mq_inproc_set_partition_(MQ *self, const char *partition);
+static const char *mq_inproc_partition_(MQ *self);
+static int mq_inproc_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received);
+static int mq_inproc_send_batch_(MQ *self, MQMESSAGE **msgs, size_t count);
+static int mq_inproc_next_timed_(MQ *self, MQMESSAGE **msg, int timeout);
+static int mq_inproc_set_option_(MQ *self, MQOPTION option, long value);
+static int mq_inproc_fd_(MQ *self, int *events);
+static int mq_inproc_process_(MQ *self);
+static MQCOMMON *mq_inproc_common_(MQ *self);
+static int mq_inproc_pending_(MQ *self);
+
+/* MQMESSAGE implementation members */
+static unsigned long mq_inproc_message_release_(MQMESSAGE *self);
+static MQMSGKIND mq_inproc_message_kind_(MQMESSAGE *self);
+static int mq_inproc_message_accept_(MQMESSAGE *self);
+static int mq_inproc_message_reject_(MQMESSAGE *self);
+static int mq_inproc_message_pass_(MQMESSAGE *self);
+static int mq_inproc_message_send_(MQMESSAGE *self);
+static int mq_inproc_message_set_type_(MQMESSAGE *self, const char *type);
+static const char *mq_inproc_message_type_(MQMESSAGE *self);
+static int mq_inproc_message_set_subject_(MQMESSAGE *self, const char *type);
+static const char *mq_inproc_message_subject_(MQMESSAGE *self);
+static int mq_inproc_message_set_address_(MQMESSAGE *self, const char *address);
+static const char *mq_inproc_message_address_(MQMESSAGE *self);
+static const unsigned char *mq_inproc_message_body_(MQMESSAGE *self);
+static size_t mq_inproc_message_len_(MQMESSAGE *self);
+static int mq_inproc_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len);
+static int mq_inproc_message_set_partition_(MQMESSAGE *self, const char *partition);
+static const char *mq_inproc_message_partition_(MQMESSAGE *self);
+static int mq_inproc_message_add_iov_(MQMESSAGE *self, const struct iovec *iov, int iovcnt);
+static int mq_inproc_message_add_bytes_owned_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn);
+static unsigned char *mq_inproc_message_take_body_(MQMESSAGE *self, size_t *buflen);
+static MQ *mq_inproc_message_connection_(MQMESSAGE *self);
+static int mq_inproc_message_set_encoding_(MQMESSAGE *self, const char *encoding);
+static const char *mq_inproc_message_encoding_(MQMESSAGE *self);
+static int mq_inproc_message_replace_body_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn);
+
+/* A slot in a ring: seq is used to determine whether the slot is free to be
+ * written to or ready to be read from, as in Dmitry Vyukov's bounded
+ * multiple-producer, multiple-consumer queue
+ */
+struct mq_inproc_slot_struct
+{
+	size_t seq;
+	MQINPROCPAYLOAD *payload;
+};
+
+struct mq_inproc_ring_struct
+{
+	/* Registry members, protected by registrylock */
+	MQINPROCRING *next;
+	char *key;
+	unsigned long refcount;
+	/* The ring itself: enqueue and dequeue are the positions at which the
+	 * next message will be written and read respectively
+	 */
+	size_t mask;
+	struct mq_inproc_slot_struct *slots;
+	size_t enqueue;
+	size_t dequeue;
+	/* pushed and popped are incremented after each message is written
+	 * or read, and are used as futexes by waiting receivers and senders
+	 * respectively; the waiters counts are used to avoid waking when
+	 * nobody is waiting
+	 */
+	unsigned int pushed;
+	unsigned int popped;
+	unsigned int recvwaiters;
+	unsigned int sendwaiters;
+#ifndef HAVE_LINUX_FUTEX_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+	/* An eventfd which is signalled whenever a message is written, created
+	 * the first time a receiver calls fd()
+	 */
+	int efd;
+};
+
+/* The content of a message, which is moved between connections */
+struct mq_inproc_payload_struct
+{
+	char *type;
+	char *subject;
+	char *address;
+	char *partition;
+	char *encoding;
+	unsigned char *body;
+	size_t len;
+	size_t size;
+	MQFREEFN free_fn;
+};
+
+struct mq_connection_struct
+{
+	MQCONNIMPL *impl;
+	MQ_CONNECTION_COMMON_MEMBERS;
+	char *name;
+	size_t capacity;
+	char *partition;
+	/* The ring a receiver reads from */
+	MQINPROCRING *ring;
+	/* The rings a sender has written to */
+	MQINPROCRING **rings;
+	size_t nrings;
+	/* Released message objects retained for re-use, and the maximum
+	 * number to retain (negative for no limit)
+	 */
+	MQMESSAGE *pool;
+	size_t poolcount;
+	long poollimit;
+};
+
+struct mq_message_struct
+{
+	MQMESSAGEIMPL *impl;
+	MQ_MESSAGE_COMMON_MEMBERS;
+	/* The message content; this is NULL once an outgoing message has been
+	 * sent
+	 */
+	MQINPROCPAYLOAD *payload;
+	/* The next message in the connection's pool */
+	MQMESSAGE *next;
+};
+
+static MQCONNIMPL mq_inproc_connection_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_inproc_release_,
+	mq_inproc_error_,
+	mq_inproc_errmsg_,
+	mq_inproc_state_,
+	mq_inproc_connect_recv_,
+	mq_inproc_connect_send_,
+	mq_inproc_disconnect_,
+	mq_inproc_next_,
+	mq_inproc_deliver_,
+	mq_inproc_create_,
+	mq_inproc_set_cluster_,
+	mq_inproc_cluster_,
+	mq_inproc_set_partition_,
+	mq_inproc_partition_,
+	mq_inproc_next_batch_,
+	mq_inproc_send_batch_,
+	mq_inproc_next_timed_,
+	mq_inproc_set_option_,
+	mq_inproc_fd_,
+	mq_inproc_process_,
+	mq_inproc_common_,
+	/* set_spool */
+	NULL,
+	mq_inproc_pending_,
+	/* set_sent_callback */
+	NULL,
+	/* set_partitions */
+	NULL
+};
+
+static MQMESSAGEIMPL mq_inproc_message_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_inproc_message_release_,
+	mq_inproc_message_kind_,
+	mq_inproc_message_accept_,
+	mq_inproc_message_reject_,
+	mq_inproc_message_pass_,
+	mq_inproc_message_send_,
+	mq_inproc_message_set_type_,
+	mq_inproc_message_type_,
+	mq_inproc_message_set_subject_,
+	mq_inproc_message_subject_,
+	mq_inproc_message_set_address_,
+	mq_inproc_message_address_,
+	mq_inproc_message_body_,
+	mq_inproc_message_len_,
+	mq_inproc_message_add_bytes_,
+	mq_inproc_message_set_partition_,
+	mq_inproc_message_partition_,
+	mq_inproc_message_add_iov_,
+	mq_inproc_message_add_bytes_owned_,
+	mq_inproc_message_take_body_,
+	mq_inproc_message_connection_,
+	/* status */
+	NULL,
+	mq_inproc_message_set_encoding_,
+	mq_inproc_message_encoding_,
+	mq_inproc_message_replace_body_
+};
+
+MQ *mq_inproc_construct_(const char *uri, const char *reserved1, const char *reserved2);
+
+/* Internal utilities */
+static MQMESSAGE *mq_inproc_message_construct_(MQ *self);
+static void mq_inproc_pool_trim_(MQ *self, size_t limit);
+static MQINPROCRING *mq_inproc_ring_get_(MQ *self, const char *partition);
+static void mq_inproc_ring_put_(MQINPROCRING *ring);
+static MQINPROCRING *mq_inproc_sender_ring_(MQ *self, const char *partition);
+static int mq_inproc_ring_push_(MQINPROCRING *ring, MQINPROCPAYLOAD *payload);
+static MQINPROCPAYLOAD *mq_inproc_ring_pop_(MQINPROCRING *ring);
+static int mq_inproc_ring_wait_(MQINPROCRING *ring, unsigned int *futex, unsigned int *waiters, int forspace, int timeout, const struct timespec *deadline);
+static void mq_inproc_deadline_(struct timespec *deadline, int timeout);
+static void mq_inproc_ring_wake_(MQINPROCRING *ring, unsigned int *futex, unsigned int *waiters);
+static int mq_inproc_push_(MQ *self, MQINPROCRING *ring, MQINPROCPAYLOAD *payload);
+static int mq_inproc_pop_(MQ *self, MQMESSAGE **msg, int timeout);
+static MQMESSAGE *mq_inproc_wrap_(MQ *self, MQINPROCPAYLOAD *payload);
+static void mq_inproc_payload_free_(MQINPROCPAYLOAD *payload);
+static int mq_inproc_payload_grow_(MQINPROCPAYLOAD *payload, size_t len);
+static int mq_inproc_strset_(MQMESSAGE *self, char **dest, const char *src);
+
+/* registrylock protects the list of rings and their reference counts */
+static pthread_mutex_t registrylock = PTHREAD_MUTEX_INITIALIZER;
+static MQINPROCRING *rings;
+
+MQ_ENGINE_PLUGIN;
+
+int
+mq_entry(void *self)
+{
+	if(mq_register("inproc", mq_inproc_construct_, self))
+	{
+		fprintf(stderr, "MQ: inproc: constructor registration failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* In-process message queue constructor: this is invoked by libmq to create a
+ * new inproc-flavoured MQ instance
+ */
+MQ *
+mq_inproc_construct_(const char *uri, const char *reserved1, const char *reserved2)
+{
+	MQ *mq;
+	const char *name, *query;
+	size_t len;
+	long capacity;
+
+	(void) reserved1;
+	(void) reserved2;
+
+	name = strchr(uri, ':');
+	name = name ? name + 1 : uri;
+	if(!strncmp(name, "//", 2))
+	{
+		name += 2;
+	}
+	query = strchr(name, '?');
+	len = query ? (size_t) (query - name) : strlen(name);
+	capacity = MQ_INPROC_CAPACITY;
+	if(query)
+	{
+		if(strncmp(query, "?capacity=", 10) ||
+		   (capacity = strtol(query + 10, NULL, 10)) < 1 ||
+		   capacity > MQ_INPROC_MAXCAPACITY)
+		{
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	mq = (MQ *) calloc(1, sizeof(MQ));
+	if(!mq)
+	{
+		return NULL;
+	}
+	mq->impl = &mq_inproc_connection_impl_;
+	mq->uri = strdup(uri);
+	mq->name = (char *) malloc(len + 1);
+	if(!mq->uri || !mq->name)
+	{
+		free(mq->uri);
+		free(mq->name);
+		free(mq);
+		return NULL;
+	}
+	memcpy(mq->name, name, len);
+	mq->name[len] = 0;
+	/* Rings have a power-of-two capacity */
+	for(mq->capacity = 1; mq->capacity < (size_t) capacity; mq->capacity <<= 1);
+	mq->poollimit = -1;
+	return mq;
+}
+
+/* Free an MQ connection object */
+static unsigned long
+mq_inproc_release_(MQ *self)
+{
+	mq_inproc_disconnect_(self);
+	mq_inproc_pool_trim_(self, 0);
+	free(self->rings);
+	free(self->partition);
+	free(self->name);
+	free(self->errmsg);
+	free(self->uri);
+	free(self);
+	return 0;
+}
+
+/* Return an indicator as to whether the connection is in an error state */
+static int
+mq_inproc_error_(MQ *self)
+{
+	if(self->errcode || self->syserr)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* Return the error message for the connection */
+static const char *
+mq_inproc_errmsg_(MQ *self)
+{
+	if(!self->errmsg)
+	{
+		self->errmsg = (char *) malloc(MQ_ERRBUF_LEN);
+		if(!self->errmsg)
+		{
+			return "Memory allocation error obtaining error message";
+		}
+	}
+	self->errmsg[0] = 0;
+	if(self->syserr)
+	{
+		strerror_r(self->syserr, self->errmsg, MQ_ERRBUF_LEN);
+		return self->errmsg;
+	}
+	if(self->errcode)
+	{
+		snprintf(self->errmsg, MQ_ERRBUF_LEN, "Unknown error #%d", self->errcode);
+		return self->errmsg;
+	}
+	return "Success";
+}
+
+/* Return the MQ connection state */
+static MQSTATE
+mq_inproc_state_(MQ *self)
+{
+	RESET_ERROR(self);
+	return self->state;
+}
+
+/* Establish a connection for receiving, attaching to the ring for the
+ * connection's partition
+ */
+static int
+mq_inproc_connect_recv_(MQ *self)
+{
+	RESET_ERROR(self);
+	if(self->state != MQS_DISCONNECTED)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	self->ring = mq_inproc_ring_get_(self, self->partition);
+	if(!self->ring)
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	self->state = MQS_RECV;
+	return 0;
+}
+
+/* Establish a connection for sending; rings are attached to as messages are
+ * sent to them
+ */
+static int
+mq_inproc_connect_send_(MQ *self)
+{
+	RESET_ERROR(self);
+	if(self->state != MQS_DISCONNECTED)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	self->state = MQS_SEND;
+	return 0;
+}
+
+/* Disconnect from a message queue */
+static int
+mq_inproc_disconnect_(MQ *self)
+{
+	size_t c;
+
+	RESET_ERROR(self);
+	if(self->ring)
+	{
+		mq_inproc_ring_put_(self->ring);
+		self->ring = NULL;
+	}
+	for(c = 0; c < self->nrings; c++)
+	{
+		mq_inproc_ring_put_(self->rings[c]);
+	}
+	self->nrings = 0;
+	self->state = MQS_DISCONNECTED;
+	return 0;
+}
+
+/* Wait for a message to arrive via a connection */
+static int
+mq_inproc_next_(MQ *self, MQMESSAGE **msg)
+{
+	return mq_inproc_pop_(self, msg, self->nonblock ? 0 : -1);
+}
+
+/* Wait up to timeout milliseconds for a message to arrive */
+static int
+mq_inproc_next_timed_(MQ *self, MQMESSAGE **msg, int timeout)
+{
+	return mq_inproc_pop_(self, msg, timeout);
+}
+
+/* Obtain up to count messages, waiting only for the first */
+static int
+mq_inproc_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received)
+{
+	MQINPROCPAYLOAD *payload;
+	size_t n;
+
+	*received = 0;
+	if(!count)
+	{
+		RESET_ERROR(self);
+		return 0;
+	}
+	if(mq_inproc_next_(self, &(msgs[0])))
+	{
+		return -1;
+	}
+	for(n = 1; n < count; n++)
+	{
+		payload = mq_inproc_ring_pop_(self->ring);
+		if(!payload)
+		{
+			break;
+		}
+		msgs[n] = mq_inproc_wrap_(self, payload);
+		if(!msgs[n])
+		{
+			/* Put the payload back for somebody else */
+			mq_inproc_push_(self, self->ring, payload);
+			break;
+		}
+	}
+	*received = n;
+	RESET_ERROR(self);
+	return 0;
+}
+
+/* Messages are delivered as soon as they are sent, so there is never
+ * anything to do here
+ */
+static int
+mq_inproc_deliver_(MQ *self)
+{
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	return 0;
+}
+
+/* Send a set of messages */
+static int
+mq_inproc_send_batch_(MQ *self, MQMESSAGE **msgs, size_t count)
+{
+	size_t c;
+
+	for(c = 0; c < count; c++)
+	{
+		if(msgs[c]->connection != self)
+		{
+			SET_SYSERR(self, EINVAL);
+			return -1;
+		}
+		if(mq_inproc_message_send_(msgs[c]))
+		{
+			return -1;
+		}
+	}
+	RESET_ERROR(self);
+	return 0;
+}
+
+/* Create a new outgoing message */
+static int
+mq_inproc_create_(MQ *self, MQMESSAGE **msg)
+{
+	MQMESSAGE *p;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	p = mq_inproc_message_construct_(self);
+	if(!p)
+	{
+		return -1;
+	}
+	p->payload = (MQINPROCPAYLOAD *) calloc(1, sizeof(MQINPROCPAYLOAD));
+	if(!p->payload)
+	{
+		SET_ERRNO(self);
+		mq_inproc_message_release_(p);
+		return -1;
+	}
+	p->kind = MQK_OUTGOING;
+	*msg = p;
+	return 0;
+}
+
+/* Set the cluster associated with a connection */
+static int
+mq_inproc_set_cluster_(MQ *self, CLUSTER *cluster)
+{
+	self->cluster = cluster;
+	return self->impl->set_partition(self, cluster_partition(cluster));
+}
+
+/* Obtain the cluster (if any) associated with a connection */
+static CLUSTER *
+mq_inproc_cluster_(MQ *self)
+{
+	return self->cluster;
+}
+
+/* Set the name of the partition this queue uses (NULL or an empty string
+ * will unset it); a receiver switches to the partition's ring
+ */
+static int
+mq_inproc_set_partition_(MQ *self, const char *partition)
+{
+	MQINPROCRING *ring;
+	char *p;
+
+	RESET_ERROR(self);
+	p = NULL;
+	if(partition && partition[0])
+	{
+		p = strdup(partition);
+		if(!p)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+	}
+	if(self->state == MQS_RECV)
+	{
+		ring = mq_inproc_ring_get_(self, p);
+		if(!ring)
+		{
+			SET_ERRNO(self);
+			free(p);
+			return -1;
+		}
+		mq_inproc_ring_put_(self->ring);
+		self->ring = ring;
+	}
+	free(self->partition);
+	self->partition = p;
+	return 0;
+}
+
+/* Obtain the partition (if any) associated with a connection */
+static const char *
+mq_inproc_partition_(MQ *self)
+{
+	return self->partition;
+}
+
+/* Set a connection option */
+static int
+mq_inproc_set_option_(MQ *self, MQOPTION option, long value)
+{
+	RESET_ERROR(self);
+	switch(option)
+	{
+	case MQO_NONBLOCK:
+		self->nonblock = !!value;
+		return 0;
+	case MQO_POOL:
+		self->poollimit = value < 0 ? -1 : value;
+		if(value >= 0)
+		{
+			mq_inproc_pool_trim_(self, (size_t) value);
+		}
+		return 0;
+	default:
+		break;
+	}
+	SET_SYSERR(self, ENOTSUP);
+	return -1;
+}
+
+/* Obtain a pollable file descriptor for a receiver: an eventfd which is
+ * signalled whenever a message is written to the ring. It should be
+ * cleared with mq_process() before messages are read without blocking.
+ */
+static int
+mq_inproc_fd_(MQ *self, int *events)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	int fd;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_RECV)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	fd = MQ_ATOMIC_LOAD(&(self->ring->efd));
+	if(fd == -1)
+	{
+		pthread_mutex_lock(&registrylock);
+		if(self->ring->efd == -1)
+		{
+			/* Start off signalled, in case the ring isn't empty */
+			fd = eventfd(1, EFD_CLOEXEC|EFD_NONBLOCK);
+			MQ_ATOMIC_STORE(&(self->ring->efd), fd);
+		}
+		fd = self->ring->efd;
+		pthread_mutex_unlock(&registrylock);
+		if(fd == -1)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+	}
+	if(events)
+	{
+		*events = MQE_READ;
+	}
+	return fd;
+#else
+	(void) events;
+
+	SET_SYSERR(self, ENOTSUP);
+	return -1;
+#endif
+}
+
+/* Perform any pending work on the connection: for a receiver which is using
+ * fd(), this clears the eventfd once the ring has been drained. As the
+ * eventfd is shared by every receiver from the ring, it is signalled again
+ * if messages remain, so that none of them misses a wake-up.
+ */
+static int
+mq_inproc_process_(MQ *self)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	eventfd_t value;
+	int fd;
+
+	RESET_ERROR(self);
+	if(self->state == MQS_RECV &&
+	   (fd = MQ_ATOMIC_LOAD(&(self->ring->efd))) != -1)
+	{
+		eventfd_read(fd, &value);
+		/* A sender which writes to the ring after this check signals
+		 * the eventfd itself
+		 */
+		if(__atomic_load_n(&(self->ring->enqueue), __ATOMIC_SEQ_CST) !=
+		   __atomic_load_n(&(self->ring->dequeue), __ATOMIC_SEQ_CST))
+		{
+			eventfd_write(fd, 1);
+		}
+	}
+	return 0;
+#else
+	RESET_ERROR(self);
+	return 0;
+#endif
+}
+
+/* Obtain the state maintained by libmq for the connection */
+static MQCOMMON *
+mq_inproc_common_(MQ *self)
+{
+	return &(self->common);
+}
+
+/* Obtain the number of messages waiting to be received; this includes any
+ * which are still being written by a sender
+ */
+static int
+mq_inproc_pending_(MQ *self)
+{
+	size_t enq, deq;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_RECV)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	deq = __atomic_load_n(&(self->ring->dequeue), __ATOMIC_RELAXED);
+	enq = __atomic_load_n(&(self->ring->enqueue), __ATOMIC_RELAXED);
+	if(enq <= deq)
+	{
+		return 0;
+	}
+	return enq - deq > INT_MAX ? INT_MAX : (int) (enq - deq);
+}
+
+/* Release (destroy) a message, freeing its payload if it has one */
+static unsigned long
+mq_inproc_message_release_(MQMESSAGE *self)
+{
+	MQ *conn;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	if(self->payload)
+	{
+		mq_inproc_payload_free_(self->payload);
+		self->payload = NULL;
+	}
+	if(conn->poollimit >= 0 && conn->poolcount >= (size_t) conn->poollimit)
+	{
+		free(self);
+		return 0;
+	}
+	self->next = conn->pool;
+	conn->pool = self;
+	conn->poolcount++;
+	return 0;
+}
+
+static MQMSGKIND
+mq_inproc_message_kind_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->kind;
+}
+
+/* Mark an incoming message as being accepted */
+static int
+mq_inproc_message_accept_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_INCOMING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return 0;
+}
+
+/* Reject an incoming message: it is simply discarded */
+static int
+mq_inproc_message_reject_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_INCOMING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return 0;
+}
+
+/* Pass on an incoming message, returning it to the ring so that it can be
+ * received again
+ */
+static int
+mq_inproc_message_pass_(MQMESSAGE *self)
+{
+	MQ *conn;
+	int nonblock;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	if(self->kind != MQK_INCOMING || !self->payload || !conn->ring)
+	{
+		SET_SYSERR(conn, EINVAL);
+		return -1;
+	}
+	/* Never wait for space: the ring may be full of messages which this
+	 * thread would otherwise be the one to receive
+	 */
+	nonblock = conn->nonblock;
+	conn->nonblock = 1;
+	if(mq_inproc_push_(conn, conn->ring, self->payload))
+	{
+		conn->nonblock = nonblock;
+		return -1;
+	}
+	conn->nonblock = nonblock;
+	self->payload = NULL;
+	return 0;
+}
+
+/* Send an outgoing message to the ring for its partition, moving the payload
+ * there
+ */
+static int
+mq_inproc_message_send_(MQMESSAGE *self)
+{
+	MQ *conn;
+	MQINPROCRING *ring;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	if(self->kind != MQK_OUTGOING || !self->payload)
+	{
+		SET_SYSERR(conn, EINVAL);
+		return -1;
+	}
+	ring = mq_inproc_sender_ring_(conn, mq_inproc_message_partition_(self));
+	if(!ring)
+	{
+		return -1;
+	}
+	if(mq_inproc_push_(conn, ring, self->payload))
+	{
+		return -1;
+	}
+	self->payload = NULL;
+	return 0;
+}
+
+/* Set the content-type of an outgoing message */
+static int
+mq_inproc_message_set_type_(MQMESSAGE *self, const char *type)
+{
+	return mq_inproc_strset_(self, self->payload ? &(self->payload->type) : NULL, type);
+}
+
+/* Retrieve the content-type of a message */
+static const char *
+mq_inproc_message_type_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->payload ? self->payload->type : NULL;
+}
+
+/* Set the subject of a message */
+static int
+mq_inproc_message_set_subject_(MQMESSAGE *self, const char *subject)
+{
+	return mq_inproc_strset_(self, self->payload ? &(self->payload->subject) : NULL, subject);
+}
+
+/* Retrieve the subject of a message */
+static const char *
+mq_inproc_message_subject_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->payload ? self->payload->subject : NULL;
+}
+
+/* Set the address (destination) of an outgoing message */
+static int
+mq_inproc_message_set_address_(MQMESSAGE *self, const char *address)
+{
+	return mq_inproc_strset_(self, self->payload ? &(self->payload->address) : NULL, address);
+}
+
+/* Retrieve the address of a message: if none was set when it was sent, this
+ * is the URI of the connection
+ */
+static const char *
+mq_inproc_message_address_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->payload && self->payload->address)
+	{
+		return self->payload->address;
+	}
+	return self->connection->uri;
+}
+
+/* Retrieve the body of a message */
+static const unsigned char *
+mq_inproc_message_body_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(!self->payload)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return NULL;
+	}
+	if(!self->payload->body)
+	{
+		return (const unsigned char *) "";
+	}
+	return self->payload->body;
+}
+
+/* Retrieve the length of a message body, in bytes */
+static size_t
+mq_inproc_message_len_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(!self->payload)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return (size_t) -1;
+	}
+	return self->payload->len;
+}
+
+/* Add a sequence of bytes to an outgoing message body */
+static int
+mq_inproc_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING || !self->payload)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	if(mq_inproc_payload_grow_(self->payload, len))
+	{
+		SET_ERRNO(self->connection);
+		return -1;
+	}
+	memcpy(&(self->payload->body[self->payload->len]), buf, len);
+	self->payload->len += len;
+	return 0;
+}
+
+/* Add a sequence of bytes gathered from a set of buffers to an outgoing
+ * message body
+ */
+static int
+mq_inproc_message_add_iov_(MQMESSAGE *self, const struct iovec *iov, int iovcnt)
+{
+	size_t len;
+	int c;
+
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING || !self->payload)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	len = 0;
+	for(c = 0; c < iovcnt; c++)
+	{
+		len += iov[c].iov_len;
+	}
+	if(mq_inproc_payload_grow_(self->payload, len))
+	{
+		SET_ERRNO(self->connection);
+		return -1;
+	}
+	for(c = 0; c < iovcnt; c++)
+	{
+		memcpy(&(self->payload->body[self->payload->len]), iov[c].iov_base, iov[c].iov_len);
+		self->payload->len += iov[c].iov_len;
+	}
+	return 0;
+}
+
+/* Add a buffer to an outgoing message body: if the body is empty, the
+ * buffer is adopted as-is
+ */
+static int
+mq_inproc_message_add_bytes_owned_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING || !self->payload)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	if(self->payload->body)
+	{
+		if(mq_inproc_message_add_bytes_(self, buf, len))
+		{
+			return -1;
+		}
+		if(free_fn)
+		{
+			free_fn(buf);
+		}
+		return 0;
+	}
+	self->payload->body = buf;
+	self->payload->len = len;
+	self->payload->size = len;
+	self->payload->free_fn = free_fn;
+	return 0;
+}
+
+/* Detach the body of a message: this only involves a copy if the body was
+ * supplied by the sender with a free function other than free()
+ */
+static unsigned char *
+mq_inproc_message_take_body_(MQMESSAGE *self, size_t *buflen)
+{
+	MQINPROCPAYLOAD *payload;
+	unsigned char *p;
+
+	RESET_ERROR(self->connection);
+	payload = self->payload;
+	if(!payload)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return NULL;
+	}
+	if(payload->body && payload->free_fn == free)
+	{
+		p = payload->body;
+	}
+	else
+	{
+		p = (unsigned char *) malloc(payload->len ? payload->len : 1);
+		if(!p)
+		{
+			SET_ERRNO(self->connection);
+			return NULL;
+		}
+		if(payload->len)
+		{
+			memcpy(p, payload->body, payload->len);
+		}
+		if(payload->body && payload->free_fn)
+		{
+			payload->free_fn(payload->body);
+		}
+	}
+	if(buflen)
+	{
+		*buflen = payload->len;
+	}
+	payload->body = NULL;
+	payload->len = payload->size = 0;
+	payload->free_fn = NULL;
+	return p;
+}
+
+/* Set the partition used for a message: NULL will cause the connection's
+ * partition to be used, while an empty string will cause the message to be
+ * sent to the queue's default ring regardless of the connection's settings
+ */
+static int
+mq_inproc_message_set_partition_(MQMESSAGE *self, const char *partition)
+{
+	if(!self->payload)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	if(!partition)
+	{
+		free(self->payload->partition);
+		self->payload->partition = NULL;
+		return 0;
+	}
+	return mq_inproc_strset_(self, &(self->payload->partition), partition);
+}
+
+/* Obtain the partition for a message, which defaults to that of its
+ * connection
+ */
+static const char *
+mq_inproc_message_partition_(MQMESSAGE *self)
+{
+	if(!self->payload || !self->payload->partition)
+	{
+		return self->connection->partition;
+	}
+	if(!self->payload->partition[0])
+	{
+		return NULL;
+	}
+	return self->payload->partition;
+}
+
+/* Obtain the connection that a message is associated with */
+static MQ *
+mq_inproc_message_connection_(MQMESSAGE *self)
+{
+	return self->connection;
+}
+
+/* Set the content-encoding of an outgoing message */
+static int
+mq_inproc_message_set_encoding_(MQMESSAGE *self, const char *encoding)
+{
+	return mq_inproc_strset_(self, self->payload ? &(self->payload->encoding) : NULL, encoding);
+}
+
+/* Retrieve the content-encoding of a message */
+static const char *
+mq_inproc_message_encoding_(MQMESSAGE *self)
+{
+	return self->payload ? self->payload->encoding : NULL;
+}
+
+/* Replace the body of an incoming message with a decoded one, which the
+ * message takes ownership of
+ */
+static int
+mq_inproc_message_replace_body_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn)
+{
+	MQINPROCPAYLOAD *payload;
+
+	RESET_ERROR(self->connection);
+	payload = self->payload;
+	if(self->kind != MQK_INCOMING || !payload)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	if(payload->body && payload->free_fn)
+	{
+		payload->free_fn(payload->body);
+	}
+	payload->body = buf;
+	payload->len = len;
+	payload->size = len;
+	payload->free_fn = free_fn;
+	free(payload->encoding);
+	payload->encoding = NULL;
+	return 0;
+}
+
+/* (Internal) create a new MQ message object */
+static MQMESSAGE *
+mq_inproc_message_construct_(MQ *self)
+{
+	MQMESSAGE *p;
+
+	if(self->pool)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		p->next = NULL;
+		return p;
+	}
+	p = (MQMESSAGE *) calloc(1, sizeof(MQMESSAGE));
+	if(!p)
+	{
+		SET_ERRNO(self);
+		return NULL;
+	}
+	p->impl = &mq_inproc_message_impl_;
+	p->connection = self;
+	return p;
+}
+
+/* (Internal) destroy pooled message objects until no more than limit remain */
+static void
+mq_inproc_pool_trim_(MQ *self, size_t limit)
+{
+	MQMESSAGE *p;
+
+	while(self->poolcount > limit)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		free(p);
+	}
+}
+
+/* (Internal) wrap an incoming payload in a message object */
+static MQMESSAGE *
+mq_inproc_wrap_(MQ *self, MQINPROCPAYLOAD *payload)
+{
+	MQMESSAGE *p;
+
+	p = mq_inproc_message_construct_(self);
+	if(!p)
+	{
+		return NULL;
+	}
+	p->kind = MQK_INCOMING;
+	p->payload = payload;
+	return p;
+}
+
+/* (Internal) obtain the next message from a receiver's ring, waiting up to
+ * timeout milliseconds (or indefinitely, if timeout is negative) for one to
+ * arrive
+ */
+static int
+mq_inproc_pop_(MQ *self, MQMESSAGE **msg, int timeout)
+{
+	MQINPROCRING *ring;
+	MQINPROCPAYLOAD *payload;
+	struct timespec deadline;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_RECV)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	ring = self->ring;
+	/* Another receiver may take the message which woke this one, so the
+	 * timeout applies to the call as a whole rather than to each wait
+	 */
+	if(timeout > 0)
+	{
+		mq_inproc_deadline_(&deadline, timeout);
+	}
+	while(!(payload = mq_inproc_ring_pop_(ring)))
+	{
+		if(mq_inproc_ring_wait_(ring, &(ring->pushed), &(ring->recvwaiters), 0, timeout, &deadline))
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+	}
+	mq_inproc_ring_wake_(ring, &(ring->popped), &(ring->sendwaiters));
+	*msg = mq_inproc_wrap_(self, payload);
+	if(!*msg)
+	{
+		mq_inproc_push_(self, ring, payload);
+		return -1;
+	}
+	return 0;
+}
+
+/* (Internal) write a payload to a ring, waiting for space unless the
+ * connection is non-blocking
+ */
+static int
+mq_inproc_push_(MQ *self, MQINPROCRING *ring, MQINPROCPAYLOAD *payload)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	int fd;
+#endif
+
+	while(mq_inproc_ring_push_(ring, payload))
+	{
+		if(mq_inproc_ring_wait_(ring, &(ring->popped), &(ring->sendwaiters), 1, self->nonblock ? 0 : -1, NULL))
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+	}
+	mq_inproc_ring_wake_(ring, &(ring->pushed), &(ring->recvwaiters));
+#ifdef HAVE_SYS_EVENTFD_H
+	if((fd = MQ_ATOMIC_LOAD(&(ring->efd))) != -1)
+	{
+		eventfd_write(fd, 1);
+	}
+#endif
+	return 0;
+}
+
+/* (Internal) write a payload to a ring without waiting; returns -1 if the
+ * ring is full
+ */
+static int
+mq_inproc_ring_push_(MQINPROCRING *ring, MQINPROCPAYLOAD *payload)
+{
+	struct mq_inproc_slot_struct *slot;
+	size_t pos, seq;
+	long dif;
+
+	pos = __atomic_load_n(&(ring->enqueue), __ATOMIC_RELAXED);
+	for(;;)
+	{
+		slot = &(ring->slots[pos & ring->mask]);
+		seq = MQ_ATOMIC_LOAD(&(slot->seq));
+		dif = (long) seq - (long) pos;
+		if(!dif)
+		{
+			if(__atomic_compare_exchange_n(&(ring->enqueue), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if(dif < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = __atomic_load_n(&(ring->enqueue), __ATOMIC_RELAXED);
+		}
+	}
+	slot->payload = payload;
+	MQ_ATOMIC_STORE(&(slot->seq), pos + 1);
+	return 0;
+}
+
+/* (Internal) read a payload from a ring without waiting; returns NULL if the
+ * ring is empty
+ */
+static MQINPROCPAYLOAD *
+mq_inproc_ring_pop_(MQINPROCRING *ring)
+{
+	struct mq_inproc_slot_struct *slot;
+	MQINPROCPAYLOAD *payload;
+	size_t pos, seq;
+	long dif;
+
+	pos = __atomic_load_n(&(ring->dequeue), __ATOMIC_RELAXED);
+	for(;;)
+	{
+		slot = &(ring->slots[pos & ring->mask]);
+		seq = MQ_ATOMIC_LOAD(&(slot->seq));
+		dif = (long) seq - (long) (pos + 1);
+		if(!dif)
+		{
+			if(__atomic_compare_exchange_n(&(ring->dequeue), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if(dif < 0)
+		{
+			return NULL;
+		}
+		else
+		{
+			pos = __atomic_load_n(&(ring->dequeue), __ATOMIC_RELAXED);
+		}
+	}
+	payload = slot->payload;
+	MQ_ATOMIC_STORE(&(slot->seq), pos + ring->mask + 1);
+	return payload;
+}
+
+/* (Internal) wait for a ring to become non-empty (or, if forspace is set,
+ * non-full): spin for a while, then sleep on futex until it changes. If
+ * timeout is positive, returns -1 with errno set to EAGAIN if the absolute
+ * deadline (as obtained from mq_inproc_deadline_()) passes first; a zero
+ * timeout doesn't wait at all, and a negative one waits indefinitely.
+ * Spurious returns are possible, and so the caller must re-check the ring.
+ */
+static int
+mq_inproc_ring_wait_(MQINPROCRING *ring, unsigned int *futex, unsigned int *waiters, int forspace, int timeout, const struct timespec *deadline)
+{
+	struct timespec now, ts;
+	unsigned int value;
+	size_t enq, deq;
+	int c, r;
+
+	if(!timeout)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	for(c = 0; c < MQ_INPROC_SPIN; c++)
+	{
+		enq = __atomic_load_n(&(ring->enqueue), __ATOMIC_RELAXED);
+		deq = __atomic_load_n(&(ring->dequeue), __ATOMIC_RELAXED);
+		if(forspace ? (enq - deq <= ring->mask) : (enq != deq))
+		{
+			return 0;
+		}
+		if(c >= MQ_INPROC_SPIN / 2)
+		{
+			sched_yield();
+		}
+	}
+	/* Register as a waiter before sampling the futex and re-checking the
+	 * ring: a thread which changes the ring after this point will see
+	 * that there is a waiter and wake it
+	 */
+	__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+	value = __atomic_load_n(futex, __ATOMIC_SEQ_CST);
+	enq = __atomic_load_n(&(ring->enqueue), __ATOMIC_SEQ_CST);
+	deq = __atomic_load_n(&(ring->dequeue), __ATOMIC_SEQ_CST);
+	r = 0;
+	if(forspace ? (enq - deq > ring->mask) : (enq == deq))
+	{
+		if(timeout > 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ts.tv_sec = deadline->tv_sec - now.tv_sec;
+			ts.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+			if(ts.tv_nsec < 0)
+			{
+				ts.tv_sec--;
+				ts.tv_nsec += 1000000000;
+			}
+			if(ts.tv_sec < 0)
+			{
+				ts.tv_sec = 0;
+				ts.tv_nsec = 0;
+			}
+		}
+#ifdef HAVE_LINUX_FUTEX_H
+		if(syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, value, timeout > 0 ? &ts : NULL, NULL, 0) &&
+		   errno == ETIMEDOUT)
+		{
+			r = -1;
+		}
+#else
+		pthread_mutex_lock(&(ring->lock));
+		while(__atomic_load_n(futex, __ATOMIC_SEQ_CST) == value)
+		{
+			if(timeout > 0)
+			{
+				clock_gettime(CLOCK_REALTIME, &now);
+				now.tv_sec += ts.tv_sec;
+				now.tv_nsec += ts.tv_nsec;
+				if(now.tv_nsec >= 1000000000)
+				{
+					now.tv_sec++;
+					now.tv_nsec -= 1000000000;
+				}
+				if(pthread_cond_timedwait(&(ring->cond), &(ring->lock), &now) == ETIMEDOUT)
+				{
+					r = -1;
+					break;
+				}
+			}
+			else
+			{
+				pthread_cond_wait(&(ring->cond), &(ring->lock));
+			}
+		}
+		pthread_mutex_unlock(&(ring->lock));
+#endif
+	}
+	__atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+	if(r)
+	{
+		errno = EAGAIN;
+	}
+	return r;
+}
+
+/* (Internal) determine the absolute deadline for a timeout in milliseconds */
+static void
+mq_inproc_deadline_(struct timespec *deadline, int timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000;
+	if(deadline->tv_nsec >= 1000000000)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* (Internal) advance a ring's futex and wake anything waiting on it */
+static void
+mq_inproc_ring_wake_(MQINPROCRING *ring, unsigned int *futex, unsigned int *waiters)
+{
+	__atomic_add_fetch(futex, 1, __ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+	{
+		return;
+	}
+#ifdef HAVE_LINUX_FUTEX_H
+	(void) ring;
+
+	syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&(ring->lock));
+	pthread_cond_broadcast(&(ring->cond));
+	pthread_mutex_unlock(&(ring->lock));
+#endif
+}
+
+/* (Internal) find the ring a sender should write to for a partition,
+ * attaching to it if necessary
+ */
+static MQINPROCRING *
+mq_inproc_sender_ring_(MQ *self, const char *partition)
+{
+	MQINPROCRING *ring, **p;
+	size_t c, len;
+
+	len = strlen(self->name);
+	for(c = 0; c < self->nrings; c++)
+	{
+		ring = self->rings[c];
+		if(partition)
+		{
+			if(!strncmp(ring->key, self->name, len) && ring->key[len] == '/' &&
+			   !strcmp(&(ring->key[len + 1]), partition))
+			{
+				return ring;
+			}
+		}
+		else if(!ring->key[len])
+		{
+			return ring;
+		}
+	}
+	p = (MQINPROCRING **) realloc(self->rings, sizeof(MQINPROCRING *) * (self->nrings + 1));
+	if(!p)
+	{
+		SET_ERRNO(self);
+		return NULL;
+	}
+	self->rings = p;
+	ring = mq_inproc_ring_get_(self, partition);
+	if(!ring)
+	{
+		SET_ERRNO(self);
+		return NULL;
+	}
+	self->rings[self->nrings] = ring;
+	self->nrings++;
+	return ring;
+}
+
+/* (Internal) obtain a reference to the ring for a partition of the
+ * connection's queue, creating it if it doesn't yet exist
+ */
+static MQINPROCRING *
+mq_inproc_ring_get_(MQ *self, const char *partition)
+{
+	MQINPROCRING *ring;
+	char *key;
+	size_t c;
+
+	key = (char *) malloc(strlen(self->name) + (partition ? strlen(partition) + 1 : 0) + 1);
+	if(!key)
+	{
+		return NULL;
+	}
+	strcpy(key, self->name);
+	if(partition)
+	{
+		strcat(key, "/");
+		strcat(key, partition);
+	}
+	pthread_mutex_lock(&registrylock);
+	for(ring = rings; ring; ring = ring->next)
+	{
+		if(!strcmp(ring->key, key))
+		{
+			ring->refcount++;
+			pthread_mutex_unlock(&registrylock);
+			free(key);
+			return ring;
+		}
+	}
+	ring = (MQINPROCRING *) calloc(1, sizeof(MQINPROCRING));
+	if(ring)
+	{
+		ring->slots = (struct mq_inproc_slot_struct *) calloc(self->capacity, sizeof(struct mq_inproc_slot_struct));
+	}
+	if(!ring || !ring->slots)
+	{
+		pthread_mutex_unlock(&registrylock);
+		if(ring)
+		{
+			free(ring);
+		}
+		free(key);
+		errno = ENOMEM;
+		return NULL;
+	}
+	for(c = 0; c < self->capacity; c++)
+	{
+		ring->slots[c].seq = c;
+	}
+	ring->mask = self->capacity - 1;
+	ring->key = key;
+	ring->refcount = 1;
+	ring->efd = -1;
+#ifndef HAVE_LINUX_FUTEX_H
+	pthread_mutex_init(&(ring->lock), NULL);
+	pthread_cond_init(&(ring->cond), NULL);
+#endif
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&registrylock);
+	return ring;
+}
+
+/* (Internal) release a reference to a ring; once nothing refers to it, it
+ * is destroyed unless it still holds messages
+ */
+static void
+mq_inproc_ring_put_(MQINPROCRING *ring)
+{
+	MQINPROCRING **p;
+
+	pthread_mutex_lock(&registrylock);
+	ring->refcount--;
+	if(ring->refcount ||
+	   __atomic_load_n(&(ring->enqueue), __ATOMIC_ACQUIRE) != __atomic_load_n(&(ring->dequeue), __ATOMIC_ACQUIRE))
+	{
+		pthread_mutex_unlock(&registrylock);
+		return;
+	}
+	for(p = &rings; *p; p = &((*p)->next))
+	{
+		if(*p == ring)
+		{
+			*p = ring->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registrylock);
+	if(ring->efd != -1)
+	{
+		close(ring->efd);
+	}
+#ifndef HAVE_LINUX_FUTEX_H
+	pthread_cond_destroy(&(ring->cond));
+	pthread_mutex_destroy(&(ring->lock));
+#endif
+	free(ring->slots);
+	free(ring->key);
+	free(ring);
+}
+
+/* (Internal) free a message payload */
+static void
+mq_inproc_payload_free_(MQINPROCPAYLOAD *payload)
+{
+	if(payload->body && payload->free_fn)
+	{
+		payload->free_fn(payload->body);
+	}
+	free(payload->type);
+	free(payload->subject);
+	free(payload->address);
+	free(payload->partition);
+	free(payload->encoding);
+	free(payload);
+}
+
+/* (Internal) ensure that a payload's body has room for len more bytes; a
+ * body which was adopted with a free function other than free() is copied
+ * first
+ */
+static int
+mq_inproc_payload_grow_(MQINPROCPAYLOAD *payload, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if(payload->body && payload->free_fn != free)
+	{
+		p = (unsigned char *) malloc(payload->len + len ? payload->len + len : 1);
+		if(!p)
+		{
+			return -1;
+		}
+		memcpy(p, payload->body, payload->len);
+		if(payload->free_fn)
+		{
+			payload->free_fn(payload->body);
+		}
+		payload->body = p;
+		payload->size = payload->len + len;
+		payload->free_fn = free;
+		return 0;
+	}
+	if(payload->len + len <= payload->size && payload->body)
+	{
+		return 0;
+	}
+	size = payload->size ? payload->size : 64;
+	while(size < payload->len + len)
+	{
+		size <<= 1;
+	}
+	p = (unsigned char *) realloc(payload->body, size);
+	if(!p)
+	{
+		return -1;
+	}
+	payload->body = p;
+	payload->size = size;
+	payload->free_fn = free;
+	return 0;
+}
+
+/* (Internal) replace one of a message's string properties */
+static int
+mq_inproc_strset_(MQMESSAGE *self, char **dest, const char *src)
+{
+	char *p;
+
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING || !dest)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	p = NULL;
+	if(src)
+	{
+		p = strdup(src);
+		if(!p)
+		{
+			SET_ERRNO(self->connection);
+			return -1;
+		}
+	}
+	free(*dest);
+	*dest = p;
+	return 0;
+}
@@ -30,8 +30,116 @@
 
 # include <proton/message.h>
 # include <proton/messenger.h>
+# include <unistd.h>
+# include <limits.h>
+# include <stddef.h>
+# include <stdint.h>
+# include <time.h>
+# include <fcntl.h>
+# include <sys/file.h>
+# include <sys/stat.h>
+# if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#  include <sys/epoll.h>
+#  include <sys/timerfd.h>
+#  include <proton/selectable.h>
+#  define MQ_PROTON_POLLABLE            1
+# endif
 
 # define MQ_ERRBUF_LEN                  128
+/* Maximum number of events processed per call to mq_process() */
+# define MQ_PROTON_MAXEVENTS            16
+
+/* The spool file used by a spooled connection consists of a header followed
+ * by a sequence of records, each of which is a MQPROTONSPOOLRECORD followed
+ * by an encoded message
+ */
+# define MQ_PROTON_SPOOL_FILE           "spool"
+# define MQ_PROTON_SPOOL_MAGIC          0x6c6f6f70UL
+# define MQ_PROTON_SPOOL_VERSION        1
+/* The largest encoded message which can be spooled */
+# define MQ_PROTON_SPOOL_MAXLEN         0x40000000UL
+/* The maximum number of messages forwarded by the drainer at once */
+# define MQ_PROTON_SPOOL_BATCH          64
+/* The interval, in milliseconds, at which the drainer checks whether it
+ * should stop while it waits for the broker
+ */
+# define MQ_PROTON_SPOOL_TIMEOUT        1000
+/* The longest interval, in seconds, between attempts to forward messages */
+# define MQ_PROTON_SPOOL_BACKOFF        32
+/* Defaults for MQO_SPOOL_DEADLINE, MQO_SPOOL_MEMORY and MQO_SPOOL_DISK */
+# define MQ_PROTON_SPOOL_DEADLINE       1000
+# define MQ_PROTON_SPOOL_MEMORY         (16L * 1024 * 1024)
+# define MQ_PROTON_SPOOL_DISK           (1024L * 1024 * 1024)
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	/* The offset of the first record which has not been forwarded */
+	uint64_t head;
+} MQPROTONSPOOLHEADER;
+
+typedef struct
+{
+	uint32_t len;
+	/* A 32-bit FNV-1a hash of the encoded message */
+	uint32_t check;
+} MQPROTONSPOOLRECORD;
+
+/* An encoded message awaiting forwarding */
+typedef struct mq_proton_spooled_struct MQPROTONSPOOLED;
+
+struct mq_proton_spooled_struct
+{
+	MQPROTONSPOOLED *next;
+	size_t len;
+	char data[1];
+};
+
+/* The state of a spooled connection (see mq_set_spool()): outgoing messages
+ * are encoded and queued for a drainer thread, which owns the messenger and
+ * forwards them in order. Messages are held in memory until either the
+ * memory limit is reached or mq_deliver() has waited for the deadline, at
+ * which point they are appended to the spool file. Whenever the spool file
+ * holds records which have not been forwarded, nothing is held in memory and
+ * subsequent messages are appended to the file too, so that ordering is
+ * preserved.
+ */
+typedef struct
+{
+	MQ *connection;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	/* Signalled when messages are queued, or the drainer should stop */
+	pthread_cond_t queued;
+	/* Signalled when the drainer has forwarded a batch of messages */
+	pthread_cond_t forwarded;
+	int fd;
+	/* Messages held in memory, oldest first, and their total size */
+	MQPROTONSPOOLED *head;
+	MQPROTONSPOOLED *tail;
+	size_t bytes;
+	/* The batch being forwarded by the drainer; if ondisk is set, it
+	 * is also stored in the spool file, ending at offset end
+	 */
+	MQPROTONSPOOLED *batch;
+	int ondisk;
+	unsigned long long end;
+	/* The offset of the first record in the spool file which has not
+	 * been forwarded, and of the end of the last record
+	 */
+	unsigned long long first;
+	unsigned long long last;
+	/* Set when records have been appended since the file was synced */
+	int dirty;
+	int stop;
+	/* The number of records discarded by the drainer because they could
+	 * not be decoded, which have not yet been reported by mq_deliver()
+	 */
+	unsigned long discarded;
+	/* Used by the drainer to decode spooled messages */
+	pn_message_t *msg;
+} MQPROTONSPOOL;
 
 /* MQ implementation members */
 static unsigned long mq_proton_release_(MQ *self);
@@ -48,6 +156,17 @@ static int mq_proton_set_cluster_(MQ *self, CLUSTER *cluster);
 static CLUSTER *mq_proton_cluster_(MQ *self);
 static int mq_proton_set_partition_(MQ *self, const char *partition);
 static const char *mq_proton_partition_(MQ *self);
+static int mq_proton_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received);
+static int mq_proton_send_batch_(MQ *self, MQMESSAGE **msgs, size_t count);
+static int mq_proton_next_timed_(MQ *self, MQMESSAGE **msg, int timeout);
+static int mq_proton_set_option_(MQ *self, MQOPTION option, long value);
+static int mq_proton_fd_(MQ *self, int *events);
+static int mq_proton_process_(MQ *self);
+static MQCOMMON *mq_proton_common_(MQ *self);
+static int mq_proton_set_spool_(MQ *self, const char *path);
+static int mq_proton_pending_(MQ *self);
+static int mq_proton_set_sent_callback_(MQ *self, MQSENTFN fn, void *data);
+static int mq_proton_set_partitions_(MQ *self, const char *const *partitions, size_t count);
 
 /* MQMESSAGE implementation members */
 static unsigned long mq_proton_message_release_(MQMESSAGE *self);
@@ -67,10 +186,51 @@ static size_t mq_proton_message_len_(MQMESSAGE *self);
 static int mq_proton_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len);
 static int mq_proton_message_set_partition_(MQMESSAGE *self, const char *partition);
 static const char *mq_proton_message_partition_(MQMESSAGE *self);
+static int mq_proton_message_add_iov_(MQMESSAGE *self, const struct iovec *iov, int iovcnt);
+static MQ *mq_proton_message_connection_(MQMESSAGE *self);
+static MQSTATUS mq_proton_message_status_(MQMESSAGE *self);
+static int mq_proton_message_set_encoding_(MQMESSAGE *self, const char *encoding);
+static const char *mq_proton_message_encoding_(MQMESSAGE *self);
+static int mq_proton_message_replace_body_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn);
 
 /* Internal utilities */
 static int mq_proton_disconnect_internal_(MQ *self);
 static MQMESSAGE *mq_proton_message_construct_(MQ *self);
+static void mq_proton_message_recycle_(MQMESSAGE *self);
+static void mq_proton_pool_trim_(MQ *self, size_t limit);
+static void mq_proton_pool_fill_(MQ *self, size_t count);
+static int mq_proton_message_decode_body_(MQMESSAGE *self);
+static int mq_proton_wait_(MQ *self, int timeout);
+static MQMESSAGE *mq_proton_message_get_(MQ *self);
+static void mq_proton_adapt_(MQ *self, int incoming);
+static MQSTATUS mq_proton_status_(MQ *self, pn_tracker_t tracker);
+static void mq_proton_sent_(MQ *self);
+static void mq_proton_sent_discard_(MQ *self);
+static int mq_proton_scratch_(MQ *self, size_t len);
+static const char *mq_proton_partition_address_(MQ *self, const char *address, const char *partition);
+static int mq_proton_partition_listed_(char **list, size_t count, const char *partition);
+static void mq_proton_partitions_free_(MQ *self);
+static int mq_proton_spool_open_(MQPROTONSPOOL *spool, const char *path);
+static int mq_proton_spool_close_(MQ *self);
+static void mq_proton_spool_free_(MQPROTONSPOOL *spool);
+static int mq_proton_spool_put_(MQ *self, pn_message_t *msg);
+static int mq_proton_spool_wait_(MQ *self);
+static int mq_proton_spool_spill_(MQPROTONSPOOL *spool);
+static int mq_proton_spool_append_(MQPROTONSPOOL *spool, const char *data, size_t len);
+static int mq_proton_spool_read_(MQPROTONSPOOL *spool, unsigned long long offset, unsigned long long last, MQPROTONSPOOLED **list, unsigned long long *end);
+static void mq_proton_spool_advance_(MQPROTONSPOOL *spool, unsigned long long offset);
+static void *mq_proton_spool_thread_(void *arg);
+static int mq_proton_spool_forward_(MQ *self, MQPROTONSPOOLED *list);
+static int mq_proton_spool_reset_(MQ *self);
+static void mq_proton_spooled_free_(MQPROTONSPOOLED *list);
+static uint32_t mq_proton_spool_check_(const char *data, size_t len);
+static void mq_proton_deadline_(struct timespec *ts, long ms);
+static int mq_proton_pread_(int fd, void *buf, size_t len, unsigned long long offset);
+static int mq_proton_pwrite_(int fd, const void *buf, size_t len, unsigned long long offset);
+# ifdef MQ_PROTON_POLLABLE
+static int mq_proton_selectables_(MQ *self);
+static int mq_proton_selectable_remove_(MQ *self, pn_selectable_t *sel);
+# endif
 
 struct mq_connection_struct
 {
@@ -79,6 +239,62 @@ struct mq_connection_struct
 	pn_messenger_t *messenger;
 	pn_subscription_t *sub;
 	int window_size;
+	int timeout;
+	/* The prefetch set with MQO_PREFETCH (negative if adaptive), and the
+	 * credit currently being granted (negative to leave it to the
+	 * messenger): once the messages consumed amount to half of it, it is
+	 * topped up without waiting for the buffer to empty
+	 */
+	long prefetch;
+	int credit;
+	int consumed;
+	/* The number of consecutive waits which found the buffer full */
+	int lagging;
+	int outgoing_window;
+	/* If there is a sent callback, the outgoing messages whose outcome
+	 * isn't yet known, in the order they were sent
+	 */
+	MQSENTFN sentfn;
+	void *sentdata;
+	MQMESSAGE *sent;
+	MQMESSAGE *senttail;
+	/* Released message objects (and their pn_message_t objects) which
+	 * are retained for re-use, and the maximum number to retain (a
+	 * negative limit means there is none)
+	 */
+	MQMESSAGE *pool;
+	size_t poolcount;
+	long poollimit;
+	/* Scratch buffer used to assemble scattered message bodies */
+	char *scratch;
+	size_t scratchsize;
+	/* The partition set with mq_set_partition() (or by the cluster), and
+	 * a buffer used to form the addresses of partitions
+	 */
+	char *partition;
+	char *partaddr;
+	size_t partaddrsize;
+	/* The partitions set with set_partitions(), each of which a
+	 * receiving connection is subscribed to
+	 */
+	char **partitions;
+	size_t npartitions;
+	/* Once fd() has been called, the messenger operates in passive mode:
+	 * its selectables are registered with an epoll instance, along with
+	 * a timer which fires at the earliest selectable deadline
+	 */
+	int epfd;
+	int timerfd;
+# ifdef MQ_PROTON_POLLABLE
+	pn_selectable_t **sel;
+	size_t nsel;
+	size_t selsize;
+# endif
+	/* Store-and-forward spooling, if enabled by mq_set_spool() */
+	MQPROTONSPOOL *spool;
+	long spooldeadline;
+	long spoolmemory;
+	long spooldisk;
 };
 
 struct mq_message_struct
@@ -87,9 +303,32 @@ struct mq_message_struct
 	MQ_MESSAGE_COMMON_MEMBERS;
 	pn_message_t *msg;
 	pn_tracker_t tracker;
+	/* The body of an incoming message is located on first use; bytes.size
+	 * is the total length of an outgoing message's body
+	 */
 	pn_data_t *body;
 	pn_bytes_t bytes;
+	int decoded:1;
+	/* A decoded body which has replaced that of an incoming message */
+	unsigned char *plain;
+	MQFREEFN plainfree;
+	/* The delivery status of an outgoing message; while it is pending,
+	 * the messenger is asked for the current status
+	 */
+	MQSTATUS status;
 	int addressed:1;
+	/* Set while the message is in the connection's list of sent messages,
+	 * and if it has been freed in the meantime
+	 */
+	int tracked:1;
+	int released:1;
+	MQMESSAGE *nextsent;
+	/* The partition set with mq_message_set_partition(), if any: an
+	 * empty string means no partition, regardless of the connection's
+	 */
+	char *partition;
+	/* The next message in the connection's pool */
+	MQMESSAGE *next;
 };
 
 static MQCONNIMPL mq_proton_connection_impl_ = {
@@ -110,7 +349,18 @@ static MQCONNIMPL mq_proton_connection_impl_ = {
 	mq_proton_set_cluster_,
 	mq_proton_cluster_,
 	mq_proton_set_partition_,
-	mq_proton_partition_
+	mq_proton_partition_,
+	mq_proton_next_batch_,
+	mq_proton_send_batch_,
+	mq_proton_next_timed_,
+	mq_proton_set_option_,
+	mq_proton_fd_,
+	mq_proton_process_,
+	mq_proton_common_,
+	mq_proton_set_spool_,
+	mq_proton_pending_,
+	mq_proton_set_sent_callback_,
+	mq_proton_set_partitions_
 };
 
 static MQMESSAGEIMPL mq_proton_message_impl_ = {
@@ -134,7 +384,19 @@ static MQMESSAGEIMPL mq_proton_message_impl_ = {
 	mq_proton_message_len_,
 	mq_proton_message_add_bytes_,
 	mq_proton_message_set_partition_,
-	mq_proton_message_partition_
+	mq_proton_message_partition_,
+	mq_proton_message_add_iov_,
+	/* add_bytes_owned: pn_data_put_binary() always copies, so there is
+	 * no advantage to adopting the caller's buffer
+	 */
+	NULL,
+	/* take_body */
+	NULL,
+	mq_proton_message_connection_,
+	mq_proton_message_status_,
+	mq_proton_message_set_encoding_,
+	mq_proton_message_encoding_,
+	mq_proton_message_replace_body_
 };
 
 /* Proton message queue constructor: this is invoked by libmq to create a new
@@ -163,6 +425,15 @@ mq_proton_construct_(const char *uri, const char *reserved1, const char *reserve
 	mq->impl = &mq_proton_connection_impl_;
 	mq->uri = p;
 	mq->window_size = 1;
+	mq->timeout = -1;
+	mq->credit = -1;
+	mq->outgoing_window = 1;
+	mq->epfd = -1;
+	mq->timerfd = -1;
+	mq->poollimit = -1;
+	mq->spooldeadline = MQ_PROTON_SPOOL_DEADLINE;
+	mq->spoolmemory = MQ_PROTON_SPOOL_MEMORY;
+	mq->spooldisk = MQ_PROTON_SPOOL_DISK;
 	return mq;
 }
 
@@ -171,6 +442,11 @@ static unsigned long
 mq_proton_release_(MQ *self)
 {
 	mq_proton_disconnect_internal_(self);
+	mq_proton_pool_trim_(self, 0);
+	free(self->scratch);
+	free(self->partition);
+	free(self->partaddr);
+	mq_proton_partitions_free_(self);
 	free(self->errmsg);
 	free(self->uri);
 	free(self);
@@ -208,8 +484,9 @@ mq_proton_errmsg_(MQ *self)
 	}
 	if(self->errcode)
 	{
-		if(self->messenger)
+		if(self->messenger && !self->spool)
 		{
+			/* Once spooling, the messenger belongs to the drainer */
 			return pn_error_text(pn_messenger_error(self->messenger));
 		}
 		snprintf(self->errmsg, MQ_ERRBUF_LEN, "Unknown error #%d", self->errcode);
@@ -230,6 +507,7 @@ mq_proton_state_(MQ *self)
 static int
 mq_proton_connect_recv_(MQ *self)
 {
+	const char *address;
 	int e;
 
 	RESET_ERROR(self);
@@ -238,6 +516,15 @@ mq_proton_connect_recv_(MQ *self)
 		SET_SYSERR(self, EINVAL);
 		return -1;
 	}
+	/* A receiving connection with a partition subscribes to the
+	 * partition's address
+	 */
+	address = mq_proton_partition_address_(self, self->uri, self->partition);
+	if(!address)
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
 	self->messenger = pn_messenger(NULL);
 	if(!self->messenger)
 	{
@@ -251,7 +538,7 @@ mq_proton_connect_recv_(MQ *self)
 		SET_ERROR(self, e);
 		return 1;
 	}
-	self->sub = pn_messenger_subscribe(self->messenger, self->uri);
+	self->sub = pn_messenger_subscribe(self->messenger, address);
 	if(!self->sub || (e = pn_messenger_errno(self->messenger)))
 	{
 		mq_proton_disconnect_internal_(self);
@@ -259,6 +546,10 @@ mq_proton_connect_recv_(MQ *self)
 		return 1;
 	}
 	pn_messenger_set_incoming_window(self->messenger, self->window_size);
+	/* Construct the message objects which will be in use at once up
+	 * front, so that receiving doesn't allocate any in steady state
+	 */
+	mq_proton_pool_fill_(self, (size_t) self->window_size);
 	self->state = MQS_RECV;
 	return 0;
 }
@@ -288,8 +579,7 @@ mq_proton_connect_send_(MQ *self)
 		SET_ERROR(self, e);
 		return 1;
 	}
-	/* TODO: outgoing window size should be configurable */
-	pn_messenger_set_outgoing_window(self->messenger, 1);
+	pn_messenger_set_outgoing_window(self->messenger, self->outgoing_window);
 	self->state = MQS_SEND;
 	return 0;
 }
@@ -311,58 +601,66 @@ mq_proton_disconnect_(MQ *self)
 /* Wait for a message to arrive via a connection */
 int
 mq_proton_next_(MQ *self, MQMESSAGE **msg)
+{
+	return mq_proton_next_timed_(self, msg, self->nonblock ? 0 : -1);
+}
+
+/* Wait up to timeout milliseconds for a message to arrive via a connection */
+static int
+mq_proton_next_timed_(MQ *self, MQMESSAGE **msg, int timeout)
 {
 	MQMESSAGE *p;
-	int e;
 
 	RESET_ERROR(self);
-	if(!pn_messenger_incoming(self->messenger))
+	if(mq_proton_wait_(self, timeout))
 	{
-		/* There are no buffered incoming messages yet */
-		pn_messenger_recv(self->messenger, -1);
-		if((e = pn_messenger_errno(self->messenger)))
-		{
-			SET_ERROR(self, e);
-			return -1;
-		}
-		if(!pn_messenger_incoming(self->messenger))
-		{
-			/* TODO: if libmq supports non-blocking mode, this should
-			 * not be an error
-			 */
-			SET_ERROR(self, pn_messenger_errno(self->messenger));
-			return -1;
-		}
+		return -1;
 	}
-	p = mq_proton_message_construct_(self);
+	p = mq_proton_message_get_(self);
 	if(!p)
 	{
 		return -1;
 	}
-	p->kind = MQK_INCOMING;
-	p->msg = pn_message();
-	if(!p->msg)
+	*msg = p;
+	return 0;
+}
+
+/* Obtain up to count buffered messages, waiting for some to arrive if there
+ * are none
+ */
+static int
+mq_proton_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received)
+{
+	size_t n, incoming;
+
+	RESET_ERROR(self);
+	*received = 0;
+	if(!count)
+	{
+		return 0;
+	}
+	if(mq_proton_wait_(self, self->nonblock ? 0 : -1))
 	{
-		SET_ERRNO(self);
-		free(p);
 		return -1;
 	}
-	pn_messenger_get(self->messenger, p->msg);
-	if((e = pn_messenger_errno(self->messenger)))
+	incoming = (size_t) pn_messenger_incoming(self->messenger);
+	for(n = 0; n < count && n < incoming; n++)
 	{
-		pn_message_free(p->msg);
-		free(p);
-		SET_ERROR(self, e);
-		return 1;
+		msgs[n] = mq_proton_message_get_(self);
+		if(!msgs[n])
+		{
+			break;
+		}
 	}
-	p->tracker = pn_messenger_incoming_tracker(self->messenger);
-	p->body = pn_message_body(p->msg);
-	if(p->body)
+	if(!n)
 	{
-		pn_data_next(p->body);
-		p->bytes = pn_data_get_binary(p->body);
+		return -1;
 	}
-	*msg = p;
+	/* If we obtained at least one message, don't report a failure to
+	 * obtain any subsequent ones; it will be reported on the next call
+	 */
+	RESET_ERROR(self);
+	*received = n;
 	return 0;
 }
 
@@ -370,20 +668,67 @@ mq_proton_next_(MQ *self, MQMESSAGE **msg)
 static int
 mq_proton_deliver_(MQ *self)
 {
+	int e;
+
 	RESET_ERROR(self);
 	if(self->state != MQS_SEND)
 	{
 		SET_SYSERR(self, EINVAL);
 		return -1;
 	}
-	if(pn_messenger_send(self->messenger, -1))
+	if(self->spool)
+	{
+		/* The drainer forwards messages in the background: wait for a
+		 * while for those held in memory to be forwarded, and spool
+		 * any which haven't been
+		 */
+		return mq_proton_spool_wait_(self);
+	}
+	e = pn_messenger_send(self->messenger, -1);
+	mq_proton_sent_(self);
+	if(e)
 	{
+		if(e == PN_INPROGRESS)
+		{
+			/* The messenger is in passive mode: delivery will complete
+			 * as mq_process() is called
+			 */
+			SET_SYSERR(self, EAGAIN);
+			return -1;
+		}
 		SET_ERROR(self, pn_messenger_errno(self->messenger));
 		return -1;
 	}
 	return 0;
 }
 
+/* Queue a set of outgoing messages and then deliver them all at once */
+static int
+mq_proton_send_batch_(MQ *self, MQMESSAGE **msgs, size_t count)
+{
+	size_t c;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	for(c = 0; c < count; c++)
+	{
+		if(msgs[c]->connection != self)
+		{
+			SET_SYSERR(self, EINVAL);
+			return -1;
+		}
+		if(mq_proton_message_send_(msgs[c]))
+		{
+			return -1;
+		}
+	}
+	return mq_proton_deliver_(self);
+}
+
 /* Create a new outgoing message */
 int
 mq_proton_create_(MQ *self, MQMESSAGE **msg)
@@ -397,22 +742,19 @@ mq_proton_create_(MQ *self, MQMESSAGE **msg)
 		return -1;
 	}
 	p->kind = MQK_OUTGOING;
-	p->msg = pn_message();
-	if(!p->msg)
-	{
-		SET_ERROR(self, pn_messenger_errno(self->messenger));
-		free(p);
-		return -1;
-	}
 	*msg = p;
 	return 0;
 }
 
-/* Set the cluster associated with a connection */
+/* Set the cluster associated with a connection, and use its partition */
 static int
 mq_proton_set_cluster_(MQ *self, CLUSTER *cluster)
 {
 	self->cluster = cluster;
+	/* Following the cluster's partition is best-effort: a failure is left
+	 * in the connection's error state, but doesn't fail the association
+	 */
+	self->impl->set_partition(self, cluster ? cluster_partition(cluster) : NULL);
 	return 0;
 }
 
@@ -423,24 +765,280 @@ mq_proton_cluster_(MQ *self)
 	return self->cluster;
 }
 
-/* Set the partition associated with this connection */
+/* Set the partition associated with this connection (NULL or an empty
+ * string will unset it): messages are sent to, or received from, the
+ * partition's own address on the same host. A receiving connection which
+ * is already connected subscribes to the new partition's address; as the
+ * messenger can't cancel a subscription, it continues to receive from any
+ * address it was subscribed to before.
+ */
 static int
 mq_proton_set_partition_(MQ *self, const char *partition)
 {
-	(void) self;
-	(void) partition;
-	
-	errno = EPERM;
+	char *p;
+	int e;
+
+	RESET_ERROR(self);
+	if(partition && !partition[0])
+	{
+		partition = NULL;
+	}
+	p = NULL;
+	if(partition)
+	{
+		p = strdup(partition);
+		if(!p)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+	}
+	if(self->state == MQS_RECV && partition &&
+	   (!self->partition || strcmp(self->partition, partition)) &&
+	   !mq_proton_partition_listed_(self->partitions, self->npartitions, partition))
+	{
+		if(!mq_proton_partition_address_(self, self->uri, partition))
+		{
+			SET_ERRNO(self);
+			free(p);
+			return -1;
+		}
+		if(!pn_messenger_subscribe(self->messenger, self->partaddr))
+		{
+			e = pn_messenger_errno(self->messenger);
+			if(e)
+			{
+				SET_ERROR(self, e);
+			}
+			else
+			{
+				SET_ERRNO(self);
+			}
+			free(p);
+			return -1;
+		}
+	}
+	free(self->partition);
+	self->partition = p;
+	return 0;
+}
+
+/* Set a connection option */
+static int
+mq_proton_set_option_(MQ *self, MQOPTION option, long value)
+{
+	RESET_ERROR(self);
+	switch(option)
+	{
+	case MQO_NONBLOCK:
+		self->nonblock = !!value;
+		return 0;
+	case MQO_POOL:
+		self->poollimit = value < 0 ? -1 : value;
+		if(value >= 0)
+		{
+			mq_proton_pool_trim_(self, (size_t) value);
+		}
+		return 0;
+	case MQO_SPOOL_DEADLINE:
+		if(value < 0)
+		{
+			SET_SYSERR(self, EINVAL);
+			return -1;
+		}
+		self->spooldeadline = value;
+		return 0;
+	case MQO_SPOOL_MEMORY:
+		self->spoolmemory = value < 0 ? -1 : value;
+		return 0;
+	case MQO_SPOOL_DISK:
+		self->spooldisk = value < 0 ? -1 : value;
+		return 0;
+	case MQO_PREFETCH:
+		if(value > INT_MAX || value < -INT_MAX)
+		{
+			SET_SYSERR(self, EINVAL);
+			return -1;
+		}
+		/* Adaptive prefetch starts from a single message; the window
+		 * must be large enough to track every message prefetched
+		 */
+		self->prefetch = value;
+		self->credit = value > 0 ? (int) value : (value ? 1 : -1);
+		self->consumed = 0;
+		self->lagging = 0;
+		self->window_size = (int) (value > 0 ? value : (value ? -value : 1));
+		if(self->state == MQS_RECV)
+		{
+			pn_messenger_set_incoming_window(self->messenger, self->window_size);
+			mq_proton_pool_fill_(self, (size_t) self->window_size);
+		}
+		return 0;
+	case MQO_OUTGOING_WINDOW:
+		if(value < 1 || value > INT_MAX)
+		{
+			SET_SYSERR(self, EINVAL);
+			return -1;
+		}
+		self->outgoing_window = (int) value;
+		if(self->state == MQS_SEND && !self->spool)
+		{
+			pn_messenger_set_outgoing_window(self->messenger, self->outgoing_window);
+		}
+		return 0;
+	default:
+		break;
+	}
+	SET_SYSERR(self, ENOTSUP);
+	return -1;
+}
+
+/* Obtain a pollable file descriptor for the connection: the messenger is
+ * switched to passive mode, and the descriptor returned is an epoll instance
+ * which becomes readable whenever any of its selectables is ready
+ */
+static int
+mq_proton_fd_(MQ *self, int *events)
+{
+# ifdef MQ_PROTON_POLLABLE
+	struct epoll_event ev;
+
+	RESET_ERROR(self);
+	if(self->state == MQS_DISCONNECTED || self->spool)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	if(self->epfd == -1)
+	{
+		self->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if(self->epfd == -1)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+		self->timerfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC|TFD_NONBLOCK);
+		if(self->timerfd == -1)
+		{
+			SET_ERRNO(self);
+			close(self->epfd);
+			self->epfd = -1;
+			return -1;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if(epoll_ctl(self->epfd, EPOLL_CTL_ADD, self->timerfd, &ev))
+		{
+			SET_ERRNO(self);
+			close(self->timerfd);
+			close(self->epfd);
+			self->timerfd = self->epfd = -1;
+			return -1;
+		}
+		pn_messenger_set_passive(self->messenger, true);
+		if(mq_proton_selectables_(self))
+		{
+			return -1;
+		}
+	}
+	if(events)
+	{
+		*events = MQE_READ;
+	}
+	return self->epfd;
+# else
+	(void) events;
+
+	SET_SYSERR(self, ENOTSUP);
 	return -1;
+# endif
+}
+
+/* Perform any pending work on the connection without waiting */
+static int
+mq_proton_process_(MQ *self)
+{
+# ifdef MQ_PROTON_POLLABLE
+	struct epoll_event ev[MQ_PROTON_MAXEVENTS];
+	struct timeval tv;
+	pn_selectable_t *sel;
+	pn_timestamp_t now, deadline;
+	uint64_t expirations;
+	size_t c;
+	int n, i, r;
+# endif
+
+	RESET_ERROR(self);
+	if(self->state == MQS_DISCONNECTED)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	if(self->spool)
+	{
+		/* The drainer performs all of the work */
+		return 0;
+	}
+# ifdef MQ_PROTON_POLLABLE
+	if(self->epfd != -1)
+	{
+		n = epoll_wait(self->epfd, ev, MQ_PROTON_MAXEVENTS, 0);
+		if(n < 0 && errno != EINTR)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+		for(i = 0; i < n; i++)
+		{
+			sel = (pn_selectable_t *) ev[i].data.ptr;
+			if(!sel)
+			{
+				/* The deadline timer fired */
+				if(read(self->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+				{
+					SET_ERRNO(self);
+					return -1;
+				}
+				continue;
+			}
+			if(ev[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+			{
+				pn_selectable_readable(sel);
+			}
+			if(ev[i].events & EPOLLOUT)
+			{
+				pn_selectable_writable(sel);
+			}
+		}
+		gettimeofday(&tv, NULL);
+		now = ((pn_timestamp_t) tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+		for(c = 0; c < self->nsel; c++)
+		{
+			deadline = pn_selectable_get_deadline(self->sel[c]);
+			if(deadline && deadline <= now)
+			{
+				pn_selectable_expired(self->sel[c]);
+			}
+		}
+		r = mq_proton_selectables_(self);
+		mq_proton_sent_(self);
+		return r;
+	}
+# endif
+	/* Not in passive mode: just give the messenger a chance to perform
+	 * any outstanding I/O
+	 */
+	pn_messenger_work(self->messenger, 0);
+	mq_proton_sent_(self);
+	return 0;
 }
 
 /* Return the connection partition */
 static const char *
 mq_proton_partition_(MQ *self)
 {
-	(void) self;
-
-	return NULL;
+	return self->partition;
 }
 
 /* Release (destroy) a message */
@@ -448,15 +1046,20 @@ static unsigned long
 mq_proton_message_release_(MQMESSAGE *self)
 {
 	RESET_ERROR(self->connection);
-	if(self->tracker)
+	if(self->tracked)
 	{
-		pn_messenger_settle(self->connection->messenger, self->tracker, 0);
+		/* The message is recycled once its outcome is known */
+		self->released = 1;
+		return 0;
 	}
-	if(self->msg)
+	/* Outgoing messages are settled by the messenger as they leave the
+	 * outgoing window
+	 */
+	if(self->tracker && self->kind == MQK_INCOMING)
 	{
-		pn_message_free(self->msg);
+		pn_messenger_settle(self->connection->messenger, self->tracker, 0);
 	}
-	free(self);
+	mq_proton_message_recycle_(self);
 	return 0;
 }
 
@@ -612,7 +1215,7 @@ static const unsigned char *
 mq_proton_message_body_(MQMESSAGE *self)
 {
 	RESET_ERROR(self->connection);
-	if(!self->msg || !self->body)
+	if(!self->msg || mq_proton_message_decode_body_(self))
 	{
 		SET_SYSERR(self->connection, EINVAL);
 		return NULL;
@@ -625,7 +1228,11 @@ static size_t
 mq_proton_message_len_(MQMESSAGE *self)
 {
 	RESET_ERROR(self->connection);
-	if(!self->msg || !self->body)
+	if(self->msg && self->kind == MQK_OUTGOING)
+	{
+		return self->bytes.size;
+	}
+	if(!self->msg || mq_proton_message_decode_body_(self))
 	{
 		SET_SYSERR(self->connection, EINVAL);
 		return (size_t) -1;
@@ -657,39 +1264,116 @@ mq_proton_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len)
 		SET_ERROR(self->connection, pn_messenger_errno(self->connection->messenger));
 		return -1;
 	}
+	self->bytes.size += len;
 	return 0;
 }
 
+/* Add a sequence of bytes gathered from a set of buffers to an outgoing
+ * message body; the buffers are assembled in the connection's scratch buffer
+ * so that the body is added as a single binary value
+ */
+static int
+mq_proton_message_add_iov_(MQMESSAGE *self, const struct iovec *iov, int iovcnt)
+{
+	MQ *conn;
+	size_t len;
+	char *p;
+	int c;
+
+	conn = self->connection;
+	if(iovcnt == 1)
+	{
+		return mq_proton_message_add_bytes_(self, (unsigned char *) iov[0].iov_base, iov[0].iov_len);
+	}
+	RESET_ERROR(conn);
+	if(self->kind != MQK_OUTGOING || !self->msg || iovcnt < 0)
+	{
+		SET_SYSERR(conn, EINVAL);
+		return -1;
+	}
+	len = 0;
+	for(c = 0; c < iovcnt; c++)
+	{
+		len += iov[c].iov_len;
+	}
+	if(mq_proton_scratch_(conn, len))
+	{
+		return -1;
+	}
+	for(c = 0, p = conn->scratch; c < iovcnt; c++)
+	{
+		memcpy(p, iov[c].iov_base, iov[c].iov_len);
+		p += iov[c].iov_len;
+	}
+	return mq_proton_message_add_bytes_(self, (unsigned char *) conn->scratch, len);
+}
+
 /* Set the partition that this message is associated with */
 static int
 mq_proton_message_set_partition_(MQMESSAGE *self, const char *partition)
 {
-	(void) self;
-	(void) partition;
+	char *p;
 
-	errno = EPERM;
-	return -1;
+	if(partition)
+	{
+		p = strdup(partition);
+		if(!p)
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		p = NULL;
+	}
+	free(self->partition);
+	self->partition = p;
+	return 0;
 }
 
-/* Obtain the partition that this message is associated with */
+/* Obtain the partition that this message is associated with: if none has
+ * been set, it's the connection's
+ */
 static const char *
 mq_proton_message_partition_(MQMESSAGE *self)
 {
-	(void) self;
-	
-	return NULL;
+	if(!self->partition)
+	{
+		return self->connection->partition;
+	}
+	if(!self->partition[0])
+	{
+		return NULL;
+	}
+	return self->partition;
 }
 
-/* Send an outgoing message */
+/* Send an outgoing message: if it is associated with a partition, it is
+ * sent to the partition's address, which the messenger sends over a link of
+ * its own on the existing connection
+ */
 static int
 mq_proton_message_send_(MQMESSAGE *self)
 {
+	const char *partition, *address;
+	size_t len;
+	int r;
+
 	RESET_ERROR(self->connection);
 	if(self->kind != MQK_OUTGOING || !self->msg)
 	{
 		SET_SYSERR(self->connection, EINVAL);
 		return -1;
 	}
+	if(self->tracked ||
+	   (self->status == MQT_PENDING && mq_proton_status_(self->connection, self->tracker) == MQT_PENDING))
+	{
+		/* The message is still being tracked from when it was last
+		 * sent, and has only one tracker
+		 */
+		SET_SYSERR(self->connection, EBUSY);
+		return -1;
+	}
 	if(!self->addressed)
 	{
 		if(pn_message_set_address(self->msg, self->connection->uri))
@@ -698,11 +1382,290 @@ mq_proton_message_send_(MQMESSAGE *self)
 			return -1;
 		}
 	}
-	if(pn_messenger_put(self->connection->messenger, self->msg))
+	partition = mq_proton_message_partition_(self);
+	len = 0;
+	if(partition)
+	{
+		/* The message is encoded when it's put, so its own address can
+		 * be restored straight afterwards
+		 */
+		address = pn_message_get_address(self->msg);
+		len = strlen(address);
+		address = mq_proton_partition_address_(self->connection, address, partition);
+		if(!address || pn_message_set_address(self->msg, address))
+		{
+			SET_SYSERR(self->connection, ENOMEM);
+			return -1;
+		}
+	}
+	if(self->connection->spool)
+	{
+		r = mq_proton_spool_put_(self->connection, self->msg);
+	}
+	else if((r = pn_messenger_put(self->connection->messenger, self->msg)))
 	{
 		SET_ERROR(self->connection, pn_messenger_errno(self->connection->messenger));
+	}
+	if(partition)
+	{
+		self->connection->partaddr[len] = 0;
+		pn_message_set_address(self->msg, self->connection->partaddr);
+	}
+	if(r)
+	{
+		return -1;
+	}
+	if(self->connection->spool)
+	{
+		return 0;
+	}
+	self->tracker = pn_messenger_outgoing_tracker(self->connection->messenger);
+	self->status = MQT_PENDING;
+	if(self->connection->sentfn && !self->tracked)
+	{
+		self->tracked = 1;
+		self->nextsent = NULL;
+		if(self->connection->senttail)
+		{
+			self->connection->senttail->nextsent = self;
+		}
+		else
+		{
+			self->connection->sent = self;
+		}
+		self->connection->senttail = self;
+	}
+	return 0;
+}
+
+/* Obtain the state maintained by libmq for the connection */
+static MQCOMMON *
+mq_proton_common_(MQ *self)
+{
+	return &(self->common);
+}
+
+/* Enable store-and-forward spooling of outgoing messages: from now on, the
+ * messenger is used only by the drainer thread
+ */
+static int
+mq_proton_set_spool_(MQ *self, const char *path)
+{
+	MQPROTONSPOOL *spool;
+	pthread_condattr_t attr;
+	int e;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND || self->spool || self->epfd != -1)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	spool = (MQPROTONSPOOL *) calloc(1, sizeof(MQPROTONSPOOL));
+	if(!spool)
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	spool->connection = self;
+	spool->fd = -1;
+	pthread_mutex_init(&(spool->lock), NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(spool->queued), &attr);
+	pthread_cond_init(&(spool->forwarded), &attr);
+	pthread_condattr_destroy(&attr);
+	spool->msg = pn_message();
+	if(!spool->msg || mq_proton_spool_open_(spool, path))
+	{
+		SET_ERRNO(self);
+		mq_proton_spool_free_(spool);
+		return -1;
+	}
+	pn_messenger_set_timeout(self->messenger, MQ_PROTON_SPOOL_TIMEOUT);
+	self->spool = spool;
+	if((e = pthread_create(&(spool->thread), NULL, mq_proton_spool_thread_, spool)))
+	{
+		self->spool = NULL;
+		mq_proton_spool_free_(spool);
+		SET_SYSERR(self, e);
+		return -1;
+	}
+	return 0;
+}
+
+/* Set the function invoked as outgoing messages' outcomes become known;
+ * only messages sent after it has been set are reported
+ */
+static int
+mq_proton_set_sent_callback_(MQ *self, MQSENTFN fn, void *data)
+{
+	RESET_ERROR(self);
+	self->sentfn = fn;
+	self->sentdata = data;
+	return 0;
+}
+
+/* Set the partitions consumed by a receiving connection, in addition to its
+ * own address; as the messenger can't cancel a subscription, partitions can
+ * be added to the set, but not removed from it
+ */
+static int
+mq_proton_set_partitions_(MQ *self, const char *const *partitions, size_t count)
+{
+	char **list;
+	size_t c;
+	int e;
+
+	RESET_ERROR(self);
+	if(self->state == MQS_RECV)
+	{
+		for(c = 0; c < self->npartitions; c++)
+		{
+			if(!mq_proton_partition_listed_((char **) partitions, count, self->partitions[c]))
+			{
+				SET_SYSERR(self, EBUSY);
+				return -1;
+			}
+		}
+	}
+	list = NULL;
+	if(count)
+	{
+		list = (char **) calloc(count, sizeof(char *));
+		if(!list)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+	}
+	for(c = 0; c < count; c++)
+	{
+		list[c] = strdup(partitions[c]);
+		if(!list[c])
+		{
+			SET_ERRNO(self);
+			break;
+		}
+		if(self->state != MQS_RECV || mq_proton_partition_listed_(self->partitions, self->npartitions, partitions[c]))
+		{
+			continue;
+		}
+		if(!mq_proton_partition_address_(self, self->uri, partitions[c]) ||
+		   !pn_messenger_subscribe(self->messenger, self->partaddr))
+		{
+			e = pn_messenger_errno(self->messenger);
+			if(e)
+			{
+				SET_ERROR(self, e);
+			}
+			else
+			{
+				SET_ERRNO(self);
+			}
+			free(list[c]);
+			break;
+		}
+	}
+	if(c < count)
+	{
+		/* The partitions which have been subscribed to remain in the set,
+		 * and those which haven't are left out
+		 */
+		count = c;
+	}
+	mq_proton_partitions_free_(self);
+	self->partitions = list;
+	self->npartitions = count;
+	return (self->errcode || self->syserr) ? -1 : 0;
+}
+
+/* Obtain the number of incoming messages buffered by the messenger */
+static int
+mq_proton_pending_(MQ *self)
+{
+	RESET_ERROR(self);
+	if(self->state != MQS_RECV)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	return pn_messenger_incoming(self->messenger);
+}
+
+/* Obtain the connection that a message is associated with */
+static MQ *
+mq_proton_message_connection_(MQMESSAGE *self)
+{
+	return self->connection;
+}
+
+/* Obtain the delivery status of an outgoing message */
+static MQSTATUS
+mq_proton_message_status_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return MQT_UNKNOWN;
+	}
+	if(self->status != MQT_PENDING)
+	{
+		return self->status;
+	}
+	if(!self->connection->messenger || self->connection->spool)
+	{
+		return MQT_UNKNOWN;
+	}
+	return mq_proton_status_(self->connection, self->tracker);
+}
+
+/* Set the content-encoding of an outgoing message */
+static int
+mq_proton_message_set_encoding_(MQMESSAGE *self, const char *encoding)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING || !self->msg)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return pn_message_set_content_encoding(self->msg, encoding);
+}
+
+/* Retrieve the content-encoding of a message; once the body of an incoming
+ * message has been decoded, it has none
+ */
+static const char *
+mq_proton_message_encoding_(MQMESSAGE *self)
+{
+	if(!self->msg || self->plain)
+	{
+		return NULL;
+	}
+	return pn_message_get_content_encoding(self->msg);
+}
+
+/* Replace the body of an incoming message with a decoded one, which the
+ * message takes ownership of
+ */
+static int
+mq_proton_message_replace_body_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_INCOMING || !self->msg || mq_proton_message_decode_body_(self))
+	{
+		SET_SYSERR(self->connection, EINVAL);
 		return -1;
 	}
+	if(self->plain && self->plainfree)
+	{
+		self->plainfree(self->plain);
+	}
+	self->plain = buf;
+	self->plainfree = free_fn;
+	self->bytes = pn_bytes(len, (char *) buf);
 	return 0;
 }
 
@@ -712,29 +1675,1340 @@ mq_proton_message_construct_(MQ *self)
 {
 	MQMESSAGE *p;
 
+	if(self->pool)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		p->next = NULL;
+		return p;
+	}
 	p = (MQMESSAGE *) calloc(1, sizeof(MQMESSAGE));
 	if(!p)
 	{
 		SET_ERRNO(self);	   
 		return NULL;
 	}
+	p->msg = pn_message();
+	if(!p->msg)
+	{
+		SET_ERRNO(self);
+		free(p);
+		return NULL;
+	}
 	p->impl = &mq_proton_message_impl_;
 	p->connection = self;
 	return p;
 }
 
-/* (Internal) disconnect from a message queue */
+/* (Internal) return a message object to the connection's pool, clearing its
+ * pn_message_t for re-use, or destroy it if the pool is full
+ */
+static void
+mq_proton_message_recycle_(MQMESSAGE *self)
+{
+	MQ *conn;
+	pn_message_t *msg;
+
+	conn = self->connection;
+	free(self->partition);
+	if(self->plain && self->plainfree)
+	{
+		self->plainfree(self->plain);
+	}
+	if(conn->poollimit >= 0 && conn->poolcount >= (size_t) conn->poollimit)
+	{
+		pn_message_free(self->msg);
+		free(self);
+		return;
+	}
+	msg = self->msg;
+	pn_message_clear(msg);
+	memset(self, 0, sizeof(MQMESSAGE));
+	self->impl = &mq_proton_message_impl_;
+	self->connection = conn;
+	self->msg = msg;
+	self->next = conn->pool;
+	conn->pool = self;
+	conn->poolcount++;
+}
+
+/* (Internal) destroy pooled message objects until no more than limit remain */
+static void
+mq_proton_pool_trim_(MQ *self, size_t limit)
+{
+	MQMESSAGE *p;
+
+	while(self->poolcount > limit)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		pn_message_free(p->msg);
+		free(p);
+	}
+}
+
+/* (Internal) construct message objects and add them to the connection's
+ * pool until it holds count of them (or as many as its limit allows)
+ */
+static void
+mq_proton_pool_fill_(MQ *self, size_t count)
+{
+	MQMESSAGE *p;
+
+	if(self->poollimit >= 0 && count > (size_t) self->poollimit)
+	{
+		count = (size_t) self->poollimit;
+	}
+	while(self->poolcount < count)
+	{
+		p = (MQMESSAGE *) calloc(1, sizeof(MQMESSAGE));
+		if(!p)
+		{
+			return;
+		}
+		p->msg = pn_message();
+		if(!p->msg)
+		{
+			free(p);
+			return;
+		}
+		p->impl = &mq_proton_message_impl_;
+		p->connection = self;
+		p->next = self->pool;
+		self->pool = p;
+		self->poolcount++;
+	}
+}
+
+/* (Internal) wait up to timeout milliseconds (or indefinitely, if timeout is
+ * negative) until at least one incoming message is buffered by the messenger
+ */
 static int
-mq_proton_disconnect_internal_(MQ *self)
+mq_proton_wait_(MQ *self, int timeout)
 {
-	if(self->messenger)
+	int e, incoming;
+
+	if(self->state != MQS_RECV)
 	{
-		/* TODO; deal with PN_INPROGRESS response from pn_messenger_stop() */
-		pn_messenger_stop(self->messenger);
-		pn_messenger_free(self->messenger);
-		self->messenger = NULL;
-		self->sub = NULL;
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	incoming = pn_messenger_incoming(self->messenger);
+	mq_proton_adapt_(self, incoming);
+	if(incoming && self->credit > 1 && self->consumed >= self->credit / 2)
+	{
+		/* Top up the credit while messages are still buffered, so that
+		 * the link isn't left idle while they are processed; as there
+		 * are buffered messages, this doesn't wait
+		 */
+		pn_messenger_recv(self->messenger, self->credit);
+		self->consumed = 0;
+	}
+	if(!incoming)
+	{
+		/* There are no buffered incoming messages yet */
+		if(timeout != self->timeout)
+		{
+			pn_messenger_set_timeout(self->messenger, timeout);
+			self->timeout = timeout;
+		}
+		self->consumed = 0;
+		e = pn_messenger_recv(self->messenger, self->credit);
+		if(e == PN_TIMEOUT || e == PN_INPROGRESS)
+		{
+			SET_SYSERR(self, EAGAIN);
+			return -1;
+		}
+		if(e || (e = pn_messenger_errno(self->messenger)))
+		{
+			SET_ERROR(self, e);
+			return -1;
+		}
+		if(!pn_messenger_incoming(self->messenger))
+		{
+			/* Nothing arrived before the messenger returned: if we're
+			 * not waiting indefinitely, this isn't an error as such
+			 */
+			if(timeout >= 0)
+			{
+				SET_SYSERR(self, EAGAIN);
+				return -1;
+			}
+			SET_ERROR(self, pn_messenger_errno(self->messenger));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* (Internal) obtain the next buffered incoming message from the messenger */
+static MQMESSAGE *
+mq_proton_message_get_(MQ *self)
+{
+	MQMESSAGE *p;
+	int e;
+
+	p = mq_proton_message_construct_(self);
+	if(!p)
+	{
+		return NULL;
+	}
+	p->kind = MQK_INCOMING;
+	pn_messenger_get(self->messenger, p->msg);
+	if((e = pn_messenger_errno(self->messenger)))
+	{
+		mq_proton_message_recycle_(p);
+		SET_ERROR(self, e);
+		return NULL;
+	}
+	p->tracker = pn_messenger_incoming_tracker(self->messenger);
+	self->consumed++;
+	return p;
+}
+
+/* (Internal) locate the body of an incoming message, if it hasn't been
+ * already; as messages are recycled, the pn_data_t holding it is re-used
+ */
+static int
+mq_proton_message_decode_body_(MQMESSAGE *self)
+{
+	if(!self->decoded && self->kind == MQK_INCOMING)
+	{
+		self->decoded = 1;
+		self->body = pn_message_body(self->msg);
+		if(self->body)
+		{
+			pn_data_rewind(self->body);
+			pn_data_next(self->body);
+			self->bytes = pn_data_get_binary(self->body);
+		}
+	}
+	return self->body ? 0 : -1;
+}
+
+/* (Internal) adjust the credit granted by a connection with adaptive
+ * prefetch, given the number of messages buffered when the application asks
+ * for another: the credit doubles each time the application has consumed
+ * every buffered message, and halves once it has found the buffer full on
+ * as many successive occasions as the credit itself
+ */
+static void
+mq_proton_adapt_(MQ *self, int incoming)
+{
+	int max;
+
+	if(self->prefetch >= 0)
+	{
+		return;
+	}
+	max = (int) -self->prefetch;
+	if(!incoming)
+	{
+		self->lagging = 0;
+		self->credit = self->credit > max / 2 ? max : self->credit * 2;
+		return;
+	}
+	if(incoming < self->credit)
+	{
+		self->lagging = 0;
+		return;
+	}
+	self->lagging++;
+	if(self->lagging >= self->credit && self->credit > 1)
+	{
+		self->credit /= 2;
+		self->lagging = 0;
+	}
+}
+
+/* (Internal) obtain the status of an outgoing message from the messenger: a
+ * message which is still buffered is pending, while one which has left the
+ * outgoing window has an unknown status
+ */
+static MQSTATUS
+mq_proton_status_(MQ *self, pn_tracker_t tracker)
+{
+	switch(pn_messenger_status(self->messenger, tracker))
+	{
+	case PN_STATUS_PENDING:
+		return MQT_PENDING;
+	case PN_STATUS_ACCEPTED:
+		return MQT_ACCEPTED;
+	case PN_STATUS_REJECTED:
+		return MQT_REJECTED;
+	case PN_STATUS_RELEASED:
+		return MQT_RELEASED;
+	case PN_STATUS_MODIFIED:
+		return MQT_MODIFIED;
+	case PN_STATUS_ABORTED:
+		return MQT_ABORTED;
+	case PN_STATUS_SETTLED:
+		return MQT_SETTLED;
+	default:
+		break;
+	}
+	if(pn_messenger_buffered(self->messenger, tracker))
+	{
+		return MQT_PENDING;
+	}
+	return MQT_UNKNOWN;
+}
+
+/* (Internal) invoke the sent callback for each of the tracked messages, in
+ * the order they were sent, whose outcome has become known; a message which
+ * has been freed is recycled once the callback returns
+ */
+static void
+mq_proton_sent_(MQ *self)
+{
+	MQMESSAGE *p;
+	MQSTATUS status;
+	int released;
+
+	while((p = self->sent))
+	{
+		status = mq_proton_status_(self, p->tracker);
+		if(status == MQT_PENDING)
+		{
+			break;
+		}
+		self->sent = p->nextsent;
+		if(!self->sent)
+		{
+			self->senttail = NULL;
+		}
+		p->nextsent = NULL;
+		p->tracked = 0;
+		p->status = status;
+		/* If the message hasn't been freed, the callback may free it */
+		released = p->released;
+		if(self->sentfn)
+		{
+			self->sentfn(p, status, self->sentdata);
+		}
+		if(released)
+		{
+			mq_proton_message_recycle_(p);
+		}
+	}
+}
+
+/* (Internal) stop tracking sent messages when disconnecting: the outcome of
+ * any which remain will never be known
+ */
+static void
+mq_proton_sent_discard_(MQ *self)
+{
+	MQMESSAGE *p;
+	int released;
+
+	while((p = self->sent))
+	{
+		self->sent = p->nextsent;
+		p->nextsent = NULL;
+		p->tracked = 0;
+		p->status = MQT_UNKNOWN;
+		released = p->released;
+		if(self->sentfn)
+		{
+			self->sentfn(p, MQT_UNKNOWN, self->sentdata);
+		}
+		if(released)
+		{
+			mq_proton_message_recycle_(p);
+		}
+	}
+	self->senttail = NULL;
+}
+
+# ifdef MQ_PROTON_POLLABLE
+/* (Internal) bring the epoll instance up to date with the selectables which
+ * the messenger has created, modified or finished with since the last call,
+ * and re-arm the timer for the earliest deadline
+ */
+static int
+mq_proton_selectables_(MQ *self)
+{
+	struct epoll_event ev;
+	struct itimerspec its;
+	pn_selectable_t *sel, **p;
+	pn_timestamp_t deadline, earliest;
+	size_t c;
+	int fd;
+
+	while((sel = pn_messenger_selectable(self->messenger)))
+	{
+		fd = pn_selectable_get_fd(sel);
+		if(pn_selectable_is_terminal(sel))
+		{
+			if(pn_selectable_is_registered(sel))
+			{
+				epoll_ctl(self->epfd, EPOLL_CTL_DEL, fd, NULL);
+				mq_proton_selectable_remove_(self, sel);
+			}
+			pn_selectable_free(sel);
+			continue;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = (pn_selectable_is_reading(sel) ? EPOLLIN : 0) |
+			(pn_selectable_is_writing(sel) ? EPOLLOUT : 0);
+		ev.data.ptr = sel;
+		if(pn_selectable_is_registered(sel))
+		{
+			if(epoll_ctl(self->epfd, EPOLL_CTL_MOD, fd, &ev))
+			{
+				SET_ERRNO(self);
+				return -1;
+			}
+			continue;
+		}
+		if(self->nsel >= self->selsize)
+		{
+			p = (pn_selectable_t **) realloc(self->sel, sizeof(pn_selectable_t *) * (self->selsize + 8));
+			if(!p)
+			{
+				SET_ERRNO(self);
+				return -1;
+			}
+			self->sel = p;
+			self->selsize += 8;
+		}
+		if(epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev))
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+		pn_selectable_set_registered(sel, true);
+		self->sel[self->nsel] = sel;
+		self->nsel++;
+	}
+	earliest = 0;
+	for(c = 0; c < self->nsel; c++)
+	{
+		deadline = pn_selectable_get_deadline(self->sel[c]);
+		if(deadline && (!earliest || deadline < earliest))
+		{
+			earliest = deadline;
+		}
+	}
+	/* A zero it_value disarms the timer if there is no deadline */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = earliest / 1000;
+	its.it_value.tv_nsec = (earliest % 1000) * 1000000;
+	if(timerfd_settime(self->timerfd, TFD_TIMER_ABSTIME, &its, NULL))
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	return 0;
+}
+
+/* (Internal) remove a selectable from the list of those registered */
+static int
+mq_proton_selectable_remove_(MQ *self, pn_selectable_t *sel)
+{
+	size_t c;
+
+	pn_selectable_set_registered(sel, false);
+	for(c = 0; c < self->nsel; c++)
+	{
+		if(self->sel[c] == sel)
+		{
+			self->nsel--;
+			self->sel[c] = self->sel[self->nsel];
+			return 0;
+		}
+	}
+	return -1;
+}
+# endif /*MQ_PROTON_POLLABLE*/
+
+/* (Internal) determine whether a partition appears in a list */
+static int
+mq_proton_partition_listed_(char **list, size_t count, const char *partition)
+{
+	size_t c;
+
+	for(c = 0; c < count; c++)
+	{
+		if(!strcmp(list[c], partition))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* (Internal) discard the set of partitions */
+static void
+mq_proton_partitions_free_(MQ *self)
+{
+	size_t c;
+
+	for(c = 0; c < self->npartitions; c++)
+	{
+		free(self->partitions[c]);
+	}
+	free(self->partitions);
+	self->partitions = NULL;
+	self->npartitions = 0;
+}
+
+/* (Internal) form the address of a partition (or, if partition is NULL,
+ * return address as-is), in a buffer belonging to the connection
+ */
+static const char *
+mq_proton_partition_address_(MQ *self, const char *address, const char *partition)
+{
+	size_t len;
+	char *p;
+
+	if(!partition)
+	{
+		return address;
+	}
+	len = strlen(address) + strlen(MQ_AMQP_PARTITION_SEP) + strlen(partition) + 1;
+	if(len > self->partaddrsize)
+	{
+		p = (char *) realloc(self->partaddr, len);
+		if(!p)
+		{
+			return NULL;
+		}
+		self->partaddr = p;
+		self->partaddrsize = len;
+	}
+	snprintf(self->partaddr, self->partaddrsize, "%s%s%s", address, MQ_AMQP_PARTITION_SEP, partition);
+	return self->partaddr;
+}
+
+/* (Internal) ensure that the connection's scratch buffer is at least len
+ * bytes long; it grows geometrically, so that it settles at the size of the
+ * largest body assembled (or message spooled) on this connection
+ */
+static int
+mq_proton_scratch_(MQ *self, size_t len)
+{
+	size_t size;
+	char *p;
+
+	if(len <= self->scratchsize)
+	{
+		return 0;
+	}
+	size = self->scratchsize ? self->scratchsize : 1024;
+	while(size < len)
+	{
+		size *= 2;
+	}
+	p = (char *) realloc(self->scratch, size);
+	if(!p)
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	self->scratch = p;
+	self->scratchsize = size;
+	return 0;
+}
+
+/* (Internal) open (creating if needed) the spool file within the directory
+ * path, and find the extent of the records which have yet to be forwarded;
+ * anything following a torn or corrupt record is discarded
+ */
+static int
+mq_proton_spool_open_(MQPROTONSPOOL *spool, const char *path)
+{
+	MQPROTONSPOOLHEADER header;
+	MQPROTONSPOOLRECORD record;
+	struct stat sbuf;
+	unsigned long long offset, size;
+	char *filename, *buf, *p;
+	size_t bufsize;
+	int e;
+
+	if(mkdir(path, 0777) && errno != EEXIST)
+	{
+		return -1;
+	}
+	filename = (char *) malloc(strlen(path) + strlen(MQ_PROTON_SPOOL_FILE) + 2);
+	if(!filename)
+	{
+		return -1;
+	}
+	sprintf(filename, "%s/%s", path, MQ_PROTON_SPOOL_FILE);
+	spool->fd = open(filename, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+	free(filename);
+	if(spool->fd == -1)
+	{
+		return -1;
+	}
+	if(flock(spool->fd, LOCK_EX|LOCK_NB))
+	{
+		if(errno == EWOULDBLOCK)
+		{
+			errno = EBUSY;
+		}
+		return -1;
+	}
+	if(fstat(spool->fd, &sbuf))
+	{
+		return -1;
+	}
+	size = (unsigned long long) sbuf.st_size;
+	if(size < sizeof(header))
+	{
+		/* A new spool */
+		header.magic = MQ_PROTON_SPOOL_MAGIC;
+		header.version = MQ_PROTON_SPOOL_VERSION;
+		header.head = sizeof(header);
+		if(ftruncate(spool->fd, 0) ||
+		   mq_proton_pwrite_(spool->fd, &header, sizeof(header), 0))
+		{
+			return -1;
+		}
+		spool->first = spool->last = sizeof(header);
+		return 0;
+	}
+	if(mq_proton_pread_(spool->fd, &header, sizeof(header), 0))
+	{
+		return -1;
+	}
+	if(header.magic != MQ_PROTON_SPOOL_MAGIC || header.version != MQ_PROTON_SPOOL_VERSION)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	offset = header.head;
+	if(offset < sizeof(header) || offset > size)
+	{
+		/* The spool was emptied before its header was updated */
+		offset = size;
+	}
+	spool->first = offset;
+	buf = NULL;
+	bufsize = 0;
+	while(offset + sizeof(record) <= size)
+	{
+		if(mq_proton_pread_(spool->fd, &record, sizeof(record), offset))
+		{
+			goto failed;
+		}
+		if(record.len > MQ_PROTON_SPOOL_MAXLEN || offset + sizeof(record) + record.len > size)
+		{
+			break;
+		}
+		if(record.len > bufsize)
+		{
+			p = (char *) realloc(buf, record.len);
+			if(!p)
+			{
+				goto failed;
+			}
+			buf = p;
+			bufsize = record.len;
+		}
+		if(mq_proton_pread_(spool->fd, buf, record.len, offset + sizeof(record)))
+		{
+			goto failed;
+		}
+		if(mq_proton_spool_check_(buf, record.len) != record.check)
+		{
+			break;
+		}
+		offset += sizeof(record) + record.len;
+	}
+	free(buf);
+	spool->last = offset;
+	if(offset < size && ftruncate(spool->fd, offset))
+	{
+		return -1;
+	}
+	/* Discard the spool's contents if they have all been forwarded */
+	mq_proton_spool_advance_(spool, spool->first);
+	return 0;
+failed:
+	e = errno;
+	free(buf);
+	errno = e;
+	return -1;
+}
+
+/* (Internal) disable spooling: wait for messages held in memory to be
+ * forwarded for up to the deadline, spool any which have not been, and then
+ * stop the drainer
+ */
+static int
+mq_proton_spool_close_(MQ *self)
+{
+	MQPROTONSPOOL *spool;
+	int r;
+
+	spool = self->spool;
+	r = mq_proton_spool_wait_(self);
+	pthread_mutex_lock(&(spool->lock));
+	__atomic_store_n(&(spool->stop), 1, __ATOMIC_RELEASE);
+	pn_messenger_interrupt(self->messenger);
+	pthread_cond_signal(&(spool->queued));
+	pthread_mutex_unlock(&(spool->lock));
+	pthread_join(spool->thread, NULL);
+	self->spool = NULL;
+	mq_proton_spool_free_(spool);
+	return r;
+}
+
+/* (Internal) destroy the state of a spooled connection */
+static void
+mq_proton_spool_free_(MQPROTONSPOOL *spool)
+{
+	mq_proton_spooled_free_(spool->head);
+	mq_proton_spooled_free_(spool->batch);
+	if(spool->msg)
+	{
+		pn_message_free(spool->msg);
+	}
+	if(spool->fd != -1)
+	{
+		close(spool->fd);
+	}
+	pthread_cond_destroy(&(spool->forwarded));
+	pthread_cond_destroy(&(spool->queued));
+	pthread_mutex_destroy(&(spool->lock));
+	free(spool);
+}
+
+/* (Internal) encode an outgoing message and queue it for the drainer */
+static int
+mq_proton_spool_put_(MQ *self, pn_message_t *msg)
+{
+	MQPROTONSPOOL *spool;
+	MQPROTONSPOOLED *p;
+	size_t len;
+	int r, e;
+
+	spool = self->spool;
+	if(mq_proton_scratch_(self, 1))
+	{
+		return -1;
+	}
+	for(;;)
+	{
+		len = self->scratchsize;
+		r = pn_message_encode(msg, self->scratch, &len);
+		if(r != PN_OVERFLOW)
+		{
+			break;
+		}
+		if(mq_proton_scratch_(self, self->scratchsize * 2))
+		{
+			return -1;
+		}
+	}
+	if(r || len > MQ_PROTON_SPOOL_MAXLEN)
+	{
+		SET_SYSERR(self, r ? EINVAL : EMSGSIZE);
+		return -1;
+	}
+	pthread_mutex_lock(&(spool->lock));
+	if(spool->first < spool->last ||
+	   (self->spoolmemory >= 0 && spool->bytes + len > (size_t) self->spoolmemory))
+	{
+		/* Once anything has been spooled, everything which follows it
+		 * must be too
+		 */
+		r = mq_proton_spool_spill_(spool);
+		if(!r && self->spooldisk >= 0 &&
+		   spool->last - sizeof(MQPROTONSPOOLHEADER) + sizeof(MQPROTONSPOOLRECORD) + len > (unsigned long long) self->spooldisk)
+		{
+			errno = ENOSPC;
+			r = -1;
+		}
+		if(!r)
+		{
+			r = mq_proton_spool_append_(spool, self->scratch, len);
+		}
+	}
+	else
+	{
+		p = (MQPROTONSPOOLED *) malloc(sizeof(MQPROTONSPOOLED) + len);
+		if(p)
+		{
+			p->next = NULL;
+			p->len = len;
+			memcpy(p->data, self->scratch, len);
+			if(spool->tail)
+			{
+				spool->tail->next = p;
+			}
+			else
+			{
+				spool->head = p;
+			}
+			spool->tail = p;
+			spool->bytes += len;
+			r = 0;
+		}
+		else
+		{
+			r = -1;
+		}
+	}
+	e = errno;
+	if(!r)
+	{
+		pthread_cond_signal(&(spool->queued));
+	}
+	pthread_mutex_unlock(&(spool->lock));
+	if(r)
+	{
+		SET_SYSERR(self, e);
+	}
+	return r;
+}
+
+/* (Internal) wait for up to the connection's deadline for messages held in
+ * memory to be forwarded, spool any which have not been by then, and sync
+ * the spool file if anything has been appended to it
+ */
+static int
+mq_proton_spool_wait_(MQ *self)
+{
+	MQPROTONSPOOL *spool;
+	struct timespec deadline;
+	int r, e;
+
+	spool = self->spool;
+	mq_proton_deadline_(&deadline, self->spooldeadline);
+	r = 0;
+	pthread_mutex_lock(&(spool->lock));
+	while(spool->head || (spool->batch && !spool->ondisk))
+	{
+		if(pthread_cond_timedwait(&(spool->forwarded), &(spool->lock), &deadline) == ETIMEDOUT)
+		{
+			r = mq_proton_spool_spill_(spool);
+			break;
+		}
+	}
+	if(!r && spool->dirty)
+	{
+		r = fdatasync(spool->fd);
+		if(!r)
+		{
+			spool->dirty = 0;
+		}
+	}
+	if(!r && spool->discarded)
+	{
+		/* Report messages which the drainer has had to discard */
+		spool->discarded = 0;
+		errno = EBADMSG;
+		r = -1;
+	}
+	e = errno;
+	pthread_mutex_unlock(&(spool->lock));
+	if(r)
+	{
+		SET_SYSERR(self, e);
+	}
+	return r;
+}
+
+/* (Internal) append every message held in memory, starting with the batch
+ * being forwarded if it isn't already on disk, to the spool file; the caller
+ * must hold the lock
+ */
+static int
+mq_proton_spool_spill_(MQPROTONSPOOL *spool)
+{
+	MQPROTONSPOOLED *p;
+	unsigned long long last, total;
+	int e;
+
+	last = spool->last;
+	if(spool->connection->spooldisk >= 0)
+	{
+		total = 0;
+		if(spool->batch && !spool->ondisk)
+		{
+			for(p = spool->batch; p; p = p->next)
+			{
+				total += sizeof(MQPROTONSPOOLRECORD) + p->len;
+			}
+		}
+		for(p = spool->head; p; p = p->next)
+		{
+			total += sizeof(MQPROTONSPOOLRECORD) + p->len;
+		}
+		if(last - sizeof(MQPROTONSPOOLHEADER) + total > (unsigned long long) spool->connection->spooldisk)
+		{
+			errno = ENOSPC;
+			return -1;
+		}
+	}
+	if(spool->batch && !spool->ondisk)
+	{
+		/* Nothing was on disk when the batch was taken from memory,
+		 * and nothing can have been added since without it having
+		 * been spilled first, so the batch's records will be first
+		 */
+		for(p = spool->batch; p; p = p->next)
+		{
+			if(mq_proton_spool_append_(spool, p->data, p->len))
+			{
+				goto failed;
+			}
+		}
+	}
+	for(p = spool->head; p; p = p->next)
+	{
+		if(mq_proton_spool_append_(spool, p->data, p->len))
+		{
+			goto failed;
+		}
+	}
+	if(spool->batch && !spool->ondisk)
+	{
+		spool->ondisk = 1;
+		spool->end = last;
+		for(p = spool->batch; p; p = p->next)
+		{
+			spool->end += sizeof(MQPROTONSPOOLRECORD) + p->len;
+		}
+	}
+	mq_proton_spooled_free_(spool->head);
+	spool->head = spool->tail = NULL;
+	spool->bytes = 0;
+	return 0;
+failed:
+	e = errno;
+	if(!ftruncate(spool->fd, last))
+	{
+		spool->last = last;
+	}
+	errno = e;
+	return -1;
+}
+
+/* (Internal) append a record to the spool file; the caller must hold the
+ * lock
+ */
+static int
+mq_proton_spool_append_(MQPROTONSPOOL *spool, const char *data, size_t len)
+{
+	MQPROTONSPOOLRECORD record;
+
+	record.len = (uint32_t) len;
+	record.check = mq_proton_spool_check_(data, len);
+	if(mq_proton_pwrite_(spool->fd, &record, sizeof(record), spool->last) ||
+	   mq_proton_pwrite_(spool->fd, data, len, spool->last + sizeof(record)))
+	{
+		return -1;
+	}
+	spool->last += sizeof(record) + len;
+	spool->dirty = 1;
+	return 0;
+}
+
+/* (Internal) read up to MQ_PROTON_SPOOL_BATCH records from the spool file,
+ * starting at offset and ending before last, setting *end to the offset of
+ * the record following them
+ */
+static int
+mq_proton_spool_read_(MQPROTONSPOOL *spool, unsigned long long offset, unsigned long long last, MQPROTONSPOOLED **list, unsigned long long *end)
+{
+	MQPROTONSPOOLRECORD record;
+	MQPROTONSPOOLED *p, **tailp;
+	size_t c;
+	int e;
+
+	*list = NULL;
+	tailp = list;
+	for(c = 0; c < MQ_PROTON_SPOOL_BATCH && offset < last; c++)
+	{
+		if(mq_proton_pread_(spool->fd, &record, sizeof(record), offset))
+		{
+			goto failed;
+		}
+		if(offset + sizeof(record) + record.len > last)
+		{
+			errno = EILSEQ;
+			goto failed;
+		}
+		p = (MQPROTONSPOOLED *) malloc(sizeof(MQPROTONSPOOLED) + record.len);
+		if(!p)
+		{
+			goto failed;
+		}
+		p->next = NULL;
+		p->len = record.len;
+		*tailp = p;
+		tailp = &(p->next);
+		if(mq_proton_pread_(spool->fd, p->data, p->len, offset + sizeof(record)))
+		{
+			goto failed;
+		}
+		if(mq_proton_spool_check_(p->data, p->len) != record.check)
+		{
+			errno = EILSEQ;
+			goto failed;
+		}
+		offset += sizeof(record) + record.len;
+	}
+	*end = offset;
+	return 0;
+failed:
+	e = errno;
+	mq_proton_spooled_free_(*list);
+	*list = NULL;
+	errno = e;
+	return -1;
+}
+
+/* (Internal) note that every record before offset has been forwarded,
+ * discarding the spool file's contents altogether once all of them have
+ * been; the caller must hold the lock
+ */
+static void
+mq_proton_spool_advance_(MQPROTONSPOOL *spool, unsigned long long offset)
+{
+	uint64_t head;
+
+	spool->first = offset;
+	if(spool->first == spool->last &&
+	   !ftruncate(spool->fd, sizeof(MQPROTONSPOOLHEADER)))
+	{
+		spool->first = spool->last = sizeof(MQPROTONSPOOLHEADER);
+	}
+	/* If this is lost, the records will be forwarded again */
+	head = spool->first;
+	mq_proton_pwrite_(spool->fd, &head, sizeof(head), offsetof(MQPROTONSPOOLHEADER, head));
+}
+
+/* (Internal) the drainer thread: forward batches of messages, from the spool
+ * file if it has any records which have not been forwarded and from memory
+ * otherwise, backing off each time a batch cannot be forwarded
+ */
+static void *
+mq_proton_spool_thread_(void *arg)
+{
+	MQPROTONSPOOL *spool;
+	MQPROTONSPOOLED *batch, *p, **tailp;
+	struct timespec deadline;
+	unsigned long long first, last, end;
+	unsigned failures;
+	size_t c;
+	int r;
+
+	spool = (MQPROTONSPOOL *) arg;
+	failures = 0;
+	pthread_mutex_lock(&(spool->lock));
+	while(!spool->stop)
+	{
+		r = 0;
+		if(!spool->batch)
+		{
+			if(spool->first < spool->last)
+			{
+				/* Records below last are never modified, so they
+				 * can be read without holding the lock
+				 */
+				first = spool->first;
+				last = spool->last;
+				pthread_mutex_unlock(&(spool->lock));
+				r = mq_proton_spool_read_(spool, first, last, &batch, &end);
+				pthread_mutex_lock(&(spool->lock));
+				if(!r)
+				{
+					spool->batch = batch;
+					spool->ondisk = 1;
+					spool->end = end;
+				}
+			}
+			else if(spool->head)
+			{
+				tailp = &(spool->batch);
+				for(c = 0; c < MQ_PROTON_SPOOL_BATCH && spool->head; c++)
+				{
+					p = spool->head;
+					spool->head = p->next;
+					spool->bytes -= p->len;
+					p->next = NULL;
+					*tailp = p;
+					tailp = &(p->next);
+				}
+				if(!spool->head)
+				{
+					spool->tail = NULL;
+				}
+				spool->ondisk = 0;
+			}
+			else
+			{
+				pthread_cond_wait(&(spool->queued), &(spool->lock));
+				continue;
+			}
+		}
+		if(!r)
+		{
+			/* The batch is only freed by this thread, so it can be
+			 * forwarded without holding the lock
+			 */
+			batch = spool->batch;
+			pthread_mutex_unlock(&(spool->lock));
+			r = mq_proton_spool_forward_(spool->connection, batch);
+			pthread_mutex_lock(&(spool->lock));
+			if(!r)
+			{
+				if(spool->ondisk)
+				{
+					mq_proton_spool_advance_(spool, spool->end);
+				}
+				spool->batch = NULL;
+				spool->ondisk = 0;
+				mq_proton_spooled_free_(batch);
+				failures = 0;
+				pthread_cond_broadcast(&(spool->forwarded));
+				continue;
+			}
+		}
+		if(spool->stop)
+		{
+			break;
+		}
+		/* Back off for 1, 2, 4... seconds before trying again */
+		mq_proton_deadline_(&deadline, 1000L * (failures < 5 ? (1L << failures) : MQ_PROTON_SPOOL_BACKOFF));
+		failures++;
+		__atomic_add_fetch(&(spool->connection->common.stats.backoffs), 1, __ATOMIC_RELAXED);
+		while(!spool->stop &&
+			  pthread_cond_timedwait(&(spool->queued), &(spool->lock), &deadline) != ETIMEDOUT);
+	}
+	pthread_mutex_unlock(&(spool->lock));
+	return NULL;
+}
+
+/* (Internal) put a batch of spooled messages and wait for the messenger to
+ * send them; if it fails to, the messenger is replaced, discarding anything
+ * it had buffered, so that the whole batch can be forwarded again
+ */
+static int
+mq_proton_spool_forward_(MQ *self, MQPROTONSPOOLED *list)
+{
+	MQPROTONSPOOL *spool;
+	MQPROTONSPOOLED *p;
+	int e;
+
+	spool = self->spool;
+	for(p = list; p; p = p->next)
+	{
+		pn_message_clear(spool->msg);
+		if(pn_message_decode(spool->msg, p->data, p->len))
+		{
+			/* This can never be forwarded: count it, and leave it to
+			 * be reported by the next mq_deliver()
+			 */
+			__atomic_add_fetch(&(self->common.stats.errors), 1, __ATOMIC_RELAXED);
+			pthread_mutex_lock(&(spool->lock));
+			spool->discarded++;
+			pthread_mutex_unlock(&(spool->lock));
+			continue;
+		}
+		if(pn_messenger_put(self->messenger, spool->msg))
+		{
+			mq_proton_spool_reset_(self);
+			return -1;
+		}
+	}
+	for(;;)
+	{
+		e = pn_messenger_send(self->messenger, -1);
+		if(!e)
+		{
+			return 0;
+		}
+		if(__atomic_load_n(&(spool->stop), __ATOMIC_ACQUIRE))
+		{
+			return -1;
+		}
+		if(e != PN_TIMEOUT && e != PN_INTR)
+		{
+			mq_proton_spool_reset_(self);
+			return -1;
+		}
+	}
+}
+
+/* (Internal) replace the drainer's messenger with a new one */
+static int
+mq_proton_spool_reset_(MQ *self)
+{
+	pn_messenger_t *messenger, *old;
+
+	messenger = pn_messenger(NULL);
+	if(!messenger)
+	{
+		return -1;
+	}
+	pn_messenger_start(messenger);
+	if(pn_messenger_errno(messenger))
+	{
+		pn_messenger_free(messenger);
+		return -1;
+	}
+	pn_messenger_set_outgoing_window(messenger, __atomic_load_n(&(self->outgoing_window), __ATOMIC_RELAXED));
+	pn_messenger_set_timeout(messenger, MQ_PROTON_SPOOL_TIMEOUT);
+	pthread_mutex_lock(&(self->spool->lock));
+	old = self->messenger;
+	self->messenger = messenger;
+	pthread_mutex_unlock(&(self->spool->lock));
+	pn_messenger_stop(old);
+	pn_messenger_free(old);
+	return 0;
+}
+
+/* (Internal) free a list of spooled messages */
+static void
+mq_proton_spooled_free_(MQPROTONSPOOLED *list)
+{
+	MQPROTONSPOOLED *p;
+
+	while(list)
+	{
+		p = list;
+		list = p->next;
+		free(p);
+	}
+}
+
+/* (Internal) compute the check value of a spooled message, a 32-bit FNV-1a
+ * hash of its encoding
+ */
+static uint32_t
+mq_proton_spool_check_(const char *data, size_t len)
+{
+	const unsigned char *p, *end;
+	uint32_t hash;
+
+	hash = 2166136261UL;
+	for(p = (const unsigned char *) data, end = p + len; p < end; p++)
+	{
+		hash ^= *p;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/* (Internal) obtain an absolute CLOCK_MONOTONIC deadline ms milliseconds in
+ * the future
+ */
+static void
+mq_proton_deadline_(struct timespec *ts, long ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if(ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* (Internal) read exactly len bytes from a file at offset */
+static int
+mq_proton_pread_(int fd, void *buf, size_t len, unsigned long long offset)
+{
+	ssize_t n;
+
+	while(len)
+	{
+		n = pread(fd, buf, len, (off_t) offset);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		if(!n)
+		{
+			errno = EIO;
+			return -1;
+		}
+		buf = (char *) buf + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/* (Internal) write exactly len bytes to a file at offset */
+static int
+mq_proton_pwrite_(int fd, const void *buf, size_t len, unsigned long long offset)
+{
+	ssize_t n;
+
+	while(len)
+	{
+		n = pwrite(fd, buf, len, (off_t) offset);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buf = (const char *) buf + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/* (Internal) disconnect from a message queue */
+static int
+mq_proton_disconnect_internal_(MQ *self)
+{
+	if(self->spool)
+	{
+		mq_proton_spool_close_(self);
+	}
+	if(self->sent)
+	{
+		mq_proton_sent_(self);
+		mq_proton_sent_discard_(self);
+	}
+	if(self->messenger)
+	{
+		/* TODO; deal with PN_INPROGRESS response from pn_messenger_stop() */
+		pn_messenger_stop(self->messenger);
+# ifdef MQ_PROTON_POLLABLE
+		if(self->epfd != -1)
+		{
+			/* In passive mode, we are responsible for freeing any
+			 * selectables which have become terminal
+			 */
+			mq_proton_selectables_(self);
+		}
+# endif
+		pn_messenger_free(self->messenger);
+		self->messenger = NULL;
+		self->sub = NULL;
+	}
+	if(self->epfd != -1)
+	{
+		close(self->timerfd);
+		close(self->epfd);
+		self->timerfd = self->epfd = -1;
 	}
+# ifdef MQ_PROTON_POLLABLE
+	free(self->sel);
+	self->sel = NULL;
+	self->nsel = self->selsize = 0;
+# endif
 	self->state = MQS_DISCONNECTED;
 	return 0;
 }
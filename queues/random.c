@@ -27,6 +27,11 @@
 #include "p_libmq.h"
 
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
 
 #define MQ_ERRBUF_LEN                  128
 
@@ -45,6 +50,12 @@ static int mq_random_set_cluster_(MQ *self, CLUSTER *cluster);
 static CLUSTER *mq_random_cluster_(MQ *self);
 static int mq_random_set_partition_(MQ *self, const char *partition);
 static const char *mq_random_partition_(MQ *self);
+static int mq_random_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received);
+static int mq_random_next_timed_(MQ *self, MQMESSAGE **msg, int timeout);
+static int mq_random_set_option_(MQ *self, MQOPTION option, long value);
+static int mq_random_fd_(MQ *self, int *events);
+static int mq_random_process_(MQ *self);
+static MQCOMMON *mq_random_common_(MQ *self);
 
 /* MQMESSAGE implementation members */
 static unsigned long mq_random_message_release_(MQMESSAGE *self);
@@ -64,12 +75,21 @@ static size_t mq_random_message_len_(MQMESSAGE *self);
 static int mq_random_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len);
 static int mq_random_message_set_partition_(MQMESSAGE *self, const char *partition);
 static const char *mq_random_message_partition_(MQMESSAGE *self);
+static MQ *mq_random_message_connection_(MQMESSAGE *self);
 
 struct mq_connection_struct
 {
 	MQCONNIMPL *impl;
 	MQ_CONNECTION_COMMON_MEMBERS;
 	char *partition;
+	/* Descriptors which are permanently readable, returned by fd() */
+	int fd[2];
+	/* Released message objects retained for re-use, and the maximum
+	 * number to retain (negative for no limit)
+	 */
+	MQMESSAGE *pool;
+	size_t poolcount;
+	long poollimit;
 };
 
 struct mq_message_struct
@@ -78,6 +98,8 @@ struct mq_message_struct
 	MQ_MESSAGE_COMMON_MEMBERS;
 	char unsigned buf[32];
 	char *partition;
+	/* The next message in the connection's pool */
+	MQMESSAGE *next;
 };
 
 static MQCONNIMPL mq_random_connection_impl_ = {
@@ -98,7 +120,23 @@ static MQCONNIMPL mq_random_connection_impl_ = {
 	mq_random_set_cluster_,
 	mq_random_cluster_,
 	mq_random_set_partition_,
-	mq_random_partition_
+	mq_random_partition_,
+	mq_random_next_batch_,
+	/* send_batch */
+	NULL,
+	mq_random_next_timed_,
+	mq_random_set_option_,
+	mq_random_fd_,
+	mq_random_process_,
+	mq_random_common_,
+	/* set_spool */
+	NULL,
+	/* pending */
+	NULL,
+	/* set_sent_callback */
+	NULL,
+	/* set_partitions */
+	NULL
 };
 
 static MQMESSAGEIMPL mq_random_message_impl_ = {
@@ -122,11 +160,29 @@ static MQMESSAGEIMPL mq_random_message_impl_ = {
 	mq_random_message_len_,
 	mq_random_message_add_bytes_,
 	mq_random_message_set_partition_,
-	mq_random_message_partition_
+	mq_random_message_partition_,
+	/* add_iov */
+	NULL,
+	/* add_bytes_owned */
+	NULL,
+	/* take_body */
+	NULL,
+	mq_random_message_connection_,
+	/* status */
+	NULL,
+	/* set_encoding */
+	NULL,
+	/* encoding */
+	NULL,
+	/* replace_body */
+	NULL
 };
 
 MQ *mq_random_construct_(const char *uri, const char *reserved1, const char *reserved2);
 static MQMESSAGE *mq_random_message_construct_(MQ *self);
+static void mq_random_pool_trim_(MQ *self, size_t limit);
+
+MQ_ENGINE_PLUGIN;
 
 int
 mq_entry(void *self)
@@ -164,6 +220,9 @@ mq_random_construct_(const char *uri, const char *reserved1, const char *reserve
 	}
 	mq->impl = &mq_random_connection_impl_;
 	mq->uri = p;
+	mq->fd[0] = -1;
+	mq->fd[1] = -1;
+	mq->poollimit = -1;
 	return mq;
 }
 
@@ -171,6 +230,15 @@ mq_random_construct_(const char *uri, const char *reserved1, const char *reserve
 static unsigned long
 mq_random_release_(MQ *self)
 {
+	mq_random_pool_trim_(self, 0);
+	if(self->fd[0] != -1)
+	{
+		close(self->fd[0]);
+	}
+	if(self->fd[1] != -1)
+	{
+		close(self->fd[1]);
+	}
 	free(self->errmsg);
 	free(self->uri);
 	free(self);
@@ -272,6 +340,42 @@ mq_random_next_(MQ *self, MQMESSAGE **msg)
 	return 0;
 }
 
+/* Generate a batch of messages: as there is no waiting involved, this
+ * always fills the whole of msgs
+ */
+static int
+mq_random_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received)
+{
+	size_t n;
+
+	RESET_ERROR(self);
+	for(n = 0; n < count; n++)
+	{
+		if(mq_random_next_(self, &(msgs[n])))
+		{
+			break;
+		}
+	}
+	*received = n;
+	if(count && !n)
+	{
+		return -1;
+	}
+	RESET_ERROR(self);
+	return 0;
+}
+
+/* Wait up to timeout milliseconds for a message to arrive: as messages are
+ * generated on demand, this never needs to wait
+ */
+static int
+mq_random_next_timed_(MQ *self, MQMESSAGE **msg, int timeout)
+{
+	(void) timeout;
+
+	return mq_random_next_(self, msg);
+}
+
 /* Deliver any buffered outgoing messages */
 static int
 mq_random_deliver_(MQ *self)
@@ -337,6 +441,82 @@ mq_random_set_partition_(MQ *self, const char *partition)
 	return 0;
 }
 
+/* Set a connection option */
+static int
+mq_random_set_option_(MQ *self, MQOPTION option, long value)
+{
+	RESET_ERROR(self);
+	switch(option)
+	{
+	case MQO_NONBLOCK:
+		self->nonblock = !!value;
+		return 0;
+	case MQO_POOL:
+		self->poollimit = value < 0 ? -1 : value;
+		if(value >= 0)
+		{
+			mq_random_pool_trim_(self, (size_t) value);
+		}
+		return 0;
+	default:
+		break;
+	}
+	SET_SYSERR(self, ENOTSUP);
+	return -1;
+}
+
+/* Obtain a pollable file descriptor for the connection: because messages
+ * are generated on demand, one is always available, and so the descriptor
+ * is permanently readable
+ */
+static int
+mq_random_fd_(MQ *self, int *events)
+{
+	RESET_ERROR(self);
+	if(self->state != MQS_RECV)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	if(self->fd[0] == -1)
+	{
+#ifdef HAVE_SYS_EVENTFD_H
+		self->fd[0] = eventfd(1, EFD_CLOEXEC|EFD_NONBLOCK);
+		if(self->fd[0] == -1)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+#else
+		if(pipe(self->fd))
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+		fcntl(self->fd[0], F_SETFD, FD_CLOEXEC);
+		fcntl(self->fd[1], F_SETFD, FD_CLOEXEC);
+		if(write(self->fd[1], "", 1) != 1)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+#endif
+	}
+	if(events)
+	{
+		*events = MQE_READ;
+	}
+	return self->fd[0];
+}
+
+/* Perform any pending work on the connection: there never is any */
+static int
+mq_random_process_(MQ *self)
+{
+	RESET_ERROR(self);
+	return 0;
+}
+
 static const char *
 mq_random_partition_(MQ *self)
 {
@@ -347,8 +527,22 @@ mq_random_partition_(MQ *self)
 static unsigned long
 mq_random_message_release_(MQMESSAGE *self)
 {
-	RESET_ERROR(self->connection);
-	free(self);
+	MQ *conn;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	free(self->partition);
+	if(conn->poollimit >= 0 && conn->poolcount >= (size_t) conn->poollimit)
+	{
+		free(self);
+		return 0;
+	}
+	memset(self, 0, sizeof(MQMESSAGE));
+	self->impl = &mq_random_message_impl_;
+	self->connection = conn;
+	self->next = conn->pool;
+	conn->pool = self;
+	conn->poolcount++;
 	return 0;
 }
 
@@ -543,12 +737,34 @@ mq_random_message_partition_(MQMESSAGE *self)
 }
 
 
+/* Obtain the state maintained by libmq for the connection */
+static MQCOMMON *
+mq_random_common_(MQ *self)
+{
+	return &(self->common);
+}
+
+/* Obtain the connection that a message is associated with */
+static MQ *
+mq_random_message_connection_(MQMESSAGE *self)
+{
+	return self->connection;
+}
+
 /* (Internal) create a new MQ message object */
 static MQMESSAGE *
 mq_random_message_construct_(MQ *self)
 {
 	MQMESSAGE *p;
 
+	if(self->pool)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		p->next = NULL;
+		return p;
+	}
 	p = (MQMESSAGE *) calloc(1, sizeof(MQMESSAGE));
 	if(!p)
 	{
@@ -559,3 +775,18 @@ mq_random_message_construct_(MQ *self)
 	p->connection = self;
 	return p;
 }
+
+/* (Internal) destroy pooled message objects until no more than limit remain */
+static void
+mq_random_pool_trim_(MQ *self, size_t limit)
+{
+	MQMESSAGE *p;
+
+	while(self->poolcount > limit)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		free(p);
+	}
+}
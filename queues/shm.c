@@ -0,0 +1,2058 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* The shm: engine passes messages between processes on the same host via a
+ * POSIX shared memory segment.
+ *
+ * Connections to shm:NAME (or shm://NAME) use the segment /libmq-NAME, or
+ * /libmq-NAME@PARTITION for a partition, creating it if it doesn't already
+ * exist. The URI may include a query string specifying the parameters of a
+ * newly-created segment:
+ *
+ *   slots=N       the number of messages the segment can hold (default 1024)
+ *   arena=BYTES   the size of the message arena (default 4MiB)
+ *   hugepages=1   ask for the segment to be backed by transparent huge pages
+ *
+ * Each segment holds a bounded multiple-producer, multiple-consumer ring of
+ * fixed-size slots, each of which refers to a variable-sized block in the
+ * arena holding a message's properties and body. Messages are copied into
+ * the arena when they are sent; received messages are views directly into
+ * the arena, which remain valid until the message is freed (or accepted,
+ * rejected or passed).
+ *
+ * Arena space is allocated and reclaimed in order, so a message which is
+ * held for a long time will eventually prevent any more being sent. Each
+ * block records the process holding it (the sender until the message is
+ * written to the ring, then the receiver which obtained it), and when the
+ * arena is full, blocks held by processes which no longer exist are
+ * reclaimed; this relies upon the processes using a segment sharing a PID
+ * namespace. Receivers waiting on an empty ring, and senders waiting for
+ * space, spin briefly before sleeping on a futex in the segment.
+ *
+ * Segments persist until they are removed (e.g., from /dev/shm), so that
+ * messages can be sent before anything is receiving them.
+ */
+
+#define MQ_CONNECTION_STRUCT_DEFINED   1
+#define MQ_MESSAGE_STRUCT_DEFINED      1
+
+#include "p_libmq.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_LINUX_FUTEX_H
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+
+#define MQ_ERRBUF_LEN                  128
+#define MQ_SHM_MAGIC                   0x4d51534dUL
+#define MQ_SHM_VERSION                 2
+/* The default and maximum number of slots in a segment */
+#define MQ_SHM_SLOTS                   1024
+#define MQ_SHM_MAXSLOTS                (1UL << 24)
+/* The default, minimum and maximum size of a segment's arena */
+#define MQ_SHM_ARENA                   (4UL << 20)
+#define MQ_SHM_MINARENA                (64UL << 10)
+#define MQ_SHM_MAXARENA                (1UL << 30)
+/* Blocks in the arena are aligned to cache lines */
+#define MQ_SHM_ALIGN                   64
+#define MQ_SHM_HUGEPAGE                (2UL << 20)
+/* The number of times an operation is retried before sleeping */
+#define MQ_SHM_SPIN                    128
+/* How long to wait for another process to initialise a segment, in ms */
+#define MQ_SHM_INITWAIT                5000
+/* How often a sender waiting for arena space checks for blocks held by
+ * processes which have exited, in ms
+ */
+#define MQ_SHM_RECLAIM                 1000
+/* The length of a block string which is not present */
+#define MQ_SHM_ABSENT                  0xffffffffUL
+/* The state of an arena block which has been freed */
+#define MQ_SHM_FREE                    1
+
+typedef struct mq_shm_segment_struct MQSHMSEGMENT;
+typedef struct mq_shm_header_struct MQSHMHEADER;
+typedef struct mq_shm_block_struct MQSHMBLOCK;
+
+/* MQ implementation members */
+static unsigned long mq_shm_release_(MQ *self);
+static int mq_shm_error_(MQ *self);
+static const char *mq_shm_errmsg_(MQ *self);
+static MQSTATE mq_shm_state_(MQ *self);
+static int mq_shm_connect_recv_(MQ *self);
+static int mq_shm_connect_send_(MQ *self);
+static int mq_shm_disconnect_(MQ *self);
+static int mq_shm_next_(MQ *self, MQMESSAGE **msg);
+static int mq_shm_deliver_(MQ *self);
+static int mq_shm_create_(MQ *self, MQMESSAGE **msg);
+static int mq_shm_set_cluster_(MQ *self, CLUSTER *cluster);
+static CLUSTER *mq_shm_cluster_(MQ *self);
+static int mq_shm_set_partition_(MQ *self, const char *partition);
+static const char *mq_shm_partition_(MQ *self);
+static int mq_shm_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received);
+static int mq_shm_next_timed_(MQ *self, MQMESSAGE **msg, int timeout);
+static int mq_shm_set_option_(MQ *self, MQOPTION option, long value);
+static MQCOMMON *mq_shm_common_(MQ *self);
+static int mq_shm_pending_(MQ *self);
+
+/* MQMESSAGE implementation members */
+static unsigned long mq_shm_message_release_(MQMESSAGE *self);
+static MQMSGKIND mq_shm_message_kind_(MQMESSAGE *self);
+static int mq_shm_message_accept_(MQMESSAGE *self);
+static int mq_shm_message_reject_(MQMESSAGE *self);
+static int mq_shm_message_pass_(MQMESSAGE *self);
+static int mq_shm_message_send_(MQMESSAGE *self);
+static int mq_shm_message_set_type_(MQMESSAGE *self, const char *type);
+static const char *mq_shm_message_type_(MQMESSAGE *self);
+static int mq_shm_message_set_subject_(MQMESSAGE *self, const char *type);
+static const char *mq_shm_message_subject_(MQMESSAGE *self);
+static int mq_shm_message_set_address_(MQMESSAGE *self, const char *address);
+static const char *mq_shm_message_address_(MQMESSAGE *self);
+static const unsigned char *mq_shm_message_body_(MQMESSAGE *self);
+static size_t mq_shm_message_len_(MQMESSAGE *self);
+static int mq_shm_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len);
+static int mq_shm_message_set_partition_(MQMESSAGE *self, const char *partition);
+static const char *mq_shm_message_partition_(MQMESSAGE *self);
+static int mq_shm_message_add_iov_(MQMESSAGE *self, const struct iovec *iov, int iovcnt);
+static int mq_shm_message_add_bytes_owned_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn);
+static unsigned char *mq_shm_message_take_body_(MQMESSAGE *self, size_t *buflen);
+static MQ *mq_shm_message_connection_(MQMESSAGE *self);
+
+/* The header at the start of a shared memory segment; all positions are
+ * monotonically-increasing counters, reduced modulo the number of slots or
+ * the size of the arena as appropriate
+ */
+struct mq_shm_header_struct
+{
+	/* magic is set once the segment has been initialised */
+	uint32_t magic;
+	uint32_t version;
+	uint64_t nslots;
+	uint64_t arenasize;
+	uint64_t slotsoff;
+	uint64_t arenaoff;
+	uint64_t size;
+	/* lock protects allocation and reclamation of arena space */
+	pthread_mutex_t lock;
+	uint64_t head;
+	uint64_t tail;
+	/* The positions in the ring of the next slot to be written and read */
+	uint64_t enqueue __attribute__((aligned(MQ_SHM_ALIGN)));
+	uint64_t dequeue __attribute__((aligned(MQ_SHM_ALIGN)));
+	/* pushed is incremented when a message is written, and popped when
+	 * a slot or arena space is released; they are used as futexes by
+	 * waiting receivers and senders respectively
+	 */
+	uint32_t pushed __attribute__((aligned(MQ_SHM_ALIGN)));
+	uint32_t recvwaiters;
+	uint32_t popped __attribute__((aligned(MQ_SHM_ALIGN)));
+	uint32_t sendwaiters;
+};
+
+/* A slot in the ring, used as in Dmitry Vyukov's bounded MPMC queue; pos is
+ * the arena position of the message's block
+ */
+struct mq_shm_slot_struct
+{
+	uint64_t seq;
+	uint64_t pos;
+};
+
+/* A block in the arena, which is followed by the (nul-terminated) type,
+ * subject and address of the message, if present, and then the body
+ */
+struct mq_shm_block_struct
+{
+	/* The size of the block, including this header */
+	uint64_t size;
+	uint64_t len;
+	uint32_t state;
+	uint32_t typelen;
+	uint32_t subjectlen;
+	uint32_t addresslen;
+	/* The process holding the block, or zero while it's in the ring */
+	uint32_t holder;
+};
+
+/* A mapped segment */
+struct mq_shm_segment_struct
+{
+	/* The connection and each incoming message read from the segment
+	 * hold a reference to it
+	 */
+	unsigned long refcount;
+	char *partition;
+	unsigned char *base;
+	size_t size;
+	MQSHMHEADER *header;
+	struct mq_shm_slot_struct *slots;
+	unsigned char *arena;
+};
+
+struct mq_connection_struct
+{
+	MQCONNIMPL *impl;
+	MQ_CONNECTION_COMMON_MEMBERS;
+	char *name;
+	char *partition;
+	/* Parameters for newly-created segments */
+	size_t nslots;
+	size_t arenasize;
+	int hugepages;
+	/* The segment a receiver reads from */
+	MQSHMSEGMENT *segment;
+	/* The segments a sender has written to */
+	MQSHMSEGMENT **segments;
+	size_t nsegments;
+	/* Released message objects retained for re-use, and the maximum
+	 * number to retain (negative for no limit)
+	 */
+	MQMESSAGE *pool;
+	size_t poolcount;
+	long poollimit;
+};
+
+struct mq_message_struct
+{
+	MQMESSAGEIMPL *impl;
+	MQ_MESSAGE_COMMON_MEMBERS;
+	/* For incoming messages, the segment and block the message was read
+	 * from; the block is NULL once it has been released or passed on.
+	 * The properties and body are views into the block.
+	 */
+	MQSHMSEGMENT *segment;
+	MQSHMBLOCK *block;
+	uint64_t pos;
+	/* For outgoing messages, the properties and body are owned by the
+	 * message
+	 */
+	char *type;
+	char *subject;
+	char *address;
+	char *partition;
+	unsigned char *body;
+	size_t len;
+	size_t size;
+	MQFREEFN free_fn;
+	/* The next message in the connection's pool */
+	MQMESSAGE *next;
+};
+
+static MQCONNIMPL mq_shm_connection_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_shm_release_,
+	mq_shm_error_,
+	mq_shm_errmsg_,
+	mq_shm_state_,
+	mq_shm_connect_recv_,
+	mq_shm_connect_send_,
+	mq_shm_disconnect_,
+	mq_shm_next_,
+	mq_shm_deliver_,
+	mq_shm_create_,
+	mq_shm_set_cluster_,
+	mq_shm_cluster_,
+	mq_shm_set_partition_,
+	mq_shm_partition_,
+	mq_shm_next_batch_,
+	/* send_batch */
+	NULL,
+	mq_shm_next_timed_,
+	mq_shm_set_option_,
+	/* fd */
+	NULL,
+	/* process */
+	NULL,
+	mq_shm_common_,
+	/* set_spool */
+	NULL,
+	mq_shm_pending_,
+	/* set_sent_callback */
+	NULL,
+	/* set_partitions */
+	NULL
+};
+
+static MQMESSAGEIMPL mq_shm_message_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_shm_message_release_,
+	mq_shm_message_kind_,
+	mq_shm_message_accept_,
+	mq_shm_message_reject_,
+	mq_shm_message_pass_,
+	mq_shm_message_send_,
+	mq_shm_message_set_type_,
+	mq_shm_message_type_,
+	mq_shm_message_set_subject_,
+	mq_shm_message_subject_,
+	mq_shm_message_set_address_,
+	mq_shm_message_address_,
+	mq_shm_message_body_,
+	mq_shm_message_len_,
+	mq_shm_message_add_bytes_,
+	mq_shm_message_set_partition_,
+	mq_shm_message_partition_,
+	mq_shm_message_add_iov_,
+	mq_shm_message_add_bytes_owned_,
+	mq_shm_message_take_body_,
+	mq_shm_message_connection_,
+	/* status */
+	NULL,
+	/* set_encoding */
+	NULL,
+	/* encoding */
+	NULL,
+	/* replace_body */
+	NULL
+};
+
+MQ *mq_shm_construct_(const char *uri, const char *reserved1, const char *reserved2);
+
+/* Internal utilities */
+static int mq_shm_parse_(MQ *self, const char *query);
+static MQMESSAGE *mq_shm_message_construct_(MQ *self);
+static void mq_shm_pool_trim_(MQ *self, size_t limit);
+static MQSHMSEGMENT *mq_shm_segment_open_(MQ *self, const char *partition);
+static int mq_shm_segment_init_(MQ *self, MQSHMSEGMENT *seg, int fd);
+static int mq_shm_segment_attach_(MQSHMSEGMENT *seg, int fd);
+static void mq_shm_segment_put_(MQSHMSEGMENT *seg);
+static MQSHMSEGMENT *mq_shm_sender_segment_(MQ *self, const char *partition);
+static void mq_shm_lock_(MQSHMSEGMENT *seg);
+static int mq_shm_alloc_(MQSHMSEGMENT *seg, uint64_t size, uint64_t *pos);
+static void mq_shm_free_(MQSHMSEGMENT *seg, MQSHMBLOCK *block);
+static int mq_shm_reclaim_(MQSHMSEGMENT *seg);
+static int mq_shm_held_(MQSHMBLOCK *block);
+static MQSHMBLOCK *mq_shm_block_(MQSHMSEGMENT *seg, uint64_t pos);
+static int mq_shm_push_(MQSHMSEGMENT *seg, uint64_t pos);
+static int mq_shm_pop_(MQSHMSEGMENT *seg, uint64_t *pos);
+static int mq_shm_wait_(uint32_t *futex, uint32_t value, struct timespec *deadline);
+static void mq_shm_wake_(uint32_t *futex, uint32_t *waiters);
+static void mq_shm_deadline_(struct timespec *deadline, int timeout);
+static int mq_shm_next_wait_(MQ *self, MQMESSAGE **msg, int timeout);
+static int mq_shm_send_try_(MQMESSAGE *self, MQSHMSEGMENT *seg, uint64_t size, uint64_t *pos, int *allocated);
+static int mq_shm_wrap_(MQ *self, MQMESSAGE **msg, uint64_t pos);
+static int mq_shm_grow_(MQMESSAGE *self, size_t len);
+static int mq_shm_strset_(MQMESSAGE *self, char **dest, const char *src);
+
+MQ_ENGINE_PLUGIN;
+
+int
+mq_entry(void *self)
+{
+	if(mq_register("shm", mq_shm_construct_, self))
+	{
+		fprintf(stderr, "MQ: shm: constructor registration failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Shared memory message queue constructor: this is invoked by libmq to create
+ * a new shm-flavoured MQ instance
+ */
+MQ *
+mq_shm_construct_(const char *uri, const char *reserved1, const char *reserved2)
+{
+	MQ *mq;
+	const char *name, *query;
+	size_t len;
+
+	(void) reserved1;
+	(void) reserved2;
+
+	name = strchr(uri, ':');
+	name = name ? name + 1 : uri;
+	if(!strncmp(name, "//", 2))
+	{
+		name += 2;
+	}
+	query = strchr(name, '?');
+	len = query ? (size_t) (query - name) : strlen(name);
+	if(!len || memchr(name, '/', len) || memchr(name, '@', len))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	mq = (MQ *) calloc(1, sizeof(MQ));
+	if(!mq)
+	{
+		return NULL;
+	}
+	mq->impl = &mq_shm_connection_impl_;
+	mq->nslots = MQ_SHM_SLOTS;
+	mq->arenasize = MQ_SHM_ARENA;
+	mq->poollimit = -1;
+	if(query && mq_shm_parse_(mq, query + 1))
+	{
+		free(mq);
+		errno = EINVAL;
+		return NULL;
+	}
+	mq->uri = strdup(uri);
+	mq->name = (char *) malloc(len + 1);
+	if(!mq->uri || !mq->name)
+	{
+		free(mq->uri);
+		free(mq->name);
+		free(mq);
+		return NULL;
+	}
+	memcpy(mq->name, name, len);
+	mq->name[len] = 0;
+	return mq;
+}
+
+/* Free an MQ connection object */
+static unsigned long
+mq_shm_release_(MQ *self)
+{
+	mq_shm_disconnect_(self);
+	mq_shm_pool_trim_(self, 0);
+	free(self->segments);
+	free(self->partition);
+	free(self->name);
+	free(self->errmsg);
+	free(self->uri);
+	free(self);
+	return 0;
+}
+
+/* Return an indicator as to whether the connection is in an error state */
+static int
+mq_shm_error_(MQ *self)
+{
+	if(self->errcode || self->syserr)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* Return the error message for the connection */
+static const char *
+mq_shm_errmsg_(MQ *self)
+{
+	if(!self->errmsg)
+	{
+		self->errmsg = (char *) malloc(MQ_ERRBUF_LEN);
+		if(!self->errmsg)
+		{
+			return "Memory allocation error obtaining error message";
+		}
+	}
+	self->errmsg[0] = 0;
+	if(self->syserr)
+	{
+		strerror_r(self->syserr, self->errmsg, MQ_ERRBUF_LEN);
+		return self->errmsg;
+	}
+	if(self->errcode)
+	{
+		snprintf(self->errmsg, MQ_ERRBUF_LEN, "Unknown error #%d", self->errcode);
+		return self->errmsg;
+	}
+	return "Success";
+}
+
+/* Return the MQ connection state */
+static MQSTATE
+mq_shm_state_(MQ *self)
+{
+	RESET_ERROR(self);
+	return self->state;
+}
+
+/* Establish a connection for receiving, mapping the segment for the
+ * connection's partition
+ */
+static int
+mq_shm_connect_recv_(MQ *self)
+{
+	RESET_ERROR(self);
+	if(self->state != MQS_DISCONNECTED)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	self->segment = mq_shm_segment_open_(self, self->partition);
+	if(!self->segment)
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	self->state = MQS_RECV;
+	return 0;
+}
+
+/* Establish a connection for sending; segments are mapped as messages are
+ * sent to them
+ */
+static int
+mq_shm_connect_send_(MQ *self)
+{
+	RESET_ERROR(self);
+	if(self->state != MQS_DISCONNECTED)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	self->state = MQS_SEND;
+	return 0;
+}
+
+/* Disconnect from a message queue; a segment remains mapped until any
+ * messages which have been received from it are freed
+ */
+static int
+mq_shm_disconnect_(MQ *self)
+{
+	size_t c;
+
+	RESET_ERROR(self);
+	if(self->segment)
+	{
+		mq_shm_segment_put_(self->segment);
+		self->segment = NULL;
+	}
+	for(c = 0; c < self->nsegments; c++)
+	{
+		mq_shm_segment_put_(self->segments[c]);
+	}
+	self->nsegments = 0;
+	self->state = MQS_DISCONNECTED;
+	return 0;
+}
+
+/* Wait for a message to arrive via a connection */
+static int
+mq_shm_next_(MQ *self, MQMESSAGE **msg)
+{
+	return mq_shm_next_wait_(self, msg, self->nonblock ? 0 : -1);
+}
+
+/* Wait up to timeout milliseconds for a message to arrive */
+static int
+mq_shm_next_timed_(MQ *self, MQMESSAGE **msg, int timeout)
+{
+	return mq_shm_next_wait_(self, msg, timeout);
+}
+
+/* Obtain up to count messages, waiting only for the first */
+static int
+mq_shm_next_batch_(MQ *self, MQMESSAGE **msgs, size_t count, size_t *received)
+{
+	uint64_t pos;
+	size_t n;
+
+	*received = 0;
+	if(!count)
+	{
+		RESET_ERROR(self);
+		return 0;
+	}
+	if(mq_shm_next_(self, &(msgs[0])))
+	{
+		return -1;
+	}
+	for(n = 1; n < count; n++)
+	{
+		if(mq_shm_pop_(self->segment, &pos))
+		{
+			break;
+		}
+		if(mq_shm_wrap_(self, &(msgs[n]), pos))
+		{
+			break;
+		}
+	}
+	*received = n;
+	RESET_ERROR(self);
+	return 0;
+}
+
+/* Messages are delivered as soon as they are sent, so there is never
+ * anything to do here
+ */
+static int
+mq_shm_deliver_(MQ *self)
+{
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	return 0;
+}
+
+/* Create a new outgoing message */
+static int
+mq_shm_create_(MQ *self, MQMESSAGE **msg)
+{
+	MQMESSAGE *p;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_SEND)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	p = mq_shm_message_construct_(self);
+	if(!p)
+	{
+		return -1;
+	}
+	p->kind = MQK_OUTGOING;
+	*msg = p;
+	return 0;
+}
+
+/* Set the cluster associated with a connection */
+static int
+mq_shm_set_cluster_(MQ *self, CLUSTER *cluster)
+{
+	self->cluster = cluster;
+	return self->impl->set_partition(self, cluster_partition(cluster));
+}
+
+/* Obtain the cluster (if any) associated with a connection */
+static CLUSTER *
+mq_shm_cluster_(MQ *self)
+{
+	return self->cluster;
+}
+
+/* Set the name of the partition this queue uses (NULL or an empty string
+ * will unset it); a receiver switches to the partition's segment
+ */
+static int
+mq_shm_set_partition_(MQ *self, const char *partition)
+{
+	MQSHMSEGMENT *seg;
+	char *p;
+
+	RESET_ERROR(self);
+	p = NULL;
+	if(partition && partition[0])
+	{
+		if(strchr(partition, '/'))
+		{
+			SET_SYSERR(self, EINVAL);
+			return -1;
+		}
+		p = strdup(partition);
+		if(!p)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+	}
+	if(self->state == MQS_RECV)
+	{
+		seg = mq_shm_segment_open_(self, p);
+		if(!seg)
+		{
+			SET_ERRNO(self);
+			free(p);
+			return -1;
+		}
+		mq_shm_segment_put_(self->segment);
+		self->segment = seg;
+	}
+	free(self->partition);
+	self->partition = p;
+	return 0;
+}
+
+/* Obtain the partition (if any) associated with a connection */
+static const char *
+mq_shm_partition_(MQ *self)
+{
+	return self->partition;
+}
+
+/* Set a connection option */
+static int
+mq_shm_set_option_(MQ *self, MQOPTION option, long value)
+{
+	RESET_ERROR(self);
+	switch(option)
+	{
+	case MQO_NONBLOCK:
+		self->nonblock = !!value;
+		return 0;
+	case MQO_POOL:
+		self->poollimit = value < 0 ? -1 : value;
+		if(value >= 0)
+		{
+			mq_shm_pool_trim_(self, (size_t) value);
+		}
+		return 0;
+	default:
+		break;
+	}
+	SET_SYSERR(self, ENOTSUP);
+	return -1;
+}
+
+/* Obtain the state maintained by libmq for the connection */
+static MQCOMMON *
+mq_shm_common_(MQ *self)
+{
+	return &(self->common);
+}
+
+/* Obtain the number of messages waiting to be received; this includes any
+ * which are still being written by a sender
+ */
+static int
+mq_shm_pending_(MQ *self)
+{
+	uint64_t enq, deq;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_RECV)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	deq = __atomic_load_n(&(self->segment->header->dequeue), __ATOMIC_RELAXED);
+	enq = __atomic_load_n(&(self->segment->header->enqueue), __ATOMIC_RELAXED);
+	if(enq <= deq)
+	{
+		return 0;
+	}
+	return enq - deq > INT_MAX ? INT_MAX : (int) (enq - deq);
+}
+
+/* Release (destroy) a message: an incoming message's arena space is freed */
+static unsigned long
+mq_shm_message_release_(MQMESSAGE *self)
+{
+	MQ *conn;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	if(self->block)
+	{
+		mq_shm_free_(self->segment, self->block);
+		self->block = NULL;
+	}
+	if(self->segment)
+	{
+		mq_shm_segment_put_(self->segment);
+	}
+	if(self->kind == MQK_OUTGOING)
+	{
+		if(self->body && self->free_fn)
+		{
+			self->free_fn(self->body);
+		}
+		free(self->type);
+		free(self->subject);
+		free(self->address);
+		free(self->partition);
+	}
+	self->segment = NULL;
+	self->type = self->subject = self->address = self->partition = NULL;
+	self->body = NULL;
+	self->len = self->size = 0;
+	self->free_fn = NULL;
+	if(conn->poollimit >= 0 && conn->poolcount >= (size_t) conn->poollimit)
+	{
+		free(self);
+		return 0;
+	}
+	self->next = conn->pool;
+	conn->pool = self;
+	conn->poolcount++;
+	return 0;
+}
+
+static MQMSGKIND
+mq_shm_message_kind_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->kind;
+}
+
+/* Mark an incoming message as being accepted */
+static int
+mq_shm_message_accept_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_INCOMING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return 0;
+}
+
+/* Reject an incoming message: it is simply discarded */
+static int
+mq_shm_message_reject_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_INCOMING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return 0;
+}
+
+/* Pass on an incoming message, returning it to the ring so that it can be
+ * received again; its arena space is retained. If the ring is full, the
+ * message is left intact and EAGAIN is reported, so that it can be passed
+ * on again later.
+ */
+static int
+mq_shm_message_pass_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_INCOMING || !self->block)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	/* Never wait for a free slot, as this thread may be the one which
+	 * would otherwise receive the messages which fill the ring
+	 */
+	__atomic_store_n(&(self->block->holder), 0, __ATOMIC_RELAXED);
+	if(mq_shm_push_(self->segment, self->pos))
+	{
+		__atomic_store_n(&(self->block->holder), (uint32_t) getpid(), __ATOMIC_RELAXED);
+		SET_SYSERR(self->connection, EAGAIN);
+		return -1;
+	}
+	mq_shm_wake_(&(self->segment->header->pushed), &(self->segment->header->recvwaiters));
+	self->block = NULL;
+	return 0;
+}
+
+/* Send an outgoing message, copying it into the arena of the segment for
+ * its partition
+ */
+static int
+mq_shm_message_send_(MQMESSAGE *self)
+{
+	MQ *conn;
+	MQSHMSEGMENT *seg;
+	struct timespec deadline;
+	uint64_t size, pos;
+	uint32_t value;
+	int spin, allocated;
+
+	conn = self->connection;
+	RESET_ERROR(conn);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(conn, EINVAL);
+		return -1;
+	}
+	seg = mq_shm_sender_segment_(conn, mq_shm_message_partition_(self));
+	if(!seg)
+	{
+		return -1;
+	}
+	size = sizeof(MQSHMBLOCK) + self->len;
+	size += self->type ? strlen(self->type) + 1 : 0;
+	size += self->subject ? strlen(self->subject) + 1 : 0;
+	size += self->address ? strlen(self->address) + 1 : 0;
+	size = (size + MQ_SHM_ALIGN - 1) & ~((uint64_t) MQ_SHM_ALIGN - 1);
+	if(size > seg->header->arenasize / 2)
+	{
+		SET_SYSERR(conn, EMSGSIZE);
+		return -1;
+	}
+	/* Obtain arena space and then a slot, waiting for either if needed */
+	allocated = 0;
+	for(spin = 0; mq_shm_send_try_(self, seg, size, &pos, &allocated); spin++)
+	{
+		if(conn->nonblock)
+		{
+			if(allocated)
+			{
+				mq_shm_free_(seg, mq_shm_block_(seg, pos));
+			}
+			SET_SYSERR(conn, EAGAIN);
+			return -1;
+		}
+		if(spin < MQ_SHM_SPIN)
+		{
+			if(spin >= MQ_SHM_SPIN / 2)
+			{
+				sched_yield();
+			}
+			continue;
+		}
+		/* Sample the futex before re-trying: anything which frees a
+		 * slot or arena space after this point will change it
+		 */
+		__atomic_add_fetch(&(seg->header->sendwaiters), 1, __ATOMIC_SEQ_CST);
+		value = __atomic_load_n(&(seg->header->popped), __ATOMIC_SEQ_CST);
+		if(!mq_shm_send_try_(self, seg, size, &pos, &allocated))
+		{
+			__atomic_sub_fetch(&(seg->header->sendwaiters), 1, __ATOMIC_SEQ_CST);
+			break;
+		}
+		/* Wake periodically even if nothing is freed, in case the
+		 * arena is held up by a process which has exited
+		 */
+		mq_shm_deadline_(&deadline, MQ_SHM_RECLAIM);
+		mq_shm_wait_(&(seg->header->popped), value, &deadline);
+		__atomic_sub_fetch(&(seg->header->sendwaiters), 1, __ATOMIC_SEQ_CST);
+	}
+	mq_shm_wake_(&(seg->header->pushed), &(seg->header->recvwaiters));
+	return 0;
+}
+
+/* Set the content-type of an outgoing message */
+static int
+mq_shm_message_set_type_(MQMESSAGE *self, const char *type)
+{
+	return mq_shm_strset_(self, &(self->type), type);
+}
+
+/* Retrieve the content-type of a message */
+static const char *
+mq_shm_message_type_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->type;
+}
+
+/* Set the subject of a message */
+static int
+mq_shm_message_set_subject_(MQMESSAGE *self, const char *subject)
+{
+	return mq_shm_strset_(self, &(self->subject), subject);
+}
+
+/* Retrieve the subject of a message */
+static const char *
+mq_shm_message_subject_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	return self->subject;
+}
+
+/* Set the address (destination) of an outgoing message */
+static int
+mq_shm_message_set_address_(MQMESSAGE *self, const char *address)
+{
+	return mq_shm_strset_(self, &(self->address), address);
+}
+
+/* Retrieve the address of a message: if none was set when it was sent, this
+ * is the URI of the connection
+ */
+static const char *
+mq_shm_message_address_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->address)
+	{
+		return self->address;
+	}
+	return self->connection->uri;
+}
+
+/* Retrieve the body of a message; for an incoming message, this is a view
+ * into the segment which remains valid until the message is freed
+ */
+static const unsigned char *
+mq_shm_message_body_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind == MQK_INCOMING && !self->block)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return NULL;
+	}
+	if(!self->body)
+	{
+		return (const unsigned char *) "";
+	}
+	return self->body;
+}
+
+/* Retrieve the length of a message body, in bytes */
+static size_t
+mq_shm_message_len_(MQMESSAGE *self)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind == MQK_INCOMING && !self->block)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return (size_t) -1;
+	}
+	return self->len;
+}
+
+/* Add a sequence of bytes to an outgoing message body */
+static int
+mq_shm_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	if(mq_shm_grow_(self, len))
+	{
+		return -1;
+	}
+	memcpy(&(self->body[self->len]), buf, len);
+	self->len += len;
+	return 0;
+}
+
+/* Add a sequence of bytes gathered from a set of buffers to an outgoing
+ * message body
+ */
+static int
+mq_shm_message_add_iov_(MQMESSAGE *self, const struct iovec *iov, int iovcnt)
+{
+	size_t len;
+	int c;
+
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	len = 0;
+	for(c = 0; c < iovcnt; c++)
+	{
+		len += iov[c].iov_len;
+	}
+	if(mq_shm_grow_(self, len))
+	{
+		return -1;
+	}
+	for(c = 0; c < iovcnt; c++)
+	{
+		memcpy(&(self->body[self->len]), iov[c].iov_base, iov[c].iov_len);
+		self->len += iov[c].iov_len;
+	}
+	return 0;
+}
+
+/* Add a buffer to an outgoing message body: if the body is empty, the
+ * buffer is adopted until the message is sent
+ */
+static int
+mq_shm_message_add_bytes_owned_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn)
+{
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	if(self->body)
+	{
+		if(mq_shm_message_add_bytes_(self, buf, len))
+		{
+			return -1;
+		}
+		if(free_fn)
+		{
+			free_fn(buf);
+		}
+		return 0;
+	}
+	self->body = buf;
+	self->len = len;
+	self->size = len;
+	self->free_fn = free_fn;
+	return 0;
+}
+
+/* Detach the body of a message: the body of an incoming message is a view
+ * into the segment, and so is always copied
+ */
+static unsigned char *
+mq_shm_message_take_body_(MQMESSAGE *self, size_t *buflen)
+{
+	unsigned char *p;
+
+	RESET_ERROR(self->connection);
+	if(self->kind == MQK_INCOMING && !self->block)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return NULL;
+	}
+	if(self->kind == MQK_OUTGOING && self->body && self->free_fn == free)
+	{
+		p = self->body;
+	}
+	else
+	{
+		p = (unsigned char *) malloc(self->len ? self->len : 1);
+		if(!p)
+		{
+			SET_ERRNO(self->connection);
+			return NULL;
+		}
+		if(self->len)
+		{
+			memcpy(p, self->body, self->len);
+		}
+		if(self->kind == MQK_OUTGOING && self->body && self->free_fn)
+		{
+			self->free_fn(self->body);
+		}
+	}
+	if(buflen)
+	{
+		*buflen = self->len;
+	}
+	self->body = NULL;
+	self->len = self->size = 0;
+	self->free_fn = NULL;
+	return p;
+}
+
+/* Set the partition used for a message: NULL will cause the connection's
+ * partition to be used, while an empty string will cause the message to be
+ * sent to the queue's default segment regardless of the connection's settings
+ */
+static int
+mq_shm_message_set_partition_(MQMESSAGE *self, const char *partition)
+{
+	if(partition && strchr(partition, '/'))
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	return mq_shm_strset_(self, &(self->partition), partition);
+}
+
+/* Obtain the partition for a message: for an incoming message, this is the
+ * partition of the segment it was read from; for an outgoing message, it
+ * defaults to that of its connection
+ */
+static const char *
+mq_shm_message_partition_(MQMESSAGE *self)
+{
+	if(self->kind == MQK_INCOMING)
+	{
+		return self->segment ? self->segment->partition : NULL;
+	}
+	if(!self->partition)
+	{
+		return self->connection->partition;
+	}
+	if(!self->partition[0])
+	{
+		return NULL;
+	}
+	return self->partition;
+}
+
+/* Obtain the connection that a message is associated with */
+static MQ *
+mq_shm_message_connection_(MQMESSAGE *self)
+{
+	return self->connection;
+}
+
+/* (Internal) parse the query-string of a URI */
+static int
+mq_shm_parse_(MQ *self, const char *query)
+{
+	const char *value;
+	char *end;
+	unsigned long n;
+	size_t len;
+
+	while(*query)
+	{
+		len = strcspn(query, "&");
+		value = memchr(query, '=', len);
+		if(!value)
+		{
+			return -1;
+		}
+		value++;
+		n = strtoul(value, &end, 10);
+		if(end == value || end != query + len)
+		{
+			return -1;
+		}
+		if(!strncmp(query, "slots=", 6))
+		{
+			if(n < 2 || n > MQ_SHM_MAXSLOTS)
+			{
+				return -1;
+			}
+			/* The ring has a power-of-two number of slots */
+			for(self->nslots = 2; self->nslots < n; self->nslots <<= 1);
+		}
+		else if(!strncmp(query, "arena=", 6))
+		{
+			if(n < MQ_SHM_MINARENA || n > MQ_SHM_MAXARENA)
+			{
+				return -1;
+			}
+			self->arenasize = (n + MQ_SHM_ALIGN - 1) & ~((unsigned long) MQ_SHM_ALIGN - 1);
+		}
+		else if(!strncmp(query, "hugepages=", 10))
+		{
+			self->hugepages = !!n;
+		}
+		else
+		{
+			return -1;
+		}
+		query += len;
+		if(*query)
+		{
+			query++;
+		}
+	}
+	return 0;
+}
+
+/* (Internal) create a new MQ message object */
+static MQMESSAGE *
+mq_shm_message_construct_(MQ *self)
+{
+	MQMESSAGE *p;
+
+	if(self->pool)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		p->next = NULL;
+		return p;
+	}
+	p = (MQMESSAGE *) calloc(1, sizeof(MQMESSAGE));
+	if(!p)
+	{
+		SET_ERRNO(self);
+		return NULL;
+	}
+	p->impl = &mq_shm_message_impl_;
+	p->connection = self;
+	return p;
+}
+
+/* (Internal) destroy pooled message objects until no more than limit remain */
+static void
+mq_shm_pool_trim_(MQ *self, size_t limit)
+{
+	MQMESSAGE *p;
+
+	while(self->poolcount > limit)
+	{
+		p = self->pool;
+		self->pool = p->next;
+		self->poolcount--;
+		free(p);
+	}
+}
+
+/* (Internal) open and map the segment for a partition of the connection's
+ * queue, creating and initialising it if it doesn't yet exist
+ */
+static MQSHMSEGMENT *
+mq_shm_segment_open_(MQ *self, const char *partition)
+{
+	MQSHMSEGMENT *seg;
+	char *path;
+	int fd, r, e;
+
+	path = (char *) malloc(strlen(self->name) + (partition ? strlen(partition) + 1 : 0) + 8);
+	seg = (MQSHMSEGMENT *) calloc(1, sizeof(MQSHMSEGMENT));
+	if(!path || !seg)
+	{
+		free(path);
+		free(seg);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if(partition)
+	{
+		seg->partition = strdup(partition);
+		if(!seg->partition)
+		{
+			free(path);
+			free(seg);
+			errno = ENOMEM;
+			return NULL;
+		}
+		sprintf(path, "/libmq-%s@%s", self->name, partition);
+	}
+	else
+	{
+		sprintf(path, "/libmq-%s", self->name);
+	}
+	fd = shm_open(path, O_RDWR|O_CREAT|O_EXCL, 0666);
+	if(fd != -1)
+	{
+		r = mq_shm_segment_init_(self, seg, fd);
+		if(r)
+		{
+			e = errno;
+			shm_unlink(path);
+			errno = e;
+		}
+	}
+	else if(errno == EEXIST)
+	{
+		fd = shm_open(path, O_RDWR, 0);
+		r = fd == -1 ? -1 : mq_shm_segment_attach_(seg, fd);
+	}
+	else
+	{
+		r = -1;
+	}
+	e = errno;
+	if(fd != -1)
+	{
+		close(fd);
+	}
+	free(path);
+	if(r)
+	{
+		free(seg->partition);
+		free(seg);
+		errno = e;
+		return NULL;
+	}
+	seg->refcount = 1;
+	return seg;
+}
+
+/* (Internal) size, map and initialise a newly-created segment */
+static int
+mq_shm_segment_init_(MQ *self, MQSHMSEGMENT *seg, int fd)
+{
+	pthread_mutexattr_t attr;
+	MQSHMHEADER *header;
+	size_t slotsoff, arenaoff, size, c;
+
+	slotsoff = (sizeof(MQSHMHEADER) + MQ_SHM_ALIGN - 1) & ~((size_t) MQ_SHM_ALIGN - 1);
+	arenaoff = slotsoff + self->nslots * sizeof(struct mq_shm_slot_struct);
+	arenaoff = (arenaoff + MQ_SHM_ALIGN - 1) & ~((size_t) MQ_SHM_ALIGN - 1);
+	size = arenaoff + self->arenasize;
+	if(self->hugepages)
+	{
+		size = (size + MQ_SHM_HUGEPAGE - 1) & ~(MQ_SHM_HUGEPAGE - 1);
+	}
+	if(ftruncate(fd, (off_t) size))
+	{
+		return -1;
+	}
+	seg->base = (unsigned char *) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(seg->base == (unsigned char *) MAP_FAILED)
+	{
+		seg->base = NULL;
+		return -1;
+	}
+#ifdef MADV_HUGEPAGE
+	if(self->hugepages)
+	{
+		/* This is advisory: whether shared memory is backed by huge
+		 * pages depends upon the system's configuration
+		 */
+		madvise(seg->base, size, MADV_HUGEPAGE);
+	}
+#endif
+	seg->size = size;
+	seg->header = header = (MQSHMHEADER *) seg->base;
+	seg->slots = (struct mq_shm_slot_struct *) (seg->base + slotsoff);
+	seg->arena = seg->base + arenaoff;
+	header->version = MQ_SHM_VERSION;
+	header->nslots = self->nslots;
+	header->arenasize = self->arenasize;
+	header->slotsoff = slotsoff;
+	header->arenaoff = arenaoff;
+	header->size = size;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&(header->lock), &attr);
+	pthread_mutexattr_destroy(&attr);
+	for(c = 0; c < self->nslots; c++)
+	{
+		seg->slots[c].seq = c;
+	}
+	/* Publish the segment to other processes */
+	__atomic_store_n(&(header->magic), MQ_SHM_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* (Internal) map an existing segment, waiting for it to be initialised by
+ * the process which created it if necessary
+ */
+static int
+mq_shm_segment_attach_(MQSHMSEGMENT *seg, int fd)
+{
+	struct stat sbuf;
+	MQSHMHEADER *header;
+	int c;
+
+	for(c = 0; ; c++)
+	{
+		if(fstat(fd, &sbuf))
+		{
+			return -1;
+		}
+		if((size_t) sbuf.st_size >= sizeof(MQSHMHEADER))
+		{
+			break;
+		}
+		if(c >= MQ_SHM_INITWAIT)
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		usleep(1000);
+	}
+	seg->base = (unsigned char *) mmap(NULL, sbuf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(seg->base == (unsigned char *) MAP_FAILED)
+	{
+		seg->base = NULL;
+		return -1;
+	}
+	seg->size = sbuf.st_size;
+	header = (MQSHMHEADER *) seg->base;
+	for(c = 0; __atomic_load_n(&(header->magic), __ATOMIC_ACQUIRE) != MQ_SHM_MAGIC; c++)
+	{
+		if(c >= MQ_SHM_INITWAIT)
+		{
+			munmap(seg->base, seg->size);
+			seg->base = NULL;
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		usleep(1000);
+	}
+	if(header->version != MQ_SHM_VERSION || header->size != seg->size)
+	{
+		munmap(seg->base, seg->size);
+		seg->base = NULL;
+		errno = EINVAL;
+		return -1;
+	}
+	seg->header = header;
+	seg->slots = (struct mq_shm_slot_struct *) (seg->base + header->slotsoff);
+	seg->arena = seg->base + header->arenaoff;
+	return 0;
+}
+
+/* (Internal) release a reference to a segment, unmapping it once there are
+ * none left
+ */
+static void
+mq_shm_segment_put_(MQSHMSEGMENT *seg)
+{
+	seg->refcount--;
+	if(seg->refcount)
+	{
+		return;
+	}
+	if(seg->base)
+	{
+		munmap(seg->base, seg->size);
+	}
+	free(seg->partition);
+	free(seg);
+}
+
+/* (Internal) find the segment a sender should write to for a partition,
+ * mapping it if necessary
+ */
+static MQSHMSEGMENT *
+mq_shm_sender_segment_(MQ *self, const char *partition)
+{
+	MQSHMSEGMENT *seg, **p;
+	size_t c;
+
+	for(c = 0; c < self->nsegments; c++)
+	{
+		seg = self->segments[c];
+		if(partition ? (seg->partition && !strcmp(seg->partition, partition)) : !seg->partition)
+		{
+			return seg;
+		}
+	}
+	p = (MQSHMSEGMENT **) realloc(self->segments, sizeof(MQSHMSEGMENT *) * (self->nsegments + 1));
+	if(!p)
+	{
+		SET_ERRNO(self);
+		return NULL;
+	}
+	self->segments = p;
+	seg = mq_shm_segment_open_(self, partition);
+	if(!seg)
+	{
+		SET_ERRNO(self);
+		return NULL;
+	}
+	self->segments[self->nsegments] = seg;
+	self->nsegments++;
+	return seg;
+}
+
+/* (Internal) lock a segment's arena, recovering the lock if its previous
+ * holder died
+ */
+static void
+mq_shm_lock_(MQSHMSEGMENT *seg)
+{
+	if(pthread_mutex_lock(&(seg->header->lock)) == EOWNERDEAD)
+	{
+		pthread_mutex_consistent(&(seg->header->lock));
+	}
+}
+
+/* (Internal) allocate a block of size bytes in the arena, held by this
+ * process; returns -1 if there isn't currently enough free space, even after
+ * reclaiming blocks held by processes which have exited. Blocks never wrap
+ * around the end of the arena: if there isn't room for the block before the
+ * end, the remainder is filled with a padding block.
+ */
+static int
+mq_shm_alloc_(MQSHMSEGMENT *seg, uint64_t size, uint64_t *pos)
+{
+	MQSHMHEADER *header;
+	MQSHMBLOCK *block;
+	uint64_t head, offset, pad;
+
+	header = seg->header;
+	mq_shm_lock_(seg);
+	head = header->head;
+	offset = head % header->arenasize;
+	pad = offset + size > header->arenasize ? header->arenasize - offset : 0;
+	if(head + pad + size - header->tail > header->arenasize &&
+	   (!mq_shm_reclaim_(seg) || head + pad + size - header->tail > header->arenasize))
+	{
+		pthread_mutex_unlock(&(header->lock));
+		return -1;
+	}
+	if(pad)
+	{
+		block = mq_shm_block_(seg, head);
+		block->size = pad;
+		block->state = MQ_SHM_FREE;
+		head += pad;
+	}
+	block = mq_shm_block_(seg, head);
+	block->size = size;
+	block->state = 0;
+	block->holder = (uint32_t) getpid();
+	*pos = head;
+	header->head = head + size;
+	pthread_mutex_unlock(&(header->lock));
+	return 0;
+}
+
+/* (Internal) free a block, reclaiming as much of the arena as possible; all
+ * blocks between the tail and head have valid headers, because they are
+ * only written while the lock is held
+ */
+static void
+mq_shm_free_(MQSHMSEGMENT *seg, MQSHMBLOCK *block)
+{
+	MQSHMHEADER *header;
+	MQSHMBLOCK *p;
+	uint64_t tail;
+
+	header = seg->header;
+	mq_shm_lock_(seg);
+	block->state = MQ_SHM_FREE;
+	tail = header->tail;
+	while(tail != header->head)
+	{
+		p = mq_shm_block_(seg, tail);
+		if(p->state != MQ_SHM_FREE)
+		{
+			break;
+		}
+		p->state = 0;
+		tail += p->size;
+	}
+	header->tail = tail;
+	pthread_mutex_unlock(&(header->lock));
+	mq_shm_wake_(&(header->popped), &(header->sendwaiters));
+}
+
+/* (Internal) reclaim the blocks at the tail of the arena which have been
+ * freed, or whose holders have exited; returns the number reclaimed. The
+ * caller must hold the arena lock.
+ */
+static int
+mq_shm_reclaim_(MQSHMSEGMENT *seg)
+{
+	MQSHMHEADER *header;
+	MQSHMBLOCK *p;
+	uint64_t tail;
+	int count;
+
+	header = seg->header;
+	count = 0;
+	for(tail = header->tail; tail != header->head; tail += p->size)
+	{
+		p = mq_shm_block_(seg, tail);
+		if(p->state != MQ_SHM_FREE && mq_shm_held_(p))
+		{
+			break;
+		}
+		p->state = 0;
+		count++;
+	}
+	header->tail = tail;
+	return count;
+}
+
+/* (Internal) determine whether a block which hasn't been freed is still
+ * held: either it's in the ring, or the process holding it still exists
+ */
+static int
+mq_shm_held_(MQSHMBLOCK *block)
+{
+	uint32_t holder;
+
+	holder = __atomic_load_n(&(block->holder), __ATOMIC_RELAXED);
+	if(!holder || holder == (uint32_t) getpid())
+	{
+		return 1;
+	}
+	return !(kill((pid_t) holder, 0) && errno == ESRCH);
+}
+
+/* (Internal) locate a block given its position */
+static MQSHMBLOCK *
+mq_shm_block_(MQSHMSEGMENT *seg, uint64_t pos)
+{
+	return (MQSHMBLOCK *) (seg->arena + (pos % seg->header->arenasize));
+}
+
+/* (Internal) write a block position to the ring without waiting; returns -1
+ * if the ring is full
+ */
+static int
+mq_shm_push_(MQSHMSEGMENT *seg, uint64_t pos)
+{
+	MQSHMHEADER *header;
+	struct mq_shm_slot_struct *slot;
+	uint64_t enq, seq;
+	int64_t dif;
+
+	header = seg->header;
+	enq = __atomic_load_n(&(header->enqueue), __ATOMIC_RELAXED);
+	for(;;)
+	{
+		slot = &(seg->slots[enq & (header->nslots - 1)]);
+		seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		dif = (int64_t) (seq - enq);
+		if(!dif)
+		{
+			if(__atomic_compare_exchange_n(&(header->enqueue), &enq, enq + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if(dif < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			enq = __atomic_load_n(&(header->enqueue), __ATOMIC_RELAXED);
+		}
+	}
+	slot->pos = pos;
+	__atomic_store_n(&(slot->seq), enq + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* (Internal) read a block position from the ring without waiting; returns
+ * -1 if the ring is empty
+ */
+static int
+mq_shm_pop_(MQSHMSEGMENT *seg, uint64_t *pos)
+{
+	MQSHMHEADER *header;
+	struct mq_shm_slot_struct *slot;
+	uint64_t deq, seq;
+	int64_t dif;
+
+	header = seg->header;
+	deq = __atomic_load_n(&(header->dequeue), __ATOMIC_RELAXED);
+	for(;;)
+	{
+		slot = &(seg->slots[deq & (header->nslots - 1)]);
+		seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		dif = (int64_t) (seq - (deq + 1));
+		if(!dif)
+		{
+			if(__atomic_compare_exchange_n(&(header->dequeue), &deq, deq + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if(dif < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			deq = __atomic_load_n(&(header->dequeue), __ATOMIC_RELAXED);
+		}
+	}
+	*pos = slot->pos;
+	__atomic_store_n(&(slot->seq), deq + header->nslots, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* (Internal) sleep until futex no longer holds value, or until deadline
+ * (if not NULL) passes; returns -1 with errno set to EAGAIN upon timeout.
+ * Spurious returns are possible, and so the caller must re-check whatever it
+ * is waiting for.
+ */
+static int
+mq_shm_wait_(uint32_t *futex, uint32_t value, struct timespec *deadline)
+{
+#ifndef HAVE_LINUX_FUTEX_H
+	struct timespec now;
+#endif
+	int r;
+
+	r = 0;
+#ifdef HAVE_LINUX_FUTEX_H
+	/* FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline */
+	if(syscall(SYS_futex, futex, FUTEX_WAIT_BITSET, value, deadline, NULL, FUTEX_BITSET_MATCH_ANY) &&
+	   errno == ETIMEDOUT)
+	{
+		r = -1;
+	}
+#else
+	/* Without futexes, poll the segment */
+	while(__atomic_load_n(futex, __ATOMIC_SEQ_CST) == value)
+	{
+		if(deadline)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if(now.tv_sec > deadline->tv_sec ||
+			   (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec))
+			{
+				r = -1;
+				break;
+			}
+		}
+		usleep(100);
+	}
+#endif
+	if(r)
+	{
+		errno = EAGAIN;
+	}
+	return r;
+}
+
+/* (Internal) advance a futex and wake any processes waiting on it */
+static void
+mq_shm_wake_(uint32_t *futex, uint32_t *waiters)
+{
+	__atomic_add_fetch(futex, 1, __ATOMIC_SEQ_CST);
+#ifdef HAVE_LINUX_FUTEX_H
+	if(__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+	{
+		syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+#else
+	(void) waiters;
+#endif
+}
+
+/* (Internal) determine the absolute deadline for a timeout in milliseconds */
+static void
+mq_shm_deadline_(struct timespec *deadline, int timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000;
+	if(deadline->tv_nsec >= 1000000000)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* (Internal) obtain the next message from a receiver's segment, waiting up
+ * to timeout milliseconds (or indefinitely, if timeout is negative) for one
+ * to arrive
+ */
+static int
+mq_shm_next_wait_(MQ *self, MQMESSAGE **msg, int timeout)
+{
+	MQSHMHEADER *header;
+	struct timespec deadline;
+	uint64_t pos;
+	uint32_t value;
+	int spin, r;
+
+	RESET_ERROR(self);
+	if(self->state != MQS_RECV)
+	{
+		SET_SYSERR(self, EINVAL);
+		return -1;
+	}
+	header = self->segment->header;
+	if(timeout > 0)
+	{
+		mq_shm_deadline_(&deadline, timeout);
+	}
+	for(spin = 0; mq_shm_pop_(self->segment, &pos); spin++)
+	{
+		if(!timeout)
+		{
+			SET_SYSERR(self, EAGAIN);
+			return -1;
+		}
+		if(spin < MQ_SHM_SPIN)
+		{
+			if(spin >= MQ_SHM_SPIN / 2)
+			{
+				sched_yield();
+			}
+			continue;
+		}
+		/* Register as a waiter and sample the futex before re-checking
+		 * the ring: a sender which writes to it after this point will
+		 * see that there is a waiter and wake it
+		 */
+		__atomic_add_fetch(&(header->recvwaiters), 1, __ATOMIC_SEQ_CST);
+		value = __atomic_load_n(&(header->pushed), __ATOMIC_SEQ_CST);
+		if(!mq_shm_pop_(self->segment, &pos))
+		{
+			__atomic_sub_fetch(&(header->recvwaiters), 1, __ATOMIC_SEQ_CST);
+			break;
+		}
+		r = mq_shm_wait_(&(header->pushed), value, timeout > 0 ? &deadline : NULL);
+		__atomic_sub_fetch(&(header->recvwaiters), 1, __ATOMIC_SEQ_CST);
+		if(r)
+		{
+			SET_ERRNO(self);
+			return -1;
+		}
+	}
+	mq_shm_wake_(&(header->popped), &(header->sendwaiters));
+	return mq_shm_wrap_(self, msg, pos);
+}
+
+/* (Internal) try to copy an outgoing message into the arena, if that hasn't
+ * already been done, and then write it to the ring; returns -1 if either
+ * the arena or the ring is full
+ */
+static int
+mq_shm_send_try_(MQMESSAGE *self, MQSHMSEGMENT *seg, uint64_t size, uint64_t *pos, int *allocated)
+{
+	MQSHMBLOCK *block;
+	unsigned char *p;
+
+	if(!*allocated)
+	{
+		if(mq_shm_alloc_(seg, size, pos))
+		{
+			return -1;
+		}
+		*allocated = 1;
+		block = mq_shm_block_(seg, *pos);
+		block->len = self->len;
+		p = (unsigned char *) (block + 1);
+#define MQ_SHM_COPYSTR_(str, member) \
+		if(str) \
+		{ \
+			block->member = (uint32_t) strlen(str); \
+			memcpy(p, str, block->member + 1); \
+			p += block->member + 1; \
+		} \
+		else \
+		{ \
+			block->member = (uint32_t) MQ_SHM_ABSENT; \
+		}
+		MQ_SHM_COPYSTR_(self->type, typelen);
+		MQ_SHM_COPYSTR_(self->subject, subjectlen);
+		MQ_SHM_COPYSTR_(self->address, addresslen);
+#undef MQ_SHM_COPYSTR_
+		if(self->len)
+		{
+			memcpy(p, self->body, self->len);
+		}
+	}
+	/* Once it's in the ring, the block is no longer held by this
+	 * process, which may exit before it is received
+	 */
+	block = mq_shm_block_(seg, *pos);
+	__atomic_store_n(&(block->holder), 0, __ATOMIC_RELAXED);
+	if(mq_shm_push_(seg, *pos))
+	{
+		__atomic_store_n(&(block->holder), (uint32_t) getpid(), __ATOMIC_RELAXED);
+		return -1;
+	}
+	return 0;
+}
+
+/* (Internal) create a message object providing a view of the block at pos;
+ * if this fails, the block is returned to the ring
+ */
+static int
+mq_shm_wrap_(MQ *self, MQMESSAGE **msg, uint64_t pos)
+{
+	MQMESSAGE *p;
+	MQSHMBLOCK *block;
+	char *s;
+
+	p = mq_shm_message_construct_(self);
+	if(!p)
+	{
+		if(!mq_shm_push_(self->segment, pos))
+		{
+			mq_shm_wake_(&(self->segment->header->pushed), &(self->segment->header->recvwaiters));
+		}
+		return -1;
+	}
+	block = mq_shm_block_(self->segment, pos);
+	__atomic_store_n(&(block->holder), (uint32_t) getpid(), __ATOMIC_RELAXED);
+	p->kind = MQK_INCOMING;
+	p->segment = self->segment;
+	p->segment->refcount++;
+	p->block = block;
+	p->pos = pos;
+	s = (char *) (block + 1);
+#define MQ_SHM_VIEWSTR_(member, len) \
+	if(block->len != (uint32_t) MQ_SHM_ABSENT) \
+	{ \
+		p->member = s; \
+		s += block->len + 1; \
+	}
+	MQ_SHM_VIEWSTR_(type, typelen);
+	MQ_SHM_VIEWSTR_(subject, subjectlen);
+	MQ_SHM_VIEWSTR_(address, addresslen);
+#undef MQ_SHM_VIEWSTR_
+	p->body = (unsigned char *) s;
+	p->len = block->len;
+	*msg = p;
+	return 0;
+}
+
+/* (Internal) ensure that an outgoing message's body has room for len more
+ * bytes; a body which was adopted with a free function other than free() is
+ * copied first
+ */
+static int
+mq_shm_grow_(MQMESSAGE *self, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if(self->body && self->free_fn != free)
+	{
+		p = (unsigned char *) malloc(self->len + len ? self->len + len : 1);
+		if(!p)
+		{
+			SET_ERRNO(self->connection);
+			return -1;
+		}
+		memcpy(p, self->body, self->len);
+		if(self->free_fn)
+		{
+			self->free_fn(self->body);
+		}
+		self->body = p;
+		self->size = self->len + len;
+		self->free_fn = free;
+		return 0;
+	}
+	if(self->body && self->len + len <= self->size)
+	{
+		return 0;
+	}
+	size = self->size ? self->size : 64;
+	while(size < self->len + len)
+	{
+		size <<= 1;
+	}
+	p = (unsigned char *) realloc(self->body, size);
+	if(!p)
+	{
+		SET_ERRNO(self->connection);
+		return -1;
+	}
+	self->body = p;
+	self->size = size;
+	self->free_fn = free;
+	return 0;
+}
+
+/* (Internal) replace one of an outgoing message's string properties */
+static int
+mq_shm_strset_(MQMESSAGE *self, char **dest, const char *src)
+{
+	char *p;
+
+	RESET_ERROR(self->connection);
+	if(self->kind != MQK_OUTGOING)
+	{
+		SET_SYSERR(self->connection, EINVAL);
+		return -1;
+	}
+	p = NULL;
+	if(src)
+	{
+		p = strdup(src);
+		if(!p)
+		{
+			SET_ERRNO(self->connection);
+			return -1;
+		}
+	}
+	free(*dest);
+	*dest = p;
+	return 0;
+}
@@ -0,0 +1,431 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libmq.h"
+
+/* Sharded consumption divides a queue into a fixed number of shards, each of
+ * which is a partition named with its decimal index. A message is assigned
+ * to a shard by hashing its key (FNV-1a), and each shard is assigned to one
+ * of the members of a cluster by rendezvous (highest random weight)
+ * hashing: every member scores the shard, and the highest score wins. When
+ * the size of the cluster changes, only the shards whose winner changes
+ * move, and a receiving connection subscribes to exactly the partitions of
+ * the shards its member owns.
+ *
+ * Membership changes reported by libcluster (via mq_cluster_balancer()) may
+ * arrive on any thread, and so are only recorded; they are applied by the
+ * connection's own thread the next time it calls mq_next(),
+ * mq_next_batch(), mq_next_timed() or mq_process().
+ */
+
+#define MQ_SHARD_NAMELEN               12
+
+struct mq_shards_struct
+{
+	/* Link in the list of connections following a cluster */
+	struct mq_shards_struct *next;
+	MQ *connection;
+	CLUSTER *cluster;
+	unsigned int count;
+	int worker;
+	/* The membership that the subscription currently reflects */
+	int index;
+	int total;
+	/* Membership reported by the cluster, protected by lock */
+	int pindex;
+	int ptotal;
+	int changed;
+	/* owned[n] is nonzero if shard n is assigned to this member */
+	unsigned char *owned;
+	/* The names of each shard's partition */
+	char *names;
+	const char **list;
+};
+
+static unsigned long long mq_shard_score_(unsigned int shard, int member);
+static int mq_shard_owner_(unsigned int shard, int total);
+static struct mq_shards_struct *mq_shards_create_(MQ *connection, unsigned int count, int worker);
+static void mq_shards_destroy_(struct mq_shards_struct *shards);
+static int mq_shards_apply_(struct mq_shards_struct *shards, int index, int total);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mq_shards_struct *following;
+
+/* Divide the queue into count shards, and subscribe to those assigned to this
+ * member of the connection's cluster
+ */
+int
+mq_set_shards(MQ *connection, unsigned int count, int worker)
+{
+	MQCOMMON *common;
+	struct mq_shards_struct *shards;
+	CLUSTER *cluster;
+	int index, total;
+
+	common = MQ_COMMON(connection);
+	if(!common || !connection->impl->set_partitions)
+	{
+		errno = ENOTSUP;
+		return -1;
+	}
+	if(!count)
+	{
+		if(!common->shards)
+		{
+			return 0;
+		}
+		if(connection->impl->set_partitions(connection, NULL, 0))
+		{
+			return -1;
+		}
+		mq_shards_free_(common);
+		return 0;
+	}
+	if(worker < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	shards = mq_shards_create_(connection, count, worker);
+	if(!shards)
+	{
+		return -1;
+	}
+	cluster = connection->impl->cluster(connection);
+	if(cluster)
+	{
+		index = cluster_index(cluster, worker);
+		total = cluster_total(cluster);
+	}
+	else
+	{
+		index = 0;
+		total = 1;
+	}
+	if(mq_shards_apply_(shards, index, total))
+	{
+		mq_shards_destroy_(shards);
+		return -1;
+	}
+	mq_shards_free_(common);
+	common->shards = shards;
+	if(cluster)
+	{
+		shards->cluster = cluster;
+		pthread_mutex_lock(&lock);
+		shards->next = following;
+		following = shards;
+		pthread_mutex_unlock(&lock);
+	}
+	return 0;
+}
+
+/* Obtain the shard which messages with a particular key are assigned to */
+int
+mq_shard(MQ *connection, const char *key)
+{
+	MQCOMMON *common;
+
+	common = MQ_COMMON(connection);
+	if(!common || !common->shards || !key)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return (int) (mq_key_hash_(key) % common->shards->count);
+}
+
+/* Obtain the index of the cluster member which messages with a particular
+ * key are consumed by
+ */
+int
+mq_shard_owner(MQ *connection, const char *key)
+{
+	MQCOMMON *common;
+	int shard;
+
+	shard = mq_shard(connection, key);
+	if(shard < 0)
+	{
+		return -1;
+	}
+	common = MQ_COMMON(connection);
+	return mq_shard_owner_((unsigned int) shard, common->shards->total);
+}
+
+/* Determine whether this member of the cluster owns a shard */
+int
+mq_shard_owned(MQ *connection, int shard)
+{
+	MQCOMMON *common;
+
+	common = MQ_COMMON(connection);
+	if(!common || !common->shards || shard < 0 || (unsigned int) shard >= common->shards->count)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return common->shards->owned[shard];
+}
+
+/* Reassign shards for a new cluster membership */
+int
+mq_rebalance(MQ *connection, int index, int total)
+{
+	MQCOMMON *common;
+
+	common = MQ_COMMON(connection);
+	if(!common || !common->shards)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return mq_shards_apply_(common->shards, index, total);
+}
+
+/* A libcluster balancing callback, which records the new membership of a
+ * cluster for each sharded connection following it
+ */
+int
+mq_cluster_balancer(CLUSTER *cluster, CLUSTERSTATE *state)
+{
+	struct mq_shards_struct *p;
+
+	pthread_mutex_lock(&lock);
+	for(p = following; p; p = p->next)
+	{
+		if(p->cluster != cluster)
+		{
+			continue;
+		}
+		p->pindex = state->index + p->worker;
+		p->ptotal = state->total;
+		MQ_ATOMIC_STORE(&(p->changed), 1);
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+/* Set the partition of an outgoing message to that of a shard */
+int
+mq_message_set_shard(MQMESSAGE *message, int shard)
+{
+	char name[MQ_SHARD_NAMELEN];
+
+	if(shard < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	snprintf(name, sizeof(name), "%d", shard);
+	return mq_message_set_partition(message, name);
+}
+
+/* (Internal) apply any membership change which has been reported by the
+ * cluster since the connection's shards were last assigned
+ */
+int
+mq_shards_check_(MQCOMMON *common)
+{
+	struct mq_shards_struct *shards;
+	int index, total;
+
+	shards = common->shards;
+	if(!MQ_ATOMIC_LOAD(&(shards->changed)))
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&lock);
+	index = shards->pindex;
+	total = shards->ptotal;
+	shards->changed = 0;
+	pthread_mutex_unlock(&lock);
+	if(index == shards->index && total == shards->total)
+	{
+		return 0;
+	}
+	if(mq_shards_apply_(shards, index, total))
+	{
+		mq_count_error_(common);
+		return -1;
+	}
+	return 0;
+}
+
+/* (Internal) discard a connection's shard state */
+void
+mq_shards_free_(MQCOMMON *common)
+{
+	struct mq_shards_struct **p;
+
+	if(!common->shards)
+	{
+		return;
+	}
+	if(common->shards->cluster)
+	{
+		pthread_mutex_lock(&lock);
+		for(p = &following; *p; p = &((*p)->next))
+		{
+			if(*p == common->shards)
+			{
+				*p = common->shards->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&lock);
+	}
+	mq_shards_destroy_(common->shards);
+	common->shards = NULL;
+}
+
+/* (Internal) 64-bit FNV-1a hash of a key */
+unsigned long long
+mq_key_hash_(const char *key)
+{
+	unsigned long long h;
+
+	h = 14695981039346656037ULL;
+	for(; *key; key++)
+	{
+		h ^= (unsigned char) *key;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* (Internal) the rendezvous weight of a member for a shard, mixed with the
+ * splitmix64 finaliser
+ */
+static unsigned long long
+mq_shard_score_(unsigned int shard, int member)
+{
+	unsigned long long z;
+
+	z = ((unsigned long long) shard << 32) | (unsigned int) member;
+	z += 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* (Internal) determine which of total members a shard is assigned to */
+static int
+mq_shard_owner_(unsigned int shard, int total)
+{
+	unsigned long long score, best;
+	int c, owner;
+
+	owner = 0;
+	best = 0;
+	for(c = 0; c < total; c++)
+	{
+		score = mq_shard_score_(shard, c);
+		if(!c || score > best)
+		{
+			best = score;
+			owner = c;
+		}
+	}
+	return owner;
+}
+
+static struct mq_shards_struct *
+mq_shards_create_(MQ *connection, unsigned int count, int worker)
+{
+	struct mq_shards_struct *shards;
+	unsigned int c;
+
+	shards = (struct mq_shards_struct *) calloc(1, sizeof(struct mq_shards_struct));
+	if(!shards)
+	{
+		return NULL;
+	}
+	shards->connection = connection;
+	shards->count = count;
+	shards->worker = worker;
+	shards->owned = (unsigned char *) calloc(count, 1);
+	shards->names = (char *) calloc(count, MQ_SHARD_NAMELEN);
+	shards->list = (const char **) calloc(count, sizeof(const char *));
+	if(!shards->owned || !shards->names || !shards->list)
+	{
+		mq_shards_destroy_(shards);
+		errno = ENOMEM;
+		return NULL;
+	}
+	for(c = 0; c < count; c++)
+	{
+		snprintf(&(shards->names[c * MQ_SHARD_NAMELEN]), MQ_SHARD_NAMELEN, "%u", c);
+	}
+	return shards;
+}
+
+static void
+mq_shards_destroy_(struct mq_shards_struct *shards)
+{
+	free(shards->owned);
+	free(shards->names);
+	free(shards->list);
+	free(shards);
+}
+
+/* (Internal) assign shards to member index of total, and subscribe to the
+ * partitions of those which are owned; the engine is given the complete set,
+ * and is responsible for only altering its subscriptions to the shards which
+ * have moved
+ */
+static int
+mq_shards_apply_(struct mq_shards_struct *shards, int index, int total)
+{
+	MQ *connection;
+	unsigned int c;
+	size_t n;
+
+	if(total < 1 || index < 0 || index >= total)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	connection = shards->connection;
+	n = 0;
+	for(c = 0; c < shards->count; c++)
+	{
+		if(mq_shard_owner_(c, total) == index)
+		{
+			shards->list[n] = &(shards->names[c * MQ_SHARD_NAMELEN]);
+			n++;
+		}
+	}
+	if(connection->impl->set_partitions(connection, shards->list, n))
+	{
+		return -1;
+	}
+	memset(shards->owned, 0, shards->count);
+	for(c = 0; c < n; c++)
+	{
+		shards->owned[(shards->list[c] - shards->names) / MQ_SHARD_NAMELEN] = 1;
+	}
+	shards->index = index;
+	shards->total = total;
+	return 0;
+}
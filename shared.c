@@ -0,0 +1,1004 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* A shared sender wraps an ordinary sending connection so that it can be
+ * used by any number of threads at once. Messages created on it are plain
+ * buffers; sending one pushes it onto a lock-free multiple-producer,
+ * single-consumer queue, from which a dedicated I/O thread forwards it to
+ * the underlying connection. The I/O thread flushes the underlying connection
+ * whenever the queue empties (or MQ_SHARED_BATCH messages have been
+ * forwarded), and mq_deliver() waits for everything sent before it was called
+ * to have been flushed. At most MQ_SHARED_LIMIT messages may be queued at
+ * once: beyond that, senders wait for the I/O thread to catch up (or, if
+ * MQO_NONBLOCK is set, fail with EAGAIN).
+ */
+
+#define MQ_CONNECTION_STRUCT_DEFINED   1
+#define MQ_MESSAGE_STRUCT_DEFINED      1
+
+#include "p_libmq.h"
+
+#define MQ_ERRBUF_LEN                  128
+/* The maximum number of messages forwarded between flushes */
+#define MQ_SHARED_BATCH                256
+/* The maximum number of messages queued for the I/O thread */
+#define MQ_SHARED_LIMIT                1024
+
+/* MQ implementation members */
+static unsigned long mq_shared_release_(MQ *self);
+static int mq_shared_error_(MQ *self);
+static const char *mq_shared_errmsg_(MQ *self);
+static MQSTATE mq_shared_state_(MQ *self);
+static int mq_shared_connect_recv_(MQ *self);
+static int mq_shared_connect_send_(MQ *self);
+static int mq_shared_disconnect_(MQ *self);
+static int mq_shared_next_(MQ *self, MQMESSAGE **msg);
+static int mq_shared_deliver_(MQ *self);
+static int mq_shared_set_option_(MQ *self, MQOPTION option, long value);
+static int mq_shared_create_(MQ *self, MQMESSAGE **msg);
+static int mq_shared_set_cluster_(MQ *self, CLUSTER *cluster);
+static CLUSTER *mq_shared_cluster_(MQ *self);
+static int mq_shared_set_partition_(MQ *self, const char *partition);
+static const char *mq_shared_partition_(MQ *self);
+static MQCOMMON *mq_shared_common_(MQ *self);
+
+/* MQMESSAGE implementation members */
+static unsigned long mq_shared_message_release_(MQMESSAGE *self);
+static MQMSGKIND mq_shared_message_kind_(MQMESSAGE *self);
+static int mq_shared_message_accept_(MQMESSAGE *self);
+static int mq_shared_message_reject_(MQMESSAGE *self);
+static int mq_shared_message_pass_(MQMESSAGE *self);
+static int mq_shared_message_send_(MQMESSAGE *self);
+static int mq_shared_message_set_type_(MQMESSAGE *self, const char *type);
+static const char *mq_shared_message_type_(MQMESSAGE *self);
+static int mq_shared_message_set_subject_(MQMESSAGE *self, const char *type);
+static const char *mq_shared_message_subject_(MQMESSAGE *self);
+static int mq_shared_message_set_address_(MQMESSAGE *self, const char *address);
+static const char *mq_shared_message_address_(MQMESSAGE *self);
+static const unsigned char *mq_shared_message_body_(MQMESSAGE *self);
+static size_t mq_shared_message_len_(MQMESSAGE *self);
+static int mq_shared_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len);
+static int mq_shared_message_set_partition_(MQMESSAGE *self, const char *partition);
+static const char *mq_shared_message_partition_(MQMESSAGE *self);
+static int mq_shared_message_add_bytes_owned_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn);
+static MQ *mq_shared_message_connection_(MQMESSAGE *self);
+
+/* Internal utilities */
+static void *mq_shared_thread_(void *arg);
+static void mq_shared_push_(MQ *self, MQMESSAGE *msg);
+static MQMESSAGE *mq_shared_pop_(MQ *self);
+static int mq_shared_empty_(MQ *self);
+static int mq_shared_reserve_(MQ *self);
+static int mq_shared_forward_(MQ *self, MQMESSAGE *msg);
+static void mq_shared_message_unref_(MQMESSAGE *self);
+static int mq_shared_strset_(MQMESSAGE *self, char **dest, const char *src);
+
+struct mq_message_struct
+{
+	MQMESSAGEIMPL *impl;
+	MQ_MESSAGE_COMMON_MEMBERS;
+	/* The next message in the queue */
+	MQMESSAGE *next;
+	/* One reference is held by the caller and, once sent, one by the
+	 * queue
+	 */
+	int refcount;
+	int queued;
+	char *type;
+	char *subject;
+	char *address;
+	char *partition;
+	unsigned char *body;
+	size_t len;
+	size_t size;
+	MQFREEFN free_fn;
+};
+
+struct mq_connection_struct
+{
+	MQCONNIMPL *impl;
+	MQ_CONNECTION_COMMON_MEMBERS;
+	/* The underlying connection, which is only used with iolock held */
+	MQ *inner;
+	pthread_mutex_t iolock;
+	pthread_t thread;
+	/* The queue: producers exchange new messages onto head, while the
+	 * I/O thread consumes from tail; stub is the queue's placeholder node
+	 */
+	MQMESSAGE *head;
+	MQMESSAGE *tail;
+	MQMESSAGE stub;
+	/* The number of messages in the queue (or about to be pushed) */
+	unsigned long queued;
+	/* lock and wake are used to put the I/O thread to sleep when the
+	 * queue is empty, flushed to signal completed flushes to
+	 * mq_deliver(), and space to wake the waiting senders once the
+	 * I/O thread has taken messages from a full queue
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t flushed;
+	pthread_cond_t space;
+	int sleeping;
+	int stopping;
+	int waiting;
+	/* The number of messages sent, and the number which have been
+	 * flushed, along with the result of the most recent failed flush and
+	 * the number which had been flushed once it completed. reported is
+	 * the highest number that a call to mq_deliver() has waited for, so
+	 * that a failure is reported by every call which is waiting (or
+	 * begins waiting) before it has been reported.
+	 */
+	unsigned long long sent;
+	unsigned long long completed;
+	int failed;
+	unsigned long long failedseq;
+	unsigned long long reported;
+	char *innererr;
+	char *partition;
+};
+
+static MQCONNIMPL mq_shared_connection_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_shared_release_,
+	mq_shared_error_,
+	mq_shared_errmsg_,
+	mq_shared_state_,
+	mq_shared_connect_recv_,
+	mq_shared_connect_send_,
+	mq_shared_disconnect_,
+	mq_shared_next_,
+	mq_shared_deliver_,
+	mq_shared_create_,
+	mq_shared_set_cluster_,
+	mq_shared_cluster_,
+	mq_shared_set_partition_,
+	mq_shared_partition_,
+	/* next_batch */
+	NULL,
+	/* send_batch */
+	NULL,
+	/* next_timed */
+	NULL,
+	mq_shared_set_option_,
+	/* fd */
+	NULL,
+	/* process */
+	NULL,
+	mq_shared_common_,
+	/* set_spool */
+	NULL,
+	/* pending */
+	NULL,
+	/* set_sent_callback */
+	NULL,
+	/* set_partitions */
+	NULL
+};
+
+static MQMESSAGEIMPL mq_shared_message_impl_ = {
+	/* reserved */
+	NULL,
+	/* reserved */
+	NULL,
+	mq_shared_message_release_,
+	mq_shared_message_kind_,
+	mq_shared_message_accept_,
+	mq_shared_message_reject_,
+	mq_shared_message_pass_,
+	mq_shared_message_send_,
+	mq_shared_message_set_type_,
+	mq_shared_message_type_,
+	mq_shared_message_set_subject_,
+	mq_shared_message_subject_,
+	mq_shared_message_set_address_,
+	mq_shared_message_address_,
+	mq_shared_message_body_,
+	mq_shared_message_len_,
+	mq_shared_message_add_bytes_,
+	mq_shared_message_set_partition_,
+	mq_shared_message_partition_,
+	/* add_iov */
+	NULL,
+	mq_shared_message_add_bytes_owned_,
+	/* take_body */
+	NULL,
+	mq_shared_message_connection_,
+	/* status */
+	NULL,
+	/* set_encoding */
+	NULL,
+	/* encoding */
+	NULL,
+	/* replace_body */
+	NULL
+};
+
+/* (Internal) wrap a connected sending connection in a shared sender, which
+ * takes ownership of it
+ */
+MQ *
+mq_create_shared_(MQ *inner)
+{
+	MQ *mq;
+
+	mq = (MQ *) calloc(1, sizeof(MQ));
+	if(!mq)
+	{
+		return NULL;
+	}
+	mq->impl = &mq_shared_connection_impl_;
+	mq->inner = inner;
+	mq->state = MQS_SEND;
+	mq->stub.impl = &mq_shared_message_impl_;
+	mq->head = &(mq->stub);
+	mq->tail = &(mq->stub);
+	pthread_mutex_init(&(mq->iolock), NULL);
+	pthread_mutex_init(&(mq->lock), NULL);
+	pthread_cond_init(&(mq->wake), NULL);
+	pthread_cond_init(&(mq->flushed), NULL);
+	pthread_cond_init(&(mq->space), NULL);
+	if((errno = pthread_create(&(mq->thread), NULL, mq_shared_thread_, mq)))
+	{
+		pthread_cond_destroy(&(mq->space));
+		pthread_cond_destroy(&(mq->flushed));
+		pthread_cond_destroy(&(mq->wake));
+		pthread_mutex_destroy(&(mq->lock));
+		pthread_mutex_destroy(&(mq->iolock));
+		free(mq);
+		return NULL;
+	}
+	return mq;
+}
+
+/* Stop the I/O thread (once it has forwarded everything in the queue) and
+ * free the shared sender along with the underlying connection
+ */
+static unsigned long
+mq_shared_release_(MQ *self)
+{
+	pthread_mutex_lock(&(self->lock));
+	self->stopping = 1;
+	pthread_cond_signal(&(self->wake));
+	pthread_mutex_unlock(&(self->lock));
+	pthread_join(self->thread, NULL);
+	mq_disconnect(self->inner);
+	pthread_cond_destroy(&(self->space));
+	pthread_cond_destroy(&(self->flushed));
+	pthread_cond_destroy(&(self->wake));
+	pthread_mutex_destroy(&(self->lock));
+	pthread_mutex_destroy(&(self->iolock));
+	free(self->partition);
+	free(self->innererr);
+	free(self->errmsg);
+	free(self);
+	return 0;
+}
+
+/* Return an indicator as to whether the connection is in an error state */
+static int
+mq_shared_error_(MQ *self)
+{
+	if(self->errcode || self->syserr)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* Return the error message for the connection: errors reported by the
+ * underlying connection are recorded by the I/O thread
+ */
+static const char *
+mq_shared_errmsg_(MQ *self)
+{
+	if(!self->errmsg)
+	{
+		self->errmsg = (char *) malloc(MQ_ERRBUF_LEN);
+		if(!self->errmsg)
+		{
+			return "Memory allocation error obtaining error message";
+		}
+	}
+	self->errmsg[0] = 0;
+	if(self->syserr)
+	{
+		strerror_r(self->syserr, self->errmsg, MQ_ERRBUF_LEN);
+		return self->errmsg;
+	}
+	if(self->errcode)
+	{
+		pthread_mutex_lock(&(self->lock));
+		if(self->innererr)
+		{
+			strncpy(self->errmsg, self->innererr, MQ_ERRBUF_LEN - 1);
+			self->errmsg[MQ_ERRBUF_LEN - 1] = 0;
+		}
+		else
+		{
+			snprintf(self->errmsg, MQ_ERRBUF_LEN, "Unknown error #%d", self->errcode);
+		}
+		pthread_mutex_unlock(&(self->lock));
+		return self->errmsg;
+	}
+	return "Success";
+}
+
+/* Return the MQ connection state */
+static MQSTATE
+mq_shared_state_(MQ *self)
+{
+	return self->state;
+}
+
+/* A shared sender can't be used for receiving */
+static int
+mq_shared_connect_recv_(MQ *self)
+{
+	SET_SYSERR(self, EPERM);
+	return -1;
+}
+
+/* A shared sender is already connected */
+static int
+mq_shared_connect_send_(MQ *self)
+{
+	SET_SYSERR(self, EINVAL);
+	return -1;
+}
+
+/* Disconnecting happens when the shared sender is released */
+static int
+mq_shared_disconnect_(MQ *self)
+{
+	return 0;
+}
+
+/* A shared sender can't receive messages */
+static int
+mq_shared_next_(MQ *self, MQMESSAGE **msg)
+{
+	(void) msg;
+
+	SET_SYSERR(self, EPERM);
+	return -1;
+}
+
+/* Wait until every message sent before this call has been forwarded to, and
+ * flushed by, the underlying connection
+ */
+static int
+mq_shared_deliver_(MQ *self)
+{
+	unsigned long long target, baseline;
+	int failed;
+
+	/* The error state is shared by every thread using the connection, and
+	 * so is only updated if something has gone wrong
+	 */
+	target = __atomic_load_n(&(self->sent), __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&(self->lock));
+	baseline = self->reported;
+	if(self->sleeping)
+	{
+		pthread_cond_signal(&(self->wake));
+	}
+	while(self->completed < target)
+	{
+		pthread_cond_wait(&(self->flushed), &(self->lock));
+	}
+	/* Any flush which failed since the last reported generation fails
+	 * every call waiting for it, not just the first to return
+	 */
+	failed = self->failedseq > baseline ? self->failed : 0;
+	if(target > self->reported)
+	{
+		self->reported = target;
+	}
+	pthread_mutex_unlock(&(self->lock));
+	if(failed)
+	{
+		SET_ERROR(self, failed);
+		return -1;
+	}
+	return 0;
+}
+
+/* Set a connection option: only MQO_NONBLOCK is supported, which makes
+ * sending fail with EAGAIN rather than wait when the queue is full
+ */
+static int
+mq_shared_set_option_(MQ *self, MQOPTION option, long value)
+{
+	if(option != MQO_NONBLOCK)
+	{
+		errno = ENOTSUP;
+		return -1;
+	}
+	__atomic_store_n(&(self->nonblock), !!value, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Create a new outgoing message: this may be called from any thread */
+static int
+mq_shared_create_(MQ *self, MQMESSAGE **msg)
+{
+	MQMESSAGE *p;
+
+	p = (MQMESSAGE *) calloc(1, sizeof(MQMESSAGE));
+	if(!p)
+	{
+		SET_ERRNO(self);
+		return -1;
+	}
+	p->impl = &mq_shared_message_impl_;
+	p->connection = self;
+	p->kind = MQK_OUTGOING;
+	p->refcount = 1;
+	*msg = p;
+	return 0;
+}
+
+/* Set the cluster associated with the underlying connection */
+static int
+mq_shared_set_cluster_(MQ *self, CLUSTER *cluster)
+{
+	int r;
+
+	pthread_mutex_lock(&(self->iolock));
+	self->cluster = cluster;
+	r = mq_set_cluster(self->inner, cluster);
+	pthread_mutex_unlock(&(self->iolock));
+	return r;
+}
+
+/* Obtain the cluster (if any) associated with the connection */
+static CLUSTER *
+mq_shared_cluster_(MQ *self)
+{
+	return self->cluster;
+}
+
+/* Set the partition associated with the underlying connection */
+static int
+mq_shared_set_partition_(MQ *self, const char *partition)
+{
+	int r;
+
+	pthread_mutex_lock(&(self->iolock));
+	r = mq_set_partition(self->inner, partition);
+	pthread_mutex_unlock(&(self->iolock));
+	return r;
+}
+
+/* Obtain the partition associated with the underlying connection */
+static const char *
+mq_shared_partition_(MQ *self)
+{
+	const char *p;
+
+	pthread_mutex_lock(&(self->iolock));
+	p = mq_partition(self->inner);
+	pthread_mutex_unlock(&(self->iolock));
+	return p;
+}
+
+/* Release the caller's reference to a message */
+static unsigned long
+mq_shared_message_release_(MQMESSAGE *self)
+{
+	mq_shared_message_unref_(self);
+	return 0;
+}
+
+static MQMSGKIND
+mq_shared_message_kind_(MQMESSAGE *self)
+{
+	return self->kind;
+}
+
+/* There are no incoming messages on a shared sender */
+static int
+mq_shared_message_accept_(MQMESSAGE *self)
+{
+	SET_SYSERR(self->connection, EINVAL);
+	return -1;
+}
+
+static int
+mq_shared_message_reject_(MQMESSAGE *self)
+{
+	SET_SYSERR(self->connection, EINVAL);
+	return -1;
+}
+
+static int
+mq_shared_message_pass_(MQMESSAGE *self)
+{
+	SET_SYSERR(self->connection, EINVAL);
+	return -1;
+}
+
+/* Queue a message for the I/O thread to forward: once sent, a message can't
+ * be modified, although the caller must still free it
+ */
+static int
+mq_shared_message_send_(MQMESSAGE *self)
+{
+	MQ *conn;
+
+	conn = self->connection;
+	if(self->queued)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(mq_shared_reserve_(conn))
+	{
+		return -1;
+	}
+	self->queued = 1;
+	__atomic_add_fetch(&(self->refcount), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(conn->sent), 1, __ATOMIC_SEQ_CST);
+	mq_shared_push_(conn, self);
+	/* Wake the I/O thread if it's waiting for something to do: because
+	 * both the push and this load are sequentially consistent, either the
+	 * I/O thread will see the message when it re-checks the queue before
+	 * sleeping, or we will see that it is asleep
+	 */
+	if(__atomic_load_n(&(conn->sleeping), __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&(conn->lock));
+		pthread_cond_signal(&(conn->wake));
+		pthread_mutex_unlock(&(conn->lock));
+	}
+	return 0;
+}
+
+/* Set the content-type of an outgoing message */
+static int
+mq_shared_message_set_type_(MQMESSAGE *self, const char *type)
+{
+	return mq_shared_strset_(self, &(self->type), type);
+}
+
+/* Retrieve the content-type of a message */
+static const char *
+mq_shared_message_type_(MQMESSAGE *self)
+{
+	return self->type;
+}
+
+/* Set the subject of a message */
+static int
+mq_shared_message_set_subject_(MQMESSAGE *self, const char *subject)
+{
+	return mq_shared_strset_(self, &(self->subject), subject);
+}
+
+/* Retrieve the subject of a message */
+static const char *
+mq_shared_message_subject_(MQMESSAGE *self)
+{
+	return self->subject;
+}
+
+/* Set the address (destination) of an outgoing message */
+static int
+mq_shared_message_set_address_(MQMESSAGE *self, const char *address)
+{
+	return mq_shared_strset_(self, &(self->address), address);
+}
+
+/* Retrieve the address of a message */
+static const char *
+mq_shared_message_address_(MQMESSAGE *self)
+{
+	return self->address;
+}
+
+/* Retrieve the body of a message */
+static const unsigned char *
+mq_shared_message_body_(MQMESSAGE *self)
+{
+	return self->body;
+}
+
+/* Retrieve the length of a message body, in bytes */
+static size_t
+mq_shared_message_len_(MQMESSAGE *self)
+{
+	return self->len;
+}
+
+/* Append a sequence of bytes to the body of an outgoing message */
+static int
+mq_shared_message_add_bytes_(MQMESSAGE *self, unsigned char *buf, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if(self->queued)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(self->free_fn && self->free_fn != free)
+	{
+		/* The body was adopted from the caller and can't be extended
+		 * in place, so copy it first
+		 */
+		p = (unsigned char *) malloc(self->len + len);
+		if(!p)
+		{
+			return -1;
+		}
+		memcpy(p, self->body, self->len);
+		self->free_fn(self->body);
+		self->body = p;
+		self->size = self->len + len;
+		self->free_fn = free;
+	}
+	if(self->len + len > self->size)
+	{
+		size = self->len + len;
+		p = (unsigned char *) realloc(self->body, size);
+		if(!p)
+		{
+			return -1;
+		}
+		self->body = p;
+		self->size = size;
+		self->free_fn = free;
+	}
+	memcpy(&(self->body[self->len]), buf, len);
+	self->len += len;
+	return 0;
+}
+
+/* Adopt a buffer as the body of an outgoing message, if it doesn't already
+ * have one
+ */
+static int
+mq_shared_message_add_bytes_owned_(MQMESSAGE *self, unsigned char *buf, size_t len, MQFREEFN free_fn)
+{
+	if(self->queued)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(self->body)
+	{
+		if(mq_shared_message_add_bytes_(self, buf, len))
+		{
+			return -1;
+		}
+		if(free_fn)
+		{
+			free_fn(buf);
+		}
+		return 0;
+	}
+	self->body = buf;
+	self->len = len;
+	self->size = len;
+	self->free_fn = free_fn;
+	return 0;
+}
+
+/* Set the partition for an individual message */
+static int
+mq_shared_message_set_partition_(MQMESSAGE *self, const char *partition)
+{
+	return mq_shared_strset_(self, &(self->partition), partition);
+}
+
+/* Obtain the partition for an individual message */
+static const char *
+mq_shared_message_partition_(MQMESSAGE *self)
+{
+	return self->partition;
+}
+
+/* Obtain the state maintained by libmq for the connection */
+static MQCOMMON *
+mq_shared_common_(MQ *self)
+{
+	return &(self->common);
+}
+
+/* Obtain the connection that a message is associated with */
+static MQ *
+mq_shared_message_connection_(MQMESSAGE *self)
+{
+	return self->connection;
+}
+
+/* (Internal) the I/O thread: forward queued messages to the underlying
+ * connection, flushing it whenever the queue empties
+ */
+static void *
+mq_shared_thread_(void *arg)
+{
+	MQ *self = (MQ *) arg;
+	MQMESSAGE *msg;
+	unsigned long long forwarded;
+	size_t batch;
+	int failed, stopping;
+
+	forwarded = 0;
+	failed = 0;
+	for(;;)
+	{
+		pthread_mutex_lock(&(self->iolock));
+		for(batch = 0; batch < MQ_SHARED_BATCH && (msg = mq_shared_pop_(self)); batch++)
+		{
+			__atomic_sub_fetch(&(self->queued), 1, __ATOMIC_SEQ_CST);
+			if(mq_shared_forward_(self, msg) && !failed)
+			{
+				failed = mq_error(self->inner) ? -1 : 0;
+			}
+			mq_shared_message_unref_(msg);
+			forwarded++;
+		}
+		if(batch)
+		{
+			if(mq_deliver(self->inner) && !failed)
+			{
+				failed = -1;
+			}
+		}
+		pthread_mutex_unlock(&(self->iolock));
+		pthread_mutex_lock(&(self->lock));
+		if(batch)
+		{
+			if(failed)
+			{
+				free(self->innererr);
+				self->innererr = strdup(mq_errmsg(self->inner));
+				self->failed = failed;
+				self->failedseq = forwarded;
+				failed = 0;
+			}
+			self->completed = forwarded;
+			pthread_cond_broadcast(&(self->flushed));
+			if(self->waiting)
+			{
+				pthread_cond_broadcast(&(self->space));
+			}
+			pthread_mutex_unlock(&(self->lock));
+			continue;
+		}
+		__atomic_store_n(&(self->sleeping), 1, __ATOMIC_SEQ_CST);
+		stopping = self->stopping;
+		if(!stopping && mq_shared_empty_(self))
+		{
+			pthread_cond_wait(&(self->wake), &(self->lock));
+		}
+		__atomic_store_n(&(self->sleeping), 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&(self->lock));
+		if(stopping)
+		{
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* (Internal) forward a queued message to the underlying connection */
+static int
+mq_shared_forward_(MQ *self, MQMESSAGE *msg)
+{
+	MQMESSAGE *out;
+	int r;
+
+	out = mq_message_create(self->inner);
+	if(!out)
+	{
+		return -1;
+	}
+	r = 0;
+	if(msg->type && mq_message_set_type(out, msg->type))
+	{
+		r = -1;
+	}
+	if(!r && msg->subject && mq_message_set_subject(out, msg->subject))
+	{
+		r = -1;
+	}
+	if(!r && msg->address && mq_message_set_address(out, msg->address))
+	{
+		r = -1;
+	}
+	if(!r && msg->partition && mq_message_set_partition(out, msg->partition))
+	{
+		r = -1;
+	}
+	if(!r && msg->body)
+	{
+		/* Hand the body over to the outgoing message */
+		if(mq_message_add_bytes_owned(out, msg->body, msg->len, msg->free_fn))
+		{
+			r = -1;
+		}
+		else
+		{
+			msg->body = NULL;
+			msg->len = msg->size = 0;
+			msg->free_fn = NULL;
+		}
+	}
+	if(!r && mq_message_send(out))
+	{
+		r = -1;
+	}
+	mq_message_free(out);
+	return r;
+}
+
+/* (Internal) push a message onto the queue; this is safe to call from any
+ * number of threads at once
+ */
+static void
+mq_shared_push_(MQ *self, MQMESSAGE *msg)
+{
+	MQMESSAGE *prev;
+
+	__atomic_store_n(&(msg->next), NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&(self->head), msg, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&(prev->next), msg, __ATOMIC_RELEASE);
+}
+
+/* (Internal) pop a message from the queue; this may only be called by the
+ * I/O thread. Returns NULL if the queue is empty, or if a producer is part
+ * way through pushing the only remaining message
+ */
+static MQMESSAGE *
+mq_shared_pop_(MQ *self)
+{
+	MQMESSAGE *tail, *next, *head;
+
+	tail = self->tail;
+	next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+	if(tail == &(self->stub))
+	{
+		if(!next)
+		{
+			return NULL;
+		}
+		self->tail = next;
+		tail = next;
+		next = __atomic_load_n(&(next->next), __ATOMIC_ACQUIRE);
+	}
+	if(next)
+	{
+		self->tail = next;
+		return tail;
+	}
+	head = __atomic_load_n(&(self->head), __ATOMIC_SEQ_CST);
+	if(tail != head)
+	{
+		return NULL;
+	}
+	/* tail is the only message in the queue: put the stub back behind it
+	 * so that it can be removed
+	 */
+	mq_shared_push_(self, &(self->stub));
+	next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+	if(next)
+	{
+		self->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/* (Internal) determine whether the queue is empty */
+static int
+mq_shared_empty_(MQ *self)
+{
+	return (self->tail == &(self->stub) &&
+			__atomic_load_n(&(self->head), __ATOMIC_SEQ_CST) == &(self->stub));
+}
+
+/* (Internal) reserve a place in the queue for a message which is about to
+ * be pushed, waiting for the I/O thread to take messages from the queue if
+ * it is full; this is safe to call from any number of threads at once
+ */
+static int
+mq_shared_reserve_(MQ *self)
+{
+	for(;;)
+	{
+		if(__atomic_add_fetch(&(self->queued), 1, __ATOMIC_SEQ_CST) <= MQ_SHARED_LIMIT)
+		{
+			return 0;
+		}
+		__atomic_sub_fetch(&(self->queued), 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&(self->nonblock), __ATOMIC_RELAXED))
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+		/* The I/O thread can't be asleep while the queue is full, and
+		 * takes the lock to wake us once it has taken a batch
+		 */
+		pthread_mutex_lock(&(self->lock));
+		self->waiting++;
+		while(__atomic_load_n(&(self->queued), __ATOMIC_SEQ_CST) >= MQ_SHARED_LIMIT)
+		{
+			pthread_cond_wait(&(self->space), &(self->lock));
+		}
+		self->waiting--;
+		pthread_mutex_unlock(&(self->lock));
+	}
+}
+
+/* (Internal) release a reference to a message, freeing it if it was the
+ * last
+ */
+static void
+mq_shared_message_unref_(MQMESSAGE *self)
+{
+	if(__atomic_sub_fetch(&(self->refcount), 1, __ATOMIC_ACQ_REL))
+	{
+		return;
+	}
+	if(self->body && self->free_fn)
+	{
+		self->free_fn(self->body);
+	}
+	free(self->type);
+	free(self->subject);
+	free(self->address);
+	free(self->partition);
+	free(self);
+}
+
+/* (Internal) replace one of a message's string properties */
+static int
+mq_shared_strset_(MQMESSAGE *self, char **dest, const char *src)
+{
+	char *p;
+
+	if(self->queued)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	p = NULL;
+	if(src)
+	{
+		p = strdup(src);
+		if(!p)
+		{
+			return -1;
+		}
+	}
+	free(*dest);
+	*dest = p;
+	return 0;
+}
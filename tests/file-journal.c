@@ -0,0 +1,171 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* Read a file: queue in batches while it is being written, and check that
+ * every message is received exactly once and in order. The file: plug-in is
+ * loaded from the build tree, as it has not been installed yet.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "libmq.h"
+
+#ifndef FILEPLUGIN
+# define FILEPLUGIN                    "queues/.libs/file.so"
+#endif
+
+#define MESSAGES                       200000
+#define BATCH                          16
+
+static char uri[64];
+static const char *failed;
+
+static void *
+writer(void *arg)
+{
+	MQ *mq;
+	MQMESSAGE *msg;
+	char buf[16];
+	int n;
+
+	(void) arg;
+	mq = mq_connect_send(uri, NULL, NULL);
+	if(!mq)
+	{
+		failed = "cannot connect sender";
+		return NULL;
+	}
+	for(n = 0; n < MESSAGES; n++)
+	{
+		msg = mq_message_create(mq);
+		if(!msg)
+		{
+			failed = "cannot create message";
+			break;
+		}
+		snprintf(buf, sizeof(buf), "%d", n);
+		if(mq_message_add_bytes(msg, (unsigned char *) buf, strlen(buf)) ||
+		   mq_message_send(msg))
+		{
+			mq_message_free(msg);
+			failed = "cannot send message";
+			break;
+		}
+		mq_message_free(msg);
+	}
+	mq_deliver(mq);
+	mq_disconnect(mq);
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	char dir[] = "/tmp/libmq-file-XXXXXX";
+	char cmd[64], buf[16];
+	void *handle;
+	int (*entry)(void *);
+	pthread_t thread;
+	MQ *mq;
+	MQMESSAGE *msgs[BATCH];
+	size_t c, n;
+	int expect, status;
+
+	(void) argc;
+	(void) argv;
+	handle = dlopen(FILEPLUGIN, RTLD_NOW);
+	entry = handle ? (int (*)(void *)) dlsym(handle, "mq_entry") : NULL;
+	if(!entry || entry(handle))
+	{
+		fprintf(stderr, "file-journal: cannot load %s\n", FILEPLUGIN);
+		return 1;
+	}
+	if(!mkdtemp(dir))
+	{
+		perror(dir);
+		return 1;
+	}
+	snprintf(uri, sizeof(uri), "file:%s", dir);
+	mq = mq_connect_recv(uri, NULL, NULL);
+	if(!mq)
+	{
+		fprintf(stderr, "file-journal: cannot connect receiver: %s\n", strerror(errno));
+		return 1;
+	}
+	mq_set_option(mq, MQO_NONBLOCK, 1);
+	if(pthread_create(&thread, NULL, writer, NULL))
+	{
+		return 1;
+	}
+	status = 0;
+	expect = 0;
+	while(expect < MESSAGES && !status)
+	{
+		n = mq_next_batch(mq, msgs, BATCH);
+		if(!n)
+		{
+			if(errno != EAGAIN)
+			{
+				fprintf(stderr, "file-journal: receive failed: %s\n", strerror(errno));
+				status = 1;
+			}
+			else if(failed)
+			{
+				break;
+			}
+			continue;
+		}
+		for(c = 0; c < n; c++)
+		{
+			snprintf(buf, sizeof(buf), "%d", expect);
+			if(mq_message_len(msgs[c]) != strlen(buf) ||
+			   memcmp(mq_message_body(msgs[c]), buf, strlen(buf)))
+			{
+				fprintf(stderr, "file-journal: expected message %d, received '%.*s'\n",
+						expect, (int) mq_message_len(msgs[c]), (const char *) mq_message_body(msgs[c]));
+				status = 1;
+			}
+			expect++;
+			mq_message_accept(msgs[c]);
+		}
+	}
+	pthread_join(thread, NULL);
+	if(failed)
+	{
+		fprintf(stderr, "file-journal: %s\n", failed);
+		status = 1;
+	}
+	mq_disconnect(mq);
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+	if(system(cmd))
+	{
+		status = 1;
+	}
+	return status;
+}
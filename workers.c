@@ -0,0 +1,529 @@
+/* libmq: A library for interacting with message queues
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libmq.h"
+
+#include <unistd.h>
+
+/* A worker pool processes the messages received by a connection on a number
+ * of lanes, each with its own thread. The thread which calls
+ * mq_workers_run() is the dispatcher: it alone uses the connection,
+ * obtaining messages and hashing each one's key to pick a lane, so that
+ * messages with the same key are always processed in the order they were
+ * received, by the same lane.
+ *
+ * Each lane has a pair of lock-free single-producer, single-consumer rings
+ * of MQ_WORKERS_DEPTH entries: the dispatcher pushes messages onto the
+ * incoming ring, and the lane pushes them onto the completed ring, along
+ * with their outcome, once they have been processed. The dispatcher settles
+ * completed messages on the connection. As no more than MQ_WORKERS_DEPTH
+ * messages are ever outstanding on a lane, the completed ring can't
+ * overflow; the dispatcher waits for a lane to complete messages when its
+ * incoming ring is full.
+ *
+ * A lane (or the dispatcher) only sleeps once it has found its ring empty
+ * (or full) having announced that it is about to, so that the other side
+ * knows to wake it.
+ *
+ * As the accessors of a message may update the state of its connection
+ * (and obtaining the body may decompress it), the dispatcher obtains a
+ * message's properties and body before handing it to a lane, and the lane
+ * never touches the message itself.
+ */
+
+/* The capacity of each lane's rings, which must be a power of two */
+#define MQ_WORKERS_DEPTH               256
+/* The maximum number of messages obtained by the dispatcher at once */
+#define MQ_WORKERS_BATCH               64
+/* How long the dispatcher waits for a message, in milliseconds, while
+ * messages are outstanding, before settling those which have completed
+ */
+#define MQ_WORKERS_SETTLE              10
+/* How long the dispatcher waits for a message, in milliseconds, while none
+ * are outstanding, before checking whether it has been asked to stop
+ */
+#define MQ_WORKERS_IDLE                100
+
+struct mq_workers_done_struct
+{
+	MQMESSAGE *message;
+	MQSTATUS status;
+};
+
+struct mq_workers_lane_struct
+{
+	MQWORKERS *workers;
+	pthread_t thread;
+	int started;
+	/* The incoming ring, whose head is advanced by the dispatcher; the
+	 * lane consumes it in order, and the dispatcher knows that the
+	 * entries which have been completed are free again
+	 */
+	MQWORKITEM in[MQ_WORKERS_DEPTH];
+	unsigned long inhead;
+	/* The completed ring: the lane advances donehead, the dispatcher
+	 * advances donetail
+	 */
+	struct mq_workers_done_struct done[MQ_WORKERS_DEPTH];
+	unsigned long donehead;
+	unsigned long donetail;
+	/* lock and wake are used to put the lane to sleep when its incoming
+	 * ring is empty
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int sleeping;
+};
+
+struct mq_workers_struct
+{
+	MQ *connection;
+	MQWORKFN fn;
+	void *data;
+	MQKEYFN keyfn;
+	void *keydata;
+	struct mq_workers_lane_struct *lanes;
+	size_t nlanes;
+	/* The lane which the next message without a key is given to */
+	size_t rr;
+	/* lock and completed are used to put the dispatcher to sleep while it
+	 * waits for a lane to complete messages
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t completed;
+	int sleeping;
+	int stopping;
+};
+
+static void *mq_workers_thread_(void *arg);
+static int mq_workers_dispatch_(MQWORKERS *workers, MQMESSAGE *message);
+static size_t mq_workers_settle_(MQWORKERS *workers);
+static unsigned long mq_workers_outstanding_(MQWORKERS *workers);
+static void mq_workers_wait_(MQWORKERS *workers, struct mq_workers_lane_struct *lane);
+static void mq_workers_shutdown_(MQWORKERS *workers);
+
+/* Create a pool of lanes processing the messages received by a connection */
+MQWORKERS *
+mq_workers_create(MQ *connection, size_t lanes, MQWORKFN fn, void *data)
+{
+	MQWORKERS *workers;
+	long ncpu;
+	size_t c;
+
+	if(!connection || !fn)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if(!lanes)
+	{
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		lanes = ncpu > 0 ? (size_t) ncpu : 1;
+	}
+	workers = (MQWORKERS *) calloc(1, sizeof(MQWORKERS));
+	if(!workers)
+	{
+		return NULL;
+	}
+	workers->lanes = (struct mq_workers_lane_struct *) calloc(lanes, sizeof(struct mq_workers_lane_struct));
+	if(!workers->lanes)
+	{
+		free(workers);
+		return NULL;
+	}
+	workers->connection = connection;
+	workers->fn = fn;
+	workers->data = data;
+	pthread_mutex_init(&(workers->lock), NULL);
+	pthread_cond_init(&(workers->completed), NULL);
+	for(c = 0; c < lanes; c++)
+	{
+		workers->lanes[c].workers = workers;
+		pthread_mutex_init(&(workers->lanes[c].lock), NULL);
+		pthread_cond_init(&(workers->lanes[c].wake), NULL);
+		workers->nlanes++;
+		if((errno = pthread_create(&(workers->lanes[c].thread), NULL, mq_workers_thread_, &(workers->lanes[c]))))
+		{
+			mq_workers_free(workers);
+			return NULL;
+		}
+		workers->lanes[c].started = 1;
+	}
+	return workers;
+}
+
+/* Set the function used to obtain the key of each message, in place of its
+ * subject
+ */
+int
+mq_workers_set_key(MQWORKERS *workers, MQKEYFN fn, void *data)
+{
+	workers->keyfn = fn;
+	workers->keydata = data;
+	return 0;
+}
+
+/* Obtain messages from the connection and process them on the lanes until
+ * mq_workers_stop() is called, settling each once it has been processed
+ */
+int
+mq_workers_run(MQWORKERS *workers)
+{
+	MQMESSAGE *batch[MQ_WORKERS_BATCH];
+	MQ *connection;
+	size_t n, c;
+	int timed, r;
+
+	connection = workers->connection;
+	timed = 1;
+	r = 0;
+	while(!MQ_ATOMIC_LOAD(&(workers->stopping)))
+	{
+		mq_workers_settle_(workers);
+		n = 0;
+		if(timed)
+		{
+			/* Don't wait indefinitely: while messages are being
+			 * processed, so that they are settled promptly, and
+			 * otherwise so that mq_workers_stop() takes effect
+			 */
+			errno = 0;
+			batch[0] = mq_next_timed(connection, mq_workers_outstanding_(workers) ? MQ_WORKERS_SETTLE : MQ_WORKERS_IDLE);
+			if(batch[0])
+			{
+				n = 1;
+				if(mq_pending(connection) > 0)
+				{
+					n += mq_next_batch(connection, &(batch[1]), MQ_WORKERS_BATCH - 1);
+				}
+			}
+			else if(errno == EAGAIN)
+			{
+				continue;
+			}
+			else if(errno == ENOTSUP)
+			{
+				/* Messages are settled as each batch arrives,
+				 * and stopping waits for the next one
+				 */
+				timed = 0;
+				continue;
+			}
+		}
+		else
+		{
+			errno = 0;
+			n = mq_next_batch(connection, batch, MQ_WORKERS_BATCH);
+		}
+		if(!n)
+		{
+			if(errno != EAGAIN && mq_error(connection))
+			{
+				r = -1;
+				break;
+			}
+			continue;
+		}
+		for(c = 0; c < n; c++)
+		{
+			mq_workers_dispatch_(workers, batch[c]);
+		}
+	}
+	/* Wait for every message which has been dispatched to be processed */
+	while(mq_workers_outstanding_(workers))
+	{
+		if(!mq_workers_settle_(workers))
+		{
+			mq_workers_wait_(workers, NULL);
+		}
+	}
+	MQ_ATOMIC_STORE(&(workers->stopping), 0);
+	return r;
+}
+
+/* Ask mq_workers_run() to return once the messages which have been
+ * dispatched have been processed; this may be called from any thread,
+ * including a lane's
+ */
+int
+mq_workers_stop(MQWORKERS *workers)
+{
+	MQ_ATOMIC_STORE(&(workers->stopping), 1);
+	return 0;
+}
+
+/* Stop the lanes' threads and free a pool; mq_workers_run() must have
+ * returned
+ */
+int
+mq_workers_free(MQWORKERS *workers)
+{
+	size_t c;
+
+	mq_workers_shutdown_(workers);
+	for(c = 0; c < workers->nlanes; c++)
+	{
+		pthread_cond_destroy(&(workers->lanes[c].wake));
+		pthread_mutex_destroy(&(workers->lanes[c].lock));
+	}
+	pthread_cond_destroy(&(workers->completed));
+	pthread_mutex_destroy(&(workers->lock));
+	free(workers->lanes);
+	free(workers);
+	return 0;
+}
+
+/* (Internal) a lane's thread: process messages from the incoming ring in
+ * order, and pass them back to the dispatcher
+ */
+static void *
+mq_workers_thread_(void *arg)
+{
+	struct mq_workers_lane_struct *lane = (struct mq_workers_lane_struct *) arg;
+	MQWORKERS *workers;
+	MQWORKITEM *item;
+	MQSTATUS status;
+	unsigned long tail;
+
+	workers = lane->workers;
+	tail = 0;
+	for(;;)
+	{
+		if(tail == MQ_ATOMIC_LOAD(&(lane->inhead)))
+		{
+			pthread_mutex_lock(&(lane->lock));
+			__atomic_store_n(&(lane->sleeping), 1, __ATOMIC_SEQ_CST);
+			while(tail == __atomic_load_n(&(lane->inhead), __ATOMIC_SEQ_CST))
+			{
+				pthread_cond_wait(&(lane->wake), &(lane->lock));
+			}
+			__atomic_store_n(&(lane->sleeping), 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&(lane->lock));
+		}
+		item = &(lane->in[tail % MQ_WORKERS_DEPTH]);
+		if(!item->message)
+		{
+			/* A NULL message asks the lane to stop */
+			break;
+		}
+		status = workers->fn(item, workers->data);
+		lane->done[lane->donehead % MQ_WORKERS_DEPTH].message = item->message;
+		lane->done[lane->donehead % MQ_WORKERS_DEPTH].status = status;
+		tail++;
+		__atomic_store_n(&(lane->donehead), lane->donehead + 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&(workers->sleeping), __ATOMIC_SEQ_CST))
+		{
+			pthread_mutex_lock(&(workers->lock));
+			pthread_cond_signal(&(workers->completed));
+			pthread_mutex_unlock(&(workers->lock));
+		}
+	}
+	return NULL;
+}
+
+/* (Internal) push a message onto the incoming ring of the lane for its key,
+ * waiting for the lane to complete messages if the ring is full
+ */
+static int
+mq_workers_dispatch_(MQWORKERS *workers, MQMESSAGE *message)
+{
+	struct mq_workers_lane_struct *lane;
+	MQWORKITEM *item;
+	const char *key;
+	size_t n;
+
+	if(workers->keyfn)
+	{
+		key = workers->keyfn(message, workers->keydata);
+	}
+	else
+	{
+		key = mq_message_subject(message);
+	}
+	if(key && key[0])
+	{
+		n = (size_t) (mq_key_hash_(key) % workers->nlanes);
+	}
+	else
+	{
+		/* Messages without a key aren't ordered */
+		n = workers->rr;
+		workers->rr = (workers->rr + 1) % workers->nlanes;
+	}
+	lane = &(workers->lanes[n]);
+	while(lane->inhead - MQ_ATOMIC_LOAD(&(lane->donetail)) >= MQ_WORKERS_DEPTH)
+	{
+		if(!mq_workers_settle_(workers))
+		{
+			mq_workers_wait_(workers, lane);
+		}
+	}
+	item = &(lane->in[lane->inhead % MQ_WORKERS_DEPTH]);
+	item->message = message;
+	item->type = mq_message_type(message);
+	item->subject = mq_message_subject(message);
+	item->address = mq_message_address(message);
+	item->body = mq_message_body(message);
+	item->len = mq_message_len(message);
+	__atomic_store_n(&(lane->inhead), lane->inhead + 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(lane->sleeping), __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&(lane->lock));
+		pthread_cond_signal(&(lane->wake));
+		pthread_mutex_unlock(&(lane->lock));
+	}
+	return 0;
+}
+
+/* (Internal) settle the messages which the lanes have completed, on the
+ * dispatcher's thread; returns the number settled
+ */
+static size_t
+mq_workers_settle_(MQWORKERS *workers)
+{
+	struct mq_workers_lane_struct *lane;
+	struct mq_workers_done_struct *done;
+	unsigned long head;
+	size_t c, n;
+	int again;
+
+	n = 0;
+	for(c = 0; c < workers->nlanes; c++)
+	{
+		lane = &(workers->lanes[c]);
+		head = MQ_ATOMIC_LOAD(&(lane->donehead));
+		again = 0;
+		while(lane->donetail != head)
+		{
+			done = &(lane->done[lane->donetail % MQ_WORKERS_DEPTH]);
+			switch(done->status)
+			{
+			case MQT_ACCEPTED:
+				mq_message_accept(done->message);
+				break;
+			case MQT_REJECTED:
+				mq_message_reject(done->message);
+				break;
+			case MQT_RELEASED:
+				/* If the queue has no room, the message is
+				 * left in place to be passed on when the lane
+				 * is next settled
+				 */
+				again = (mq_message_pass(done->message) && errno == EAGAIN);
+				break;
+			default:
+				/* The message is freed without an outcome */
+				mq_message_free(done->message);
+				break;
+			}
+			if(again)
+			{
+				break;
+			}
+			MQ_ATOMIC_STORE(&(lane->donetail), lane->donetail + 1);
+			n++;
+		}
+	}
+	return n;
+}
+
+/* (Internal) determine whether any messages have been dispatched but not yet
+ * settled
+ */
+static unsigned long
+mq_workers_outstanding_(MQWORKERS *workers)
+{
+	unsigned long n;
+	size_t c;
+
+	n = 0;
+	for(c = 0; c < workers->nlanes; c++)
+	{
+		n += workers->lanes[c].inhead - workers->lanes[c].donetail;
+	}
+	return n;
+}
+
+/* (Internal) put the dispatcher to sleep until a lane (or, if lane is NULL,
+ * any lane) has completed a message which hasn't been settled
+ */
+static void
+mq_workers_wait_(MQWORKERS *workers, struct mq_workers_lane_struct *lane)
+{
+	size_t c;
+
+	pthread_mutex_lock(&(workers->lock));
+	__atomic_store_n(&(workers->sleeping), 1, __ATOMIC_SEQ_CST);
+	for(;;)
+	{
+		if(lane)
+		{
+			if(__atomic_load_n(&(lane->donehead), __ATOMIC_SEQ_CST) != lane->donetail)
+			{
+				break;
+			}
+		}
+		else
+		{
+			for(c = 0; c < workers->nlanes; c++)
+			{
+				if(__atomic_load_n(&(workers->lanes[c].donehead), __ATOMIC_SEQ_CST) != workers->lanes[c].donetail)
+				{
+					break;
+				}
+			}
+			if(c < workers->nlanes)
+			{
+				break;
+			}
+		}
+		pthread_cond_wait(&(workers->completed), &(workers->lock));
+	}
+	__atomic_store_n(&(workers->sleeping), 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&(workers->lock));
+}
+
+/* (Internal) ask each lane's thread to stop, and wait for it to */
+static void
+mq_workers_shutdown_(MQWORKERS *workers)
+{
+	struct mq_workers_lane_struct *lane;
+	size_t c;
+
+	for(c = 0; c < workers->nlanes; c++)
+	{
+		lane = &(workers->lanes[c]);
+		if(!lane->started)
+		{
+			continue;
+		}
+		/* mq_workers_run() has returned, so the ring is empty */
+		lane->in[lane->inhead % MQ_WORKERS_DEPTH].message = NULL;
+		__atomic_store_n(&(lane->inhead), lane->inhead + 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&(lane->lock));
+		pthread_cond_signal(&(lane->wake));
+		pthread_mutex_unlock(&(lane->lock));
+		pthread_join(lane->thread, NULL);
+		lane->started = 0;
+	}
+}